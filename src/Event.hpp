@@ -1,23 +1,41 @@
 #pragma once
+#include <atomic>
+#include <cstdint>
 #include <sys/eventfd.h>
 #include <poll.h>
 #include <unistd.h>
 
 class Event {
     friend class MultiEventWait;
+    friend class EventLoop;
 private:
     int fd_;
+    uint64_t id_; // unique, unlike fd numbers which are reused after close
+    std::atomic_bool registered_ {false}; // set by EventLoop when waited for, only such events need close_hook
+    static uint64_t nextId() {
+        static std::atomic_uint64_t next {1};
+        return next++;
+    }
 public:
-    Event(uint64_t initial = 0) {
+    // called with fd and id of every closed event, so that EventLoop drops its waiters
+    static inline std::atomic<void(*)(int, uint64_t)> close_hook {nullptr};
+    Event(uint64_t initial = 0): id_(nextId()) {
         fd_ = eventfd(initial, EFD_NONBLOCK);
     }
     Event(const Event &copyfrom) = delete;
     Event(Event &&movefrom) {
         this->fd_ = movefrom.fd_;
+        this->id_ = movefrom.id_;
+        this->registered_ = movefrom.registered_.load();
         movefrom.fd_ = -1;
     }
     ~Event() {
         if (fd_<0) return;
+        if (registered_) {
+            if (auto hook = close_hook.load()) {
+                hook(fd_, id_);
+            }
+        }
         close(fd_);
         fd_ = -1;
     }
@@ -43,4 +61,7 @@ public:
     int fd() const {
         return fd_;
     }
+    uint64_t id() const {
+        return id_;
+    }
 };
@@ -7,9 +7,16 @@
 #include <atomic>
 #include <deque>
 #include <list>
-#include <map>
 #include <mutex>
+#include <queue>
+#include <set>
 #include <thread>
+#include <unordered_map>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <avcpp/timestamp.h>
 
 class EventLoop;
@@ -18,17 +25,57 @@ using Callable = std::function<void(EventLoop&)>;
 
 class EventLoop: public InstanceShared<EventLoop> {
 protected:
+    // scheduled times are kept in wallclock.ns() units
+    struct ScheduledItem {
+        AVTS when;
+        uint64_t seq; // keeps FIFO order of items scheduled for the same time
+        Callable cb;
+        bool operator>(const ScheduledItem &other) const {
+            return (when > other.when) || ((when == other.when) && (seq > other.seq));
+        }
+    };
+    // Every waited-for fd is registered in epoll once, edge-triggered, and stays there,
+    // so waiting doesn't cost an epoll_ctl. A signal which comes while nobody waits for the fd
+    // is remembered in `ready`, so that the next waiter runs right away.
+    struct FdState {
+        uint64_t event_id = 0; // Event::id() of the registered event, 0 if not registered
+        bool ready = false;
+        std::list<Callable> waiters;
+    };
     std::thread delegated_execution_thread_;
     Event wakeup_;
+    int epoll_fd_ = -1;
+    int timer_fd_ = -1;
     std::atomic_bool should_work_ {true};
     moodycamel::ConcurrentQueue<Callable> todo_;
-    std::map<int, Callable> todo_when_fd_readable_;
+    std::unordered_map<int, FdState> todo_when_fd_readable_;
     std::mutex todo_when_fd_readable_busy_;
-    std::list<std::pair<AVTS, Callable>> scheduled_;
+    std::priority_queue<ScheduledItem, std::vector<ScheduledItem>, std::greater<ScheduledItem>> scheduled_;
+    uint64_t scheduled_seq_ = 0;
+    AVTS timer_armed_for_ = AV_NOPTS_VALUE;
     std::mutex scheduled_busy_;
     std::mutex busy_;
     bool debug_timing_ = false;
     AVTS debug_timing_tolerance_ = 2;
+    static constexpr int max_events_ = 64;
+    // all live event loops, for dropping waiters of closed events
+    static inline std::mutex loops_busy_;
+    static inline std::set<EventLoop*> loops_;
+    static void eventClosed(int fd, uint64_t event_id) {
+        // destroyed after unlocking, callbacks may own objects with events
+        std::list<Callable> dropped;
+        std::lock_guard<decltype(loops_busy_)> lock(loops_busy_);
+        for (EventLoop* loop: loops_) {
+            loop->forgetEvent(fd, event_id, dropped);
+        }
+    }
+    void forgetEvent(int fd, uint64_t event_id, std::list<Callable> &dropped) {
+        std::lock_guard<decltype(todo_when_fd_readable_busy_)> lock(todo_when_fd_readable_busy_);
+        auto it = todo_when_fd_readable_.find(fd);
+        if (it == todo_when_fd_readable_.end() || it->second.event_id != event_id) return;
+        dropped.splice(dropped.end(), it->second.waiters);
+        todo_when_fd_readable_.erase(it);
+    }
     bool executeSingleFromToDo() {
         Callable cb;
         if (!todo_.try_dequeue(cb)) {
@@ -43,92 +90,144 @@ protected:
         }
         return true;
     }
-    void threadFunction() {
-        while (should_work_) {
-            struct pollfd *pfds = nullptr;
-            size_t i = 0;
-            size_t count = 0;
-            {
-                std::lock_guard<decltype(todo_when_fd_readable_busy_)> lock(todo_when_fd_readable_busy_);
-                count = todo_when_fd_readable_.size()+1;
-                pfds = new struct pollfd[count];
-                for (auto &kv: todo_when_fd_readable_) {
-                    pfds[i].fd = kv.first;
-                    pfds[i].events = POLLIN;
-                    pfds[i].revents = 0;
-                    i++;
-                }
+    void epollRegister(int fd) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = fd;
+        int ret = epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+        if (ret < 0 && errno==EEXIST) {
+            // closed fd whose number was reused is removed from epoll set only if it wasn't dup()ed
+            ret = epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+        }
+        if (ret < 0) {
+            throw Error("epoll_ctl failed for fd " + std::to_string(fd) + ": " + strerror(errno));
+        }
+    }
+    // must be called with scheduled_busy_ locked
+    void armTimer() {
+        AVTS when = scheduled_.empty() ? AV_NOPTS_VALUE : scheduled_.top().when;
+        if (when == timer_armed_for_) return;
+        timer_armed_for_ = when;
+        struct itimerspec its = {};
+        if (when != AV_NOPTS_VALUE) {
+            // absolute deadline, expires immediately if already in the past
+            its.it_value = wallclock.monotonicTime(when);
+            if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+                its.it_value.tv_nsec = 1; // zero would disarm the timer
             }
-            pfds[i].fd = wakeup_.fd();
-            pfds[i].events = POLLIN;
-            pfds[i].revents = 0;
-            int timeout_ms = -1;
-            {
-                std::lock_guard<decltype(scheduled_busy_)> lock(scheduled_busy_);
-                if (!scheduled_.empty()) {
-                    timeout_ms = scheduled_.front().first - wallclock.pts();
-                    if (timeout_ms<0) {
-                        if (debug_timing_ && (timeout_ms <= -debug_timing_tolerance_)) {
-                            logstream << "should wait " << timeout_ms << "ms for scheduled, changing to 0";
-                        }
-                        timeout_ms = 0;
-                    }
-                }
+        }
+        timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &its, nullptr);
+    }
+    void collectScheduled() {
+        std::lock_guard<decltype(scheduled_busy_)> lock(scheduled_busy_);
+        AVTS now = wallclock.ns();
+        while (!scheduled_.empty()) {
+            const ScheduledItem &top = scheduled_.top();
+            if (top.when > now) {
+                break;
             }
-            AVTS before_poll = wallclock.pts();
-            int ret = poll(pfds, count, timeout_ms);
-            AVTS diff = timeout_ms>=0 ? (wallclock.pts() - before_poll - timeout_ms) : 0;
-            if ( debug_timing_ && ( (ret==0 && abs(diff)>=debug_timing_tolerance_) || (diff>=debug_timing_tolerance_) ) ) {
-                logstream << "kernel is cheating on us! poll returned after ms diff " << diff << " timeout_ms " << timeout_ms;
+            AVTS diff = (top.when - now) / 1000000;
+            if (debug_timing_ && (diff <= -debug_timing_tolerance_)) {
+                logstream << "got scheduled too late diff " << diff << "ms";
             }
-
-            //logstream << "poll returned " << ret;
+            todo_.enqueue(std::move(const_cast<ScheduledItem&>(top).cb));
+            scheduled_.pop();
+        }
+        timer_armed_for_ = AV_NOPTS_VALUE; // timer fired or will be rearmed for different time
+        armTimer();
+    }
+    void fdReadable(int fd) {
+        int64_t blackhole;
+        std::lock_guard<decltype(todo_when_fd_readable_busy_)> lock(todo_when_fd_readable_busy_);
+        auto it = todo_when_fd_readable_.find(fd);
+        if (it == todo_when_fd_readable_.end()) return;
+        FdState &state = it->second;
+        if (state.waiters.empty()) {
+            // don't consume the signal, somebody else may wait for it outside the loop
+            state.ready = true;
+            return;
+        }
+        read(fd, &blackhole, sizeof blackhole);
+        for (Callable &cb: state.waiters) {
+            todo_.enqueue(std::move(cb));
+        }
+        state.waiters.clear();
+    }
+    // Called by the loop thread when it can't wait for events anymore: stops the loop
+    // and drops everything waiting for it, as nothing of it would ever run.
+    void fail(const std::string &reason) {
+        logstream << "Event loop stopped, " << reason;
+        should_work_ = false;
+        // destroyed after unlocking, callbacks may own objects with events
+        std::list<Callable> dropped;
+        {
+            std::lock_guard<decltype(todo_when_fd_readable_busy_)> lock(todo_when_fd_readable_busy_);
+            for (auto &kv: todo_when_fd_readable_) {
+                dropped.splice(dropped.end(), kv.second.waiters);
+            }
+            todo_when_fd_readable_.clear();
+        }
+        {
+            std::lock_guard<decltype(scheduled_busy_)> lock(scheduled_busy_);
+            while (!scheduled_.empty()) {
+                dropped.push_back(std::move(const_cast<ScheduledItem&>(scheduled_.top()).cb));
+                scheduled_.pop();
+            }
+        }
+        Callable cb;
+        while (todo_.try_dequeue(cb)) {
+            dropped.push_back(std::move(cb));
+        }
+        logstream << "Event loop dropped " << dropped.size() << " waiting callbacks";
+    }
+    // after fail(), or during destruction
+    bool rejectStopped() {
+        if (should_work_) return false;
+        logstream_limited(1) << "Event loop is stopped, dropping callback";
+        return true;
+    }
+    void threadFunction() {
+        struct epoll_event events[max_events_];
+        while (should_work_) {
+            int ret = epoll_wait(epoll_fd_, events, max_events_, -1);
             if (!should_work_) {
                 return;
             }
-            {
-                std::lock_guard<decltype(scheduled_busy_)> lock(scheduled_busy_);
-                AVTS now = wallclock.pts();
-                while (!scheduled_.empty()) {
-                    if (scheduled_.front().first > now) {
-                        break;
-                    }
-                    AVTS diff = scheduled_.front().first - now;
-                    if (debug_timing_ && (diff <= -debug_timing_tolerance_)) {
-                        logstream << "got scheduled too late diff " << diff << "ms";
-                    }
-                    todo_.enqueue(scheduled_.front().second);
-                    scheduled_.pop_front();
-                }
-            }
             if (ret<0) {
-                throw Error("poll error in event loop thread");
-            } else if (ret>0) {
-                int64_t blackhole;
-                for (size_t i=0; i<(count-1); i++) {
-                    if (pfds[i].revents & POLLIN) {
-                        std::lock_guard<decltype(todo_when_fd_readable_busy_)> lock(todo_when_fd_readable_busy_);
-                        auto cb_it = todo_when_fd_readable_.find(pfds[i].fd);
-                        if (cb_it != todo_when_fd_readable_.end()) {
-                            todo_.enqueue(cb_it->second);
-                            todo_when_fd_readable_.erase(cb_it);
-                            read(pfds[i].fd, &blackhole, sizeof blackhole);
-                        }
-                        pfds[i].revents = 0;
-                    }
-                }
-                if (pfds[count-1].revents & POLLIN) {
-                    // this is wakeup_
-                    read(pfds[count-1].fd, &blackhole, sizeof blackhole);
-                    pfds[count-1].revents = 0;
+                if (errno == EINTR) continue;
+                fail(std::string("epoll_wait: ") + strerror(errno));
+                return;
+            }
+            bool timer_fired = false;
+            int64_t blackhole;
+            for (int i=0; i<ret; i++) {
+                int fd = events[i].data.fd;
+                if (fd == wakeup_.fd()) {
+                    read(fd, &blackhole, sizeof blackhole);
+                } else if (fd == timer_fd_) {
+                    read(fd, &blackhole, sizeof blackhole);
+                    timer_fired = true;
+                } else {
+                    fdReadable(fd);
                 }
             }
+            if (timer_fired) {
+                collectScheduled();
+            }
             {
                 std::lock_guard<decltype(busy_)> lock(busy_);
                 while (executeSingleFromToDo() && should_work_) { };
             }
         }
     }
+    void addToEpoll(int fd) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            throw Error(std::string("epoll_ctl failed: ") + strerror(errno));
+        }
+    }
 public:
     EventLoop() {
         const char* envstr = getenv("AVPLUMBER_WARN_BAD_TIMING");
@@ -136,11 +235,27 @@ public:
         if (debug_timing_) {
             debug_timing_tolerance_ = atoi(envstr);
         }
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (epoll_fd_ < 0 || timer_fd_ < 0) {
+            throw Error(std::string("can't create event loop: ") + strerror(errno));
+        }
+        addToEpoll(wakeup_.fd());
+        addToEpoll(timer_fd_);
+        {
+            std::lock_guard<decltype(loops_busy_)> lock(loops_busy_);
+            loops_.insert(this);
+            Event::close_hook = &EventLoop::eventClosed;
+        }
         delegated_execution_thread_ = start_thread("EventLoop", [this]() {
             threadFunction();
         });
     }
     ~EventLoop() {
+        {
+            std::lock_guard<decltype(loops_busy_)> lock(loops_busy_);
+            loops_.erase(this);
+        }
         should_work_ = false;
         wakeup_.signal();
         delegated_execution_thread_.join();
@@ -148,18 +263,26 @@ public:
         if (todo_.try_dequeue(blackhole)) {
             logstream << "still have something in todo queue when shutting down event loop";
         }
-        if (!todo_when_fd_readable_.empty()) {
-            logstream << "still have " << todo_when_fd_readable_.size() << " events for fd wakeup when shutting down event loop";
+        size_t fd_waiters = 0;
+        for (auto &kv: todo_when_fd_readable_) {
+            fd_waiters += kv.second.waiters.size();
+        }
+        if (fd_waiters > 0) {
+            logstream << "still have " << fd_waiters << " events for fd wakeup when shutting down event loop";
         }
         if (!scheduled_.empty()) {
             logstream << "still have " << scheduled_.size() << " events scheduled for timed execution when shutting down event loop";
         }
+        close(timer_fd_);
+        close(epoll_fd_);
     }
     void execute(Callable cb) {
+        if (rejectStopped()) return;
         todo_.enqueue(cb);
         wakeup_.signal();
     }
     void fastExecute(av::Timestamp time_limit, Callable cb) {
+        if (rejectStopped()) return;
         av::Timestamp deadline = addTS(wallclock.ts(), time_limit);
         if (busy_.try_lock()) {
             std::lock_guard<decltype(busy_)> lock(busy_, std::adopt_lock);
@@ -175,34 +298,44 @@ public:
         }
     }
     void asyncWaitAndExecute(Event &event, Callable cb) {
-        // TODO FIXME: this works only by accident!!!
-        // it should be map of lists
+        // multiple waiters per fd are allowed, all of them are executed when it becomes readable
+        if (rejectStopped()) return;
+        int fd = event.fd();
+        std::list<Callable> stale; // destroyed after unlocking
         std::lock_guard<decltype(todo_when_fd_readable_busy_)> lock(todo_when_fd_readable_busy_);
-        todo_when_fd_readable_[event.fd()] = cb;
-        wakeup_.signal();
+        FdState &state = todo_when_fd_readable_[fd];
+        if (state.event_id != event.id()) {
+            // first wait for this event (fd number could belong to a closed one before,
+            // its waiters must never run)
+            epollRegister(fd);
+            event.registered_ = true;
+            state.event_id = event.id();
+            state.ready = false; // epoll reports it again if it's readable
+            stale.splice(stale.end(), state.waiters);
+        } else if (state.ready) {
+            // signalled while nobody waited, may be spurious if somebody else consumed it meanwhile
+            state.ready = false;
+            int64_t blackhole;
+            read(fd, &blackhole, sizeof blackhole);
+            todo_.enqueue(std::move(cb));
+            wakeup_.signal();
+            return;
+        }
+        state.waiters.push_back(std::move(cb));
     }
     void schedule(av::Timestamp when, Callable cb) {
-        AVTS ts = when.timestamp(wallclock.timeBase());
+        if (rejectStopped()) return;
+        AVTS ts = when.timestamp(wallclock.fineTimeBase());
         std::lock_guard<decltype(scheduled_busy_)> lock(scheduled_busy_);
-        auto it = scheduled_.begin();
-        bool is_first = true;
-        while (it != scheduled_.end()) {
-            if (it->first > ts) {
-                break;
-            }
-            is_first = false;
-            it++;
-        }
         if (debug_timing_) {
-            AVTS diff = ts - wallclock.pts();
+            AVTS diff = (ts - wallclock.ns()) / 1000000;
             if (diff <= -debug_timing_tolerance_) {
                 logstream << "scheduling event from the past?! " << diff << " ms";
             }
         }
-        scheduled_.insert(it, std::pair(ts, cb));
-        if (is_first) {
-            wakeup_.signal();
-        }
+        scheduled_.push(ScheduledItem{ts, scheduled_seq_++, std::move(cb)});
+        // timer is rearmed only if we're the earliest, no need to wake up the thread
+        armTimer();
     }
     void sleepAndExecute(int ms, Callable cb) {
         schedule(addTS(wallclock.ts(), av::Timestamp(ms, {1, 1000})), cb);
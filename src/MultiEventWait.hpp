@@ -1,55 +1,76 @@
 #pragma once
+#include <algorithm>
+#include <cerrno>
 #include <vector>
 #include <stdexcept>
+#include <sys/epoll.h>
 #include "Event.hpp"
 #include "util.hpp"
 
 
+// Waits for any of the events. Uses epoll, so the cost of a wait
+// depends on the number of signalled events, not on the number of all events.
 class MultiEventWait {
 private:
-    struct pollfd *pfds_;
-    size_t count_;
+    int epoll_fd_ = -1;
+    std::vector<int> fds_;
+    std::vector<struct epoll_event> ready_;
+    void init() {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ < 0) {
+            throw Error("MultiEventWait: epoll_create1 failed");
+        }
+        for (size_t i=0; i<fds_.size(); i++) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u64 = i;
+            if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fds_[i], &ev) < 0) {
+                throw Error("MultiEventWait: epoll_ctl failed");
+            }
+        }
+        ready_.resize(std::max<size_t>(fds_.size(), 1));
+    }
 public:
     MultiEventWait(const std::vector<Event*> &events) {
-        count_ = events.size();
-        pfds_ = new struct pollfd[count_];
-        struct pollfd *pfd = pfds_;
         for (Event* event: events) {
-            pfd->fd = event->fd_;
-            pfd->events = POLLIN;
-            pfd->revents = 0;
-            pfd++;
+            fds_.push_back(event->fd_);
         }
+        init();
     }
     MultiEventWait(const MultiEventWait &copyfrom) {
-        count_ = copyfrom.count_;
-        pfds_ = new struct pollfd[count_];
-        std::copy(copyfrom.pfds_, copyfrom.pfds_+copyfrom.count_, pfds_);
+        fds_ = copyfrom.fds_;
+        init();
     }
     MultiEventWait(MultiEventWait &&movefrom) {
-        count_ = movefrom.count_;
-        pfds_ = movefrom.pfds_;
-        movefrom.count_ = 0;
-        movefrom.pfds_ = nullptr;
+        epoll_fd_ = movefrom.epoll_fd_;
+        fds_ = std::move(movefrom.fds_);
+        ready_ = std::move(movefrom.ready_);
+        movefrom.epoll_fd_ = -1;
     }
     ~MultiEventWait() {
-        if (pfds_ != nullptr) delete[] pfds_;
+        if (epoll_fd_ >= 0) close(epoll_fd_);
     }
-    bool wait(int timeout_ms = -1) { // returns false for timeout, true if at least 1 event was signalled
-        bool result = false;
-        int ret = poll(pfds_, count_, timeout_ms);
+    // returns false for timeout, true if at least 1 event was signalled
+    // indices (in the constructor's vector) of signalled events are appended to signalled
+    bool wait(int timeout_ms, std::vector<size_t> &signalled) {
+        int ret;
+        do {
+            ret = epoll_wait(epoll_fd_, ready_.data(), ready_.size(), timeout_ms);
+        } while (ret<0 && errno==EINTR);
         if (ret<0) {
-            throw Error("wait: poll error");
-        } else if (ret>0) {
-            int64_t blackhole;
-            for (size_t i=0; i<count_; i++) {
-                if (pfds_[i].revents & POLLIN) {
-                    result = true;
-                    read(pfds_[i].fd, &blackhole, sizeof blackhole);
-                }
-                pfds_[i].revents = 0;
-            }
+            throw Error("wait: epoll error");
+        }
+        int64_t blackhole;
+        for (int i=0; i<ret; i++) {
+            size_t index = ready_[i].data.u64;
+            read(fds_[index], &blackhole, sizeof blackhole);
+            signalled.push_back(index);
         }
-        return result;
+        return ret>0;
+    }
+    bool wait(int timeout_ms = -1) {
+        thread_local std::vector<size_t> signalled;
+        signalled.clear();
+        return wait(timeout_ms, signalled);
     }
 };
@@ -5,6 +5,7 @@
 #include <algorithm>
 
 void TickSource::tick(EventLoop &evl) {
+    ticks_++;
     std::lock_guard<decltype(busy_)> lock(busy_);
     for (auto &wptr: nodes_) {
         if (wptr.expired()) continue;
@@ -28,3 +29,65 @@ void TickSource::add(std::shared_ptr<NonBlockingNodeBase> node) {
     nodes_.erase(std::remove_if(nodes_.begin(), nodes_.end(), [](std::weak_ptr<NonBlockingNodeBase> &p) { return p.expired(); }), nodes_.end());
     nodes_.push_back(std::weak_ptr<NonBlockingNodeBase>(node));
 }
+
+void TickSource::startTimer(AVRational period) {
+    if (period.num <= 0 || period.den <= 0) {
+        throw Error("tick period must be positive");
+    }
+    if (timer_should_work_.exchange(true)) {
+        throw Error("tick source timer already started");
+    }
+    period_ = period;
+    std::weak_ptr<TickSource> wthis = weak_from_this();
+    timer_thread_ = start_thread("TickSource", [wthis, period]() {
+        timerThread(wthis, period);
+    });
+}
+
+void TickSource::timerThread(std::weak_ptr<TickSource> wthis, AVRational period) {
+    const int64_t ns_per_sec = 1000000000;
+    const AVTS period_ns = av_rescale(period.num, ns_per_sec, period.den);
+    const AVTS start = wallclock.ns();
+    // deadlines are computed from the tick number, not from the previous deadline,
+    // so rounding errors of non-integer periods (e.g. 1001/60000) don't accumulate
+    int64_t n = 0;
+    while (true) {
+        n++;
+        AVTS deadline = start + av_rescale(n * period.num, ns_per_sec, period.den);
+        wallclock.sleepUntilNs(deadline);
+        std::shared_ptr<TickSource> sthis = wthis.lock();
+        if (!sthis || !sthis->timer_should_work_) break;
+        AVTS late = wallclock.ns() - deadline;
+        sthis->lateness_us_.record(late > 0 ? late / 1000 : 0);
+        if (late >= period_ns) {
+            // don't burst to catch up, skip the ticks we've missed
+            int64_t skip = late / period_ns;
+            n += skip;
+            sthis->missed_ticks_ += skip;
+        }
+        sthis->fastTick();
+    }
+}
+
+Parameters TickSource::stats() {
+    Parameters r;
+    r["ticks"] = ticks_.load();
+    if (timer_should_work_) {
+        r["period"] = std::to_string(period_.num) + "/" + std::to_string(period_.den);
+        r["missed_ticks"] = missed_ticks_.load();
+        r["lateness_us"] = lateness_us_.toJson();
+    }
+    return r;
+}
+
+TickSource::~TickSource() {
+    timer_should_work_ = false;
+    if (timer_thread_.joinable()) {
+        if (timer_thread_.get_id() == std::this_thread::get_id()) {
+            // last reference to us was dropped by a tick executed in the timer thread
+            timer_thread_.detach();
+        } else {
+            timer_thread_.join();
+        }
+    }
+}
@@ -1,6 +1,10 @@
 #pragma once
 #include "instance_shared.hpp"
+#include "avutils.hpp"
+#include "histogram.hpp"
+#include <atomic>
 #include <memory>
+#include <thread>
 
 class NonBlockingNodeBase;
 class EventLoop;
@@ -10,10 +14,22 @@ protected:
     std::vector<std::weak_ptr<NonBlockingNodeBase>> nodes_;
     std::mutex busy_;
     std::shared_ptr<EventLoop> event_loop_;
+    // timer mode:
+    std::thread timer_thread_;
+    std::atomic_bool timer_should_work_ {false};
+    AVRational period_ = {0, 1};
+    std::atomic_uint64_t ticks_ {0};
+    std::atomic_uint64_t missed_ticks_ {0};
+    LogHistogram<> lateness_us_; // how late timer ticks were, microseconds
+    static void timerThread(std::weak_ptr<TickSource> wthis, AVRational period);
 public:
     void tick(EventLoop &evl);
     void fastTick();
     void add(std::shared_ptr<NonBlockingNodeBase> node);
+    // generate ticks from our own high resolution timer, every period (seconds)
+    void startTimer(AVRational period);
+    Parameters stats();
     TickSource(std::shared_ptr<EventLoop> evl): event_loop_(evl) {
     }
+    ~TickSource();
 };
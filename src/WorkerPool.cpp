@@ -0,0 +1,120 @@
+#include "WorkerPool.hpp"
+
+thread_local WorkerPool* WorkerPool::current_pool_ = nullptr;
+thread_local size_t WorkerPool::current_worker_ = 0;
+
+bool WorkerPool::popLocal(size_t index, Task &task) {
+    Worker &w = *workers_[index];
+    std::lock_guard<decltype(w.busy)> lock(w.busy);
+    if (w.tasks.empty()) return false;
+    task = std::move(w.tasks.front());
+    w.tasks.pop_front();
+    return true;
+}
+
+bool WorkerPool::steal(size_t thief, Task &task) {
+    size_t count = workers_.size();
+    for (size_t i=1; i<count; i++) {
+        Worker &victim = *workers_[(thief+i) % count];
+        std::unique_lock<decltype(victim.busy)> lock(victim.busy, std::try_to_lock);
+        if (!lock.owns_lock() || victim.tasks.empty()) continue;
+        task = std::move(victim.tasks.back());
+        victim.tasks.pop_back();
+        return true;
+    }
+    return false;
+}
+
+bool WorkerPool::findTask(size_t index, Task &task) {
+    return popLocal(index, task) || injected_.try_dequeue(task) || steal(index, task);
+}
+
+void WorkerPool::wakeOne() {
+    if (sleeping_.load(std::memory_order_acquire) > 0) {
+        std::lock_guard<decltype(idle_mutex_)> lock(idle_mutex_);
+        idle_cv_.notify_one();
+    }
+}
+
+void WorkerPool::workerFunction(size_t index) {
+    current_pool_ = this;
+    current_worker_ = index;
+    Task task;
+    while (should_work_) {
+        if (findTask(index, task)) {
+            pending_--;
+            try {
+                task();
+            } catch (std::exception &e) {
+                logstream << "error in worker pool task: " << e.what();
+            }
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<decltype(idle_mutex_)> lock(idle_mutex_);
+        sleeping_++;
+        idle_cv_.wait(lock, [this]() { return (pending_.load() > 0) || !should_work_; });
+        sleeping_--;
+    }
+}
+
+void WorkerPool::pushPending() {
+    std::lock_guard<decltype(idle_mutex_)> lock(idle_mutex_);
+    pending_++;
+}
+
+WorkerPool::WorkerPool(size_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    parking_ = std::make_shared<EventLoop>();
+    workers_.reserve(threads);
+    for (size_t i=0; i<threads; i++) {
+        workers_.push_back(make_unique<Worker>());
+    }
+    for (size_t i=0; i<threads; i++) {
+        workers_[i]->thread = start_thread("WP" + std::to_string(i), [this, i]() {
+            workerFunction(i);
+        });
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<decltype(idle_mutex_)> lock(idle_mutex_);
+        should_work_ = false;
+        idle_cv_.notify_all();
+    }
+    for (auto &w: workers_) {
+        w->thread.join();
+    }
+    if (pending_.load() > 0) {
+        logstream << "still have " << pending_.load() << " tasks when shutting down worker pool";
+    }
+}
+
+void WorkerPool::submit(Task task) {
+    pushPending();
+    injected_.enqueue(std::move(task));
+    wakeOne();
+}
+
+void WorkerPool::yield(Task task) {
+    if (current_pool_ != this) {
+        submit(std::move(task));
+        return;
+    }
+    pushPending();
+    {
+        Worker &w = *workers_[current_worker_];
+        std::lock_guard<decltype(w.busy)> lock(w.busy);
+        w.tasks.push_back(std::move(task));
+    }
+    wakeOne();
+}
+
+void WorkerPool::submitWhenSignalled(Event &event, Task task) {
+    parking_->asyncWaitAndExecute(event, [this, task](EventLoop&) {
+        submit(task);
+    });
+}
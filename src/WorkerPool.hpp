@@ -0,0 +1,64 @@
+#pragma once
+#include "Event.hpp"
+#include "EventLoop.hpp"
+#include "util.hpp"
+#include "instance_shared.hpp"
+#include <concurrentqueue/concurrentqueue.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads executing short tasks.
+// Each worker has its own deque of tasks. Tasks resubmitted from a worker
+// go to its own deque, tasks submitted from the outside go to a shared
+// injection queue and idle workers steal from their busy neighbours.
+// Blocking nodes which implement IWorkerPoolSafe may run on it (see NodeWrapper, "worker_pool" parameter):
+// instead of sleeping in Edge waits, such node is parked in the pool's event loop
+// until its queue's produced/consumed Event is signalled.
+class WorkerPool: public InstanceShared<WorkerPool> {
+public:
+    using Task = std::function<void()>;
+protected:
+    struct Worker {
+        std::deque<Task> tasks;
+        std::mutex busy;
+        std::thread thread;
+    };
+    std::vector<std::unique_ptr<Worker>> workers_;
+    moodycamel::ConcurrentQueue<Task> injected_;
+    std::shared_ptr<EventLoop> parking_;
+    std::mutex idle_mutex_;
+    std::condition_variable idle_cv_;
+    std::atomic_uint64_t pending_ {0};
+    std::atomic_size_t sleeping_ {0};
+    std::atomic_bool should_work_ {true};
+    static thread_local WorkerPool* current_pool_;
+    static thread_local size_t current_worker_;
+
+    bool popLocal(size_t index, Task &task);
+    bool steal(size_t thief, Task &task);
+    bool findTask(size_t index, Task &task);
+    void wakeOne();
+    void workerFunction(size_t index);
+    void pushPending();
+public:
+    WorkerPool(size_t threads = 0);
+    WorkerPool(const WorkerPool&) = delete;
+    ~WorkerPool();
+    size_t threadsCount() const {
+        return workers_.size();
+    }
+    // submit from any thread
+    void submit(Task task);
+    // task which just ran on our worker and wants to continue:
+    // keep it on the same worker for locality, let others steal it if they're idle
+    void yield(Task task);
+    // park the task (without occupying any worker) until event is signalled
+    void submitWhenSignalled(Event &event, Task task);
+};
@@ -0,0 +1,221 @@
+#include "async_file_writer.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "avutils.hpp"
+
+AsyncFileWriter::AsyncFileWriter(const std::string thread_name, const size_t max_backlog_bytes): max_backlog_bytes_(max_backlog_bytes) {
+    writer_ = start_thread(thread_name, [this]() {
+        writerThread();
+    });
+}
+
+AsyncFileWriter::~AsyncFileWriter() {
+    {
+        std::lock_guard<decltype(mutex_)> lock(mutex_);
+        should_work_ = false;
+    }
+    cv_.notify_all();
+    if (writer_.joinable()) {
+        writer_.join();
+    }
+    closeAppended();
+}
+
+void AsyncFileWriter::enqueue(Job &&job) {
+    size_t size = job.data ? job.data->size() : 0;
+    std::unique_lock<decltype(mutex_)> lock(mutex_);
+    // always accept into empty queue, so that a request bigger than the budget doesn't block forever
+    cv_.wait(lock, [&]() {
+        return failed_ || queue_.empty() || (backlog_bytes_ + size <= max_backlog_bytes_);
+    });
+    if (failed_) {
+        throw Error("File writer failed: " + error_);
+    }
+    queue_.push_back(std::move(job));
+    backlog_bytes_ += size;
+    if (backlog_bytes_ > max_seen_backlog_bytes_) {
+        max_seen_backlog_bytes_ = backlog_bytes_;
+    }
+    lock.unlock();
+    cv_.notify_all();
+}
+
+void AsyncFileWriter::create(const std::string path, std::shared_ptr<const std::string> data) {
+    enqueue({Op::Create, path, std::move(data)});
+}
+
+void AsyncFileWriter::append(const std::string path, std::shared_ptr<const std::string> data) {
+    enqueue({Op::Append, path, std::move(data)});
+}
+
+void AsyncFileWriter::replace(const std::string path, std::string data) {
+    enqueue({Op::Replace, path, std::make_shared<const std::string>(std::move(data))});
+}
+
+void AsyncFileWriter::remove(const std::string path) {
+    enqueue({Op::Remove, path, nullptr});
+}
+
+void AsyncFileWriter::flush() {
+    std::unique_lock<decltype(mutex_)> lock(mutex_);
+    cv_.wait(lock, [this]() {
+        return failed_ || (queue_.empty() && !busy_);
+    });
+    if (failed_) {
+        throw Error("File writer failed: " + error_);
+    }
+}
+
+void AsyncFileWriter::closeAppended() {
+    if (append_fd_ >= 0) {
+        close(append_fd_);
+        append_fd_ = -1;
+    }
+    append_path_.clear();
+}
+
+void AsyncFileWriter::openAppended(const std::string &path, const int flags) {
+    closeAppended();
+    append_fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | flags, 0644);
+    if (append_fd_ < 0) {
+        throw Error("open " + path + ": " + strerror(errno));
+    }
+    append_path_ = path;
+    written_files_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void AsyncFileWriter::run(const Job &job) {
+    switch (job.op) {
+    case Op::Create:
+        openAppended(job.path, O_TRUNC);
+        writeAll(append_fd_, job.data->data(), job.data->size(), job.path);
+        break;
+    case Op::Append:
+        if (append_fd_ < 0 || append_path_ != job.path) {
+            openAppended(job.path, 0);
+        }
+        writeAll(append_fd_, job.data->data(), job.data->size(), job.path);
+        break;
+    case Op::Replace:
+        replaceFile(job.path, *job.data);
+        written_files_.fetch_add(1, std::memory_order_relaxed);
+        break;
+    case Op::Remove:
+        if (job.path == append_path_) {
+            closeAppended();
+        }
+        if (unlink(job.path.c_str()) < 0 && errno != ENOENT) {
+            logstream_limited(1) << "unlink " << job.path << ": " << strerror(errno);
+        }
+        break;
+    }
+    if (job.data) {
+        written_bytes_.fetch_add(job.data->size(), std::memory_order_relaxed);
+    }
+}
+
+void AsyncFileWriter::writerThread() {
+    std::deque<Job> batch;
+    std::unique_lock<decltype(mutex_)> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this]() {
+            return !queue_.empty() || !should_work_;
+        });
+        if (queue_.empty()) {
+            // stopping, everything written
+            break;
+        }
+        batch.swap(queue_);
+        busy_ = true;
+        lock.unlock();
+        cv_.notify_all();
+        for (Job &job: batch) {
+            AVTS begin = wallclock.ns();
+            try {
+                run(job);
+            } catch (std::exception &e) {
+                logstream << "File writer failed: " << e.what();
+                lock.lock();
+                failed_ = true;
+                error_ = e.what();
+                busy_ = false;
+                queue_.clear();
+                backlog_bytes_ = 0;
+                lock.unlock();
+                cv_.notify_all();
+                return;
+            }
+            write_us_.record((wallclock.ns() - begin) / 1000);
+            if (job.data) {
+                {
+                    std::lock_guard<decltype(mutex_)> lock2(mutex_);
+                    backlog_bytes_ -= job.data->size();
+                }
+                cv_.notify_all();
+            }
+        }
+        batch.clear();
+        lock.lock();
+        busy_ = false;
+        cv_.notify_all();
+    }
+}
+
+nlohmann::json AsyncFileWriter::stats() {
+    nlohmann::json r;
+    r["written_bytes"] = written_bytes_.load(std::memory_order_relaxed);
+    r["written_files"] = written_files_.load(std::memory_order_relaxed);
+    {
+        std::lock_guard<decltype(mutex_)> lock(mutex_);
+        r["backlog_requests"] = queue_.size();
+        r["backlog_bytes"] = backlog_bytes_;
+        r["max_backlog_bytes"] = max_seen_backlog_bytes_;
+    }
+    r["write_us"] = write_us_.toJson();
+    r["write_us"].erase("buckets");
+    return r;
+}
+
+void AsyncFileWriter::writeAll(const int fd, const char* data, size_t size, const std::string &path) {
+    while (size > 0) {
+        ssize_t r = ::write(fd, data, size);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            throw Error("write " + path + ": " + strerror(errno));
+        }
+        data += r;
+        size -= r;
+    }
+}
+
+void AsyncFileWriter::replaceFile(const std::string path, const std::string &data) {
+    std::string tmp_path = path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw Error("open " + tmp_path + ": " + strerror(errno));
+    }
+    try {
+        writeAll(fd, data.data(), data.size(), tmp_path);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+        throw Error("rename " + tmp_path + ": " + strerror(errno));
+    }
+}
+
+void AsyncFileWriter::makeDirectories(const std::string path) {
+    for (size_t pos = 1; pos <= path.size(); pos++) {
+        if (pos == path.size() || path[pos] == '/') {
+            std::string dir = path.substr(0, pos);
+            if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+                throw Error("mkdir " + dir + ": " + strerror(errno));
+            }
+        }
+    }
+}
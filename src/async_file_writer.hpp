@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <json.hpp>
+
+#include "histogram.hpp"
+#include "util.hpp"
+
+// Writes files in a separate thread, in the order of requests, so that slow storage
+// doesn't stall media processing. Requests queued while the writer is busy are
+// handled in one go; create() and consecutive appends to the same file reuse its descriptor.
+// replace() writes a temporary file and renames it, so readers never see a partial file.
+// When more than max_backlog_bytes are waiting, the caller blocks.
+class AsyncFileWriter {
+protected:
+    enum class Op {
+        Create,
+        Append,
+        Replace,
+        Remove,
+    };
+    struct Job {
+        Op op;
+        std::string path;
+        std::shared_ptr<const std::string> data;
+    };
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Job> queue_;
+    size_t backlog_bytes_ = 0;
+    size_t max_backlog_bytes_;
+    size_t max_seen_backlog_bytes_ = 0;
+    bool busy_ = false;
+    bool should_work_ = true;
+    bool failed_ = false;
+    std::string error_;
+    // writer thread only:
+    std::string append_path_;
+    int append_fd_ = -1;
+    std::atomic_uint64_t written_bytes_ {0};
+    std::atomic_uint64_t written_files_ {0};
+    LogHistogram<> write_us_; // duration of a single request
+    std::thread writer_;
+
+    void enqueue(Job &&job);
+    void closeAppended();
+    void openAppended(const std::string &path, const int flags);
+    void run(const Job &job);
+    void writerThread();
+public:
+    AsyncFileWriter(const std::string thread_name, const size_t max_backlog_bytes = 256*1024*1024);
+    // writes everything queued before returning
+    virtual ~AsyncFileWriter();
+    // truncates the file if it exists, following append()s continue it
+    void create(const std::string path, std::shared_ptr<const std::string> data);
+    void append(const std::string path, std::shared_ptr<const std::string> data);
+    void replace(const std::string path, std::string data);
+    void remove(const std::string path);
+    // wait until all requests made before this call are done
+    void flush();
+    nlohmann::json stats();
+    // write() until everything is written, throws on error
+    static void writeAll(const int fd, const char* data, size_t size, const std::string &path);
+    // synchronous variant of replace()
+    static void replaceFile(const std::string path, const std::string &data);
+    // mkdir -p
+    static void makeDirectories(const std::string path);
+};
@@ -0,0 +1,154 @@
+#include "async_logger.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+AsyncLogger::AsyncLogger(const std::string file_name, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+    slots_.reset(new Slot[size]);
+    for (size_t i=0; i<size; i++) {
+        slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+    mask_ = size - 1;
+    if (file_name.empty()) {
+        fd_ = STDERR_FILENO;
+    } else {
+        fd_ = open(file_name.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            throw Error(std::string("open: ") + strerror(errno));
+        }
+        own_fd_ = true;
+    }
+    writer_ = start_thread("logger", [this]() {
+        writerThread();
+    });
+}
+
+AsyncLogger::~AsyncLogger() {
+    // lines of threads still logging while we're destroyed are written too
+    flush();
+    should_work_ = false;
+    wakeWriter();
+    if (writer_.joinable()) {
+        writer_.join();
+    }
+    if (own_fd_) {
+        close(fd_);
+    }
+}
+
+void AsyncLogger::write(const std::string &s) {
+    uint64_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+        slot = &slots_[pos & mask_];
+        uint64_t seq = slot->seq.load(std::memory_order_acquire);
+        int64_t diff = int64_t(seq) - int64_t(pos);
+        if (diff == 0) {
+            if (enqueue_pos_.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // full, writer is behind
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+    if (s.size() > max_line_length) {
+        slot->line.assign(s, 0, max_line_length - 1);
+        slot->line += '\n';
+    } else {
+        slot->line.assign(s); // reuses capacity of previous line
+    }
+    slot->seq.store(pos+1, std::memory_order_release);
+    // pairs with the fence in writerThread, so that either we see it sleeping or it sees our line
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (writer_sleeping_.load(std::memory_order_relaxed)) {
+        wakeWriter();
+    }
+}
+
+void AsyncLogger::wakeWriter() {
+    std::lock_guard<decltype(mutex_)> lock(mutex_);
+    wake_cv_.notify_one();
+}
+
+bool AsyncLogger::pop(std::string &batch) {
+    Slot &slot = slots_[dequeue_pos_ & mask_];
+    if (slot.seq.load(std::memory_order_acquire) != dequeue_pos_+1) {
+        return false;
+    }
+    batch += slot.line;
+    if (slot.line.capacity() > 4096) {
+        // don't keep memory of occasional huge lines (stack traces)
+        std::string().swap(slot.line);
+    } else {
+        slot.line.clear();
+    }
+    slot.seq.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+    dequeue_pos_++;
+    return true;
+}
+
+void AsyncLogger::writeAll(const std::string &data) {
+    const char* p = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+        ssize_t r = ::write(fd_, p, left);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            // nowhere to report it
+            return;
+        }
+        p += r;
+        left -= r;
+    }
+}
+
+void AsyncLogger::writerThread() {
+    std::string batch;
+    batch.reserve(max_batch_bytes + max_line_length);
+    while (true) {
+        batch.clear();
+        while (batch.size() < max_batch_bytes && pop(batch)) {
+        }
+        uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            dropped_total_.fetch_add(dropped, std::memory_order_relaxed);
+            batch += now_str() + " [logger] " + std::to_string(dropped) + " log messages dropped, queue full\n";
+        }
+        if (!batch.empty()) {
+            writeAll(batch);
+            {
+                std::lock_guard<decltype(mutex_)> lock(mutex_);
+                written_pos_.store(dequeue_pos_, std::memory_order_release);
+            }
+            written_cv_.notify_all();
+            continue;
+        }
+        if (!should_work_) {
+            break;
+        }
+        std::unique_lock<decltype(mutex_)> lock(mutex_);
+        writer_sleeping_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (should_work_ && slots_[dequeue_pos_ & mask_].seq.load(std::memory_order_acquire) != dequeue_pos_+1) {
+            // timeout only as a safety net, and to report drops
+            wake_cv_.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        writer_sleeping_.store(false, std::memory_order_relaxed);
+    }
+}
+
+void AsyncLogger::flush() {
+    uint64_t target = enqueue_pos_.load(std::memory_order_acquire);
+    std::unique_lock<decltype(mutex_)> lock(mutex_);
+    wake_cv_.notify_one();
+    written_cv_.wait_for(lock, std::chrono::milliseconds(flush_timeout_ms), [this, target]() {
+        return written_pos_.load(std::memory_order_acquire) >= target;
+    });
+}
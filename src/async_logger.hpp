@@ -0,0 +1,56 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "util.hpp"
+
+// Logger which doesn't block the calling thread on I/O.
+// Lines go to a bounded multi-producer ring (lock-free, slots keep their string
+// capacity so steady-state logging doesn't allocate) and a writer thread
+// writes them to the file in batches. When the ring is full, lines are dropped
+// and the writer reports how many.
+class AsyncLogger: public Logger {
+protected:
+    struct Slot {
+        std::atomic_uint64_t seq;
+        std::string line;
+    };
+    std::unique_ptr<Slot[]> slots_;
+    uint64_t mask_;
+    alignas(64) std::atomic_uint64_t enqueue_pos_ {0};
+    alignas(64) uint64_t dequeue_pos_ = 0; // writer thread only
+    std::atomic_uint64_t written_pos_ {0};
+    std::atomic_uint64_t dropped_ {0};
+    std::atomic_uint64_t dropped_total_ {0};
+    int fd_ = -1;
+    bool own_fd_ = false;
+    std::atomic_bool writer_sleeping_ {false};
+    std::atomic_bool should_work_ {true};
+    std::mutex mutex_;
+    std::condition_variable wake_cv_;
+    std::condition_variable written_cv_;
+    std::thread writer_;
+
+    bool pop(std::string &batch);
+    void writeAll(const std::string &data);
+    void wakeWriter();
+    void writerThread();
+    virtual void write(const std::string &s) override;
+public:
+    static constexpr size_t max_line_length = 64*1024;
+    static constexpr size_t max_batch_bytes = 256*1024;
+    static constexpr int flush_timeout_ms = 1000;
+    // empty file_name = stderr, capacity is rounded up to power of 2
+    AsyncLogger(const std::string file_name, size_t capacity = 8192);
+    virtual ~AsyncLogger();
+    // wait (at most flush_timeout_ms) until lines logged before this call are written
+    virtual void flush() override;
+    uint64_t droppedTotal() const {
+        return dropped_total_.load(std::memory_order_relaxed);
+    }
+};
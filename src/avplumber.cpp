@@ -16,15 +16,19 @@
 #include "util.hpp"
 #include "stats.hpp"
 #include "logger_impls.hpp"
+#include "async_logger.hpp"
 #include "output_control.hpp"
 #include "hwaccel_mgmt.hpp"
 #include "named_event.hpp"
 #include "RealTimeTeam.hpp"
-#ifdef EMBED_IN_OBS
-    #include "instance_shared.hpp"
-    #include "TickSource.hpp"
-    #include "EventLoop.hpp"
-#endif
+#include "WorkerPool.hpp"
+#include "instance_shared.hpp"
+#include "TickSource.hpp"
+#include "EventLoop.hpp"
+#include "trace.hpp"
+#include "buffer_pool.hpp"
+#include "metrics.hpp"
+#include "edge_recording.hpp"
 
 #include <avcpp/av.h>
 #include <avcpp/avutils.h>
@@ -98,6 +102,84 @@ struct ClientPipe {
     }
 };
 
+// Minimal HTTP server for pull-based monitoring: GET /metrics returns collectMetrics() text.
+// Every request gets its own connection (Connection: close).
+class MetricsHttpServer: public ControlServerBase {
+    struct Connection: public std::enable_shared_from_this<Connection> {
+        MetricsHttpServer &server;
+        tcp::socket socket;
+        boost::asio::streambuf request;
+        std::string response;
+        Connection(MetricsHttpServer &_server): server(_server), socket(_server.io_service_) {
+        }
+        void start() {
+            auto self = shared_from_this();
+            boost::asio::async_read_until(socket, request, "\r\n\r\n", [self](const boost::system::error_code& error, size_t) {
+                if (error) return;
+                std::istream is(&self->request);
+                std::string method, target;
+                is >> method >> target;
+                target = target.substr(0, target.find('?'));
+                std::string status = "200 OK";
+                std::string body;
+                if (method != "GET") {
+                    status = "405 Method Not Allowed";
+                } else if (target != "/metrics") {
+                    status = "404 Not Found";
+                } else {
+                    try {
+                        body = collectMetrics(*self->server.manager_);
+                    } catch (std::exception &e) {
+                        status = "500 Internal Server Error";
+                        body = e.what();
+                    }
+                }
+                self->response = "HTTP/1.1 " + status + "\r\n"
+                    "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                    "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                    "Connection: close\r\n\r\n" + body;
+                boost::asio::async_write(self->socket, boost::asio::buffer(self->response), [self](const boost::system::error_code&, const size_t) {
+                    boost::system::error_code ignored;
+                    self->socket.shutdown(tcp::socket::shutdown_both, ignored);
+                });
+            });
+        }
+    };
+
+    std::shared_ptr<NodeManager> manager_;
+    boost::asio::io_service io_service_;
+    tcp::acceptor acceptor_;
+    std::thread net_thread_;
+
+    void nextConnection() {
+        auto conn = std::make_shared<Connection>(*this);
+        acceptor_.async_accept(conn->socket, [this, conn](const boost::system::error_code& error) {
+            if (error) {
+                if (error != boost::asio::error::operation_aborted) {
+                    logstream << "metrics: accept error: " << error;
+                }
+                return;
+            }
+            conn->start();
+            nextConnection();
+        });
+    }
+public:
+    MetricsHttpServer(std::shared_ptr<NodeManager> manager, const std::string address, const uint16_t port):
+        manager_(manager),
+        acceptor_(io_service_, tcp::endpoint(boost::asio::ip::address::from_string(address), port)) {
+        nextConnection();
+        net_thread_ = start_thread("metrics HTTP", [this]() {
+            io_service_.run();
+        });
+        logstream << "Serving metrics on http://" << address << ":" << port << "/metrics";
+    }
+    virtual ~MetricsHttpServer() {
+        io_service_.stop();
+        net_thread_.join();
+    }
+};
+
 class ControlImpl {
 private:
     std::shared_ptr<NodeManager> manager_;
@@ -304,6 +386,10 @@ public:
             json params = json::parse(arg);
             manager_->createNode(params, true, true);
         };
+        commands_["graph.deploy"] = [this](ClientStream &cs, std::string &arg) {
+            json graph = json::parse(arg);
+            cs << manager_->deploy(graph) << "\n";
+        };
         commands_["node.delete"] = [this](ClientStream &cs, std::string &arg) {
             manager_->deleteNode(arg);
         };
@@ -381,6 +467,40 @@ public:
         commands_["queues.stats"] = [this](ClientStream &cs, std::string&) {
             manager_->edges()->printEdgesStats(cs);
         };
+        commands_["queues.stats.json"] = [this](ClientStream &cs, std::string &arg) {
+            std::stringstream ss(arg);
+            std::string mode;
+            ss >> mode;
+            json jstats = json::object();
+            manager_->edges()->collectEdgesStats(jstats, mode=="reset");
+            cs << jstats << "\n";
+        };
+        commands_["queue.record"] = [this](ClientStream &cs, std::string &arg) {
+            json jargs = json::parse(arg);
+            std::string queue = jargs["queue"];
+            size_t buffer_bytes = jargs.value("buffer_bytes", size_t(256*1024*1024));
+            bool blocking = jargs.value("blocking", false);
+            using ISOs = InstanceSharedObjects<EdgeRecorder>;
+            // check before starting: start truncates the file and attaches to the queue
+            if (ISOs::exists(manager_->instanceData(), "edge_recorder:" + queue)) {
+                throw Error("Already recording queue " + queue);
+            }
+            std::shared_ptr<EdgeRecorder> recorder = EdgeRecorder::start(*manager_->edges(), queue, jargs["path"], buffer_bytes, blocking);
+            ISOs::put(manager_->instanceData(), "edge_recorder:" + queue, recorder, ISOs::PolicyIfExists::Throw);
+        };
+        commands_["queue.record_stop"] = [this](ClientStream &cs, std::string &arg) {
+            std::string queue = strutils::trim(arg);
+            using ISOs = InstanceSharedObjects<EdgeRecorder>;
+            std::shared_ptr<EdgeRecorder> recorder = ISOs::get(manager_->instanceData(), "edge_recorder:" + queue);
+            recorder->stop();
+            cs << recorder->stats() << "\n";
+            ISOs::put(manager_->instanceData(), "edge_recorder:" + queue, nullptr);
+        };
+        commands_["queue.record_stats"] = [this](ClientStream &cs, std::string &arg) {
+            std::string queue = strutils::trim(arg);
+            cs << InstanceSharedObjects<EdgeRecorder>::get(manager_->instanceData(), "edge_recorder:" + queue)->stats() << "\n";
+        };
+        no_lock_commands_.insert("queue.record_stats");
         commands_["group.restart"] = [this](ClientStream &cs, std::string &arg) {
             manager_->group(arg)->restartNodes();
         };
@@ -398,6 +518,23 @@ public:
             json jargs = json::parse(arg);
             auto ssthr = std::make_shared<StatsSenderThread>(jargs, manager_);
         };
+        commands_["stats.unsubscribe"] = [this](ClientStream &cs, std::string &arg) {
+            std::string name = strutils::trim(arg);
+            if (InstanceSharedObjects<StatsRegistry>::get(manager_->instanceData(), "default")->unsubscribe(name) == 0) {
+                throw Error("No stats subscription " + name);
+            }
+        };
+        commands_["metrics.listen"] = [this](ClientStream &cs, std::string &arg) {
+            // [address:]port, local only by default
+            std::string address = "127.0.0.1";
+            std::string port = strutils::trim(arg);
+            size_t colon = port.rfind(':');
+            if (colon != std::string::npos) {
+                address = port.substr(0, colon);
+                port = port.substr(colon+1);
+            }
+            createServer<MetricsHttpServer>(manager_, address, std::stoi(port));
+        };
         commands_["output.start"] = [this](ClientStream &cs, std::string &args) {
             OutputControl::get(args, false)->start();
         };
@@ -410,6 +547,61 @@ public:
             json jargs = json::parse(arg);
             initHWAccel(manager_->instanceData(), jargs);
         };
+        commands_["worker_pool.init"] = [this](ClientStream &cs, std::string &arg) {
+            json jargs = json::parse(arg);
+            size_t threads = 0;
+            if (jargs.count("threads")) {
+                threads = jargs["threads"];
+            }
+            using ISOs = InstanceSharedObjects<WorkerPool>;
+            ISOs::emplace(manager_->instanceData(), jargs["name"], ISOs::PolicyIfExists::Ignore, threads);
+        };
+        commands_["tick_source.init"] = [this](ClientStream &cs, std::string &arg) {
+            json jargs = json::parse(arg);
+            std::string evl_name = "default";
+            if (jargs.count("event_loop")) {
+                evl_name = jargs["event_loop"];
+            }
+            using ISOs = InstanceSharedObjects<TickSource>;
+            std::shared_ptr<EventLoop> evl = InstanceSharedObjects<EventLoop>::get(manager_->instanceData(), evl_name);
+            std::shared_ptr<TickSource> ts = std::make_shared<TickSource>(evl);
+            ISOs::put(manager_->instanceData(), jargs["name"], ts, ISOs::PolicyIfExists::Throw);
+            ts->startTimer(parseRatio(jargs["tick_period"]));
+        };
+        commands_["tick_source.stats"] = [this](ClientStream &cs, std::string &arg) {
+            cs << InstanceSharedObjects<TickSource>::get(manager_->instanceData(), arg)->stats() << "\n";
+        };
+        no_lock_commands_.insert("tick_source.stats");
+        commands_["buffer_pool.stats"] = [this](ClientStream &cs, std::string &arg) {
+            std::string name = arg.empty() ? "default" : arg;
+            cs << InstanceSharedObjects<BufferPools>::get(manager_->instanceData(), name)->stats() << "\n";
+        };
+        no_lock_commands_.insert("buffer_pool.stats");
+        commands_["trace.enable"] = [this](ClientStream &cs, std::string &arg) {
+            trace::setEnabled(true);
+        };
+        no_lock_commands_.insert("trace.enable");
+        commands_["trace.disable"] = [this](ClientStream &cs, std::string &arg) {
+            trace::setEnabled(false);
+        };
+        no_lock_commands_.insert("trace.disable");
+        commands_["trace.dump"] = [this](ClientStream &cs, std::string &arg) {
+            std::stringstream ss(arg);
+            double seconds = 10;
+            std::string path;
+            ss >> seconds >> path;
+            json jtrace = trace::dump(seconds);
+            if (path.empty()) {
+                cs << jtrace << "\n";
+            } else {
+                std::ofstream file(path, std::ios::binary);
+                if (!file) {
+                    throw Error("Can't open " + path);
+                }
+                file << jtrace;
+            }
+        };
+        no_lock_commands_.insert("trace.dump");
         commands_["event.wait"] = [this](ClientStream &cs, std::string &arg) {
             std::stringstream ss(arg);
             std::string event_name;
@@ -635,7 +827,7 @@ void AVPlumber::setLogFile(const std::string path) {
         current_thread.logger = default_logger;
     } else {
         try {
-            current_thread.logger = std::make_shared<FileLogger>(path);
+            current_thread.logger = std::make_shared<AsyncLogger>(path);
         } catch (std::exception &e) {
             logstream << "Failed to open log file " << path << ": " << e.what();
         }
@@ -2,7 +2,48 @@
 
 #include "util.hpp"
 
+static void makeFrameWritable(AVFrame* frm) {
+    if (frm->data[0]==nullptr) return;
+    int ret = av_frame_make_writable(frm);
+    if (ret < 0) {
+        throw Error("av_frame_make_writable failed: " + std::to_string(ret));
+    }
+}
+
+void makeWritable(av::VideoFrame &frm) {
+    makeFrameWritable(frm.raw());
+}
+
+void makeWritable(av::AudioSamples &frm) {
+    makeFrameWritable(frm.raw());
+}
+
+void makeWritable(av::Packet &pkt) {
+    if (pkt.raw()->data==nullptr) return;
+    int ret = av_packet_make_writable(pkt.raw());
+    if (ret < 0) {
+        throw Error("av_packet_make_writable failed: " + std::to_string(ret));
+    }
+}
+
+void makeRefcounted(av::VideoFrame &frm) {
+    if (frm.raw()->buf[0]==nullptr) makeFrameWritable(frm.raw());
+}
+
+void makeRefcounted(av::AudioSamples &frm) {
+    if (frm.raw()->buf[0]==nullptr) makeFrameWritable(frm.raw());
+}
+
+void makeRefcounted(av::Packet &pkt) {
+    if (pkt.raw()->buf!=nullptr || pkt.raw()->data==nullptr) return;
+    int ret = av_packet_make_refcounted(pkt.raw());
+    if (ret < 0) {
+        throw Error("av_packet_make_refcounted failed: " + std::to_string(ret));
+    }
+}
+
 void silenceAudioFrame(av::AudioSamples &frm, av::SampleFormat::Alignment align) {
+    makeWritable(frm);
     if (frm.sampleFormat().isPlanar()) {
         size_t size1ch = frm.sampleFormat().requiredBufferSize(1, frm.samplesCount(), align);
         for (size_t i=0; i<frm.channelsCount(); i++) {
@@ -26,6 +67,7 @@ av::Rational parseRatio(const std::string ratio) {
 }
 
 constexpr AVRational Wallclock::time_base;
+constexpr AVRational Wallclock::fine_time_base;
 
 Wallclock wallclock;
 
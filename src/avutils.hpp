@@ -1,6 +1,9 @@
 #pragma once
 #include <chrono>
 #include <thread>
+#include <cerrno>
+#include <time.h>
+#include <poll.h>
 #include <avcpp/timestamp.h>
 #include <libavutil/rational.h>
 #include <avcpp/frame.h>
@@ -42,6 +45,19 @@ template<> struct TSGetter<av::AudioSamples>: public FrameTSGetter<av::AudioSamp
 template<> struct TSGetter<av::VideoFrame>: public FrameTSGetter<av::VideoFrame> {
 };
 
+// Frames and packets passed between nodes share their data buffers (copying av::Frame or av::Packet
+// only creates a new reference), so changing properties (pts, picture type, side data) is cheap and safe.
+// A node which writes into the data of a frame or packet it didn't allocate must call makeWritable() first:
+// it copies the data only if it is shared with someone else.
+void makeWritable(av::VideoFrame &frm);
+void makeWritable(av::AudioSamples &frm);
+void makeWritable(av::Packet &pkt);
+// Moves data of non-refcounted frame/packet into a refcounted buffer,
+// so that further copies are references instead of data copies.
+void makeRefcounted(av::VideoFrame &frm);
+void makeRefcounted(av::AudioSamples &frm);
+void makeRefcounted(av::Packet &pkt);
+
 void silenceAudioFrame(av::AudioSamples &frm, av::SampleFormat::Alignment align = av::SampleFormat::Alignment::AlignDefault);
 
 av::Rational parseRatio(const std::string ratio);
@@ -53,12 +69,15 @@ std::string fieldOrderToString(AVFieldOrder fo);
 
 class Wallclock {
 protected:
+    // on Linux steady_clock is CLOCK_MONOTONIC, so its time points can be used for absolute sleeps
     using Clock = std::chrono::steady_clock;
     std::chrono::time_point<Clock> start;
 public:
     using TimeUnit = std::chrono::milliseconds;
+    using FineTimeUnit = std::chrono::nanoseconds;
 protected:
     static constexpr AVRational time_base = {TimeUnit::period::num, TimeUnit::period::den};
+    static constexpr AVRational fine_time_base = {FineTimeUnit::period::num, FineTimeUnit::period::den};
 public:
     Wallclock() {
         start = Clock::now();
@@ -72,6 +91,43 @@ public:
     static AVRational timeBase() {
         return time_base;
     }
+    // high resolution API, nanoseconds since the same reference point as pts():
+    AVTS ns() {
+        return std::chrono::duration_cast<FineTimeUnit>(Clock::now()-start).count();
+    }
+    av::Timestamp fineTs() {
+        return av::Timestamp(ns(), fineTimeBase());
+    }
+    static AVRational fineTimeBase() {
+        return fine_time_base;
+    }
+    // CLOCK_MONOTONIC time corresponding to ns() value
+    struct timespec monotonicTime(const AVTS ns_since_start) {
+        AVTS abs_ns = std::chrono::duration_cast<FineTimeUnit>(start.time_since_epoch()).count() + ns_since_start;
+        struct timespec r;
+        r.tv_sec = abs_ns / 1000000000;
+        r.tv_nsec = abs_ns % 1000000000;
+        return r;
+    }
+    // sleep until absolute deadline (in ns() units), so that wakeup errors don't accumulate
+    void sleepUntilNs(const AVTS deadline_ns) {
+        struct timespec deadline = monotonicTime(deadline_ns);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR) {
+        }
+    }
+    // like above, but returns false as soon as interrupt_fd (e.g. Event::fd() signalled by stop()) is readable
+    bool sleepUntilNs(const AVTS deadline_ns, const int interrupt_fd) {
+        struct pollfd pfd = { interrupt_fd, POLLIN, 0 };
+        while (true) {
+            AVTS left = deadline_ns - ns();
+            if (left <= 0) return true;
+            struct timespec timeout = { time_t(left / 1000000000), long(left % 1000000000) };
+            if (ppoll(&pfd, 1, &timeout, nullptr) > 0) return false;
+        }
+    }
+    void sleepUntil(const av::Timestamp deadline) {
+        sleepUntilNs(deadline.timestamp(fineTimeBase()));
+    }
     static void sleepms(const AVTS ms) {
         if (ms<=0) return;
         std::this_thread::sleep_for(std::chrono::milliseconds(ms));
@@ -0,0 +1,1423 @@
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <flags.hh>
+#include <json.hpp>
+
+#include "../util.hpp"
+#include "../avutils.hpp"
+#include "../graph_mgmt.hpp"
+#include "../async_logger.hpp"
+#include "../timed_history.hpp"
+#include "../loudness.hpp"
+#include "../sound_levels.hpp"
+#include "../rest_client.hpp"
+#include "../edge_recording.hpp"
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/imgutils.h>
+}
+
+// Benchmark harness: builds graphs of synthetic sources (src/nodes/bench), regular nodes
+// and counting sinks through NodeManager, lets them run as fast as possible
+// and reports throughput, queue latency and CPU time of every node.
+
+using nlohmann::json;
+
+struct Scenario {
+    std::string name;
+    std::string description;
+    json nodes; // in creation order, sources first
+    json consumer = nullptr; // optional UnixSocketConsumer parameters
+};
+
+// Stand-in for the remote end of an output: listens on a UNIX socket,
+// reads and discards everything, pausing for stall_ms every stall_every_ms
+// to simulate a slow network / disk.
+class UnixSocketConsumer {
+protected:
+    std::string path_;
+    int listen_fd_ = -1;
+    int stall_every_ms_ = 0;
+    int stall_ms_ = 0;
+    std::atomic_bool should_work_ {true};
+    std::thread thread_;
+
+    void readLoop(int fd) {
+        std::vector<char> buf(1024*1024);
+        AVTS last_stall = wallclock.ns();
+        while (should_work_) {
+            pollfd pfd { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 100) <= 0) continue;
+            ssize_t r = read(fd, buf.data(), buf.size());
+            if (r <= 0) break;
+            if (stall_every_ms_ > 0 && wallclock.ns() - last_stall >= AVTS(stall_every_ms_) * 1000000) {
+                wallclock.sleepms(stall_ms_);
+                last_stall = wallclock.ns();
+            }
+        }
+    }
+    void thread() {
+        while (should_work_) {
+            pollfd pfd { listen_fd_, POLLIN, 0 };
+            if (poll(&pfd, 1, 100) <= 0) continue;
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) continue;
+            readLoop(fd);
+            close(fd);
+        }
+    }
+public:
+    UnixSocketConsumer(const json &params) {
+        path_ = params["path"];
+        if (params.count("stall_every_ms")) {
+            stall_every_ms_ = params["stall_every_ms"];
+        }
+        if (params.count("stall_ms")) {
+            stall_ms_ = params["stall_ms"];
+        }
+        sockaddr_un addr {};
+        addr.sun_family = AF_UNIX;
+        if (path_.size() >= sizeof(addr.sun_path)) {
+            throw Error("Socket path too long: " + path_);
+        }
+        path_.copy(addr.sun_path, path_.size());
+        unlink(path_.c_str());
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0 || bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listen_fd_, 4) < 0) {
+            if (listen_fd_ >= 0) close(listen_fd_);
+            throw Error("Can't listen on " + path_);
+        }
+        thread_ = start_thread("bench consumer", [this]() {
+            thread();
+        });
+    }
+    ~UnixSocketConsumer() {
+        should_work_ = false;
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        close(listen_fd_);
+        unlink(path_.c_str());
+    }
+};
+
+// Microbenchmark of a single component, without a graph. Returns results as JSON.
+struct Microbench {
+    std::string name;
+    std::string description;
+    std::function<json(const double duration_sec)> run;
+};
+
+// The std::list based TimedHistory which stats used before the ring buffer, kept as a baseline.
+template<typename Y> class ListTimedHistory {
+protected:
+    struct Item {
+        av::Timestamp time;
+        Y value;
+    };
+    double max_age_sec_;
+    std::list<Item> items_;
+public:
+    ListTimedHistory(const double max_age_sec): max_age_sec_(max_age_sec) {
+    }
+    void push(const av::Timestamp time, const Y value) {
+        items_.push_back({ time, value });
+        av::Timestamp now = items_.back().time;
+        av::Timestamp min_ts = { now.timestamp() - static_cast<int64_t>(max_age_sec_/now.timebase().getDouble()), now.timebase() };
+        items_.remove_if([min_ts](Item &item) {
+            return (item.time < min_ts);
+        });
+    }
+    double itemsPerSecond() {
+        av::Timestamp deltat = addTS(items_.back().time, negateTS(items_.front().time));
+        return deltat.timestamp()==0 ? 0 : ((double)(items_.size()-1)) / deltat.seconds();
+    }
+    Y valueDiff() {
+        return items_.back().value - items_.front().value;
+    }
+};
+
+// Per-packet work of stats: push a running byte count, then query the window as fillStats does.
+// Returns pushes per second.
+template<typename History> static double timedHistoryPushRate(const int items_per_sec, const double max_age_sec, const double duration_sec) {
+    History history(max_age_sec);
+    const av::Rational tb(1, items_per_sec);
+    size_t total = 0;
+    double sink = 0;
+    int64_t i = 0;
+    AVTS begin = wallclock.ns();
+    AVTS end = begin + AVTS(duration_sec * 1e9);
+    AVTS now = begin;
+    while (now < end) {
+        for (int j=0; j<1024; j++, i++) {
+            total += 1000 + (i & 511);
+            history.push(av::Timestamp(i, tb), total);
+            sink += history.itemsPerSecond() + history.valueDiff();
+        }
+        now = wallclock.ns();
+    }
+    if (sink < 0) std::cerr << sink; // keep the queries from being optimized out
+    return double(i) / (double(now - begin) / 1e9);
+}
+
+static json timedHistoryBench(const int items_per_sec, const double max_age_sec, const double duration_sec) {
+    double list_rate = timedHistoryPushRate<ListTimedHistory<size_t>>(items_per_sec, max_age_sec, duration_sec / 2);
+    double ring_rate = timedHistoryPushRate<TimedHistory<size_t>>(items_per_sec, max_age_sec, duration_sec / 2);
+    return {
+        { "window_items", int(items_per_sec * max_age_sec) },
+        { "list_pushes_per_sec", list_rate },
+        { "ring_pushes_per_sec", ring_rate },
+        { "speedup", ring_rate / list_rate },
+    };
+}
+
+// Loopback stand-in for a statistics receiver: HTTP/1.1 server on 127.0.0.1 (ephemeral port)
+// which answers every request with an empty 200, keeps connections alive
+// and counts connections, requests and received JSON documents (occurrences of marker).
+class LoopbackHttpServer {
+protected:
+    struct Client {
+        int fd;
+        std::string buf;
+        bool continue_sent = false;
+    };
+    int listen_fd_ = -1;
+    uint16_t port_ = 0;
+    std::string marker_;
+    std::atomic_bool should_work_ {true};
+    std::thread thread_;
+
+    static size_t countOccurrences(const std::string &s, const std::string &what, size_t from) {
+        size_t n = 0;
+        while ((from = s.find(what, from)) != std::string::npos) {
+            n++;
+            from += what.size();
+        }
+        return n;
+    }
+    // returns false if the connection should be closed
+    bool handle(Client &c) {
+        while (true) {
+            size_t header_end = c.buf.find("\r\n\r\n");
+            if (header_end == std::string::npos) return true;
+            std::string headers = c.buf.substr(0, header_end);
+            for (char &ch: headers) ch = std::tolower(ch);
+            size_t content_length = 0;
+            size_t cl = headers.find("content-length:");
+            if (cl != std::string::npos) {
+                content_length = std::stoul(headers.substr(cl + 15));
+            }
+            size_t total = header_end + 4 + content_length;
+            if (c.buf.size() < total) {
+                if (!c.continue_sent && headers.find("expect: 100-continue") != std::string::npos) {
+                    const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                    if (write(c.fd, cont, sizeof(cont)-1) < 0) return false;
+                    c.continue_sent = true;
+                }
+                return true;
+            }
+            documents += countOccurrences(c.buf.substr(header_end + 4, content_length), marker_, 0);
+            requests++;
+            c.buf.erase(0, total);
+            c.continue_sent = false;
+            const char ok[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+            if (write(c.fd, ok, sizeof(ok)-1) < 0) return false;
+        }
+    }
+    void thread() {
+        std::list<Client> clients;
+        std::vector<pollfd> pfds;
+        std::vector<char> rbuf(64*1024);
+        while (should_work_) {
+            pfds.clear();
+            pfds.push_back({ listen_fd_, POLLIN, 0 });
+            for (Client &c: clients) {
+                pfds.push_back({ c.fd, POLLIN, 0 });
+            }
+            if (poll(pfds.data(), pfds.size(), 100) <= 0) continue;
+            if (pfds[0].revents & POLLIN) {
+                int fd = accept(listen_fd_, nullptr, nullptr);
+                if (fd >= 0) {
+                    clients.push_back({ fd, "" });
+                    connections++;
+                }
+            }
+            size_t i = 1;
+            for (auto it = clients.begin(); it != clients.end() && i < pfds.size(); i++) {
+                bool keep = true;
+                if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                    ssize_t r = read(it->fd, rbuf.data(), rbuf.size());
+                    if (r <= 0) {
+                        keep = false;
+                    } else {
+                        it->buf.append(rbuf.data(), r);
+                        keep = handle(*it);
+                    }
+                }
+                if (keep) {
+                    ++it;
+                } else {
+                    close(it->fd);
+                    it = clients.erase(it);
+                }
+            }
+        }
+        for (Client &c: clients) {
+            close(c.fd);
+        }
+    }
+public:
+    std::atomic_uint64_t connections {0};
+    std::atomic_uint64_t requests {0};
+    std::atomic_uint64_t documents {0};
+    LoopbackHttpServer(const std::string marker): marker_(marker) {
+        sockaddr_in addr {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        socklen_t len = sizeof(addr);
+        listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0 || bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listen_fd_, 128) < 0
+            || getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &len) < 0) {
+            if (listen_fd_ >= 0) close(listen_fd_);
+            throw Error("Can't listen on loopback");
+        }
+        port_ = ntohs(addr.sin_port);
+        thread_ = start_thread("bench http", [this]() {
+            thread();
+        });
+    }
+    std::string url() const {
+        return "http://127.0.0.1:" + std::to_string(port_) + "/stats";
+    }
+    ~LoopbackHttpServer() {
+        should_work_ = false;
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        close(listen_fd_);
+    }
+};
+
+// Delivery of statistics of many subscriptions to a loopback receiver, in rounds:
+// every subscription sends one JSON document per round, like StatsSender every interval.
+static json statsDeliveryBench(const double duration_sec) {
+    const int subscriptions = 200;
+    std::vector<std::string> documents;
+    for (int i=0; i<subscriptions; i++) {
+        json j;
+        j["name"] = "subscription" + std::to_string(i);
+        j["stalled_seconds"] = 0.04;
+        j["streams_video"] = json::array({ { {"codec", "h264"}, {"fps", 25.0}, {"kbitrate", 4000.0}, {"width", 1920}, {"height", 1080} } });
+        j["streams_audio"] = json::array({ { {"codec", "aac"}, {"samplerate", 48000.0}, {"kbitrate", 128.0}, {"rms", -20.5}, {"peak", -3.2} } });
+        documents.push_back(j.dump());
+    }
+    json r;
+    auto measure = [&](const std::string mode, std::function<void(const std::string&, int)> send) {
+        LoopbackHttpServer server("\"name\"");
+        uint64_t rounds = 0;
+        AVTS begin = wallclock.ns();
+        AVTS end = begin + AVTS(duration_sec / 3 * 1e9);
+        AVTS now = begin;
+        while (now < end) {
+            for (int i=0; i<subscriptions; i++) {
+                send(server.url(), i);
+            }
+            rounds++;
+            // wait until the round is delivered
+            while (server.documents < rounds * subscriptions && wallclock.ns() - now < 5000000000) {
+                std::this_thread::yield();
+            }
+            now = wallclock.ns();
+        }
+        double elapsed = double(now - begin) / 1e9;
+        r[mode + "_docs_per_sec"] = server.documents / elapsed;
+        r[mode + "_requests"] = server.requests.load();
+        r[mode + "_connections"] = server.connections.load();
+    };
+    // previous behaviour: new connection (curl handle) for every request
+    measure("per_request", [&](const std::string &url, int i) {
+        cpr::Post(cpr::Url(url), cpr::Header{{"Content-Type", "application/json"}}, cpr::Body(documents[i]));
+    });
+    std::vector<RESTEndpoint> endpoints(subscriptions);
+    measure("keep_alive", [&](const std::string &url, int i) {
+        endpoints[i].setBaseURL(url);
+        endpoints[i].send("", documents[i]);
+    });
+    std::unique_ptr<BatchingRESTEndpoint> batcher;
+    measure("batched", [&](const std::string &url, int i) {
+        if (!batcher) {
+            batcher = make_unique<BatchingRESTEndpoint>(url, 5);
+        }
+        batcher->send(documents[i]);
+    });
+    batcher = nullptr;
+    return r;
+}
+
+// Feeds stereo 1 kHz sine (segments of seconds at dBFS) at 48 kHz to a LoudnessMeter.
+static LoudnessMeter::Result measureLoudness(const std::vector<std::pair<double, double>> &segments, const bool true_peak) {
+    const int sample_rate = 48000;
+    const size_t frame_size = 1024;
+    LoudnessMeter meter;
+    meter.configure(sample_rate, AV_CH_LAYOUT_STEREO, 2, true_peak);
+    std::vector<float> buf(frame_size);
+    size_t n = 0;
+    for (auto &segment: segments) {
+        const size_t end = n + segment.first * sample_rate;
+        const double amplitude = std::pow(10.0, segment.second / 20.0);
+        while (n < end) {
+            size_t count = std::min(frame_size, end - n);
+            for (size_t i=0; i<count; i++) {
+                buf[i] = amplitude * std::sin(2 * M_PI * 1000 * double(n+i) / sample_rate);
+            }
+            meter.addChannel(0, buf.data(), count);
+            meter.addChannel(1, buf.data(), count);
+            meter.endFrame(count);
+            n += count;
+        }
+    }
+    return meter.takeResult();
+}
+
+// Checks the meter with test signals of EBU Tech 3341 (integrated loudness, tolerance 0.1 LU)
+// and Tech 3342 (loudness range, tolerance 1 LU), then measures throughput.
+static json loudnessBench(const double duration_sec) {
+    json r;
+    double max_error_i = 0;
+    double max_error_lra = 0;
+    struct Case {
+        std::string name;
+        std::vector<std::pair<double, double>> segments;
+        double expected;
+        bool range;
+    };
+    const std::vector<Case> cases = {
+        { "tech3341_1_I", { {20, -23} }, -23, false },
+        { "tech3341_2_I", { {20, -33} }, -33, false },
+        { "tech3341_3_I", { {10, -36}, {60, -23}, {10, -36} }, -23, false },
+        { "tech3341_4_I", { {10, -72}, {10, -36}, {60, -23}, {10, -36}, {10, -72} }, -23, false },
+        { "tech3342_1_LRA", { {20, -20}, {20, -30} }, 10, true },
+        { "tech3342_2_LRA", { {20, -20}, {20, -15} }, 5, true },
+        { "tech3342_3_LRA", { {20, -40}, {20, -20} }, 20, true },
+    };
+    for (const Case &c: cases) {
+        LoudnessMeter::Result res = measureLoudness(c.segments, false);
+        double measured = c.range ? res.range : res.integrated;
+        r[c.name] = measured;
+        double &max_error = c.range ? max_error_lra : max_error_i;
+        max_error = std::max(max_error, std::fabs(measured - c.expected));
+    }
+    r["max_error_I"] = max_error_i;
+    r["max_error_LRA"] = max_error_lra;
+    r["pass"] = max_error_i <= 0.1 && max_error_lra <= 1;
+
+    for (bool true_peak: {false, true}) {
+        const size_t frame_size = 1024;
+        LoudnessMeter meter;
+        meter.configure(48000, AV_CH_LAYOUT_STEREO, 2, true_peak);
+        std::vector<float> buf(frame_size);
+        for (size_t i=0; i<frame_size; i++) {
+            buf[i] = 0.1 * std::sin(i * 0.1);
+        }
+        uint64_t samples = 0;
+        AVTS begin = wallclock.ns();
+        AVTS end = begin + AVTS(duration_sec / 2 * 1e9);
+        AVTS now = begin;
+        while (now < end) {
+            for (int j=0; j<100; j++) {
+                meter.addChannel(0, buf.data(), frame_size);
+                meter.addChannel(1, buf.data(), frame_size);
+                meter.endFrame(frame_size);
+                samples += 2 * frame_size;
+            }
+            now = wallclock.ns();
+        }
+        r[true_peak ? "msamples_per_sec_true_peak" : "msamples_per_sec"] = samples / (double(now - begin) / 1e9) / 1e6;
+    }
+    return r;
+}
+
+// Bin of the per-sample log10 formula which SoundAnalyzer used before the threshold kernels.
+static size_t legacyLevelBin(const double sample) {
+    const int bins = sound_levels::histogram_bins;
+    double value = std::abs(sample);
+    if (value<sound_levels::epsilon_level) return 0;
+    if (value>sound_levels::clipped_level) return bins-1;
+    int ret = std::ceil((bins-2) + (bins-2)*20.0*std::log10(value)/sound_levels::histogram_db_range);
+    return std::max(0, std::min(ret, bins-1));
+}
+
+// Writes sample (-1..1) at p in the packed variant of fmt.
+static void writeSample(const AVSampleFormat fmt, uint8_t* p, const double sample) {
+    switch (fmt) {
+    case AV_SAMPLE_FMT_U8:
+        *p = std::max(0L, std::min(255L, std::lround(sample*128 + 128)));
+        break;
+    case AV_SAMPLE_FMT_S16:
+        *reinterpret_cast<int16_t*>(p) = std::max(-32768L, std::min(32767L, std::lround(sample*32768)));
+        break;
+    case AV_SAMPLE_FMT_S32:
+        *reinterpret_cast<int32_t*>(p) = std::max<int64_t>(INT32_MIN, std::min<int64_t>(INT32_MAX, std::llround(sample*2147483648.0)));
+        break;
+    case AV_SAMPLE_FMT_S64:
+        // 2^63 isn't representable, scale slightly below it
+        *reinterpret_cast<int64_t*>(p) = sample * 9223372036854774784.0;
+        break;
+    case AV_SAMPLE_FMT_FLT:
+        *reinterpret_cast<float*>(p) = sample;
+        break;
+    case AV_SAMPLE_FMT_DBL:
+        *reinterpret_cast<double*>(p) = sample;
+        break;
+    default:
+        throw Error("unsupported sample format");
+    }
+}
+
+// Sound level kernels (sound_levels.cpp): for every sample format supported by SoundAnalyzer,
+// a frame of random samples spread over all histogram bins (including silence and clipping)
+// is converted with channelAsFloat and analyzed by every kernel available on this CPU.
+// Histograms and peaks must be identical to the per-sample reference sound_levels::bin();
+// the old log10 formula may only disagree with it within float rounding of a threshold.
+// Then measures throughput of each kernel on float samples and of conversion + analysis per format.
+static json soundLevelsBench(const double duration_sec) {
+    json r;
+    const int channels = 2;
+    const size_t samples_count = 48000 + 7; // not a multiple of the vector width, to test tails
+    const std::vector<AVSampleFormat> formats = {
+        AV_SAMPLE_FMT_U8, AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_S64, AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_DBL,
+        AV_SAMPLE_FMT_U8P, AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_S32P, AV_SAMPLE_FMT_S64P, AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_DBLP,
+    };
+    const std::vector<sound_levels::Kernel> kernels = sound_levels::availableKernels();
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> db_dist(-70, 0);
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    struct TestFrame {
+        AVSampleFormat format;
+        std::vector<std::vector<uint8_t>> planes;
+        std::vector<uint8_t*> pointers;
+        AVFrame frame = {};
+    };
+    std::vector<std::unique_ptr<TestFrame>> frames;
+    for (AVSampleFormat fmt: formats) {
+        auto tf = std::make_unique<TestFrame>();
+        tf->format = fmt;
+        const bool planar = av_sample_fmt_is_planar(fmt);
+        const size_t bps = av_get_bytes_per_sample(fmt);
+        const AVSampleFormat packed = av_get_packed_sample_fmt(fmt);
+        tf->planes.resize(planar ? channels : 1, std::vector<uint8_t>(samples_count * bps * (planar ? 1 : channels)));
+        for (size_t i=0; i<samples_count; i++) {
+            for (int ch=0; ch<channels; ch++) {
+                double x = uniform(rng);
+                double sample = x < 0.05 ? 0 : x < 0.1 ? 0.98 + 0.02*uniform(rng) : std::pow(10.0, db_dist(rng)/20);
+                if (uniform(rng) < 0.5) sample = -sample;
+                uint8_t* p = planar ? &tf->planes[ch][i*bps] : &tf->planes[0][(i*channels + ch)*bps];
+                writeSample(packed, p, sample);
+            }
+        }
+        for (std::vector<uint8_t> &plane: tf->planes) {
+            tf->pointers.push_back(plane.data());
+        }
+        tf->frame.format = fmt;
+        tf->frame.nb_samples = samples_count;
+        tf->frame.extended_data = tf->pointers.data();
+        frames.push_back(std::move(tf));
+    }
+
+    std::map<sound_levels::Kernel, uint64_t> mismatches;
+    uint64_t legacy_mismatches = 0;
+    uint64_t legacy_unexplained = 0;
+    uint64_t checked = 0;
+    std::vector<float> scratch;
+    for (auto &tf: frames) {
+        for (int ch=0; ch<channels; ch++) {
+            const float* samples = sound_levels::channelAsFloat(&tf->frame, ch, channels, scratch);
+            uint64_t reference[sound_levels::histogram_bins] = {0};
+            float peak = 0;
+            for (size_t i=0; i<samples_count; i++) {
+                const size_t bin = sound_levels::bin(samples[i]);
+                reference[bin]++;
+                peak = std::max(peak, std::fabs(samples[i]));
+                const size_t legacy = legacyLevelBin(samples[i]);
+                if (legacy != bin) {
+                    legacy_mismatches++;
+                    // only acceptable right at a bin boundary
+                    double db = 20*std::log10(std::fabs(samples[i]));
+                    double step = double(sound_levels::histogram_db_range) / (sound_levels::histogram_bins-2);
+                    if (std::fabs(db/step - std::round(db/step)) > 1e-4 && std::fabs(std::fabs(samples[i]) - sound_levels::clipped_level) > 1e-6) {
+                        legacy_unexplained++;
+                    }
+                }
+            }
+            checked += samples_count;
+            for (sound_levels::Kernel kernel: kernels) {
+                sound_levels::Accumulator acc;
+                sound_levels::analyze(kernel, samples, samples_count, acc);
+                for (size_t b=0; b<sound_levels::histogram_bins; b++) {
+                    mismatches[kernel] += std::max(acc.histogram[b], reference[b]) - std::min(acc.histogram[b], reference[b]);
+                }
+                if (acc.peak != peak || acc.samples_count != samples_count) {
+                    mismatches[kernel]++;
+                }
+            }
+        }
+    }
+    bool pass = legacy_unexplained == 0;
+    r["samples_checked"] = checked;
+    for (sound_levels::Kernel kernel: kernels) {
+        r[std::string("mismatches_") + sound_levels::kernelName(kernel)] = mismatches[kernel];
+        pass = pass && mismatches[kernel] == 0;
+    }
+    r["mismatches_legacy_log10"] = legacy_mismatches;
+    r["pass"] = pass;
+
+    // throughput
+    std::vector<float> buf(4096);
+    for (size_t i=0; i<buf.size(); i++) {
+        buf[i] = 0.5 * std::sin(i * 0.01) * std::pow(10.0, db_dist(rng)/20);
+    }
+    const double kernel_sec = duration_sec / 2 / kernels.size();
+    for (sound_levels::Kernel kernel: kernels) {
+        sound_levels::Accumulator acc;
+        uint64_t samples = 0;
+        AVTS begin = wallclock.ns();
+        AVTS end = begin + AVTS(kernel_sec * 1e9);
+        AVTS now = begin;
+        while (now < end) {
+            for (int j=0; j<100; j++) {
+                sound_levels::analyze(kernel, buf.data(), buf.size(), acc);
+                samples += buf.size();
+            }
+            now = wallclock.ns();
+        }
+        r[std::string("msamples_per_sec_") + sound_levels::kernelName(kernel)] = samples / (double(now - begin) / 1e9) / 1e6;
+    }
+    const double format_sec = duration_sec / 2 / frames.size();
+    for (auto &tf: frames) {
+        sound_levels::Accumulator acc;
+        uint64_t samples = 0;
+        AVTS begin = wallclock.ns();
+        AVTS end = begin + AVTS(format_sec * 1e9);
+        AVTS now = begin;
+        while (now < end) {
+            for (int ch=0; ch<channels; ch++) {
+                sound_levels::analyze(sound_levels::channelAsFloat(&tf->frame, ch, channels, scratch), samples_count, acc);
+            }
+            samples += channels * samples_count;
+            now = wallclock.ns();
+        }
+        r[std::string("msamples_per_sec_") + av_get_sample_fmt_name(tf->format)] = samples / (double(now - begin) / 1e9) / 1e6;
+    }
+    return r;
+}
+
+// Split fan-out of a 3840x2160 yuv420p frame to 8 outputs, without queues:
+// - copy: what split did with frames not backed by a refcounted buffer (e.g. wrapping foreign memory):
+//   every output's av_frame_ref copied the picture
+// - shared: what split does now for such frames: one copy into a refcounted buffer, then references
+// - shared_refcounted: input already refcounted (decoders, scalers), references only
+// - cow_one_writer: like shared_refcounted, with one output calling makeWritable() to draw into the picture
+static json splitFanoutBench(const double duration_sec) {
+    const int width = 3840;
+    const int height = 2160;
+    const size_t outputs = 8;
+    const AVPixelFormat fmt = AV_PIX_FMT_YUV420P;
+    std::vector<uint8_t> storage(av_image_get_buffer_size(fmt, width, height, 1), 128);
+    auto borrow = [&](av::VideoFrame &frm) {
+        AVFrame* raw = frm.raw();
+        av_frame_unref(raw);
+        raw->format = fmt;
+        raw->width = width;
+        raw->height = height;
+        av_image_fill_arrays(raw->data, raw->linesize, storage.data(), fmt, width, height, 1);
+        frm.setComplete(true);
+    };
+    av::VideoFrame refcounted(av::PixelFormat(fmt), width, height);
+    refcounted.setComplete(true);
+    std::vector<av::VideoFrame> outs(outputs);
+
+    auto measure = [&](const std::function<void()> &fanout) {
+        uint64_t frames = 0;
+        AVTS begin = wallclock.ns();
+        AVTS end = begin + AVTS(duration_sec / 4 * 1e9);
+        AVTS now = begin;
+        while (now < end) {
+            fanout();
+            for (av::VideoFrame &out: outs) {
+                out = av::VideoFrame();
+            }
+            frames++;
+            now = wallclock.ns();
+        }
+        return frames / (double(now - begin) / 1e9);
+    };
+    json r;
+    av::VideoFrame item;
+    r["copy_fps"] = measure([&]() {
+        borrow(item);
+        for (size_t i=0; i<outputs; i++) {
+            outs[i] = item;
+        }
+    });
+    r["shared_fps"] = measure([&]() {
+        borrow(item);
+        makeRefcounted(item);
+        for (size_t i=0; i+1<outputs; i++) {
+            outs[i] = item;
+        }
+        outs[outputs-1] = std::move(item);
+    });
+    r["shared_refcounted_fps"] = measure([&]() {
+        item = refcounted;
+        for (size_t i=0; i+1<outputs; i++) {
+            outs[i] = item;
+        }
+        outs[outputs-1] = std::move(item);
+    });
+    r["cow_one_writer_fps"] = measure([&]() {
+        item = refcounted;
+        for (size_t i=0; i+1<outputs; i++) {
+            outs[i] = item;
+        }
+        outs[outputs-1] = std::move(item);
+        makeWritable(outs[0]);
+        outs[0].raw()->data[0][0] = 0;
+    });
+    return r;
+}
+
+static json runScenario(const Scenario &sc, const double warmup_sec, const double duration_sec);
+// The DFS topological sort which NodeGroup did from scratch before keeping the order incrementally, kept as a baseline.
+namespace baseline_sort {
+    struct SortNode {
+        Parameters params;
+        int mark = 0; // 0 none, 1 temporary, 2 permanent
+    };
+    static std::list<std::string> offers(Parameters &params) {
+        return params.count("dst")==1 ? jsonToStringList(params["dst"]) : std::list<std::string>();
+    }
+    static std::list<std::string> needs(Parameters &params) {
+        return params.count("src")==1 ? jsonToStringList(params["src"]) : std::list<std::string>();
+    }
+    static void visit(SortNode &n, std::list<SortNode> &all_nodes, std::list<Parameters*> &target_list) {
+        if (n.mark==2) return;
+        if (n.mark==1) {
+            throw Error("Graph has cycle!");
+        }
+        auto n_offers = offers(n.params);
+        if (!n_offers.empty()) {
+            n.mark = 1;
+            for (SortNode &m: all_nodes) {
+                if (m.mark != 0) continue;
+                auto m_needs = needs(m.params);
+                if (m_needs.empty()) continue;
+                bool has_edge = false;
+                for (const std::string &offer: n_offers) {
+                    for (const std::string &need: m_needs) {
+                        if (offer==need) {
+                            has_edge = true;
+                            break;
+                        }
+                    }
+                    if (has_edge) break;
+                }
+                if (has_edge) {
+                    visit(m, all_nodes, target_list);
+                }
+            }
+        }
+        n.mark = 2;
+        target_list.push_front(&n.params);
+    }
+    static void sort(std::list<SortNode> &all_nodes, std::list<Parameters*> &target_list) {
+        for (SortNode &n: all_nodes) {
+            n.mark = 0;
+        }
+        target_list.clear();
+        for (SortNode &n: all_nodes) {
+            visit(n, all_nodes, target_list);
+        }
+    }
+};
+
+// NodeGroup ordering of chains of 10 to 10000 nodes (not created, only added to the group):
+// adding them (producers first, consumers first), taking the sorted list on group start,
+// deleting and adding back a node in the middle, compared with a full sort of the baseline
+static json groupOrderBench(const double) {
+    json r;
+    for (int n: {10, 100, 1000, 10000}) {
+        std::vector<Parameters> chain;
+        for (int i=0; i<n; i++) {
+            chain.push_back({ {"name", "n" + std::to_string(i)}, {"type", "split"}, {"group", "g"},
+                {"src", "q" + std::to_string(i)}, {"dst", json::array({"q" + std::to_string(i+1)})} });
+        }
+        std::string suffix = "_" + std::to_string(n);
+        for (const bool reverse: {false, true}) {
+            auto manager = std::make_shared<NodeManager>();
+            AVTS begin = wallclock.ns();
+            for (int i=0; i<n; i++) {
+                manager->createNode(chain[reverse ? n-1-i : i], false, false);
+            }
+            AVTS added = wallclock.ns();
+            manager->group("g")->sortedNodes();
+            AVTS sorted = wallclock.ns();
+            std::string mode = reverse ? "reverse" : "forward";
+            r["add_us_" + mode + suffix] = double(added - begin) / 1e3 / n;
+            r["sort_us_" + mode + suffix] = double(sorted - added) / 1e3;
+            if (!reverse) {
+                AVTS readd_begin = wallclock.ns();
+                manager->deleteNode("n" + std::to_string(n/2));
+                manager->createNode(chain[n/2], false, false);
+                manager->group("g")->sortedNodes();
+                r["readd_us" + suffix] = double(wallclock.ns() - readd_begin) / 1e3;
+            }
+            manager->shutdown();
+        }
+        // quadratic, too slow for 10000
+        if (n <= 1000) {
+            std::list<baseline_sort::SortNode> all_nodes;
+            for (const Parameters &params: chain) {
+                all_nodes.push_back({ params });
+            }
+            std::list<Parameters*> sorted;
+            AVTS begin = wallclock.ns();
+            baseline_sort::sort(all_nodes, sorted);
+            r["baseline_sort_us" + suffix] = double(wallclock.ns() - begin) / 1e3;
+        }
+    }
+    return r;
+}
+
+// 60 channels of loop_input (encodes a short test pattern when created, like opening a real input) -> split -> sink,
+// added node by node as node.add_start does, then with NodeManager::deploy
+static json graphDeployBench(const double) {
+    const int channels = 60;
+    json nodes = json::array();
+    for (int c=0; c<channels; c++) {
+        std::string p = "c" + std::to_string(c) + "_";
+        nodes.push_back({ {"name", p+"src"}, {"type", "loop_input"}, {"dst", p+"q0"}, {"group", p+"g"},
+            {"pattern", { {"duration", 0.4}, {"width", 320}, {"height", 180}, {"audio_codec", ""} }} });
+        nodes.push_back({ {"name", p+"split"}, {"type", "split"}, {"src", p+"q0"}, {"dst", json::array({p+"q1"})}, {"group", p+"g"} });
+        nodes.push_back({ {"name", p+"sink"}, {"type", "bench_count_sink"}, {"src", p+"q1"}, {"group", p+"g"} });
+    }
+    json r;
+    {
+        auto manager = std::make_shared<NodeManager>();
+        AVTS begin = wallclock.ns();
+        for (const json &jnode: nodes) {
+            Parameters params = jnode;
+            manager->createNode(params, true, true);
+        }
+        r["sequential_ms"] = (wallclock.ns() - begin) / 1e6;
+        manager->shutdown();
+    }
+    {
+        auto manager = std::make_shared<NodeManager>();
+        AVTS begin = wallclock.ns();
+        json jr = manager->deploy({ {"nodes", nodes} });
+        r["deploy_ms"] = (wallclock.ns() - begin) / 1e6;
+        r["deploy_create_ms"] = jr["create_us"].get<uint64_t>() / 1e3;
+        r["deploy_start_ms"] = jr["start_us"].get<uint64_t>() / 1e3;
+        r["levels"] = jr["levels"];
+        manager->shutdown();
+    }
+    return r;
+}
+
+
+// Records frames of a queue with queue.record's recorder, then replays the file flat out.
+// Recording throughput is bounded by the disk, replaying only maps the file.
+static json edgeReplayBench(const double duration_sec) {
+    const std::string path = "/tmp/avplumber_bench.rec";
+    const uint64_t frames = 100;
+    json r;
+    {
+        auto manager = std::make_shared<NodeManager>();
+        std::list<std::shared_ptr<NodeWrapper>> wrappers;
+        for (const json &jnode: json::parse(R"([
+            {"name": "src", "type": "bench_video_source", "dst": "q0", "width": 1920, "height": 1080, "pix_fmt": "yuv420p", "count": 100},
+            {"name": "sink", "type": "bench_count_sink", "src": "q0"}
+        ])")) {
+            Parameters params = jnode;
+            wrappers.push_back(manager->createNode(params, true, false));
+        }
+        std::shared_ptr<EdgeRecorder> recorder = EdgeRecorder::start(*manager->edges(), "q0", path, 256*1024*1024, true);
+        AVTS begin = wallclock.ns();
+        for (auto it = wrappers.rbegin(); it != wrappers.rend(); ++it) {
+            (*it)->start();
+        }
+        while (true) {
+            json stats = recorder->stats();
+            if (stats["records"].get<uint64_t>() + stats["skipped"].get<uint64_t>() >= frames) break;
+            wallclock.sleepms(1);
+        }
+        recorder->stop();
+        double elapsed = double(wallclock.ns() - begin) / 1e9;
+        json stats = recorder->stats();
+        manager->shutdown();
+        r["record_fps"] = frames / elapsed;
+        r["record_MBps"] = stats["written_bytes"].get<uint64_t>() / elapsed / 1e6;
+        r["record_max_backlog_MB"] = stats["max_backlog_bytes"].get<uint64_t>() / 1e6;
+        r["record_write_p99_us"] = stats["write_us"]["p99"];
+    }
+    Scenario replay { "edge_replay", "", json::parse(R"([
+        {"name": "replay", "type": "replay", "dst": "q0", "realtime": false, "loops": 0},
+        {"name": "sink", "type": "bench_count_sink", "src": "q0"}
+    ])") };
+    replay.nodes[0]["path"] = path;
+    json jr = runScenario(replay, 0.5, duration_sec);
+    r["replay_fps"] = jr["sinks"]["sink"]["fps"];
+    r["replay_MBps"] = jr["sinks"]["sink"]["MBps"];
+    r["replay_cpu_percent"] = jr["nodes"]["replay"]["cpu_percent"];
+    unlink(path.c_str());
+    return r;
+}
+
+static std::vector<Microbench> microbenchmarks() {
+    std::vector<Microbench> r;
+    r.push_back({ "timed_history_audio", "TimedHistory, std::list vs ring: 30 s window of 1024-sample frames at 48 kHz (~1400 items)", [](const double duration_sec) {
+        return timedHistoryBench(47, 30, duration_sec);
+    } });
+    r.push_back({ "timed_history_packets", "TimedHistory, std::list vs ring: 30 s window of 600 packets/s (18000 items)", [](const double duration_sec) {
+        return timedHistoryBench(600, 30, duration_sec);
+    } });
+    r.push_back({ "stats_delivery", "200 stats subscriptions posting to a loopback HTTP receiver: request per document vs keep-alive vs batched", [](const double duration_sec) {
+        return statsDeliveryBench(duration_sec);
+    } });
+    r.push_back({ "split_fanout_4k", "split of 3840x2160 yuv420p frames to 8 outputs: data copy per output vs shared buffer (copy on write)", [](const double duration_sec) {
+        return splitFanoutBench(duration_sec);
+    } });
+    r.push_back({ "loudness_meter", "EBU R128 loudness meter: accuracy on Tech 3341/3342 test signals, throughput with and without true peak", [](const double duration_sec) {
+        return loudnessBench(duration_sec);
+    } });
+    r.push_back({ "sound_levels", "sound level kernels: scalar/SSE2/AVX2 bins vs reference on random samples of every sample format, throughput", [](const double duration_sec) {
+        return soundLevelsBench(duration_sec);
+    } });
+    r.push_back({ "group_order", "NodeGroup topological order of 10 to 10000 chained nodes: adding, sorting, re-adding vs full DFS sort", [](const double duration_sec) {
+        return groupOrderBench(duration_sec);
+    } });
+    r.push_back({ "graph_deploy", "adding 60 channels of loop_input -> split -> sink: node by node vs graph.deploy (parallel creation)", [](const double duration_sec) {
+        return graphDeployBench(duration_sec);
+    } });
+    r.push_back({ "edge_replay", "queue.record of 100 1920x1080 yuv420p frames to /tmp, then replay of the recording as fast as possible", [](const double duration_sec) {
+        return edgeReplayBench(duration_sec);
+    } });
+    return r;
+}
+
+static void printMicroReport(const Microbench &mb, const json &r) {
+    std::cout << "== " << mb.name << ": " << mb.description << "\n";
+    for (auto it = r.begin(); it != r.end(); ++it) {
+        std::cout << std::left << std::setw(24) << it.key() << std::right << std::setw(16);
+        if (it.value().is_number_float()) {
+            std::cout << std::fixed << std::setprecision(1) << it.value().get<double>();
+        } else {
+            std::cout << it.value();
+        }
+        std::cout << "\n";
+    }
+    std::cout << std::endl;
+}
+
+static std::vector<Scenario> scenarios() {
+    std::vector<Scenario> r;
+    r.push_back({ "packets", "1500 byte packets, source -> sink", json::parse(R"([
+        {"name": "src", "type": "bench_packet_source", "dst": "q0", "size": 1500},
+        {"name": "sink", "type": "bench_count_sink", "src": "q0"}
+    ])") });
+    r.push_back({ "packets_chain8", "1500 byte packets through 8 passthrough nodes (split with 1 output)", json::parse(R"([
+        {"name": "src", "type": "bench_packet_source", "dst": "q0", "size": 1500},
+        {"name": "hop1", "type": "split", "src": "q0", "dst": ["q1"]},
+        {"name": "hop2", "type": "split", "src": "q1", "dst": ["q2"]},
+        {"name": "hop3", "type": "split", "src": "q2", "dst": ["q3"]},
+        {"name": "hop4", "type": "split", "src": "q3", "dst": ["q4"]},
+        {"name": "hop5", "type": "split", "src": "q4", "dst": ["q5"]},
+        {"name": "hop6", "type": "split", "src": "q5", "dst": ["q6"]},
+        {"name": "hop7", "type": "split", "src": "q6", "dst": ["q7"]},
+        {"name": "hop8", "type": "split", "src": "q7", "dst": ["q8"]},
+        {"name": "sink", "type": "bench_count_sink", "src": "q8"}
+    ])") });
+    r.push_back({ "packets_pool", "1500 byte packets, source -> sink, both in worker pool", json::parse(R"([
+        {"name": "src", "type": "bench_packet_source", "dst": "q0", "size": 1500, "worker_pool": "bench"},
+        {"name": "sink", "type": "bench_count_sink", "src": "q0", "worker_pool": "bench"}
+    ])") });
+    r.push_back({ "video_1080p", "1920x1080 yuv420p frames, source -> sink", json::parse(R"([
+        {"name": "src", "type": "bench_video_source", "dst": "q0", "width": 1920, "height": 1080, "pix_fmt": "yuv420p"},
+        {"name": "sink", "type": "bench_count_sink", "src": "q0"}
+    ])") });
+    r.push_back({ "video_split4", "1920x1080 yuv420p frames split to 4 sinks", json::parse(R"([
+        {"name": "src", "type": "bench_video_source", "dst": "q0", "width": 1920, "height": 1080, "pix_fmt": "yuv420p"},
+        {"name": "split", "type": "split", "src": "q0", "dst": ["q1", "q2", "q3", "q4"]},
+        {"name": "sink1", "type": "bench_count_sink", "src": "q1"},
+        {"name": "sink2", "type": "bench_count_sink", "src": "q2"},
+        {"name": "sink3", "type": "bench_count_sink", "src": "q3"},
+        {"name": "sink4", "type": "bench_count_sink", "src": "q4"}
+    ])") });
+    r.push_back({ "video_split8_4k", "3840x2160 yuv420p frames split to 8 sinks (shared buffers)", json::parse(R"([
+        {"name": "src", "type": "bench_video_source", "dst": "q0", "width": 3840, "height": 2160, "pix_fmt": "yuv420p"},
+        {"name": "split", "type": "split", "src": "q0", "dst": ["q1", "q2", "q3", "q4", "q5", "q6", "q7", "q8"]},
+        {"name": "sink1", "type": "bench_count_sink", "src": "q1"},
+        {"name": "sink2", "type": "bench_count_sink", "src": "q2"},
+        {"name": "sink3", "type": "bench_count_sink", "src": "q3"},
+        {"name": "sink4", "type": "bench_count_sink", "src": "q4"},
+        {"name": "sink5", "type": "bench_count_sink", "src": "q5"},
+        {"name": "sink6", "type": "bench_count_sink", "src": "q6"},
+        {"name": "sink7", "type": "bench_count_sink", "src": "q7"},
+        {"name": "sink8", "type": "bench_count_sink", "src": "q8"}
+    ])") });
+    r.push_back({ "video_scale720", "1920x1080 yuv420p frames scaled to 1280x720 (bicubic, 1 thread)", json::parse(R"([
+        {"name": "src", "type": "bench_video_source", "dst": "q0", "width": 1920, "height": 1080, "pix_fmt": "yuv420p"},
+        {"name": "scale", "type": "rescale_video", "src": "q0", "dst": "q1", "dst_width": 1280, "dst_height": 720, "dst_pixel_format": "yuv420p"},
+        {"name": "sink", "type": "bench_count_sink", "src": "q1"}
+    ])") });
+    r.push_back({ "video_scale720_mt", "1920x1080 yuv420p frames scaled to 1280x720 (bicubic, 4 slice threads)", json::parse(R"([
+        {"name": "src", "type": "bench_video_source", "dst": "q0", "width": 1920, "height": 1080, "pix_fmt": "yuv420p"},
+        {"name": "scale", "type": "rescale_video", "src": "q0", "dst": "q1", "dst_width": 1280, "dst_height": 720, "dst_pixel_format": "yuv420p", "threads": 4},
+        {"name": "sink", "type": "bench_count_sink", "src": "q1"}
+    ])") });
+    r.push_back({ "audio", "48kHz stereo fltp, 1024 samples per frame, source -> sink", json::parse(R"([
+        {"name": "src", "type": "bench_audio_source", "dst": "q0", "sample_rate": 48000, "channels": 2, "frame_size": 1024},
+        {"name": "sink", "type": "bench_count_sink", "src": "q0"}
+    ])") });
+    r.push_back({ "audio_resample", "48kHz stereo fltp resampled to 44.1kHz s16", json::parse(R"([
+        {"name": "src", "type": "bench_audio_source", "dst": "q0", "sample_rate": 48000, "channels": 2, "frame_size": 1024},
+        {"name": "resample", "type": "resample_audio", "src": "q0", "dst": "q1", "dst_sample_rate": 44100, "dst_channels": 2, "dst_sample_format": "s16"},
+        {"name": "sink", "type": "bench_count_sink", "src": "q1"}
+    ])") });
+    // 7 TS packets per bench packet, ~105 Mbps, while the consumer stalls for 200 ms every second
+    const json output_consumer = { {"path", "/tmp/avplumber_bench.sock"}, {"stall_every_ms", 1000}, {"stall_ms", 200} };
+    r.push_back({ "output_sync", "mpegts to UNIX socket with stalling reader, synchronous writes", json::parse(R"([
+        {"name": "src", "type": "bench_packet_source", "dst": "q0", "size": 1316, "rate": 10000, "realtime": true},
+        {"name": "mux", "type": "mux", "src": ["q0"], "dst": "q1"},
+        {"name": "out", "type": "output", "src": "q1", "format": "mpegts", "url": "unix:/tmp/avplumber_bench.sock"}
+    ])"), output_consumer });
+    r.push_back({ "output_async", "mpegts to UNIX socket with stalling reader, async writer with 64 MB backlog", json::parse(R"([
+        {"name": "src", "type": "bench_packet_source", "dst": "q0", "size": 1316, "rate": 10000, "realtime": true},
+        {"name": "mux", "type": "mux", "src": ["q0"], "dst": "q1"},
+        {"name": "out", "type": "output", "src": "q1", "format": "mpegts", "url": "unix:/tmp/avplumber_bench.sock", "async": true}
+    ])"), output_consumer });
+    r.push_back({ "output_async_drop", "mpegts to UNIX socket with stalling reader, async writer with 1 MB backlog dropping until keyframe", json::parse(R"([
+        {"name": "src", "type": "bench_packet_source", "dst": "q0", "size": 1316, "rate": 10000, "realtime": true, "keyframe_interval": 250},
+        {"name": "mux", "type": "mux", "src": ["q0"], "dst": "q1"},
+        {"name": "out", "type": "output", "src": "q1", "format": "mpegts", "url": "unix:/tmp/avplumber_bench.sock", "async": true, "buffer_bytes": 1048576, "overflow": "drop"}
+    ])"), output_consumer });
+    r.push_back({ "hls_ll", "20 kB video packets at 1 s GOP to hls_output: 2 s segments, 200 ms LL-HLS parts in /tmp/avplumber_bench_hls", json::parse(R"([
+        {"name": "src", "type": "bench_packet_source", "dst": "q0", "size": 20000, "codec": "mjpeg", "width": 1920, "height": 1080, "rate": 25, "keyframe_interval": 25},
+        {"name": "mux", "type": "mux", "src": ["q0"], "dst": "q1"},
+        {"name": "hls", "type": "hls_output", "src": "q1", "dir": "/tmp/avplumber_bench_hls/ll", "segment_duration": 2, "part_duration": 0.2}
+    ])") });
+    {
+        // 3 rungs cutting at the same keyframes, with a multivariant playlist.
+        // Realtime, so that the variants' playlist windows overlap and their segments can be compared.
+        json nodes = json::array();
+        int rung = 0;
+        for (auto size: { std::make_pair(1920, 40000), std::make_pair(1280, 20000), std::make_pair(640, 5000) }) {
+            std::string n = std::to_string(++rung);
+            nodes.push_back({ {"name", "src" + n}, {"type", "bench_packet_source"}, {"dst", "q" + n}, {"size", size.second}, {"codec", "mjpeg"},
+                {"width", size.first}, {"height", size.first * 9 / 16}, {"rate", 25}, {"keyframe_interval", 5}, {"realtime", true} });
+            nodes.push_back({ {"name", "mux" + n}, {"type", "mux"}, {"src", json::array({"q" + n})}, {"dst", "qmux" + n} });
+            nodes.push_back({ {"name", "hls" + n}, {"type", "hls_output"}, {"src", "qmux" + n}, {"dir", "/tmp/avplumber_bench_hls/ladder/" + n},
+                {"segment_duration", 0.4}, {"list_size", 100}, {"group", "bench_ladder"}, {"master", "/tmp/avplumber_bench_hls/ladder/master.m3u8"} });
+        }
+        r.push_back({ "hls_ladder3", "3 realtime rungs (40, 20, 5 kB packets, 200 ms GOP) to hls_output variants with a multivariant playlist, checks segment alignment", nodes });
+    }
+    r.push_back({ "loop_decode", "looped 720p mpeg2video + aac test pattern from memory, demux -> video & audio decoders", json::parse(R"([
+        {"name": "src", "type": "loop_input", "dst": "q0", "realtime": false, "pattern": {"duration": 4}},
+        {"name": "demux", "type": "demux", "src": "q0", "routing": {"v:0": "qv", "a:0": "qa"}},
+        {"name": "decv", "type": "dec_video", "src": "qv", "dst": "qvd"},
+        {"name": "deca", "type": "dec_audio", "src": "qa", "dst": "qad"},
+        {"name": "sinkv", "type": "bench_count_sink", "src": "qvd"},
+        {"name": "sinka", "type": "bench_count_sink", "src": "qad"}
+    ])") });
+    r.push_back({ "loop_remux", "looped 1080p mpeg2video + aac test pattern from memory, remuxed to MPEG-TS null output", json::parse(R"([
+        {"name": "src", "type": "loop_input", "dst": "q0", "realtime": false, "pattern": {"duration": 4, "width": 1920, "height": 1080, "bitrate": 8000000}},
+        {"name": "demux", "type": "demux", "src": "q0", "routing": {"v:0": "qv", "a:0": "qa"}},
+        {"name": "relayv", "type": "packet_relay", "src": "qv", "dst": "qv2"},
+        {"name": "relaya", "type": "packet_relay", "src": "qa", "dst": "qa2"},
+        {"name": "mux", "type": "mux", "src": ["qv2", "qa2"], "dst": "qmux"},
+        {"name": "out", "type": "output", "src": "qmux", "format": "mpegts", "url": "/dev/null"}
+    ])") });
+    // interleaving cost vs number of streams, null muxer discards packets
+    for (int streams: {2, 8, 32, 128}) {
+        json nodes = json::array();
+        json mux_src = json::array();
+        for (int i=0; i<streams; i++) {
+            std::string edge = "q" + std::to_string(i);
+            nodes.push_back({ {"name", "src" + std::to_string(i)}, {"type", "bench_packet_source"}, {"dst", edge}, {"size", 188}, {"worker_pool", "bench"} });
+            mux_src.push_back(edge);
+        }
+        nodes.push_back({ {"name", "mux"}, {"type", "mux"}, {"src", mux_src}, {"dst", "qmux"} });
+        nodes.push_back({ {"name", "out"}, {"type", "output"}, {"src", "qmux"}, {"format", "null"}, {"url", "-"} });
+        r.push_back({ "mux_streams" + std::to_string(streams), std::to_string(streams) + " packet streams interleaved by mux to null output", nodes });
+    }
+    return r;
+}
+
+struct Snapshot {
+    AVTS time_ns;
+    std::map<std::string, uint64_t> sink_count, sink_bytes;
+    std::map<std::string, AVTS> cpu_ns;
+    std::map<std::string, Parameters> outputs;
+    std::map<std::string, Parameters> hls;
+};
+
+static Snapshot takeSnapshot(std::shared_ptr<NodeManager> &manager, const Scenario &sc) {
+    Snapshot r;
+    for (const json &jnode: sc.nodes) {
+        std::string name = jnode["name"];
+        std::shared_ptr<NodeWrapper> nw = manager->node(name);
+        r.cpu_ns[name] = nw->cpuTimeNs();
+        if (jnode["type"] == "bench_count_sink") {
+            Parameters stats = nw->getObject("stats");
+            r.sink_count[name] = stats["count"];
+            r.sink_bytes[name] = stats["bytes"];
+        } else if (jnode["type"] == "output") {
+            r.outputs[name] = nw->getObject("stats");
+        } else if (jnode["type"] == "hls_output") {
+            r.hls[name] = nw->getObject("stats");
+        }
+    }
+    r.time_ns = wallclock.ns();
+    return r;
+}
+
+// sequence number -> EXTINF of segments in a media playlist
+static std::map<uint64_t, double> readHlsSegments(const std::string &path) {
+    std::ifstream f(path);
+    if (!f) {
+        throw Error("Can't read " + path);
+    }
+    std::map<uint64_t, double> r;
+    uint64_t sequence = 0;
+    std::string line;
+    const std::string seq_tag = "#EXT-X-MEDIA-SEQUENCE:";
+    const std::string extinf_tag = "#EXTINF:";
+    while (std::getline(f, line)) {
+        if (line.compare(0, seq_tag.size(), seq_tag) == 0) {
+            sequence = std::stoull(line.substr(seq_tag.size()));
+        } else if (line.compare(0, extinf_tag.size(), extinf_tag) == 0) {
+            r[sequence++] = std::stod(line.substr(extinf_tag.size()));
+        }
+    }
+    return r;
+}
+
+// Every hls_output must cut only at (aligned) keyframes, and variants of a group
+// must have the same segment sequence numbers and durations. Returns list of problems.
+static json checkHls(const Scenario &sc, const Snapshot &end) {
+    json problems = json::array();
+    std::map<std::string, std::map<std::string, std::map<uint64_t, double>>> groups; // group -> node -> segments
+    for (const json &jnode: sc.nodes) {
+        if (jnode["type"] != "hls_output") continue;
+        std::string name = jnode["name"];
+        const Parameters &stats = end.hls.at(name);
+        for (const char* counter: { "misaligned_cuts", "forced_cuts" }) {
+            if (stats[counter].get<uint64_t>() > 0) {
+                problems.push_back(name + ": " + counter + " = " + std::to_string(stats[counter].get<uint64_t>()));
+            }
+        }
+        if (jnode.count("group")) {
+            std::string path = jnode["dir"].get<std::string>() + "/" + jnode.value("playlist", std::string("index.m3u8"));
+            try {
+                groups[jnode["group"].get<std::string>()][name] = readHlsSegments(path);
+            } catch (std::exception &e) {
+                problems.push_back(name + ": " + e.what());
+            }
+        }
+    }
+    for (auto &group: groups) {
+        auto &variants = group.second;
+        const std::string &first_name = variants.begin()->first;
+        const std::map<uint64_t, double> &first = variants.begin()->second;
+        if (first.size() < 3) {
+            problems.push_back(first_name + ": only " + std::to_string(first.size()) + " segments to compare");
+            continue;
+        }
+        for (auto &kv: variants) {
+            const std::map<uint64_t, double> &segments = kv.second;
+            if (segments.empty()) {
+                problems.push_back(kv.first + ": no segments");
+                continue;
+            }
+            // playlists are snapshots taken at slightly different times, so windows may differ by a segment
+            auto windowDiff = [](uint64_t a, uint64_t b) { return a > b ? a - b : b - a; };
+            if (windowDiff(segments.begin()->first, first.begin()->first) > 1 || windowDiff(segments.rbegin()->first, first.rbegin()->first) > 1) {
+                problems.push_back(kv.first + ": media sequence " + std::to_string(segments.begin()->first) + "-" + std::to_string(segments.rbegin()->first)
+                    + " doesn't match " + first_name + " " + std::to_string(first.begin()->first) + "-" + std::to_string(first.rbegin()->first));
+            }
+            for (auto &seg: segments) {
+                auto it = first.find(seg.first);
+                // the last segment of the longer list may still be open in the other
+                if (it == first.end() || seg.first == first.rbegin()->first || seg.first == segments.rbegin()->first) continue;
+                if (std::abs(it->second - seg.second) > 0.001) {
+                    problems.push_back(kv.first + ": segment " + std::to_string(seg.first) + " is " + std::to_string(seg.second)
+                        + " s, in " + first_name + " " + std::to_string(it->second) + " s");
+                }
+            }
+        }
+    }
+    return problems;
+}
+
+static json runScenario(const Scenario &sc, const double warmup_sec, const double duration_sec) {
+    // must be listening before output nodes connect, and outlive them
+    std::unique_ptr<UnixSocketConsumer> consumer;
+    if (!sc.consumer.is_null()) {
+        consumer = make_unique<UnixSocketConsumer>(sc.consumer);
+    }
+    auto manager = std::make_shared<NodeManager>();
+    std::list<std::shared_ptr<NodeWrapper>> wrappers;
+    for (const json &jnode: sc.nodes) {
+        Parameters params = jnode;
+        wrappers.push_back(manager->createNode(params, true, false));
+    }
+    // start consumers first, so that producers don't measure filling of empty queues
+    for (auto it = wrappers.rbegin(); it != wrappers.rend(); ++it) {
+        (*it)->start();
+    }
+
+    wallclock.sleepms(warmup_sec * 1000);
+    json discard;
+    manager->edges()->collectEdgesStats(discard, true);
+    Snapshot begin = takeSnapshot(manager, sc);
+    wallclock.sleepms(duration_sec * 1000);
+    Snapshot end = takeSnapshot(manager, sc);
+    json jedges = json::object();
+    manager->edges()->collectEdgesStats(jedges);
+    json problems = checkHls(sc, end);
+
+    manager->shutdown();
+
+    double elapsed = double(end.time_ns - begin.time_ns) / 1e9;
+    json r;
+    r["scenario"] = sc.name;
+    r["duration"] = elapsed;
+    json jsinks = json::object();
+    for (auto &kv: end.sink_count) {
+        uint64_t count = kv.second - begin.sink_count[kv.first];
+        uint64_t bytes = end.sink_bytes[kv.first] - begin.sink_bytes[kv.first];
+        jsinks[kv.first] = {
+            { "count", count },
+            { "fps", count / elapsed },
+            { "MBps", bytes / elapsed / 1e6 },
+        };
+    }
+    r["sinks"] = jsinks;
+    json jqueues = json::object();
+    for (auto it = jedges.begin(); it != jedges.end(); ++it) {
+        const json &je = it.value();
+        jqueues[it.key()] = {
+            { "p50_us", je["dwell_us"]["p50"] },
+            { "p99_us", je["dwell_us"]["p99"] },
+            { "max_us", je["dwell_us"]["max"] },
+            { "occupancy_p50", je["occupancy"]["p50"] },
+            { "capacity", je["capacity"] },
+            { "drops", je["drops"] },
+        };
+    }
+    r["queues"] = jqueues;
+    json jnodes = json::object();
+    for (auto &kv: end.cpu_ns) {
+        double cpu = double(kv.second - begin.cpu_ns[kv.first]) / 1e9;
+        jnodes[kv.first] = {
+            { "cpu_sec", cpu },
+            { "cpu_percent", 100.0 * cpu / elapsed },
+        };
+    }
+    r["nodes"] = jnodes;
+    json joutputs = json::object();
+    for (auto &kv: end.outputs) {
+        Parameters &e = kv.second;
+        Parameters &b = begin.outputs[kv.first];
+        uint64_t packets = e["written_packets"].get<uint64_t>() - b["written_packets"].get<uint64_t>();
+        uint64_t bytes = e["written_bytes"].get<uint64_t>() - b["written_bytes"].get<uint64_t>();
+        // histograms cover the whole run, including warmup
+        joutputs[kv.first] = {
+            { "packets", packets },
+            { "pps", packets / elapsed },
+            { "MBps", bytes / elapsed / 1e6 },
+            { "dropped", e["dropped_packets"].get<uint64_t>() - b["dropped_packets"].get<uint64_t>() },
+            { "max_backlog_bytes", e["max_backlog_bytes"] },
+            { "write_p99_us", e["write_us"]["p99"] },
+            { "write_max_us", e["write_us"]["max"] },
+            { "queue_p99_us", e["queue_us"]["p99"] },
+        };
+    }
+    r["outputs"] = joutputs;
+    json jhls = json::object();
+    for (auto &kv: end.hls) {
+        Parameters &e = kv.second;
+        Parameters &b = begin.hls[kv.first];
+        uint64_t bytes = e["writer"]["written_bytes"].get<uint64_t>() - b["writer"]["written_bytes"].get<uint64_t>();
+        jhls[kv.first] = {
+            { "segments", e["segments"].get<uint64_t>() - b["segments"].get<uint64_t>() },
+            { "parts", e["parts"].get<uint64_t>() - b["parts"].get<uint64_t>() },
+            { "MBps", bytes / elapsed / 1e6 },
+            { "misaligned", e["misaligned_cuts"] },
+            { "forced", e["forced_cuts"] },
+            { "write_p99_us", e["writer"]["write_us"]["p99"] },
+        };
+    }
+    r["hls"] = jhls;
+    if (!jhls.empty()) {
+        r["pass"] = problems.empty();
+        r["problems"] = problems;
+    }
+    return r;
+}
+
+static void printReport(const Scenario &sc, const json &r) {
+    std::cout << "== " << sc.name << ": " << sc.description << " (" << std::fixed << std::setprecision(2) << r["duration"].get<double>() << " s)\n";
+    std::cout << std::left << std::setw(12) << "sink" << std::right << std::setw(12) << "items" << std::setw(14) << "items/s" << std::setw(12) << "MB/s" << "\n";
+    for (auto it = r["sinks"].begin(); it != r["sinks"].end(); ++it) {
+        const json &j = it.value();
+        std::cout << std::left << std::setw(12) << it.key() << std::right << std::setw(12) << j["count"].get<uint64_t>()
+            << std::setw(14) << std::setprecision(1) << j["fps"].get<double>() << std::setw(12) << j["MBps"].get<double>() << "\n";
+    }
+    std::cout << std::left << std::setw(12) << "queue" << std::right << std::setw(10) << "p50 us" << std::setw(10) << "p99 us" << std::setw(10) << "max us"
+        << std::setw(12) << "fill p50" << std::setw(8) << "drops" << "\n";
+    for (auto it = r["queues"].begin(); it != r["queues"].end(); ++it) {
+        const json &j = it.value();
+        std::cout << std::left << std::setw(12) << it.key() << std::right << std::setw(10) << j["p50_us"].get<uint64_t>() << std::setw(10) << j["p99_us"].get<uint64_t>()
+            << std::setw(10) << j["max_us"].get<uint64_t>()
+            << std::setw(12) << (std::to_string(j["occupancy_p50"].get<uint64_t>()) + "/" + std::to_string(j["capacity"].get<int>()))
+            << std::setw(8) << j["drops"].get<uint64_t>() << "\n";
+    }
+    std::cout << std::left << std::setw(12) << "node" << std::right << std::setw(10) << "cpu s" << std::setw(10) << "cpu %" << "\n";
+    for (auto it = r["nodes"].begin(); it != r["nodes"].end(); ++it) {
+        const json &j = it.value();
+        std::cout << std::left << std::setw(12) << it.key() << std::right << std::setprecision(3) << std::setw(10) << j["cpu_sec"].get<double>()
+            << std::setprecision(1) << std::setw(10) << j["cpu_percent"].get<double>() << "\n";
+    }
+    if (!r["outputs"].empty()) {
+        std::cout << std::left << std::setw(12) << "output" << std::right << std::setw(12) << "packets/s" << std::setw(10) << "MB/s" << std::setw(10) << "dropped"
+            << std::setw(14) << "max backlog" << std::setw(12) << "write p99" << std::setw(12) << "write max" << std::setw(12) << "queue p99" << "\n";
+    }
+    for (auto it = r["outputs"].begin(); it != r["outputs"].end(); ++it) {
+        const json &j = it.value();
+        std::cout << std::left << std::setw(12) << it.key() << std::right << std::setprecision(1) << std::setw(12) << j["pps"].get<double>() << std::setw(10) << j["MBps"].get<double>()
+            << std::setw(10) << j["dropped"].get<uint64_t>() << std::setw(14) << j["max_backlog_bytes"].get<uint64_t>()
+            << std::setw(12) << j["write_p99_us"].get<uint64_t>() << std::setw(12) << j["write_max_us"].get<uint64_t>()
+            << std::setw(12) << j["queue_p99_us"].get<uint64_t>() << "\n";
+    }
+    if (!r["hls"].empty()) {
+        std::cout << std::left << std::setw(12) << "hls" << std::right << std::setw(10) << "segments" << std::setw(10) << "parts" << std::setw(10) << "MB/s"
+            << std::setw(12) << "misaligned" << std::setw(8) << "forced" << std::setw(12) << "write p99" << "\n";
+    }
+    for (auto it = r["hls"].begin(); it != r["hls"].end(); ++it) {
+        const json &j = it.value();
+        std::cout << std::left << std::setw(12) << it.key() << std::right << std::setw(10) << j["segments"].get<uint64_t>() << std::setw(10) << j["parts"].get<uint64_t>()
+            << std::setprecision(1) << std::setw(10) << j["MBps"].get<double>() << std::setw(12) << j["misaligned"].get<uint64_t>()
+            << std::setw(8) << j["forced"].get<uint64_t>() << std::setw(12) << j["write_p99_us"].get<uint64_t>() << "\n";
+    }
+    if (r.count("problems")) {
+        for (const json &problem: r["problems"]) {
+            std::cout << "PROBLEM: " << problem.get<std::string>() << "\n";
+        }
+    }
+    std::cout << std::endl;
+}
+
+int main(int argc, char **argv) {
+    set_thread_name("bench main");
+
+    Flags args;
+
+    std::string only;
+    double duration;
+    double warmup;
+    std::string log_path;
+    bool list;
+    bool json_output;
+
+    args.Var(only, 's', "scenario", std::string(""), "Run only this scenario (default: all)");
+    args.Var(duration, 'd', "duration", 5.0, "Measurement time of each scenario, in seconds");
+    args.Var(warmup, 'w', "warmup", 1.0, "Time to run each scenario before measuring, in seconds");
+    args.Var(log_path, 'l', "logfile", std::string("/dev/null"), "Write avplumber messages to this file");
+    args.Bool(list, 'L', "list", std::string(""), "List scenarios and exit");
+    args.Bool(json_output, 'j', "json", std::string(""), "Print results as JSON, one line per scenario");
+    args.Parse(argc, argv);
+
+    std::vector<Scenario> all = scenarios();
+    std::vector<Microbench> micro = microbenchmarks();
+    if (list) {
+        for (const Scenario &sc: all) {
+            std::cout << sc.name << " - " << sc.description << "\n";
+        }
+        for (const Microbench &mb: micro) {
+            std::cout << mb.name << " - " << mb.description << "\n";
+        }
+        return 0;
+    }
+
+    current_thread.logger = std::make_shared<AsyncLogger>(log_path);
+
+    bool found = false;
+    bool failed = false;
+    for (const Scenario &sc: all) {
+        if (!only.empty() && sc.name != only) continue;
+        found = true;
+        try {
+            json r = runScenario(sc, warmup, duration);
+            if (json_output) {
+                std::cout << r << std::endl;
+            } else {
+                printReport(sc, r);
+            }
+            // correctness checks (hls_output) report pass, all others only measure
+            if (r.count("pass") && !r["pass"].get<bool>()) {
+                std::cerr << "Scenario " << sc.name << " failed: output checks didn't pass" << std::endl;
+                failed = true;
+            }
+        } catch (std::exception &e) {
+            std::cerr << "Scenario " << sc.name << " failed: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    for (const Microbench &mb: micro) {
+        if (!only.empty() && mb.name != only) continue;
+        found = true;
+        json r = mb.run(duration);
+        // accuracy checks (loudness_meter, sound_levels) report pass, all others only measure
+        bool passed = !r.count("pass") || r["pass"].get<bool>();
+        r["microbench"] = mb.name;
+        if (json_output) {
+            std::cout << r << std::endl;
+        } else {
+            r.erase("microbench");
+            printMicroReport(mb, r);
+        }
+        if (!passed) {
+            std::cerr << "Microbenchmark " << mb.name << " failed: result out of tolerance" << std::endl;
+            failed = true;
+        }
+    }
+    if (!found) {
+        std::cerr << "No such scenario: " << only << std::endl;
+        return 1;
+    }
+    return failed ? 1 : 0;
+}
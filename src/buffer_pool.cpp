@@ -0,0 +1,213 @@
+#include "buffer_pool.hpp"
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/common.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/samplefmt.h>
+}
+
+namespace {
+    constexpr int linesize_align = 64;
+    constexpr int height_align = 32; // like av_frame_get_buffer, some SIMD code reads beyond the last line
+    constexpr int min_audio_capacity = 1024;
+
+#if LIBAVUTIL_VERSION_MAJOR < 57
+    using PoolAllocSize = int;
+#else
+    using PoolAllocSize = size_t;
+#endif
+
+    // AVFrame::ch_layout replaced channel_layout and channels in 57.28.100,
+    // they're deprecated since then and removed in 59
+    void setChannelLayout(AVFrame* frm, const uint64_t channel_layout) {
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+        av_channel_layout_uninit(&frm->ch_layout);
+        av_channel_layout_from_mask(&frm->ch_layout, channel_layout);
+#endif
+#if LIBAVUTIL_VERSION_MAJOR < 59
+        frm->channel_layout = channel_layout;
+        frm->channels = av_popcount64(channel_layout);
+#endif
+    }
+
+    std::string channelLayoutName(const uint64_t channel_layout) {
+        char name[64];
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+        AVChannelLayout layout = {};
+        av_channel_layout_from_mask(&layout, channel_layout);
+        av_channel_layout_describe(&layout, name, sizeof(name));
+        av_channel_layout_uninit(&layout);
+#else
+        av_get_channel_layout_string(name, sizeof(name), 0, channel_layout);
+#endif
+        return name;
+    }
+};
+
+void BufferPools::Pool::init(size_t size) {
+    size_ = size;
+    pool_ = av_buffer_pool_init2(size, this, [](void* opaque, PoolAllocSize buf_size) -> AVBufferRef* {
+        Pool &self = *reinterpret_cast<Pool*>(opaque);
+        self.allocs_.fetch_add(1, std::memory_order_relaxed);
+        return av_buffer_alloc(buf_size);
+    }, nullptr);
+    if (pool_ == nullptr) {
+        throw Error("av_buffer_pool_init2 failed");
+    }
+}
+
+BufferPools::Pool::~Pool() {
+    // buffers still referenced by frames keep the pool alive until they're released
+    av_buffer_pool_uninit(&pool_);
+}
+
+AVBufferRef* BufferPools::Pool::get() {
+    gets_.fetch_add(1, std::memory_order_relaxed);
+    AVBufferRef* buf = av_buffer_pool_get(pool_);
+    if (buf == nullptr) {
+        throw Error("Out of memory: av_buffer_pool_get failed");
+    }
+    return buf;
+}
+
+av::VideoFrame BufferPools::Pool::videoFrame() {
+    av::VideoFrame r;
+    AVFrame* frm = r.raw();
+    frm->format = pix_fmt_;
+    frm->width = width_;
+    frm->height = height_;
+    frm->buf[0] = get();
+    int linesize[4];
+    std::copy(linesize_, linesize_+4, linesize);
+    av_image_fill_pointers(frm->data, pix_fmt_, FFALIGN(height_, height_align), frm->buf[0]->data, linesize);
+    std::copy(linesize, linesize+4, frm->linesize);
+    frm->extended_data = frm->data;
+    return r;
+}
+
+av::AudioSamples BufferPools::Pool::audioSamples(int nb_samples, int sample_rate) {
+    if (nb_samples > capacity_) {
+        throw Error("BUG: audio pool capacity " + std::to_string(capacity_) + " < " + std::to_string(nb_samples) + " samples");
+    }
+    av::AudioSamples r;
+    AVFrame* frm = r.raw();
+    frm->format = sample_fmt_;
+    frm->nb_samples = nb_samples;
+    frm->sample_rate = sample_rate;
+    setChannelLayout(frm, channel_layout_);
+    frm->buf[0] = get();
+    // planes are spaced by capacity, so a pool serves any frame size up to it;
+    // linesize is the plane size, consistent with that spacing
+    av_samples_fill_arrays(frm->data, &frm->linesize[0], frm->buf[0]->data, channels_, capacity_, sample_fmt_, 0);
+    frm->extended_data = frm->data;
+    return r;
+}
+
+nlohmann::json BufferPools::Pool::stats() const {
+    uint64_t gets = gets_.load(std::memory_order_relaxed);
+    uint64_t allocs = allocs_.load(std::memory_order_relaxed);
+    return {
+        { "format", description_ },
+        { "buffer_size", size_ },
+        { "gets", gets },
+        { "hits", gets > allocs ? gets - allocs : 0 },
+        { "misses", allocs },
+    };
+}
+
+void BufferPools::evictUnused() {
+    if (pools_.size() < max_pools_) return;
+    for (auto it = pools_.begin(); it != pools_.end();) {
+        // used by nobody but us
+        if (it->second.use_count() == 1) {
+            it = pools_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+std::shared_ptr<BufferPools::Pool> BufferPools::videoPool(AVPixelFormat pix_fmt, int width, int height) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pix_fmt);
+    if (desc == nullptr || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) || width <= 0 || height <= 0) {
+        return nullptr;
+    }
+    Key key { false, pix_fmt, width, height };
+    std::lock_guard<decltype(busy_)> lock(busy_);
+    auto it = pools_.find(key);
+    if (it != pools_.end()) {
+        return it->second;
+    }
+    auto pool = std::make_shared<Pool>();
+    if (av_image_fill_linesizes(pool->linesize_, pix_fmt, width) < 0) {
+        return nullptr;
+    }
+    for (int &ls: pool->linesize_) {
+        ls = FFALIGN(ls, linesize_align);
+    }
+    int linesize[4];
+    std::copy(pool->linesize_, pool->linesize_+4, linesize);
+    uint8_t* data[4];
+    int size = av_image_fill_pointers(data, pix_fmt, FFALIGN(height, height_align), nullptr, linesize);
+    if (size < 0) {
+        return nullptr;
+    }
+    pool->pix_fmt_ = pix_fmt;
+    pool->width_ = width;
+    pool->height_ = height;
+    pool->description_ = std::to_string(width) + "x" + std::to_string(height) + " " + desc->name;
+    pool->init(size + 16 + linesize_align);
+    evictUnused();
+    pools_[key] = pool;
+    return pool;
+}
+
+std::shared_ptr<BufferPools::Pool> BufferPools::audioPool(AVSampleFormat sample_fmt, uint64_t channel_layout, int nb_samples) {
+    int channels = av_popcount64(channel_layout);
+    if (sample_fmt == AV_SAMPLE_FMT_NONE || channels <= 0 || nb_samples <= 0
+        || (av_sample_fmt_is_planar(sample_fmt) && channels > AV_NUM_DATA_POINTERS)) {
+        // frames with more planes than AVFrame::data need extended_data allocation, not worth pooling
+        return nullptr;
+    }
+    int capacity = min_audio_capacity;
+    while (capacity < nb_samples) capacity *= 2;
+    Key key { true, sample_fmt, channel_layout, capacity };
+    std::lock_guard<decltype(busy_)> lock(busy_);
+    auto it = pools_.find(key);
+    if (it != pools_.end()) {
+        return it->second;
+    }
+    int size = av_samples_get_buffer_size(nullptr, channels, capacity, sample_fmt, 0);
+    if (size < 0) {
+        return nullptr;
+    }
+    auto pool = std::make_shared<Pool>();
+    pool->sample_fmt_ = sample_fmt;
+    pool->channel_layout_ = channel_layout;
+    pool->channels_ = channels;
+    pool->capacity_ = capacity;
+    pool->description_ = std::string(av_get_sample_fmt_name(sample_fmt)) + " " + channelLayoutName(channel_layout) + " " + std::to_string(capacity);
+    pool->init(size);
+    evictUnused();
+    pools_[key] = pool;
+    return pool;
+}
+
+nlohmann::json BufferPools::stats() {
+    std::lock_guard<decltype(busy_)> lock(busy_);
+    nlohmann::json pools = nlohmann::json::array();
+    uint64_t gets = 0, misses = 0;
+    for (auto &kv: pools_) {
+        nlohmann::json j = kv.second->stats();
+        gets += j["gets"].get<uint64_t>();
+        misses += j["misses"].get<uint64_t>();
+        pools.push_back(j);
+    }
+    return {
+        { "pools", pools },
+        { "gets", gets },
+        { "hits", gets - misses },
+        { "misses", misses },
+    };
+}
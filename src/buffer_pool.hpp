@@ -0,0 +1,145 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <avcpp/frame.h>
+#include <json.hpp>
+#include "util.hpp"
+#include "instance_shared.hpp"
+extern "C" {
+#include <libavutil/buffer.h>
+}
+
+// Registry of AVBufferPools for video frames and audio samples, keyed by format & geometry.
+// Nodes get it with InstanceSharedObjects<BufferPools>::get(instance, "default").
+// Buffers of frames which are no longer referenced anywhere go back to their pool
+// instead of being freed, so in steady state nodes don't malloc (and page fault) new frames.
+class BufferPools: public InstanceShared<BufferPools> {
+public:
+    // Buffers of the same size, for frames of one format & geometry.
+    class Pool {
+    protected:
+        friend class BufferPools;
+        AVBufferPool* pool_ = nullptr;
+        size_t size_ = 0;
+        std::string description_;
+        std::atomic_uint64_t gets_ {0};
+        std::atomic_uint64_t allocs_ {0};
+        // video
+        AVPixelFormat pix_fmt_ = AV_PIX_FMT_NONE;
+        int width_ = 0;
+        int height_ = 0;
+        int linesize_[4] = {0, 0, 0, 0};
+        // audio
+        AVSampleFormat sample_fmt_ = AV_SAMPLE_FMT_NONE;
+        uint64_t channel_layout_ = 0;
+        int channels_ = 0;
+        int capacity_ = 0; // samples per channel
+        void init(size_t size);
+        AVBufferRef* get();
+    public:
+        ~Pool();
+        av::VideoFrame videoFrame();
+        // nb_samples must not exceed the capacity the pool was created for
+        av::AudioSamples audioSamples(int nb_samples, int sample_rate);
+        int capacity() const {
+            return capacity_;
+        }
+        nlohmann::json stats() const;
+    };
+protected:
+    // (is_audio, format, width | channel_layout, height | capacity)
+    using Key = std::tuple<bool, int, uint64_t, int>;
+    static constexpr size_t max_pools_ = 64;
+    std::mutex busy_;
+    std::map<Key, std::shared_ptr<Pool>> pools_;
+    void evictUnused();
+public:
+    // nullptr if frames of this format can't be pooled (hardware frames)
+    std::shared_ptr<Pool> videoPool(AVPixelFormat pix_fmt, int width, int height);
+    std::shared_ptr<Pool> audioPool(AVSampleFormat sample_fmt, uint64_t channel_layout, int nb_samples);
+    nlohmann::json stats();
+};
+
+// "buffer_pool" node parameter: name of the registry ("default" if unspecified), false disables pooling
+inline std::shared_ptr<BufferPools> bufferPoolsFromParams(const InstanceData &instance, const Parameters &params) {
+    if (params.count("buffer_pool")==0) {
+        return InstanceSharedObjects<BufferPools>::get(instance, "default");
+    }
+    const Parameters &param = params["buffer_pool"];
+    if (param.is_boolean()) {
+        return param.get<bool>() ? InstanceSharedObjects<BufferPools>::get(instance, "default") : nullptr;
+    }
+    return InstanceSharedObjects<BufferPools>::get(instance, param.get<std::string>());
+}
+
+// Per-node allocation helpers: remember the pool of the last used format,
+// so that the registry is only searched (and locked) when the format changes.
+// They fall back to regular allocation if the format can't be pooled.
+class VideoFrameAllocator {
+protected:
+    std::shared_ptr<BufferPools> pools_;
+    std::shared_ptr<BufferPools::Pool> pool_;
+    AVPixelFormat pix_fmt_ = AV_PIX_FMT_NONE;
+    int width_ = 0;
+    int height_ = 0;
+public:
+    VideoFrameAllocator(std::shared_ptr<BufferPools> pools = nullptr): pools_(pools) {
+    }
+    void setPools(std::shared_ptr<BufferPools> pools) {
+        pools_ = pools;
+        pool_ = nullptr;
+        pix_fmt_ = AV_PIX_FMT_NONE;
+    }
+    av::VideoFrame alloc(const av::PixelFormat pix_fmt, const int width, const int height) {
+        if (!pools_) {
+            return av::VideoFrame(pix_fmt, width, height);
+        }
+        if (pix_fmt.get() != pix_fmt_ || width != width_ || height != height_) {
+            pool_ = pools_->videoPool(pix_fmt.get(), width, height);
+            pix_fmt_ = pix_fmt.get();
+            width_ = width;
+            height_ = height;
+        }
+        if (!pool_) {
+            return av::VideoFrame(pix_fmt, width, height);
+        }
+        return pool_->videoFrame();
+    }
+};
+
+class AudioSamplesAllocator {
+protected:
+    std::shared_ptr<BufferPools> pools_;
+    std::shared_ptr<BufferPools::Pool> pool_;
+    AVSampleFormat sample_fmt_ = AV_SAMPLE_FMT_NONE;
+    uint64_t channel_layout_ = 0;
+    int capacity_ = 0;
+public:
+    AudioSamplesAllocator(std::shared_ptr<BufferPools> pools = nullptr): pools_(pools) {
+    }
+    void setPools(std::shared_ptr<BufferPools> pools) {
+        pools_ = pools;
+        pool_ = nullptr;
+        sample_fmt_ = AV_SAMPLE_FMT_NONE;
+    }
+    av::AudioSamples alloc(const av::SampleFormat sample_fmt, const int nb_samples, const uint64_t channel_layout, const int sample_rate) {
+        if (!pools_ || nb_samples <= 0) {
+            return av::AudioSamples(sample_fmt, nb_samples, channel_layout, sample_rate);
+        }
+        if (sample_fmt.get() != sample_fmt_ || channel_layout != channel_layout_ || nb_samples > capacity_) {
+            pool_ = pools_->audioPool(sample_fmt.get(), channel_layout, nb_samples);
+            sample_fmt_ = sample_fmt.get();
+            channel_layout_ = channel_layout;
+            capacity_ = pool_ ? pool_->capacity() : 0;
+        }
+        if (!pool_) {
+            return av::AudioSamples(sample_fmt, nb_samples, channel_layout, sample_rate);
+        }
+        return pool_->audioSamples(nb_samples, sample_rate);
+    }
+};
@@ -0,0 +1,735 @@
+#include "edge_recording.hpp"
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/pixdesc.h>
+}
+#include "async_file_writer.hpp"
+#include "avutils.hpp"
+#include "graph_interfaces.hpp"
+#include "histogram.hpp"
+
+using namespace edge_recording;
+using nlohmann::json;
+
+namespace {
+    size_t alignUp(const size_t value, const size_t alignment = record_alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    std::string toHex(const uint8_t* data, const size_t size) {
+        static const char digits[] = "0123456789abcdef";
+        std::string r;
+        r.reserve(size * 2);
+        for (size_t i=0; i<size; i++) {
+            r += digits[data[i] >> 4];
+            r += digits[data[i] & 15];
+        }
+        return r;
+    }
+    std::vector<uint8_t> fromHex(const std::string &hex) {
+        std::vector<uint8_t> r(hex.size() / 2);
+        for (size_t i=0; i<r.size(); i++) {
+            r[i] = std::stoi(hex.substr(i*2, 2), nullptr, 16);
+        }
+        return r;
+    }
+    std::string rationalToString(const AVRational r) {
+        return std::to_string(r.num) + "/" + std::to_string(r.den);
+    }
+
+    json codecParametersToJson(const AVCodecParameters* cp) {
+        json r;
+        r["codec_type"] = int(cp->codec_type);
+        r["codec"] = avcodec_get_name(cp->codec_id);
+        r["codec_tag"] = cp->codec_tag;
+        r["extradata"] = toHex(cp->extradata, cp->extradata_size);
+        r["format"] = cp->format;
+        r["bit_rate"] = cp->bit_rate;
+        r["profile"] = cp->profile;
+        r["level"] = cp->level;
+        r["width"] = cp->width;
+        r["height"] = cp->height;
+        r["sample_aspect_ratio"] = rationalToString(cp->sample_aspect_ratio);
+        r["field_order"] = int(cp->field_order);
+        r["color_range"] = int(cp->color_range);
+        r["color_primaries"] = int(cp->color_primaries);
+        r["color_trc"] = int(cp->color_trc);
+        r["color_space"] = int(cp->color_space);
+        r["chroma_location"] = int(cp->chroma_location);
+        r["video_delay"] = cp->video_delay;
+        r["channel_layout"] = cp->channel_layout;
+        r["channels"] = cp->channels;
+        r["sample_rate"] = cp->sample_rate;
+        r["block_align"] = cp->block_align;
+        r["frame_size"] = cp->frame_size;
+        r["initial_padding"] = cp->initial_padding;
+        r["trailing_padding"] = cp->trailing_padding;
+        return r;
+    }
+    void codecParametersFromJson(const json &j, AVCodecParameters* cp) {
+        cp->codec_type = AVMediaType(j["codec_type"].get<int>());
+        const AVCodecDescriptor* desc = avcodec_descriptor_get_by_name(j["codec"].get<std::string>().c_str());
+        cp->codec_id = desc ? desc->id : AV_CODEC_ID_NONE;
+        cp->codec_tag = j["codec_tag"];
+        std::vector<uint8_t> extradata = fromHex(j["extradata"]);
+        if (!extradata.empty()) {
+            cp->extradata = static_cast<uint8_t*>(av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+            if (cp->extradata == nullptr) {
+                throw Error("Failed to allocate extradata");
+            }
+            memcpy(cp->extradata, extradata.data(), extradata.size());
+            cp->extradata_size = extradata.size();
+        }
+        cp->format = j["format"];
+        cp->bit_rate = j["bit_rate"];
+        cp->profile = j["profile"];
+        cp->level = j["level"];
+        cp->width = j["width"];
+        cp->height = j["height"];
+        cp->sample_aspect_ratio = parseRatio(j["sample_aspect_ratio"]).getValue();
+        cp->field_order = AVFieldOrder(j["field_order"].get<int>());
+        cp->color_range = AVColorRange(j["color_range"].get<int>());
+        cp->color_primaries = AVColorPrimaries(j["color_primaries"].get<int>());
+        cp->color_trc = AVColorTransferCharacteristic(j["color_trc"].get<int>());
+        cp->color_space = AVColorSpace(j["color_space"].get<int>());
+        cp->chroma_location = AVChromaLocation(j["chroma_location"].get<int>());
+        cp->video_delay = j["video_delay"];
+        cp->channel_layout = j["channel_layout"];
+        cp->channels = j["channels"];
+        cp->sample_rate = j["sample_rate"];
+        cp->block_align = j["block_align"];
+        cp->frame_size = j["frame_size"];
+        cp->initial_padding = j["initial_padding"];
+        cp->trailing_padding = j["trailing_padding"];
+    }
+    json streamToJson(av::Stream stream) {
+        json r;
+        AVStream* st = stream.raw();
+        r["index"] = st->index;
+        r["time_base"] = rationalToString(st->time_base);
+        r["avg_frame_rate"] = rationalToString(st->avg_frame_rate);
+        r["r_frame_rate"] = rationalToString(st->r_frame_rate);
+        r["codecpar"] = codecParametersToJson(st->codecpar);
+        return r;
+    }
+
+    // parameters which the replaying node reports to nodes after it
+    template<typename T> json describeEdge(std::shared_ptr<Edge<T>> edge);
+    template<> json describeEdge(std::shared_ptr<Edge<av::Packet>> edge) {
+        json streams = json::array();
+        std::shared_ptr<InputStreamMetadata> md = edge->template metadata<InputStreamMetadata>();
+        std::shared_ptr<IStreamsInput> input;
+        std::shared_ptr<IEncoder> encoder;
+        if (md) {
+            streams.push_back(streamToJson(md->source_stream));
+        } else if ((input = edge->template findNodeUp<IStreamsInput>())) {
+            for (size_t i=0; i<input->streamsCount(); i++) {
+                streams.push_back(streamToJson(input->stream(i)));
+            }
+        } else if ((encoder = edge->template findNodeUp<IEncoder>()) && encoder->codecParameters()) {
+            streams.push_back({ {"index", 0}, {"codecpar", codecParametersToJson(encoder->codecParameters())} });
+        } else {
+            logstream << "WARNING: no stream parameters found up the edge, replay won't be decodable";
+        }
+        return { {"streams", streams} };
+    }
+    template<> json describeEdge(std::shared_ptr<Edge<av::VideoFrame>> edge) {
+        json r = json::object();
+        if (auto vfs = edge->template findNodeUp<IVideoFormatSource>()) {
+            r["width"] = vfs->width();
+            r["height"] = vfs->height();
+            r["pixel_format"] = vfs->pixelFormat().name();
+        }
+        if (auto frs = edge->template findNodeUp<IFrameRateSource>()) {
+            r["frame_rate"] = rationalToString(frs->frameRate().getValue());
+        }
+        if (auto tbs = edge->template findNodeUp<ITimeBaseSource>()) {
+            r["time_base"] = rationalToString(tbs->timeBase().getValue());
+        }
+        return r;
+    }
+    template<> json describeEdge(std::shared_ptr<Edge<av::AudioSamples>> edge) {
+        json r = json::object();
+        if (auto ams = edge->template findNodeUp<IAudioMetadataSource>()) {
+            r["sample_rate"] = ams->sampleRate();
+            r["sample_format"] = ams->sampleFormat().name();
+            r["channel_layout"] = ams->channelLayout();
+        }
+        if (auto tbs = edge->template findNodeUp<ITimeBaseSource>()) {
+            r["time_base"] = rationalToString(tbs->timeBase().getValue());
+        }
+        return r;
+    }
+
+    // reject edges whose items describe() would refuse, when their format is already known,
+    // so that recording fails at start instead of skipping every item
+    template<typename T> void checkRecordable(std::shared_ptr<Edge<T>> edge) {
+    }
+    template<> void checkRecordable(std::shared_ptr<Edge<av::VideoFrame>> edge) {
+        if (auto vfs = edge->template findNodeUp<IVideoFormatSource>()) {
+            const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(vfs->pixelFormat().get());
+            if (desc != nullptr && (desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+                throw Error("Can't record frames in hardware pixel format " + std::string(desc->name));
+            }
+        }
+    }
+    template<> void checkRecordable(std::shared_ptr<Edge<av::AudioSamples>> edge) {
+        if (auto ams = edge->template findNodeUp<IAudioMetadataSource>()) {
+            size_t nplanes = ams->sampleFormat().isPlanar() ? av_get_channel_layout_nb_channels(ams->channelLayout()) : 1;
+            if (nplanes > max_planes) {
+                throw Error("Can't record audio with more than " + std::to_string(max_planes) + " planes, queue has " + std::to_string(nplanes));
+            }
+        }
+    }
+
+    template<typename T> constexpr MediaType mediaTypeOf();
+    template<> constexpr MediaType mediaTypeOf<av::Packet>() {
+        return MediaType::Packet;
+    }
+    template<> constexpr MediaType mediaTypeOf<av::VideoFrame>() {
+        return MediaType::Video;
+    }
+    template<> constexpr MediaType mediaTypeOf<av::AudioSamples>() {
+        return MediaType::Audio;
+    }
+
+    struct Plane {
+        const uint8_t* data;
+        size_t size;
+    };
+    struct SideData {
+        int type;
+        const uint8_t* data;
+        size_t size;
+    };
+
+    // fills RecordHeader fields and lists memory to be copied into the record
+    void describe(const av::Packet &item, RecordHeader &rh, std::vector<Plane> &planes, std::vector<SideData> &side_data) {
+        const AVPacket* raw = item.raw();
+        rh.dts = raw->dts;
+        rh.duration = raw->duration;
+        rh.packet_flags = raw->flags;
+        rh.stream_index = raw->stream_index;
+        planes.push_back({ raw->data, size_t(raw->size) });
+        for (int i=0; i<raw->side_data_elems; i++) {
+            side_data.push_back({ raw->side_data[i].type, raw->side_data[i].data, size_t(raw->side_data[i].size) });
+        }
+    }
+    void describeFrame(const AVFrame* raw, RecordHeader &rh, std::vector<SideData> &side_data) {
+        rh.format = raw->format;
+        rh.flags = (raw->key_frame ? KeyFrame : 0) | (raw->interlaced_frame ? Interlaced : 0) | (raw->top_field_first ? TopFieldFirst : 0);
+        for (int i=0; i<raw->nb_side_data; i++) {
+            side_data.push_back({ raw->side_data[i]->type, raw->side_data[i]->data, size_t(raw->side_data[i]->size) });
+        }
+    }
+    void describe(const av::VideoFrame &item, RecordHeader &rh, std::vector<Plane> &planes, std::vector<SideData> &side_data) {
+        const AVFrame* raw = item.raw();
+        describeFrame(raw, rh, side_data);
+        rh.stream_index = item.streamIndex();
+        rh.width = raw->width;
+        rh.height = raw->height;
+        rh.sar_num = raw->sample_aspect_ratio.num;
+        rh.sar_den = raw->sample_aspect_ratio.den;
+        rh.pict_type = raw->pict_type;
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(raw->format));
+        if (desc == nullptr || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+            throw Error("Can't record frames in hardware or unknown pixel format");
+        }
+        for (size_t p=0; p<max_planes && p<AV_NUM_DATA_POINTERS && raw->data[p]; p++) {
+            if (raw->linesize[p] <= 0) {
+                throw Error("Can't record frames with negative linesize");
+            }
+            size_t lines = (p==1 || p==2) ? AV_CEIL_RSHIFT(raw->height, desc->log2_chroma_h) : raw->height;
+            size_t size = (p==1 && (desc->flags & AV_PIX_FMT_FLAG_PAL)) ? 1024 : size_t(raw->linesize[p]) * lines;
+            rh.linesize[p] = raw->linesize[p];
+            planes.push_back({ raw->data[p], size });
+        }
+    }
+    void describe(const av::AudioSamples &item, RecordHeader &rh, std::vector<Plane> &planes, std::vector<SideData> &side_data) {
+        const AVFrame* raw = item.raw();
+        describeFrame(raw, rh, side_data);
+        rh.stream_index = item.streamIndex();
+        rh.nb_samples = raw->nb_samples;
+        rh.sample_rate = raw->sample_rate;
+        rh.channels = raw->channels;
+        rh.channel_layout = raw->channel_layout;
+        AVSampleFormat fmt = AVSampleFormat(raw->format);
+        bool planar = av_sample_fmt_is_planar(fmt);
+        size_t nplanes = planar ? raw->channels : 1;
+        if (nplanes > max_planes) {
+            throw Error("Can't record audio with more than " + std::to_string(max_planes) + " planes");
+        }
+        size_t size = size_t(raw->nb_samples) * av_get_bytes_per_sample(fmt) * (planar ? 1 : raw->channels);
+        for (size_t p=0; p<nplanes; p++) {
+            rh.linesize[p] = raw->linesize[0];
+            planes.push_back({ raw->extended_data[p], size });
+        }
+    }
+
+    template<typename T> size_t itemBytes(const T &item) {
+        size_t r = 0;
+        for (int i=0; i<AV_NUM_DATA_POINTERS && item.raw()->buf[i]; i++) {
+            r += item.raw()->buf[i]->size;
+        }
+        return r;
+    }
+    template<> size_t itemBytes(const av::Packet &item) {
+        return item.size();
+    }
+};
+
+template<typename T> class EdgeRecorderImpl: public EdgeRecorder, public std::enable_shared_from_this<EdgeRecorderImpl<T>> {
+protected:
+    struct Queued {
+        T item;
+        AVTS time_ns;
+        size_t bytes;
+    };
+    std::string path_;
+    int fd_ = -1;
+    uint64_t file_pos_ = 0;
+    std::vector<uint64_t> offsets_; // writer thread only, until stopped
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Queued> queue_;
+    size_t backlog_bytes_ = 0;
+    size_t max_backlog_bytes_;
+    size_t max_seen_backlog_bytes_ = 0;
+    bool blocking_;
+    std::shared_ptr<Edge<T>> edge_;
+    typename Edge<T>::WiretapId wiretap_;
+    bool stopping_ = false;
+    bool stopped_ = false;
+    AVTS first_ns_ = -1;
+    std::atomic_uint64_t records_ {0};
+    std::atomic_uint64_t written_bytes_ {0};
+    std::atomic_uint64_t skipped_ {0};
+    std::atomic_uint64_t dropped_ {0};
+    LogHistogram<> write_us_;
+    std::thread writer_;
+
+    void write(const char* data, const size_t size) {
+        AsyncFileWriter::writeAll(fd_, data, size, path_);
+        file_pos_ += size;
+    }
+    void writeRecord(const Queued &q, std::string &buf, std::vector<Plane> &planes, std::vector<SideData> &side_data) {
+        RecordHeader rh;
+        memset(&rh, 0, sizeof(rh));
+        planes.clear();
+        side_data.clear();
+        rh.time_ns = q.time_ns;
+        rh.pts = q.item.raw()->pts;
+        rh.dts = AV_NOPTS_VALUE;
+        rh.tb_num = q.item.timeBase().getNumerator();
+        rh.tb_den = q.item.timeBase().getDenominator();
+        describe(q.item, rh, planes, side_data);
+        // layout: header, side data, planes
+        size_t pos = sizeof(RecordHeader);
+        for (const SideData &sd: side_data) {
+            pos += sizeof(SideDataHeader) + alignUp(sd.size, 8);
+        }
+        size_t padding = std::is_same<T, av::Packet>::value ? AV_INPUT_BUFFER_PADDING_SIZE : 0;
+        for (size_t p=0; p<planes.size(); p++) {
+            pos = alignUp(pos);
+            rh.plane_offset[p] = pos;
+            rh.plane_size[p] = planes[p].size;
+            pos += planes[p].size + padding;
+        }
+        rh.planes = planes.size();
+        rh.side_data_count = side_data.size();
+        rh.size = alignUp(pos);
+        buf.assign(rh.size, '\0');
+        memcpy(&buf[0], &rh, sizeof(rh));
+        pos = sizeof(RecordHeader);
+        for (const SideData &sd: side_data) {
+            SideDataHeader sh { sd.type, uint32_t(sd.size) };
+            memcpy(&buf[pos], &sh, sizeof(sh));
+            pos += sizeof(sh);
+            if (sd.size > 0) {
+                memcpy(&buf[pos], sd.data, sd.size);
+            }
+            pos += alignUp(sd.size, 8);
+        }
+        for (size_t p=0; p<planes.size(); p++) {
+            if (planes[p].size > 0) {
+                memcpy(&buf[rh.plane_offset[p]], planes[p].data, planes[p].size);
+            }
+        }
+        offsets_.push_back(file_pos_);
+        write(buf.data(), buf.size());
+        records_.fetch_add(1, std::memory_order_relaxed);
+        written_bytes_.fetch_add(buf.size(), std::memory_order_relaxed);
+    }
+    void writerThread() {
+        std::deque<Queued> batch;
+        std::string buf;
+        std::vector<Plane> planes;
+        std::vector<SideData> side_data;
+        std::unique_lock<decltype(mutex_)> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this]() {
+                return !queue_.empty() || stopping_;
+            });
+            if (queue_.empty()) {
+                // stopping, everything written
+                break;
+            }
+            batch.swap(queue_);
+            lock.unlock();
+            for (Queued &q: batch) {
+                AVTS begin = wallclock.ns();
+                try {
+                    writeRecord(q, buf, planes, side_data);
+                } catch (std::exception &e) {
+                    logstream_limited(1) << "Recording " << path_ << " failed, skipping item: " << e.what();
+                    skipped_.fetch_add(1, std::memory_order_relaxed);
+                }
+                write_us_.record((wallclock.ns() - begin) / 1000);
+                {
+                    std::lock_guard<decltype(mutex_)> lock2(mutex_);
+                    backlog_bytes_ -= q.bytes;
+                }
+                cv_.notify_all();
+            }
+            batch.clear();
+            lock.lock();
+        }
+    }
+    void push(const T &item) {
+        size_t bytes = itemBytes(item);
+        AVTS now = wallclock.ns();
+        std::unique_lock<decltype(mutex_)> lock(mutex_);
+        // always accept into empty backlog, so that an item bigger than the budget doesn't block forever
+        auto accepts = [&]() {
+            return stopping_ || queue_.empty() || (backlog_bytes_ + bytes <= max_backlog_bytes_);
+        };
+        if (blocking_) {
+            cv_.wait(lock, accepts);
+        } else if (!accepts()) {
+            // don't stall the producer (possibly the event loop shared by many nodes) on a slow disk
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (stopping_) return;
+        if (first_ns_ < 0) {
+            first_ns_ = now;
+        }
+        queue_.push_back({ item, now - first_ns_, bytes });
+        backlog_bytes_ += bytes;
+        if (backlog_bytes_ > max_seen_backlog_bytes_) {
+            max_seen_backlog_bytes_ = backlog_bytes_;
+        }
+        lock.unlock();
+        cv_.notify_all();
+    }
+public:
+    EdgeRecorderImpl(const std::string path, const json &info, const size_t max_backlog_bytes, const bool blocking): path_(path), max_backlog_bytes_(max_backlog_bytes), blocking_(blocking) {
+        fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            throw Error("open " + path + ": " + strerror(errno));
+        }
+        std::string info_str = info.dump();
+        FileHeader fh;
+        memset(&fh, 0, sizeof(fh));
+        memcpy(fh.magic, file_magic, sizeof(fh.magic));
+        fh.version = format_version;
+        fh.media_type = uint32_t(mediaTypeOf<T>());
+        fh.info_size = info_str.size();
+        fh.header_size = alignUp(sizeof(fh) + info_str.size(), 4096);
+        std::string header(fh.header_size, '\0');
+        memcpy(&header[0], &fh, sizeof(fh));
+        memcpy(&header[sizeof(fh)], info_str.data(), info_str.size());
+        try {
+            write(header.data(), header.size());
+        } catch (...) {
+            close(fd_);
+            throw;
+        }
+        writer_ = start_thread("edge recorder", [this]() {
+            writerThread();
+        });
+    }
+    void attach(std::shared_ptr<Edge<T>> edge) {
+        std::weak_ptr<EdgeRecorderImpl<T>> weak = this->shared_from_this();
+        // removed in stop(), but the producer may still be calling it then
+        edge_ = edge;
+        wiretap_ = edge->addWiretapCallback([weak](const T &item) {
+            std::shared_ptr<EdgeRecorderImpl<T>> recorder = weak.lock();
+            if (recorder) {
+                recorder->push(item);
+            }
+        });
+    }
+    virtual void stop() {
+        {
+            std::lock_guard<decltype(mutex_)> lock(mutex_);
+            if (stopping_) return;
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        if (edge_) {
+            edge_->removeWiretapCallback(wiretap_);
+            edge_ = nullptr;
+        }
+        if (writer_.joinable()) {
+            writer_.join();
+        }
+        try {
+            IndexTrailer trailer;
+            memset(&trailer, 0, sizeof(trailer));
+            trailer.index_offset = file_pos_;
+            trailer.count = offsets_.size();
+            memcpy(trailer.magic, index_magic, sizeof(trailer.magic));
+            write(reinterpret_cast<const char*>(offsets_.data()), offsets_.size() * sizeof(uint64_t));
+            write(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+        } catch (std::exception &e) {
+            logstream << "Writing index of " << path_ << " failed: " << e.what();
+        }
+        close(fd_);
+        fd_ = -1;
+        std::lock_guard<decltype(mutex_)> lock(mutex_);
+        stopped_ = true;
+    }
+    virtual json stats() {
+        json r;
+        r["path"] = path_;
+        r["records"] = records_.load(std::memory_order_relaxed);
+        r["written_bytes"] = written_bytes_.load(std::memory_order_relaxed);
+        r["skipped"] = skipped_.load(std::memory_order_relaxed);
+        r["dropped"] = dropped_.load(std::memory_order_relaxed);
+        {
+            std::lock_guard<decltype(mutex_)> lock(mutex_);
+            r["recording"] = !stopped_;
+            r["backlog_items"] = queue_.size();
+            r["backlog_bytes"] = backlog_bytes_;
+            r["max_backlog_bytes"] = max_seen_backlog_bytes_;
+        }
+        r["write_us"] = write_us_.toJson();
+        r["write_us"].erase("buckets");
+        return r;
+    }
+    virtual ~EdgeRecorderImpl() {
+        stop();
+    }
+};
+
+template<typename T> static std::shared_ptr<EdgeRecorder> startRecorder(EdgeManager &edges, const std::string &edge_name, const std::string &path, const size_t max_backlog_bytes, const bool blocking) {
+    std::shared_ptr<Edge<T>> edge = edges.find<T>(edge_name);
+    checkRecordable<T>(edge);
+    auto r = std::make_shared<EdgeRecorderImpl<T>>(path, describeEdge<T>(edge), max_backlog_bytes, blocking);
+    r->attach(edge);
+    logstream << "Recording edge " << edge_name << " to " << path;
+    return r;
+}
+
+std::shared_ptr<EdgeRecorder> EdgeRecorder::start(EdgeManager &edges, const std::string edge_name, const std::string path, const size_t max_backlog_bytes, const bool blocking) {
+    if (edges.exists<av::Packet>(edge_name)) {
+        return startRecorder<av::Packet>(edges, edge_name, path, max_backlog_bytes, blocking);
+    } else if (edges.exists<av::VideoFrame>(edge_name)) {
+        return startRecorder<av::VideoFrame>(edges, edge_name, path, max_backlog_bytes, blocking);
+    } else if (edges.exists<av::AudioSamples>(edge_name)) {
+        return startRecorder<av::AudioSamples>(edges, edge_name, path, max_backlog_bytes, blocking);
+    } else {
+        throw Error("No queue " + edge_name);
+    }
+}
+
+RecordingFile::RecordingFile(const std::string path) {
+    fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0) {
+        throw Error("open " + path + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd_, &st) < 0 || size_t(st.st_size) < sizeof(FileHeader)) {
+        close(fd_);
+        throw Error(path + " is not a recording");
+    }
+    size_ = st.st_size;
+    void* map = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (map == MAP_FAILED) {
+        close(fd_);
+        throw Error("mmap " + path + ": " + strerror(errno));
+    }
+    map_ = static_cast<const uint8_t*>(map);
+    const FileHeader &fh = *reinterpret_cast<const FileHeader*>(map_);
+    if (memcmp(fh.magic, file_magic, sizeof(fh.magic)) != 0 || fh.version != format_version
+        || fh.header_size > size_ || sizeof(FileHeader) + fh.info_size > fh.header_size) {
+        munmap(const_cast<uint8_t*>(map_), size_);
+        close(fd_);
+        throw Error(path + " is not a recording or has unsupported version");
+    }
+    media_type_ = MediaType(fh.media_type);
+    info_ = json::parse(reinterpret_cast<const char*>(map_) + sizeof(FileHeader), reinterpret_cast<const char*>(map_) + sizeof(FileHeader) + fh.info_size);
+
+    if (size_ >= fh.header_size + sizeof(IndexTrailer)) {
+        const IndexTrailer &trailer = *reinterpret_cast<const IndexTrailer*>(map_ + size_ - sizeof(IndexTrailer));
+        if (memcmp(trailer.magic, index_magic, sizeof(trailer.magic)) == 0
+            && trailer.index_offset + trailer.count * sizeof(uint64_t) + sizeof(IndexTrailer) == size_) {
+            const uint64_t* index = reinterpret_cast<const uint64_t*>(map_ + trailer.index_offset);
+            offsets_.assign(index, index + trailer.count);
+            complete_ = true;
+        }
+    }
+    if (!complete_) {
+        logstream << path << " has no index (recording not stopped?), scanning records";
+        uint64_t pos = fh.header_size;
+        while (pos + sizeof(RecordHeader) <= size_) {
+            const RecordHeader &rh = *reinterpret_cast<const RecordHeader*>(map_ + pos);
+            if (rh.size < sizeof(RecordHeader) || rh.size % record_alignment || pos + rh.size > size_ || rh.planes > max_planes) break;
+            offsets_.push_back(pos);
+            pos += rh.size;
+        }
+    }
+}
+
+RecordingFile::~RecordingFile() {
+    munmap(const_cast<uint8_t*>(map_), size_);
+    close(fd_);
+}
+
+const RecordHeader& RecordingFile::record(const size_t i) const {
+    return *reinterpret_cast<const RecordHeader*>(map_ + offsets_.at(i));
+}
+
+void RecordingFile::preload() {
+    madvise(const_cast<uint8_t*>(map_), size_, MADV_WILLNEED);
+    volatile uint8_t sum = 0;
+    for (size_t pos = 0; pos < size_; pos += 4096) {
+        sum += map_[pos];
+    }
+}
+
+void RecordingFile::addStreams(AVFormatContext* ctx) {
+    const json &streams = info_["streams"];
+    int count = 0;
+    for (const json &js: streams) {
+        count = std::max(count, js["index"].get<int>() + 1);
+    }
+    for (int i=0; i<count; i++) {
+        AVStream* st = avformat_new_stream(ctx, nullptr);
+        if (st == nullptr) {
+            throw Error("Failed to add stream");
+        }
+        st->codecpar->codec_type = AVMEDIA_TYPE_DATA;
+        // streams not described in the recording get time base of their first packet
+        for (size_t r=0; r<offsets_.size(); r++) {
+            const RecordHeader &rh = record(r);
+            if (rh.stream_index == i) {
+                st->time_base = { rh.tb_num, rh.tb_den };
+                break;
+            }
+        }
+    }
+    for (const json &js: streams) {
+        AVStream* st = ctx->streams[js["index"].get<int>()];
+        codecParametersFromJson(js["codecpar"], st->codecpar);
+        if (js.count("time_base")) {
+            st->time_base = parseRatio(js["time_base"]).getValue();
+            st->avg_frame_rate = parseRatio(js["avg_frame_rate"]).getValue();
+            st->r_frame_rate = parseRatio(js["r_frame_rate"]).getValue();
+        }
+    }
+}
+
+AVBufferRef* RecordingFile::wrap(const uint8_t* data, const size_t size) {
+    // every buffer keeps the mapping alive
+    auto holder = new std::shared_ptr<RecordingFile>(shared_from_this());
+    AVBufferRef* r = av_buffer_create(const_cast<uint8_t*>(data), size, [](void* opaque, uint8_t*) {
+        delete static_cast<std::shared_ptr<RecordingFile>*>(opaque);
+    }, holder, AV_BUFFER_FLAG_READONLY);
+    if (r == nullptr) {
+        delete holder;
+        throw Error("Failed to allocate buffer reference");
+    }
+    return r;
+}
+
+template<typename T> void RecordingFile::fillFrame(const RecordHeader &rh, T &frame) {
+    const uint8_t* base = reinterpret_cast<const uint8_t*>(&rh);
+    frame = T();
+    // before timestamps, so that they aren't rescaled
+    frame.setTimeBase(av::Rational(rh.tb_num, rh.tb_den));
+    frame.setStreamIndex(rh.stream_index);
+    AVFrame* raw = frame.raw();
+    raw->format = rh.format;
+    raw->pts = rh.pts;
+    raw->key_frame = (rh.flags & KeyFrame) ? 1 : 0;
+    raw->interlaced_frame = (rh.flags & Interlaced) ? 1 : 0;
+    raw->top_field_first = (rh.flags & TopFieldFirst) ? 1 : 0;
+    for (uint32_t p=0; p<rh.planes; p++) {
+        raw->buf[p] = wrap(base + rh.plane_offset[p], rh.plane_size[p]);
+        raw->data[p] = raw->buf[p]->data;
+        raw->linesize[p] = rh.linesize[p];
+    }
+    raw->extended_data = raw->data;
+    const uint8_t* pos = base + sizeof(RecordHeader);
+    for (uint32_t i=0; i<rh.side_data_count; i++) {
+        const SideDataHeader &sh = *reinterpret_cast<const SideDataHeader*>(pos);
+        pos += sizeof(SideDataHeader);
+        AVFrameSideData* sd = av_frame_new_side_data(raw, AVFrameSideDataType(sh.type), sh.size);
+        if (sd == nullptr) {
+            throw Error("Failed to allocate side data");
+        }
+        memcpy(sd->data, pos, sh.size);
+        pos += alignUp(sh.size, 8);
+    }
+    frame.setComplete(true);
+}
+
+void RecordingFile::get(const size_t i, av::Packet &pkt) {
+    const RecordHeader &rh = record(i);
+    const uint8_t* base = map_ + offsets_[i];
+    pkt = av::Packet();
+    pkt.setTimeBase(av::Rational(rh.tb_num, rh.tb_den));
+    AVPacket* raw = pkt.raw();
+    if (rh.planes > 0) {
+        raw->buf = wrap(base + rh.plane_offset[0], rh.plane_size[0] + AV_INPUT_BUFFER_PADDING_SIZE);
+        raw->data = raw->buf->data;
+        raw->size = rh.plane_size[0];
+    }
+    raw->pts = rh.pts;
+    raw->dts = rh.dts;
+    raw->duration = rh.duration;
+    raw->flags = rh.packet_flags;
+    raw->stream_index = rh.stream_index;
+    const uint8_t* pos = base + sizeof(RecordHeader);
+    for (uint32_t s=0; s<rh.side_data_count; s++) {
+        const SideDataHeader &sh = *reinterpret_cast<const SideDataHeader*>(pos);
+        pos += sizeof(SideDataHeader);
+        uint8_t* sd = av_packet_new_side_data(raw, AVPacketSideDataType(sh.type), sh.size);
+        if (sd == nullptr) {
+            throw Error("Failed to allocate side data");
+        }
+        memcpy(sd, pos, sh.size);
+        pos += alignUp(sh.size, 8);
+    }
+    pkt.setComplete(true);
+}
+
+void RecordingFile::get(const size_t i, av::VideoFrame &frame) {
+    const RecordHeader &rh = record(i);
+    fillFrame(rh, frame);
+    AVFrame* raw = frame.raw();
+    raw->width = rh.width;
+    raw->height = rh.height;
+    raw->sample_aspect_ratio = { rh.sar_num, rh.sar_den };
+    raw->pict_type = AVPictureType(rh.pict_type);
+}
+
+void RecordingFile::get(const size_t i, av::AudioSamples &samples) {
+    const RecordHeader &rh = record(i);
+    fillFrame(rh, samples);
+    AVFrame* raw = samples.raw();
+    raw->nb_samples = rh.nb_samples;
+    raw->sample_rate = rh.sample_rate;
+    raw->channels = rh.channels;
+    raw->channel_layout = rh.channel_layout;
+}
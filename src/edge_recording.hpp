@@ -0,0 +1,138 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <json.hpp>
+#include <avcpp/packet.h>
+#include <avcpp/frame.h>
+
+#include "graph_core.hpp"
+
+// Recording of items passing through an edge, for replaying them (`replay` node)
+// to benchmark a part of the graph with exactly the same input.
+//
+// File layout, all integers little-endian (native):
+//   FileHeader, info JSON (stream / format parameters), zero padding to header_size
+//   records, each: RecordHeader, side data entries, payload planes;
+//     records and planes are aligned to record_alignment, packet payloads are followed by
+//     zeroed AV_INPUT_BUFFER_PADDING_SIZE, so the file can be mmapped and its memory
+//     used directly as packet / frame data
+//   index: record offsets (uint64_t), IndexTrailer - written when recording stops;
+//     without them (recording interrupted) records are found by walking their sizes
+namespace edge_recording {
+    constexpr char file_magic[8] = {'A', 'V', 'P', 'L', 'R', 'E', 'C', '1'};
+    constexpr char index_magic[8] = {'A', 'V', 'P', 'L', 'I', 'D', 'X', '1'};
+    constexpr uint32_t format_version = 1;
+    constexpr size_t record_alignment = 64;
+    constexpr size_t max_planes = 8;
+
+    enum class MediaType: uint32_t {
+        Packet = 0,
+        Video = 1,
+        Audio = 2,
+    };
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t media_type;
+        uint64_t header_size; // offset of the first record
+        uint64_t info_size; // JSON directly after FileHeader
+    };
+
+    enum RecordFlags: uint32_t {
+        KeyFrame = 1, // frames only, packets have AVPacket flags in packet_flags
+        Interlaced = 2,
+        TopFieldFirst = 4,
+    };
+
+    struct RecordHeader {
+        uint64_t size; // of the whole record, multiple of record_alignment
+        int64_t time_ns; // wallclock time of enqueueing, since the first record
+        int64_t pts;
+        int64_t dts; // packets only
+        int64_t duration;
+        int32_t tb_num, tb_den;
+        int32_t stream_index;
+        int32_t packet_flags;
+        uint32_t flags; // RecordFlags
+        int32_t format; // AVPixelFormat or AVSampleFormat
+        int32_t width, height; // video
+        int32_t nb_samples, sample_rate, channels; // audio
+        uint64_t channel_layout;
+        int32_t sar_num, sar_den;
+        int32_t pict_type;
+        uint32_t side_data_count; // SideDataHeader + data (padded to 8 bytes) each, after RecordHeader
+        uint32_t planes;
+        uint32_t plane_size[max_planes]; // packets: 1 plane, without padding
+        uint64_t plane_offset[max_planes]; // since record start
+        int32_t linesize[max_planes];
+    };
+
+    struct SideDataHeader {
+        int32_t type; // AVPacketSideDataType or AVFrameSideDataType
+        uint32_t size;
+    };
+
+    struct IndexTrailer {
+        uint64_t index_offset;
+        uint64_t count;
+        char magic[8];
+    };
+};
+
+// Wiretap on an edge, serializing items in its own thread.
+// Items wait in a byte-budgeted backlog. When it's full, items are dropped (counted in stats),
+// or with blocking = true the producer of the edge blocks, so that the recording is complete.
+class EdgeRecorder {
+public:
+    virtual void stop() = 0;
+    virtual nlohmann::json stats() = 0;
+    virtual ~EdgeRecorder() {
+    }
+    // edge of any type
+    static std::shared_ptr<EdgeRecorder> start(EdgeManager &edges, const std::string edge_name, const std::string path, const size_t max_backlog_bytes = 256*1024*1024, const bool blocking = false);
+};
+
+// Memory-mapped recording. Packets and frames returned by it reference the mapping,
+// which is kept until all of them are freed.
+class RecordingFile: public std::enable_shared_from_this<RecordingFile> {
+protected:
+    int fd_ = -1;
+    const uint8_t* map_ = nullptr;
+    size_t size_ = 0;
+    edge_recording::MediaType media_type_;
+    nlohmann::json info_;
+    std::vector<uint64_t> offsets_;
+    bool complete_ = false;
+    AVBufferRef* wrap(const uint8_t* data, const size_t size);
+    template<typename T> void fillFrame(const edge_recording::RecordHeader &rh, T &frame);
+public:
+    RecordingFile(const std::string path);
+    virtual ~RecordingFile();
+    edge_recording::MediaType mediaType() const {
+        return media_type_;
+    }
+    const nlohmann::json& info() const {
+        return info_;
+    }
+    size_t count() const {
+        return offsets_.size();
+    }
+    // index was found, recording was stopped properly
+    bool complete() const {
+        return complete_;
+    }
+    size_t fileSize() const {
+        return size_;
+    }
+    const edge_recording::RecordHeader& record(const size_t i) const;
+    // read all pages, so that replaying doesn't wait for disk
+    void preload();
+    // packet recordings: adds streams with recorded codec parameters, at recorded indices
+    void addStreams(AVFormatContext* ctx);
+    void get(const size_t i, av::Packet &pkt);
+    void get(const size_t i, av::VideoFrame &frame);
+    void get(const size_t i, av::AudioSamples &samples);
+};
@@ -145,6 +145,14 @@ public:
             }
         });
     }
+    virtual void forEachSinkEdge(std::function<void(EdgeBase&)> cb) override {
+        forEachOutput([&cb](Sink<OutputType>* sink_a) {
+            EdgeSink<OutputType>* sink = dynamic_cast<EdgeSink<OutputType>*>(sink_a);
+            if (sink) {
+                cb(*sink->edge());
+            }
+        });
+    }
 };
 
 template<typename OutputType> class NodeSingleOutput: virtual public NodeWithOutputs<OutputType>, virtual public IInitAfterCreate {
@@ -189,13 +197,16 @@ public:
     using SinkType = Sink<OutputType>;
 protected:
     std::vector<std::shared_ptr<Edge<OutputType>>> sink_edges_;
-    void createSinksFromParameters(EdgeManager &edges, const Parameters &params) {
+    // register_as_producer = false if the caller sets producers of the edges itself
+    void createSinksFromParameters(EdgeManager &edges, const Parameters &params, const bool register_as_producer = true) {
         std::list<std::string> edge_names = jsonToStringList(params["dst"]);
         sink_edges_.reserve(edge_names.size());
         for (const std::string &outname: edge_names) {
             auto out_edge = edges.find<OutputType>(outname);
             sink_edges_.push_back(out_edge);
-            out_edge->setProducer(this->shared_from_this());
+            if (register_as_producer) {
+                out_edge->setProducer(this->shared_from_this());
+            }
         }
     }
 public:
@@ -229,7 +240,7 @@ public:
     }
 };
 
-template <typename T> class TransparentNode: public NodeSISO<T, T> {
+template <typename T> class TransparentNode: public NodeSISO<T, T>, public IWorkerPoolSafe {
 public:
     using NodeSISO<T, T>::NodeSISO;
     virtual void process() {
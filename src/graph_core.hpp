@@ -6,10 +6,14 @@
 #include <mutex>
 #include <readerwriterqueue/readerwriterqueue.h>
 #include <unordered_map>
+#include <iterator>
+#include <vector>
 #include "Event.hpp"
 #include "instance.hpp"
 #include "EventLoop.hpp"
 #include "edge_meta_utils.hpp"
+#include "histogram.hpp"
+#include "trace.hpp"
 
 class EdgeBase;
 
@@ -23,6 +27,8 @@ public:
     virtual std::shared_ptr<EdgeBase> sourceEdge() {
         return {};
     }
+    virtual void forEachSinkEdge(std::function<void(EdgeBase&)>) {
+    }
     /*virtual std::weak_ptr<Node> sinkNode() {
         return {};
     }*/
@@ -36,6 +42,7 @@ protected:
     std::shared_ptr<EventLoop> event_loop_ = nullptr;
     std::mutex process_mutex_;
     bool tickful_;
+    const char* trace_name_ = "nonblocking";
     #define processInEventLoop(how, ...) \
         if (event_loop_==nullptr) { \
             logstream << "BUG: event_loop_ unset, can't use!"; \
@@ -66,6 +73,9 @@ protected:
     }
     #undef processInEventLoop
 public:
+    void setTraceName(const char* name) {
+        trace_name_ = name;
+    }
     void setEventLoop(std::shared_ptr<EventLoop> event_loop, bool tickful) {
         event_loop_ = event_loop;
         tickful_ = tickful;
@@ -79,6 +89,7 @@ public:
     void wrappedProcessNonBlocking(EventLoop& evl, bool ticks) {
         std::lock_guard<decltype(process_mutex_)> lock(process_mutex_);
         if (!this->nonblk_should_work_) return;
+        TRACE_SPAN(span, trace_name_, "nonblocking");
         processNonBlocking(evl, ticks);
     }
     void prohibitProcessNonBlocking() {
@@ -102,6 +113,17 @@ public:
     virtual T* peek(const int timeout_ms = -1) = 0;
     virtual bool tryPeek(T& dest, const int timeout_ms = -1) = 0;
     virtual bool pop() = 0;
+    // append up to max_count items to dest, waiting (up to timeout_ms) only for the first one.
+    // returns number of items appended
+    virtual size_t get_many(std::vector<T> &dest, const size_t max_count, const int timeout_ms = -1) {
+        size_t n = 0;
+        T data;
+        while (n < max_count && tryGet(data, n==0 ? timeout_ms : 0)) {
+            dest.push_back(std::move(data));
+            n++;
+        }
+        return n;
+    }
     virtual ~Source() {
     }
 };
@@ -109,6 +131,14 @@ template <typename T> class Sink {
 public:
     using DataType = T;
     virtual bool put(const T&, bool = false) = 0;
+    // returns number of items put, may be less than items.size() only if drop_if_full
+    virtual size_t put_many(const std::vector<T> &items, bool drop_if_full = false) {
+        size_t n = 0;
+        for (const T &item: items) {
+            if (put(item, drop_if_full)) n++;
+        }
+        return n;
+    }
     virtual ~Sink() {
     }
 };
@@ -132,6 +162,7 @@ template <typename T> class EdgeSource: public Source<T>, public EdgeWrapper<T>
 public:
     using EdgeWrapper<T>::EdgeWrapper;
     virtual T get(const int timeout_ms = -1) {
+        TRACE_SPAN(span, this->edge_->traceName(), "get");
         T data;
         if (timeout_ms < 0) {
             this->edge_->wait_dequeue(data);
@@ -141,6 +172,7 @@ public:
         return data;
     };
     virtual bool tryGet(T& dest, const int timeout_ms = -1) {
+        TRACE_SPAN(span, this->edge_->traceName(), "get");
         if (timeout_ms < 0) {
             this->edge_->wait_dequeue(dest);
             return true;
@@ -161,20 +193,27 @@ public:
         }
     }
     virtual bool pop() {
+        TRACE_INSTANT(this->edge_->traceName(), "pop");
         return this->edge_->pop();
     }
+    virtual size_t get_many(std::vector<T> &dest, const size_t max_count, const int timeout_ms = -1) {
+        TRACE_SPAN(span, this->edge_->traceName(), "get");
+        return this->edge_->wait_dequeue_many(dest, max_count, timeout_ms);
+    }
 };
 
 template <typename T> class EdgeSink: public Sink<T>, public EdgeWrapper<T> {
 public:
     using EdgeWrapper<T>::EdgeWrapper;
     virtual bool put(const T &data, bool drop_if_full = false) {
+        TRACE_SPAN(span, this->edge_->traceName(), "put");
         if (!data.pts()) {
-            logstream << "Warning: putting NOPTS into sink";
+            logstream_limited(5) << "Warning: putting NOPTS into sink";
         }
         if (drop_if_full) {
             if (!this->edge_->try_enqueue(data)) {
-                logstream << "Enqueue failed, queue full, dropping!";
+                this->edge_->countDrops(1);
+                logstream_limited(5) << "Enqueue failed, queue full, dropping!";
                 return false;
             } else {
                 return true;
@@ -184,6 +223,36 @@ public:
             return true;
         }
     };
+    virtual size_t put_many(const std::vector<T> &items, bool drop_if_full = false) {
+        return putMany(items, items.begin(), items.end(), drop_if_full);
+    }
+    // Like put_many, but moves items into the queue instead of copying them.
+    // Contents of items are unspecified afterwards.
+    size_t put_many(std::vector<T> &&items, bool drop_if_full = false) {
+        return putMany(items, std::make_move_iterator(items.begin()), std::make_move_iterator(items.end()), drop_if_full);
+    }
+protected:
+    template<typename It> size_t putMany(const std::vector<T> &items, It begin, It end, bool drop_if_full) {
+        TRACE_SPAN(span, this->edge_->traceName(), "put");
+        for (const T &data: items) {
+            if (!data.pts()) {
+                logstream_limited(5) << "Warning: putting NOPTS into sink";
+                break;
+            }
+        }
+        const size_t count = items.size();
+        if (drop_if_full) {
+            size_t n = this->edge_->try_enqueue_many(begin, end);
+            if (n < count) {
+                this->edge_->countDrops(count - n);
+                logstream_limited(5) << "Enqueue failed, queue full, dropping " << (count-n) << " of " << count << "!";
+            }
+            return n;
+        } else {
+            this->edge_->enqueue_many(begin, end);
+            return count;
+        }
+    }
 };
 
 class EdgeBase: public std::enable_shared_from_this<EdgeBase> {
@@ -197,6 +266,19 @@ protected:
     std::atomic_bool finish_consumer_{false};
     av::Timestamp last_ts_ = NOTS;
 
+    // statistics, updated lock-free on every enqueue/dequeue:
+    LogHistogram<> dwell_us_; // time between enqueue and dequeue of each item
+    LogHistogram<4> occupancy_; // number of queued items, weighted by time (ns) spent at this level
+    std::atomic<AVTS> occupancy_since_ {wallclock.ns()};
+    std::atomic_uint64_t drops_ {0};
+    const char* trace_name_ = "?";
+    void occupancyChanged(const int prev_occupied, const AVTS now) {
+        AVTS since = occupancy_since_.exchange(now, std::memory_order_relaxed);
+        if (now > since && prev_occupied >= 0) {
+            occupancy_.record(prev_occupied, now - since);
+        }
+    }
+
     static void setNodePointer(std::weak_ptr<Node> &dest, std::weak_ptr<Node> source, std::atomic_bool &flag_to_reset) {
         // TODO? here we don't protect against race conditions but they won't happen anyway
         // unless someone really screws up the graph and uses the same node name in different groups
@@ -229,6 +311,12 @@ public:
     av::Timestamp lastTS() {
         return last_ts_;
     }
+    Event& producedEvent() {
+        return produced_;
+    }
+    Event& consumedEvent() {
+        return consumed_;
+    }
     template<typename MD> std::shared_ptr<MD> metadata(bool create_if_empty = false) {
         // TODO? race conditions as in setNodePointer
         for (std::shared_ptr<EdgeMetadata> &mdptr: metadata_) {
@@ -253,6 +341,7 @@ public:
             std::shared_ptr<Node> node = edge->producer().lock();
             if (node==nullptr) return nullptr;
             edge = node->sourceEdge();
+            if (edge==nullptr) return nullptr; // source node or node with many inputs
             md = edge->metadata<MD>();
         }
     }
@@ -274,8 +363,46 @@ public:
             node_shr = node_shr->sourceNode().lock();
         } while(true);
     }
+    void setTraceName(const std::string &name) {
+        trace_name_ = trace::intern(name);
+    }
+    const char* traceName() const {
+        return trace_name_;
+    }
+    void countDrops(const size_t count) {
+        drops_.fetch_add(count, std::memory_order_relaxed);
+    }
+    // {"occupied": ..., "drops": ..., "dwell_us": {histogram}, "occupancy": {histogram weighted by ns}}
+    nlohmann::json statsJson() {
+        // account the time spent at current level up to now:
+        occupancyChanged(occupied(), wallclock.ns());
+        nlohmann::json r;
+        r["occupied"] = occupied();
+        r["drops"] = drops_.load(std::memory_order_relaxed);
+        r["dwell_us"] = dwell_us_.toJson();
+        r["occupancy"] = occupancy_.toJson();
+        return r;
+    }
+    // statistics between two statsJson() results, for readers which must not resetStats() shared edges
+    static nlohmann::json statsJsonSince(const nlohmann::json &now, const nlohmann::json &before) {
+        nlohmann::json r = now;
+        if (!before.is_object()) {
+            return r;
+        }
+        uint64_t drops = now["drops"];
+        r["drops"] = drops - std::min(drops, before["drops"].get<uint64_t>());
+        r["dwell_us"] = decltype(dwell_us_)::jsonSince(now["dwell_us"], before["dwell_us"]);
+        r["occupancy"] = decltype(occupancy_)::jsonSince(now["occupancy"], before["occupancy"]);
+        return r;
+    }
+    void resetStats() {
+        dwell_us_.reset();
+        occupancy_.reset();
+        drops_.store(0, std::memory_order_relaxed);
+    }
     virtual void waitEmpty() = 0;
     virtual int occupied() = 0;
+    virtual int free() = 0;
     virtual ~EdgeBase() {
     }
 };
@@ -283,12 +410,35 @@ public:
 template<typename T> class Edge: public EdgeBase {
 public:
     using WiretapCallback = std::function<void(const T&)>;
+    using WiretapId = uint64_t;
     static constexpr size_t default_capacity = 63;
 protected:
     moodycamel::ReaderWriterQueue<T> queue_;
     int queue_limit_;
-    std::list<WiretapCallback> wiretap_callbacks_;
+    struct Wiretap {
+        WiretapId id;
+        WiretapCallback cb;
+    };
+    using Wiretaps = std::vector<Wiretap>;
+    // replaced as a whole (copy on write) when a callback is added or removed from the control thread,
+    // so that the producer can iterate it without locking
+    std::shared_ptr<const Wiretaps> wiretap_callbacks_;
+    std::atomic_bool has_wiretaps_{false};
+    std::mutex wiretaps_busy_;
+    WiretapId next_wiretap_id_ = 0;
     std::atomic_int occupied_{0};
+    // enqueue times (wallclock.ns()) of queued items, indexed by sequence number.
+    // written only by producer, read only by consumer, ordered by the queue itself
+    std::vector<AVTS> enqueue_times_;
+    size_t enqueue_times_mask_;
+    uint64_t enqueued_seq_ = 0;
+    uint64_t dequeued_seq_ = 0;
+    static size_t enqueueTimesSize(const size_t capacity) {
+        // ReaderWriterQueue may round its capacity up, up to its block size (512)
+        size_t r = 1;
+        while (r < capacity + 513) r <<= 1;
+        return r;
+    }
 
     // try_func returns whether item appeared in the queue
     // wait_func waits and returns false if timeout, true otherwise
@@ -315,13 +465,35 @@ protected:
         event.signal();
     }
 
+    // common part of try_enqueue & try_enqueue_many, called after count items were enqueued
+    void afterEnqueue(const av::Timestamp last_ts, const int count, const AVTS now) {
+        last_ts_ = last_ts;
+        enqueued_seq_ += count;
+        int now_occupied = (occupied_ += count);
+        occupancyChanged(now_occupied - count, now);
+        if (now_occupied > queue_limit_) {
+            queue_limit_ = now_occupied;
+            //logstream << "BUG: occupied_ = " << occupied_;
+        }
+        produced_.signal();
+    }
+    // called by consumer after count items were removed from queue_
+    void afterDequeue(const int count) {
+        AVTS now = wallclock.ns();
+        for (int i=0; i<count; i++) {
+            AVTS enqueued = enqueue_times_[(dequeued_seq_++) & enqueue_times_mask_];
+            dwell_us_.record(now > enqueued ? (now - enqueued) / 1000 : 0);
+        }
+        int prev_occupied = occupied_.fetch_sub(count);
+        occupancyChanged(prev_occupied, now);
+    }
     bool try_dequeue(T &elem) {
         bool r = queue_.try_dequeue(elem);
         if (r) {
             /*if (occupied_ <= 0) {
                 logstream << "BUG: decreasing occupied_ = " << occupied_;
             }*/ // warning disabled, gave false positives because of race conditions
-            --occupied_;
+            afterDequeue(1);
             consumed_.signal();
         }
         return r;
@@ -330,26 +502,91 @@ protected:
         return std::static_pointer_cast<Edge<T>>(this->shared_from_this());
     }
 public:
-    void addWiretapCallback(WiretapCallback cb) {
-        wiretap_callbacks_.push_back(cb);
+    // returns id for removeWiretapCallback
+    WiretapId addWiretapCallback(WiretapCallback cb) {
+        std::lock_guard<decltype(wiretaps_busy_)> lock(wiretaps_busy_);
+        std::shared_ptr<const Wiretaps> old_wiretaps = std::atomic_load(&wiretap_callbacks_);
+        auto new_wiretaps = old_wiretaps ? std::make_shared<Wiretaps>(*old_wiretaps) : std::make_shared<Wiretaps>();
+        WiretapId id = next_wiretap_id_++;
+        new_wiretaps->push_back({ id, cb });
+        std::atomic_store(&wiretap_callbacks_, std::shared_ptr<const Wiretaps>(new_wiretaps));
+        has_wiretaps_ = true;
+        return id;
+    }
+    // The producer may still be running the callback (from the previous copy of the list)
+    // when this returns, so callbacks must not capture raw pointers to objects freed after removal.
+    void removeWiretapCallback(const WiretapId id) {
+        std::lock_guard<decltype(wiretaps_busy_)> lock(wiretaps_busy_);
+        std::shared_ptr<const Wiretaps> old_wiretaps = std::atomic_load(&wiretap_callbacks_);
+        if (!old_wiretaps) return;
+        auto new_wiretaps = std::make_shared<Wiretaps>();
+        for (const Wiretap &wt: *old_wiretaps) {
+            if (wt.id != id) {
+                new_wiretaps->push_back(wt);
+            }
+        }
+        if (new_wiretaps->empty()) {
+            has_wiretaps_ = false;
+            std::atomic_store(&wiretap_callbacks_, std::shared_ptr<const Wiretaps>());
+        } else {
+            std::atomic_store(&wiretap_callbacks_, std::shared_ptr<const Wiretaps>(new_wiretaps));
+        }
+    }
+    std::shared_ptr<const Wiretaps> wiretaps() {
+        if (!has_wiretaps_.load(std::memory_order_acquire)) return nullptr;
+        return std::atomic_load(&wiretap_callbacks_);
     }
     bool try_enqueue(const T &elem) {
+        AVTS now = wallclock.ns();
+        enqueue_times_[enqueued_seq_ & enqueue_times_mask_] = now;
         bool r = queue_.try_enqueue(elem);
         if (r) {
-            last_ts_ = elem.pts();
-            ++occupied_;
-            if (occupied_ > queue_limit_) {
-                queue_limit_ = occupied_;
-                //logstream << "BUG: occupied_ = " << occupied_;
-            }
-            produced_.signal();
-            for (WiretapCallback &cb: wiretap_callbacks_) {
-                cb(elem);
+            afterEnqueue(elem.pts(), 1, now);
+            if (std::shared_ptr<const Wiretaps> wiretaps = this->wiretaps()) {
+                for (const Wiretap &wt: *wiretaps) {
+                    wt.cb(elem);
+                }
             }
         }
         return r;
     }
-    Edge(const size_t capacity): queue_(capacity), queue_limit_(capacity) {
+    // Batch variant of try_enqueue: enqueues as many items from [begin, end) as there is free space for,
+    // with a single signal and a single occupancy update. Returns number of items enqueued.
+    // With move iterators, items are moved into the queue (only the ones which were enqueued).
+    template<typename It> size_t try_enqueue_many(It begin, It end) {
+        size_t n = 0;
+        av::Timestamp last_ts = NOTS;
+        AVTS now = wallclock.ns();
+        std::shared_ptr<const Wiretaps> wiretaps = this->wiretaps();
+        for (It it = begin; it != end; ++it) {
+            enqueue_times_[(enqueued_seq_ + n) & enqueue_times_mask_] = now;
+            av::Timestamp ts = (*it).pts();
+            if (!wiretaps) {
+                if (!queue_.try_enqueue(*it)) break;
+            } else {
+                // wiretaps need the item after it is enqueued, so copy it
+                const T &item = *it;
+                if (!queue_.try_enqueue(item)) break;
+            }
+            last_ts = ts;
+            n++;
+        }
+        if (n > 0) {
+            afterEnqueue(last_ts, n, now);
+        }
+        // like in try_enqueue: wiretaps see items after they're published to the consumer
+        if (wiretaps) {
+            It it = begin;
+            for (size_t i=0; i<n; i++, ++it) {
+                const T &item = *it;
+                for (const Wiretap &wt: *wiretaps) {
+                    wt.cb(item);
+                }
+            }
+        }
+        return n;
+    }
+    Edge(const size_t capacity): queue_(capacity), queue_limit_(capacity), enqueue_times_(enqueueTimesSize(capacity)), enqueue_times_mask_(enqueue_times_.size() - 1) {
     }
     size_t capacity() {
         return queue_limit_;
@@ -358,19 +595,13 @@ public:
         //return queue_.size_approx();
         return occupied_;
     }
-    int free() {
+    virtual int free() final {
         //return capacity() - occupied();
         return queue_limit_ - occupied_;
     }
     decltype(queue_)& queue() {
         return queue_;
     }
-    Event& producedEvent() {
-        return produced_;
-    }
-    Event& consumedEvent() {
-        return consumed_;
-    }
 
     void finishProducer() {
         signalAltFinish(finish_producer_, consumed_);
@@ -393,6 +624,20 @@ public:
         last_ts_ = elem.pts();
         return waitDo([this, &elem](){ return try_enqueue(elem); }, [this]() { consumed_.wait(); return true; }, finish_producer_, produced_);
     }
+    // Batch variant of enqueue. Returns false if finishProducer() was called before all items were enqueued.
+    template<typename It> bool enqueue_many(It begin, It end) {
+        while (begin != end) {
+            std::advance(begin, try_enqueue_many(begin, end));
+            if (begin == end) break;
+            if (finish_producer_) {
+                logstream << "resetting flag";
+                finish_producer_ = false;
+                return false;
+            }
+            consumed_.wait();
+        }
+        return true;
+    }
     T* peek() {
         return queue_.peek();
     }
@@ -414,13 +659,38 @@ public:
     }
     bool pop() {
         if (queue_.pop()) {
-            occupied_--;
+            afterDequeue(1);
             consumed_.signal();
             return true;
         } else {
             return false;
         }
     }
+    // Dequeues up to max_count items into dest with a single occupancy update and a single signal.
+    // Waits for the first item only (timeout_ms < 0 means infinitely). Returns number of items dequeued.
+    size_t wait_dequeue_many(std::vector<T> &dest, const size_t max_count, const int timeout_ms = -1) {
+        if (max_count == 0) return 0;
+        if (queue_.peek() == nullptr && timeout_ms != 0) {
+            if (wait_peek(timeout_ms) == nullptr) {
+                if (finish_consumer_) {
+                    logstream << "resetting flag";
+                    finish_consumer_ = false;
+                }
+                return 0;
+            }
+        }
+        size_t n = 0;
+        T elem;
+        while (n < max_count && queue_.try_dequeue(elem)) {
+            dest.push_back(std::move(elem));
+            n++;
+        }
+        if (n > 0) {
+            afterDequeue(n);
+            consumed_.signal();
+        }
+        return n;
+    }
     void wait_dequeue(T &elem) {
         waitDo([this, &elem]() { return try_dequeue(elem); }, [this]() { produced_.wait(); return true; }, finish_consumer_, consumed_);
     }
@@ -449,6 +719,7 @@ public:
     std::shared_ptr<Edge<T>> findInternal(const std::string &name, bool create_if_empty = true, const size_t capacity = Edge<T>::default_capacity) {
         if ( create_if_empty && (edges_[name]==nullptr) ) {
             edges_[name] = std::make_shared<Edge<T>>(capacity);
+            edges_[name]->setTraceName(name);
         }
         return edges_[name];
     };
@@ -472,6 +743,21 @@ public:
             }
         }
     }
+    void collectStats(nlohmann::json &dest, const bool reset, const std::string prefix = "") {
+        for (auto &kv: edges_) {
+            std::shared_ptr<Edge<T>> edge = kv.second;
+            if (edge==nullptr) continue;
+            nlohmann::json jedge = edge->statsJson();
+            jedge["capacity"] = edge->capacity();
+            if (edge->lastTS().isValid()) {
+                jedge["last_ts"] = edge->lastTS().seconds();
+            }
+            dest[prefix + kv.first] = jedge;
+            if (reset) {
+                edge->resetStats();
+            }
+        }
+    }
 };
 
 class EdgeManager {
@@ -556,6 +842,18 @@ public:
             edges->printStats(ost, compact, prefix);
         });
     }
+    // {"edge_name": {see EdgeBase::statsJson}, ...}, global edges prefixed with @
+    void collectEdgesStats(nlohmann::json &dest, const bool reset = false) {
+        bool we_are_global = this==&global_edge_manager_;
+        const std::string prefix = we_are_global ? "@" : "";
+        if (!we_are_global) {
+            global_edge_manager_.collectEdgesStats(dest, reset);
+        }
+        auto lock = getLock();
+        storage_.forEach([&dest, reset, &prefix](auto edges) {
+            edges->collectStats(dest, reset, prefix);
+        });
+    }
 };
 
 struct NodeCreationInfo {
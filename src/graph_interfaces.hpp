@@ -14,6 +14,15 @@ public:
     virtual bool finished() = 0;
 };
 
+// Node which may run in a worker pool ("worker_pool" parameter). The pool calls process()
+// only when the source edge has data and every sink edge has a free slot, so process()
+// must not wait for anything else: it consumes at most one input item (or only as many
+// as its sinks have room for) and puts at most one item into each sink.
+// It also assumes being the only producer of its sinks.
+// process() of other nodes may block a worker, and a fixed pool deadlocks when all of them are blocked.
+class IWorkerPoolSafe {
+};
+
 class IStoppable {
 public:
     virtual void stop() = 0;
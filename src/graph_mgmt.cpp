@@ -2,13 +2,27 @@
 #include "Event.hpp"
 #include "EventLoop.hpp"
 #include "TickSource.hpp"
+#include "WorkerPool.hpp"
 #include "graph_core.hpp"
 #include "graph_factory.hpp"
 #include "instance_shared.hpp"
+#include <algorithm>
 #include <atomic>
 #include <exception>
+#include <iterator>
 #include <limits>
 #include <memory>
+#include <pthread.h>
+#include <time.h>
+#include <unordered_set>
+
+static AVTS clockNs(const clockid_t clk) {
+    struct timespec ts;
+    if (clock_gettime(clk, &ts) != 0) {
+        return 0;
+    }
+    return AVTS(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
 
 ///////////////////////////////////////////////////////////
 ////// NodeFactory
@@ -23,7 +37,8 @@ std::shared_ptr< Node > NodeFactory::produce(const Parameters& params) {
     if (factories_.count(type)!=1) {
         throw Error("Unknown node type: " + type);
     }
-    NodeFactoryFunction func = factories_[type];
+    // no operator[], nodes may be created in parallel (NodeManager::deploy)
+    const NodeFactoryFunction &func = factories_.find(type)->second;
     if (func==nullptr) {
         throw Error("Invalid factory function for " + type);
     }
@@ -55,6 +70,10 @@ bool NodeWrapper::start() {
 
         std::shared_ptr<NonBlockingNodeBase> nbnode = std::dynamic_pointer_cast<NonBlockingNodeBase>(node_);
         if (nbnode) {
+            if (worker_pool_!=nullptr) {
+                throw Error("worker_pool can't be specified for non-blocking node");
+            }
+            nbnode->setTraceName(trace_name_);
             if (tick_source_!=nullptr) {
                 nbnode->setEventLoop(nullptr, true);
                 nbnode->start();
@@ -73,10 +92,25 @@ bool NodeWrapper::start() {
             if (tick_source_!=nullptr || event_loop_!=nullptr) {
                 throw Error("tick_source or event_loop can't be specified for blocking (threaded) node");
             }
-            // this is blocking Node so it requires separate thread
-            thread_ = make_unique<std::thread>(start_thread(name_, [this]() {
-                this->threadFunction();
-            }));
+            if (worker_pool_!=nullptr) {
+                if (!std::dynamic_pointer_cast<IWorkerPoolSafe>(node_)) {
+                    throw Error("worker_pool can't be specified for node " + name_ + ": its process() may block, which can deadlock the pool");
+                }
+                // this is blocking Node but it is explicitly told to share worker threads with other nodes
+                {
+                    std::lock_guard<decltype(pool_done_mutex_)> lock(pool_done_mutex_);
+                    pool_running_ = true;
+                }
+                in_pool_ = true;
+                worker_pool_->submit([this]() {
+                    this->poolStart();
+                });
+            } else {
+                // this is blocking Node so it requires separate thread
+                thread_ = make_unique<std::thread>(start_thread(name_, [this]() {
+                    this->threadFunction();
+                }));
+            }
         }
         return true;
     } else {
@@ -127,6 +161,18 @@ Parameters NodeWrapper::getObject(const std::string object_name) {
     return retobj->getObject(object_name);
 }
 
+AVTS NodeWrapper::cpuTimeNs() {
+    std::lock_guard<decltype(cpu_time_mutex_)> lock(cpu_time_mutex_);
+    AVTS r = cpu_time_ns_;
+    if (thread_cpu_clock_valid_) {
+        r += clockNs(thread_cpu_clock_);
+    }
+    // safety net, clockNs() returns 0 if the clock can't be read
+    r = std::max(r, cpu_time_reported_ns_);
+    cpu_time_reported_ns_ = r;
+    return r;
+}
+
 bool NodeWrapper::stopAndWait() {
     std::lock_guard<decltype(start_stop_mutex_)> lock(start_stop_mutex_);
     bool r = interrupt(true);
@@ -140,6 +186,8 @@ bool NodeWrapper::stopAndWait() {
 
 void NodeWrapper::join() {
     if (thread_ && thread_->joinable()) thread_->join();
+    std::unique_lock<decltype(pool_done_mutex_)> lock(pool_done_mutex_);
+    pool_done_cv_.wait(lock, [this]() { return !pool_running_; });
 }
 
 
@@ -151,6 +199,7 @@ bool NodeWrapper::stop(bool inhibit_actions) {
             if (inhibit_actions) stop_requested_ = true;
             dowork_ = false;
             node_stoppable->stop();
+            wakeParked();
         } else {
             throw Error("NodeWrapper::stop() called for node which doesn't have stopping interface!");
         }
@@ -184,6 +233,7 @@ bool NodeWrapper::interrupt(bool optional) {
         if (node_interruptible) {
             stop_requested_ = true;
             node_interruptible->interrupt();
+            wakeParked();
         } else if (optional) {
             return false;
         } else {
@@ -200,6 +250,50 @@ bool NodeWrapper::interrupt(bool optional) {
     }
 }
 
+#ifdef TRACING
+static const char* traceSourceEdge(Node &node) {
+    std::shared_ptr<EdgeBase> edge = node.sourceEdge();
+    return edge ? edge->traceName() : nullptr;
+}
+#endif
+
+bool NodeWrapper::processStep(Node &node, IReportsFinish *node_finishable, IFlushable *node_flushable) {
+    TRACE_SPAN(span, trace_name_, "node", "src", traceSourceEdge(node));
+    if (node_finishable) {
+        // Node signals that it finished work
+        if (node_finishable->finished()) {
+            logstream << "Node " << name_ << " reported that it finished processing.";
+            return false;
+        }
+        if (dowork_) {
+            node.process();
+        } else if (node_flushable) {
+            // told to finish work
+            // and Node is IFlushable
+            // so flush it
+            node_flushable->flush();
+        } else {
+            // node should finish work
+            // but doesn't have flushing interface
+            // so to give it a chance to finish,
+            // call process()...
+            node.process();
+        }
+        return true;
+    } else {
+        // dumb Node
+        if (dowork_) {
+            node.process();
+            return true;
+        }
+        if (node_flushable) {
+            node_flushable->flush();
+        }
+        logstream << "Node " << name_ << " stopped processing because it was told to do so.";
+        return false;
+    }
+}
+
 void NodeWrapper::threadFunction() {
     decltype(node_) node = node_;
     if (node==nullptr) {
@@ -208,50 +302,36 @@ void NodeWrapper::threadFunction() {
     }
     IReportsFinish *node_finishable = dynamic_cast<IReportsFinish*>(node.get());
     IFlushable *node_flushable = dynamic_cast<IFlushable*>(node.get());
+    clockid_t cpu_clock;
+    if (pthread_getcpuclockid(pthread_self(), &cpu_clock) == 0) {
+        std::lock_guard<decltype(cpu_time_mutex_)> lock(cpu_time_mutex_);
+        thread_cpu_clock_ = cpu_clock;
+        thread_cpu_clock_valid_ = true;
+    }
     try {
         logstream << "Node " << name_ << " started." << std::endl;
         node->start();
-        if (node_finishable) {
-            // Node signals that it finished work
-            while (!node_finishable->finished()) {
-                if (node_==nullptr) {
-                    logstream << "BUG: race condition detected, node_==nullptr in threadFunction() !!! (node_finishable loop)";
-                    return;
-                }
-                if (dowork_) {
-                    node->process();
-                } else if (node_flushable) {
-                    // told to finish work
-                    // and Node is IFlushable
-                    // so flush it
-                    node_flushable->flush();
-                } else {
-                    // node should finish work
-                    // but doesn't have flushing interface
-                    // so to give it a chance to finish,
-                    // call process()...
-                    node_->process();
-                }
-            }
-            logstream << "Node " << name_ << " reported that it finished processing.";
-        } else {
-            // dumb Node
-            while (dowork_) {
-                if (node_==nullptr) {
-                    logstream << "BUG: race condition detected, node_==nullptr in threadFunction() !!! (dumb Node loop)";
-                    return;
-                }
-                node->process();
-            }
-            if (node_flushable) {
-                node_flushable->flush();
+        do {
+            if (node_==nullptr) {
+                logstream << "BUG: race condition detected, node_==nullptr in threadFunction() !!! (processing loop)";
+                return;
             }
-            logstream << "Node " << name_ << " stopped processing because it was told to do so.";
-        }
+        } while (processStep(*node, node_finishable, node_flushable));
     } catch (std::exception &e) {
         logstream << "Node " << name_ << " failed: " << e.what();
         last_error_ = e.what();
     }
+    {
+        std::lock_guard<decltype(cpu_time_mutex_)> lock(cpu_time_mutex_);
+        if (thread_cpu_clock_valid_) {
+            thread_cpu_clock_valid_ = false;
+            cpu_time_ns_ += clockNs(CLOCK_THREAD_CPUTIME_ID);
+        }
+    }
+    finishProcessing(true);
+}
+
+void NodeWrapper::finishProcessing(bool detach_thread) {
     try {
         node_ = nullptr;
     } catch (std::exception &e) {
@@ -260,12 +340,21 @@ void NodeWrapper::threadFunction() {
 
     finished_ = true;
     logstream << "Node " << name_ << " finished." << std::endl;
+    if (!detach_thread) {
+        // left the worker pool, wake up join()
+        in_pool_ = false;
+        std::lock_guard<decltype(pool_done_mutex_)> lock(pool_done_mutex_);
+        pool_running_ = false;
+        pool_done_cv_.notify_all();
+    }
     if ((!on_finished_.empty()) && manager_->shouldWork()) {
-        set_thread_name("~"+name_);
-        try {
-            thread_->detach(); // detach myself to call on_finished_ independently
-        } catch (std::exception &e) {
-            logstream << "unable to detach thread: " << e.what();
+        if (detach_thread) {
+            set_thread_name("~"+name_);
+            try {
+                thread_->detach(); // detach myself to call on_finished_ independently
+            } catch (std::exception &e) {
+                logstream << "unable to detach thread: " << e.what();
+            }
         }
         for (auto &cb: on_finished_) {
             try {
@@ -277,12 +366,108 @@ void NodeWrapper::threadFunction() {
     }
 }
 
+// Worker pool mode: the same loop as in threadFunction, but every iteration is a separate task
+// and instead of blocking in process() waiting for data or free space,
+// the node is parked until its edge signals.
+
+void NodeWrapper::poolStart() {
+    decltype(node_) node = node_;
+    if (node==nullptr) {
+        logstream << "BUG: race condition detected, node_==nullptr in poolStart() !!!";
+        return;
+    }
+    try {
+        logstream << "Node " << name_ << " started in worker pool." << std::endl;
+        node->start();
+    } catch (std::exception &e) {
+        logstream << "Node " << name_ << " failed: " << e.what();
+        last_error_ = e.what();
+        finishProcessing(false);
+        return;
+    }
+    poolStep();
+}
+
+Event* NodeWrapper::blockingEvent(Node &node) {
+    std::shared_ptr<EdgeBase> src = node.sourceEdge();
+    if (src && src->occupied() <= 0) {
+        return &src->producedEvent();
+    }
+    Event* r = nullptr;
+    node.forEachSinkEdge([&r](EdgeBase &edge) {
+        if (r==nullptr && edge.free() <= 0) {
+            r = &edge.consumedEvent();
+        }
+    });
+    return r;
+}
+
+// Parked node wouldn't notice that it should stop until its edge signals, so signal it ourselves.
+// Edge waits tolerate spurious wakeups.
+void NodeWrapper::wakeParked() {
+    Event* event = parked_on_.exchange(nullptr);
+    if (event) {
+        event->signal();
+    }
+}
+
+void NodeWrapper::poolStep() {
+    decltype(node_) node = node_;
+    if (node==nullptr) {
+        logstream << "BUG: race condition detected, node_==nullptr in poolStep() !!!";
+        return;
+    }
+    if (dowork_) {
+        Event* blocker = blockingEvent(*node);
+        if (blocker) {
+            parked_on_ = blocker;
+            // stop() could have missed it
+            if (dowork_) {
+                worker_pool_->submitWhenSignalled(*blocker, [this]() {
+                    parked_on_ = nullptr;
+                    this->poolStep();
+                });
+                return;
+            }
+            parked_on_ = nullptr;
+        }
+    }
+    bool go_on = false;
+    AVTS cpu_start = clockNs(CLOCK_THREAD_CPUTIME_ID);
+    try {
+        go_on = processStep(*node, dynamic_cast<IReportsFinish*>(node.get()), dynamic_cast<IFlushable*>(node.get()));
+    } catch (std::exception &e) {
+        logstream << "Node " << name_ << " failed: " << e.what();
+        last_error_ = e.what();
+    }
+    cpu_time_ns_ += clockNs(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+    node = nullptr;
+    if (go_on) {
+        worker_pool_->yield([this]() {
+            this->poolStep();
+        });
+    } else {
+        finishProcessing(false);
+    }
+}
+
 
 
 ///////////////////////////////////////////////////////////
 ////// NodeManager
 
 std::shared_ptr< NodeWrapper > NodeManager::createNode(Parameters& params, const bool early_create, const bool start) {
+    auto nw = registerNode(params);
+    if (early_create) {
+        nw->createNode();
+    }
+    if (start) {
+        nw->start();
+    }
+    return nw;
+}
+
+std::shared_ptr< NodeWrapper > NodeManager::registerNode(Parameters& params) {
     auto nw = std::make_shared<NodeWrapper>(this->shared_from_this(), params, false);
 
     { // begin lock
@@ -340,12 +525,6 @@ std::shared_ptr< NodeWrapper > NodeManager::createNode(Parameters& params, const
         logstream << "NodeWrapper " << nw->name() << " added to manager.";
     } // end lock
 
-    if (early_create) {
-        nw->createNode();
-    }
-    if (start) {
-        nw->start();
-    }
     return nw;
 }
 
@@ -362,6 +541,9 @@ void NodeManager::deleteNode(const std::string& name) {
     } // end lock
     // and destroy the node outside of the lock
     if (!nw) return;
+    if (nw->group()) {
+        nw->group()->remove(nw.get());
+    }
     nw->stopAndWait();
 }
 
@@ -411,6 +593,7 @@ void NodeManager::shutdown() {
 
 void NodeManager::panic() {
     logstream << "Critical error. Shutting down.";
+    current_thread.logger->flush();
     shutdown();
 }
 
@@ -430,24 +613,264 @@ bool NodeManager::nodeExists(const std::string& name) {
 }
 
 
+namespace NodeGroupUtils {
+    static std::list<std::string> offers(Parameters& params) {
+        std::list<std::string> we_offer;
+        if (params["type"]=="demux") {
+            Parameters routing = params["routing"];
+            for (Parameters::iterator route = routing.begin(); route != routing.end(); ++route) {
+                we_offer.push_back(route.value());
+            }
+        } else if (params.count("dst")==1) {
+            we_offer = jsonToStringList(params["dst"]);
+        }
+        return we_offer;
+    }
+
+    static std::list<std::string> needs(Parameters& params) {
+        if (params.count("src")==1) {
+            return jsonToStringList(params["src"]);
+        } else {
+            return {};
+        }
+    }
+};
+
+
+///////////////////////////////////////////////////////////
+////// NodeGroup
+
 const std::list<NodeGroup::Item>& NodeGroup::sortedNodes() {
     auto lock = getLock();
-    if (!is_sorted_) sort();
+    collectGarbage();
+    if (!is_sorted_) {
+        sorted_nodes_.clear();
+        for (auto &kv: order_) {
+            sorted_nodes_.push_back(kv.second->item);
+        }
+        is_sorted_ = true;
+    }
     return sorted_nodes_;
 }
 
+size_t NodeGroup::edgeId(const std::string &name) {
+    auto it = edge_ids_.find(name);
+    if (it != edge_ids_.end()) {
+        return it->second;
+    }
+    size_t id = edge_links_.size();
+    edge_ids_[name] = id;
+    edge_links_.push_back({ name, {}, {} });
+    return id;
+}
 
-///////////////////////////////////////////////////////////
-////// NodeGroup
+void NodeGroup::link(Entry &entry) {
+    for (size_t e: entry.offers) {
+        edge_links_[e].producers.push_back(&entry);
+    }
+    for (size_t e: entry.needs) {
+        edge_links_[e].consumers.push_back(&entry);
+    }
+    order_[entry.order] = &entry;
+    is_sorted_ = false;
+}
+
+void NodeGroup::unlink(Entry &entry) {
+    auto erase = [&entry](std::vector<Entry*> &v) {
+        v.erase(std::remove(v.begin(), v.end(), &entry), v.end());
+    };
+    for (size_t e: entry.offers) {
+        erase(edge_links_[e].producers);
+    }
+    for (size_t e: entry.needs) {
+        erase(edge_links_[e].consumers);
+    }
+    order_.erase(entry.order);
+    is_sorted_ = false;
+}
+
+void NodeGroup::renumber() {
+    std::map<uint64_t, Entry*> renumbered;
+    uint64_t order = order_base_;
+    for (auto &kv: order_) {
+        kv.second->order = order;
+        renumbered[order] = kv.second;
+        order += order_gap_;
+    }
+    order_.swap(renumbered);
+}
+
+// free position between entry and the node before it
+uint64_t NodeGroup::orderJustBefore(Entry &entry) {
+    auto it = order_.find(entry.order);
+    if (it == order_.begin()) {
+        if (entry.order < order_gap_) {
+            renumber();
+        }
+        return entry.order - order_gap_;
+    }
+    uint64_t prev = std::prev(it)->first;
+    if (entry.order - prev < 2) {
+        renumber();
+        prev = std::prev(order_.find(entry.order))->first;
+    }
+    return prev + (entry.order - prev) / 2;
+}
+
+// Pearce-Kelly: if v is ordered before u, move u and everything leading to it (ordered after v)
+// before v and everything reachable from it (ordered before u), reusing their positions.
+void NodeGroup::orderBefore(Entry &u, Entry &v) {
+    if (u.order < v.order) return;
+    const uint64_t lower = v.order;
+    const uint64_t upper = u.order;
+    std::vector<Entry*> forward, backward, stack;
+
+    uint64_t mark = ++visit_mark_;
+    v.visit_mark = mark;
+    v.parent = nullptr;
+    stack.push_back(&v);
+    while (!stack.empty()) {
+        Entry* n = stack.back();
+        stack.pop_back();
+        if (n == &u) {
+            // u -> v -> ... -> u
+            std::vector<Entry*> path { &u };
+            for (Entry* p = &u; ; p = p->parent) {
+                path.insert(path.begin() + 1, p);
+                if (p == &v) break;
+            }
+            std::string desc = path[0]->name;
+            for (size_t i=1; i<path.size(); i++) {
+                std::string edge = "?";
+                for (size_t e: path[i-1]->offers) {
+                    if (std::find(path[i]->needs.begin(), path[i]->needs.end(), e) != path[i]->needs.end()) {
+                        edge = edge_links_[e].name;
+                        break;
+                    }
+                }
+                desc += " -(" + edge + ")-> " + path[i]->name;
+            }
+            throw Error("Graph has cycle: " + desc);
+        }
+        forward.push_back(n);
+        for (size_t e: n->offers) {
+            for (Entry* c: edge_links_[e].consumers) {
+                if (c->visit_mark != mark && c->order <= upper) {
+                    c->visit_mark = mark;
+                    c->parent = n;
+                    stack.push_back(c);
+                }
+            }
+        }
+    }
+
+    mark = ++visit_mark_;
+    u.visit_mark = mark;
+    stack.push_back(&u);
+    while (!stack.empty()) {
+        Entry* n = stack.back();
+        stack.pop_back();
+        backward.push_back(n);
+        for (size_t e: n->needs) {
+            for (Entry* p: edge_links_[e].producers) {
+                if (p->visit_mark != mark && p->order > lower) {
+                    p->visit_mark = mark;
+                    stack.push_back(p);
+                }
+            }
+        }
+    }
+
+    auto by_order = [](const Entry* a, const Entry* b) {
+        return a->order < b->order;
+    };
+    std::sort(forward.begin(), forward.end(), by_order);
+    std::sort(backward.begin(), backward.end(), by_order);
+    std::vector<uint64_t> positions;
+    positions.reserve(forward.size() + backward.size());
+    for (Entry* n: backward) {
+        positions.push_back(n->order);
+        order_.erase(n->order);
+    }
+    for (Entry* n: forward) {
+        positions.push_back(n->order);
+        order_.erase(n->order);
+    }
+    std::sort(positions.begin(), positions.end());
+    size_t i = 0;
+    for (Entry* n: backward) {
+        n->order = positions[i++];
+        order_[n->order] = n;
+    }
+    for (Entry* n: forward) {
+        n->order = positions[i++];
+        order_[n->order] = n;
+    }
+    is_sorted_ = false;
+}
 
 void NodeGroup::add(SolidItem node) {
-    collectGarbage();
-    {
-        auto lock = getLock();
-        nodes_.push_back(node);
-        is_sorted_ = false;
-        sorted_nodes_.clear();
+    auto lock = getLock();
+    auto old = entries_.find(node.get());
+    if (old != entries_.end()) {
+        // destroyed node at the same address, not collected yet
+        unlink(*old->second);
+        entries_.erase(old);
+    }
+    std::unique_ptr<Entry> entry = make_unique<Entry>();
+    entry->item = node;
+    entry->name = node->name();
+    for (const std::string &edge: NodeGroupUtils::offers(node->parameters())) {
+        entry->offers.push_back(edgeId(edge));
     }
+    for (const std::string &edge: NodeGroupUtils::needs(node->parameters())) {
+        entry->needs.push_back(edgeId(edge));
+    }
+    // usually the new node fits after its producers and before its consumers
+    Entry* last_producer = nullptr;
+    Entry* first_consumer = nullptr;
+    bool self_loop = false;
+    for (size_t e: entry->needs) {
+        for (Entry* producer: edge_links_[e].producers) {
+            if (last_producer == nullptr || producer->order > last_producer->order) last_producer = producer;
+        }
+        self_loop = self_loop || std::find(entry->offers.begin(), entry->offers.end(), e) != entry->offers.end();
+    }
+    for (size_t e: entry->offers) {
+        for (Entry* consumer: edge_links_[e].consumers) {
+            if (first_consumer == nullptr || consumer->order < first_consumer->order) first_consumer = consumer;
+        }
+    }
+    if (first_consumer == nullptr && !self_loop) {
+        entry->order = order_.empty() ? order_base_ : order_.rbegin()->first + order_gap_;
+        link(*entry);
+    } else if (first_consumer != nullptr && !self_loop && (last_producer == nullptr || last_producer->order < first_consumer->order)) {
+        entry->order = orderJustBefore(*first_consumer);
+        link(*entry);
+    } else {
+        // otherwise put it last and move its consumers (and what follows them) after it
+        entry->order = order_.empty() ? order_base_ : order_.rbegin()->first + order_gap_;
+        link(*entry);
+        try {
+            for (size_t e: entry->offers) {
+                for (Entry* consumer: edge_links_[e].consumers) {
+                    orderBefore(*entry, *consumer);
+                }
+            }
+        } catch (...) {
+            unlink(*entry);
+            throw;
+        }
+    }
+    entries_[node.get()] = std::move(entry);
+}
+
+void NodeGroup::remove(const NodeWrapper* node) {
+    auto lock = getLock();
+    auto it = entries_.find(node);
+    if (it == entries_.end()) return;
+    unlink(*it->second);
+    entries_.erase(it);
 }
 
 // TODO remove retry_single argument, not used anymore
@@ -527,112 +950,228 @@ void NodeGroup::restartNodesInternal() {
 
 void NodeGroup::collectGarbage() {
     auto lock = getLock();
-    auto is_garbage = [](Item &item) {
-        return item.expired();
-    };
-    nodes_.remove_if(is_garbage);
-    sorted_nodes_.remove_if(is_garbage);
+    for (auto it = entries_.begin(); it != entries_.end(); ) {
+        if (it->second->item.expired()) {
+            unlink(*it->second);
+            it = entries_.erase(it);
+        } else {
+            ++it;
+        }
+    }
 }
 
-namespace NodeGroupUtils {
-    static std::list<std::string> offers(Parameters& params) {
-        std::list<std::string> we_offer;
-        if (params["type"]=="demux") {
-            Parameters routing = params["routing"];
-            for (Parameters::iterator route = routing.begin(); route != routing.end(); ++route) {
-                we_offer.push_back(route.value());
+///////////////////////////////////////////////////////////
+////// NodeManager: deploying whole graph
+
+Parameters NodeManager::deploy(const Parameters &graph) {
+    AVTS begin_ns = wallclock.ns();
+    if (!graph.count("nodes") || !graph["nodes"].is_array()) {
+        throw Error("Graph must have nodes array");
+    }
+    std::vector<Parameters> params;
+    for (const Parameters &jnode: graph["nodes"]) {
+        params.push_back(jnode);
+    }
+    const size_t count = params.size();
+    const bool start = graph.value("start", true);
+    size_t max_threads = graph.value("threads", 0);
+    if (max_threads == 0) {
+        max_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // check everything that can be checked without creating nodes
+    std::vector<std::string> names(count);
+    std::unordered_map<std::string, std::string> producers, consumers; // edge -> node
+    std::unordered_set<std::string> offered; // by any node, also stopped
+    {
+        auto lock = getLock();
+        for (auto &entry: nodes_index_) {
+            for (const std::string &edge: NodeGroupUtils::offers(entry.second->parameters())) {
+                offered.insert(edge);
+            }
+            // stopped nodes may be alternatives of the new ones
+            if (!entry.second->isWorking()) continue;
+            for (const std::string &edge: NodeGroupUtils::offers(entry.second->parameters())) {
+                producers[edge] = entry.first;
+            }
+            for (const std::string &edge: NodeGroupUtils::needs(entry.second->parameters())) {
+                consumers[edge] = entry.first;
             }
-        } else if (params.count("dst")==1) {
-            we_offer = jsonToStringList(params["dst"]);
         }
-        return we_offer;
     }
-    static std::list<std::string> offers(NodeGroup::Item& weak_node) {
-        NodeGroup::SolidItem node = weak_node.lock();
-        if (node==nullptr) return {};
-        return offers(node->parameters());
+    std::unordered_map<std::string, size_t> batch_producers; // edge -> index in params
+    for (size_t i=0; i<count; i++) {
+        if (!params[i].count("name") || !params[i].count("type")) {
+            throw Error("Every node of deployed graph must have name and type");
+        }
+        names[i] = params[i]["name"].get<std::string>();
+        if (!factory_->hasType(params[i]["type"].get<std::string>())) {
+            throw Error("Unknown node type: " + params[i]["type"].get<std::string>() + " (node " + names[i] + ")");
+        }
+        if (nodeExists(names[i]) || std::find(names.begin(), names.begin() + i, names[i]) != names.begin() + i) {
+            throw Error("Name busy: " + names[i]);
+        }
+        for (const std::string &edge: NodeGroupUtils::offers(params[i])) {
+            auto it = producers.find(edge);
+            if (it != producers.end()) {
+                throw Error("Edge " + edge + " has two producers: " + it->second + " and " + names[i]);
+            }
+            producers[edge] = names[i];
+            batch_producers[edge] = i;
+            offered.insert(edge);
+        }
+        for (const std::string &edge: NodeGroupUtils::needs(params[i])) {
+            auto it = consumers.find(edge);
+            if (it != consumers.end()) {
+                throw Error("Edge " + edge + " has two consumers: " + it->second + " and " + names[i]);
+            }
+            consumers[edge] = names[i];
+        }
+    }
+    for (size_t i=0; i<count; i++) {
+        for (const std::string &edge: NodeGroupUtils::needs(params[i])) {
+            // global edges may be produced by other instances
+            if (edge[0] != '@' && !offered.count(edge) && !edges_->findAny(edge)) {
+                throw Error("Edge " + edge + " consumed by " + names[i] + " has no producer");
+            }
+        }
     }
 
-    static std::list<std::string> needs(Parameters& params) {
-        if (params.count("src")==1) {
-            return jsonToStringList(params["src"]);
-        } else {
-            return {};
+    // level = length of the longest path from a node without producers in this graph (Kahn's algorithm),
+    // nodes of the same level don't depend on each other
+    std::vector<std::vector<size_t>> dependents(count);
+    std::vector<size_t> pending(count, 0);
+    for (size_t i=0; i<count; i++) {
+        for (const std::string &edge: NodeGroupUtils::needs(params[i])) {
+            auto it = batch_producers.find(edge);
+            if (it != batch_producers.end()) {
+                dependents[it->second].push_back(i);
+                pending[i]++;
+            }
         }
     }
-    static std::list<std::string > needs(NodeGroup::Item& weak_node) {
-        NodeGroup::SolidItem node = weak_node.lock();
-        if (node==nullptr) return {};
-        return needs(node->parameters());
+    std::vector<std::vector<size_t>> levels;
+    std::vector<size_t> current;
+    for (size_t i=0; i<count; i++) {
+        if (pending[i]==0) current.push_back(i);
     }
+    size_t sorted = 0;
+    while (!current.empty()) {
+        std::vector<size_t> next;
+        for (size_t i: current) {
+            for (size_t d: dependents[i]) {
+                if (--pending[d] == 0) next.push_back(d);
+            }
+        }
+        sorted += current.size();
+        levels.push_back(std::move(current));
+        current = std::move(next);
+    }
+    if (sorted != count) {
+        throw Error("Graph has cycle!");
+    }
+    AVTS validated_ns = wallclock.ns();
 
-
-    // sorting algorithm source: https://en.wikipedia.org/wiki/Topological_sorting#Depth-first_search
-    enum SortNodeMark {
-        None, Temporary, Permanent
+    std::vector<std::shared_ptr<NodeWrapper>> wrappers(count);
+    std::vector<AVTS> create_ns(count, 0), start_ns(count, 0);
+    std::vector<std::string> errors(count);
+    auto rollback = [&]() {
+        for (size_t i=0; i<count; i++) {
+            if (wrappers[i] == nullptr) continue;
+            try {
+                deleteNode(names[i]);
+            } catch (std::exception &e) {
+                logstream << "Removing node " << names[i] << " failed: " << e.what();
+            }
+        }
     };
-    struct SortNode {
-        NodeGroup::Item item;
-        SortNodeMark mark;
-        SortNode(NodeGroup::Item a_item): item(a_item), mark(None) {
+    auto failure = [&](const std::vector<size_t> &level) {
+        for (size_t i: level) {
+            if (!errors[i].empty()) {
+                rollback();
+                throw Error("Node " + names[i] + " failed: " + errors[i]);
+            }
         }
     };
-    static void sortVisit(SortNode& n, std::list<SortNode>& all_nodes, std::list<NodeGroup::Item> &target_list) {
-        if (n.mark==Permanent) return;
-        if (n.mark==Temporary) {
-            throw Error("Graph has cycle!");
-        }
-        auto n_offers = offers(n.item);
-        if (!n_offers.empty()) {
-            n.mark = Temporary;
-            for (SortNode &m: all_nodes) {
-                if (m.mark != None) continue; // WARNING: this optimization may sabotage cycle checking
-                auto m_needs = needs(m.item);
-                if (m_needs.empty()) continue; // skip the whole loop
-                bool has_edge = false;
-                // FIXME: the following loop-in-loop is inefficient!!!
-                for (const std::string &offer: n_offers) {
-                    for (const std::string &need: m_needs) {
-                        if (offer==need) {
-                            has_edge = true;
-                            break;
-                        }
-                    }
-                    if (has_edge) break;
-                }
-                if (has_edge) {
-                    sortVisit(m, all_nodes, target_list);
+    try {
+        for (size_t i=0; i<count; i++) {
+            wrappers[i] = registerNode(params[i]);
+        }
+    } catch (std::exception &e) {
+        rollback();
+        throw;
+    }
+
+    for (const std::vector<size_t> &level: levels) {
+        std::atomic_size_t next_index {0};
+        auto createSome = [&]() {
+            size_t n;
+            while ((n = next_index.fetch_add(1)) < level.size()) {
+                size_t i = level[n];
+                AVTS t = wallclock.ns();
+                try {
+                    wrappers[i]->createNode();
+                } catch (std::exception &e) {
+                    errors[i] = e.what();
                 }
+                create_ns[i] = wallclock.ns() - t;
             }
+        };
+        std::vector<std::thread> helpers;
+        for (size_t t=1; t<std::min(max_threads, level.size()); t++) {
+            helpers.push_back(start_thread("deploy", createSome));
         }
-        n.mark = Permanent;
-        target_list.push_front(n.item);
-    }
-    static void sort(std::list<NodeGroup::Item> &target_list, std::list<NodeGroup::Item> &source_list) {
-        target_list.clear();
-        std::list<SortNode> all_nodes;
-        for (NodeGroup::Item &elem: source_list) {
-            all_nodes.push_back(SortNode(elem));
+        createSome();
+        for (std::thread &thr: helpers) {
+            thr.join();
         }
-        for (SortNode &n: all_nodes) {
-            sortVisit(n, all_nodes, target_list);
+        failure(level);
+    }
+    AVTS created_ns = wallclock.ns();
+
+    if (start) {
+        for (const std::vector<size_t> &level: levels) {
+            for (size_t i: level) {
+                AVTS t = wallclock.ns();
+                try {
+                    wrappers[i]->start();
+                } catch (std::exception &e) {
+                    errors[i] = e.what();
+                }
+                start_ns[i] = wallclock.ns() - t;
+            }
+            failure(level);
         }
     }
-};
+    AVTS end_ns = wallclock.ns();
 
-void NodeGroup::sort() {
-    collectGarbage();
-    {
-        auto lock = getLock();
-        NodeGroupUtils::sort(sorted_nodes_, nodes_);
+    Parameters r;
+    Parameters jnodes = Parameters::object();
+    for (size_t l=0; l<levels.size(); l++) {
+        for (size_t i: levels[l]) {
+            Parameters &jnode = jnodes[names[i]];
+            jnode["level"] = l;
+            jnode["create_us"] = create_ns[i] / 1000;
+            if (start) {
+                jnode["start_us"] = start_ns[i] / 1000;
+            }
+        }
     }
+    r["nodes"] = jnodes;
+    r["levels"] = levels.size();
+    r["validate_us"] = (validated_ns - begin_ns) / 1000;
+    r["create_us"] = (created_ns - validated_ns) / 1000;
+    r["start_us"] = (end_ns - created_ns) / 1000;
+    r["total_us"] = (end_ns - begin_ns) / 1000;
+    logstream << "Deployed " << count << " nodes in " << levels.size() << " levels, " << r["total_us"] << " us";
+    return r;
 }
 
 NodeGroup::State NodeGroup::currentState() {
     auto lock = getLock();
     State s = State::EMPTY;
-    for (auto &node: nodes_) {
-        auto n = node.lock();
+    for (auto &entry: entries_) {
+        auto n = entry.second->item.lock();
         if (!n) continue;
         State ns = n->isWorking() ? State::STARTED : State::STOPPED;
         if (s != ns) {
@@ -721,12 +1260,16 @@ NodeWrapper::NodeWrapper(std::shared_ptr< NodeManager > manager, const Parameter
         name << std::hex << reinterpret_cast<std::uintptr_t>(this);
         name_ = name.str();
     }
+    trace_name_ = trace::intern(name_);
     if (params_.count("tick_source") > 0) {
         tick_source_ = InstanceSharedObjects<TickSource>::get(manager->instanceData(), params["tick_source"]);
     }
     if (params_.count("event_loop") > 0) {
         event_loop_ = InstanceSharedObjects<EventLoop>::get(manager->instanceData(), params["event_loop"]);
     }
+    if (params_.count("worker_pool") > 0) {
+        worker_pool_ = InstanceSharedObjects<WorkerPool>::get(manager->instanceData(), params["worker_pool"]);
+    }
     if (tick_source_ && event_loop_) {
         throw Error("tick_source and event_loop can't be specified at the same time");
     }
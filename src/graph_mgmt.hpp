@@ -2,8 +2,12 @@
 #include <functional>
 #include <unordered_map>
 #include <list>
+#include <map>
+#include <memory>
 #include <string>
+#include <vector>
 #include <mutex>
+#include <condition_variable>
 #include "Event.hpp"
 #include "graph_core.hpp"
 #include "graph_factory.hpp"
@@ -18,12 +22,18 @@ protected:
     InstanceData &instance_;
 public:
     std::shared_ptr<Node> produce(const Parameters &params);
+    bool hasType(const std::string &type) const {
+        return factories_.count(type) > 0;
+    }
     NodeFactory(std::shared_ptr<EdgeManager> edgeman, InstanceData &inst);
 };
 
 class NodeManager;
 class NodeGroup;
 class TickSource;
+class WorkerPool;
+class IReportsFinish;
+class IFlushable;
 
 class NodeWrapper: public std::enable_shared_from_this<NodeWrapper> {
 public:
@@ -31,12 +41,27 @@ public:
     using OnFinishedHandler = std::function<void(std::shared_ptr<NodeWrapper>, bool)>;
 protected:
     std::string name_;
+    const char* trace_name_ = "";
     std::shared_ptr<Node> node_;
     std::unique_ptr<std::thread> thread_;
     std::shared_ptr<NodeManager> manager_;
     std::shared_ptr<NodeGroup> group_;
     std::shared_ptr<TickSource> tick_source_;
     std::shared_ptr<EventLoop> event_loop_;
+    std::shared_ptr<WorkerPool> worker_pool_;
+    std::atomic_bool in_pool_ {false};
+    std::atomic<Event*> parked_on_ {nullptr}; // edge event the node waits for in worker pool
+    bool pool_running_ = false;
+    std::mutex pool_done_mutex_;
+    std::condition_variable pool_done_cv_;
+    // CPU time of finished runs / pool steps, plus CPU clock of currently running thread.
+    // The thread's clock is read and moved to cpu_time_ns_ under cpu_time_mutex_,
+    // so that cpuTimeNs() never counts it twice or misses it.
+    std::atomic<AVTS> cpu_time_ns_ {0};
+    std::mutex cpu_time_mutex_;
+    clockid_t thread_cpu_clock_ = 0;
+    bool thread_cpu_clock_valid_ = false;
+    AVTS cpu_time_reported_ns_ = 0; // last result of cpuTimeNs(), it never goes below
     std::atomic_bool dowork_ {false};
     std::atomic_bool finished_;
     std::atomic_bool stop_requested_;
@@ -46,8 +71,14 @@ protected:
     Parameters params_;
     std::recursive_mutex start_stop_mutex_;
     void threadFunction();
+    bool processStep(Node &node, IReportsFinish *node_finishable, IFlushable *node_flushable);
+    void finishProcessing(bool detach_thread);
+    void poolStart();
+    void poolStep();
+    Event* blockingEvent(Node &node);
+    void wakeParked();
     inline bool threadWorks() {
-        return ((thread_!=nullptr) && (!finished_));
+        return ((thread_!=nullptr || in_pool_) && (!finished_));
     }
     bool isNonBlocking() {
         return std::dynamic_pointer_cast<NonBlockingNodeBase>(node_) != nullptr;
@@ -80,6 +111,9 @@ public:
     bool stop(bool inhibit_actions = true);
     bool interrupt(bool optional = false);
     Parameters getObject(const std::string);
+    // CPU time consumed by this node's thread (or its steps in worker pool), in ns.
+    // Not measured for non-blocking nodes.
+    AVTS cpuTimeNs();
 
     bool stopAndWait();
     void join();
@@ -97,7 +131,27 @@ public:
 protected:
     std::string name_;
     NodeManager* manager_;
-    std::list<Item> nodes_;
+    // Dependency graph of the group's nodes, kept in topological order as nodes are added and removed
+    // (Pearce-Kelly dynamic topological sort). Edges are interned, producers & consumers indexed by edge id.
+    struct Entry {
+        Item item;
+        std::string name;
+        std::vector<size_t> offers, needs; // edge ids
+        uint64_t order;
+        uint64_t visit_mark = 0;
+        Entry* parent = nullptr; // on cycle search path
+    };
+    struct EdgeLinks {
+        std::string name;
+        std::vector<Entry*> producers, consumers;
+    };
+    std::unordered_map<const NodeWrapper*, std::unique_ptr<Entry>> entries_;
+    std::map<uint64_t, Entry*> order_;
+    std::unordered_map<std::string, size_t> edge_ids_;
+    std::vector<EdgeLinks> edge_links_;
+    static constexpr uint64_t order_base_ = uint64_t(1) << 62;
+    static constexpr uint64_t order_gap_ = uint64_t(1) << 16; // between nodes appended or renumbered
+    uint64_t visit_mark_ = 0;
     std::list<Item> sorted_nodes_;
     std::recursive_mutex busy_;
     std::atomic_uint64_t start_id_{0};
@@ -117,12 +171,17 @@ protected:
         mgmt_thread_wakeup_.signal();
     }
     std::thread mgmt_thread_;
-    bool is_sorted_ = false;
+    bool is_sorted_ = false; // sorted_nodes_ reflect order_
     std::unique_lock<decltype(busy_)> getLock() {
         return std::unique_lock<decltype(busy_)>(busy_);
     }
 private:
-    void sort();
+    size_t edgeId(const std::string &name);
+    void link(Entry &entry);
+    void unlink(Entry &entry);
+    void renumber();
+    uint64_t orderJustBefore(Entry &entry);
+    void orderBefore(Entry &u, Entry &v);
     bool doWithNodes(std::function<void(NodeWrapper&)> cb, const bool retry_single, const std::string &operation_desc);
     void stopNodesInternal();
     decltype(start_id_)::value_type startNodesInternal();
@@ -130,7 +189,9 @@ private:
     State currentState();
 public:
     void collectGarbage();
+    // throws if the node would make a cycle, leaving the group unchanged
     void add(SolidItem node);
+    void remove(const NodeWrapper* node);
     void stopNodes() {
         goToState(State::STOPPED);
     }
@@ -164,10 +225,16 @@ protected:
     
     bool nodeExists(const std::string &name);
     std::shared_ptr<NodeWrapper> getNodeByName(const std::string &name);
+    std::shared_ptr<NodeWrapper> registerNode(Parameters &params);
     void panic();
 public:
     NodeManager(const NodeManager&) = delete;
     std::shared_ptr<NodeWrapper> createNode(Parameters &params, const bool early_create, const bool start);
+    // Adds a whole graph at once: {"nodes": [...], "start": true, "threads": 0}
+    // Checks connections of all nodes first, creates nodes which don't depend on each other in parallel,
+    // then starts them in topological order. If any node fails, all nodes of the graph are removed.
+    // Returns timing of every node.
+    Parameters deploy(const Parameters &graph);
     void deleteNode(const std::string &name);
     void interrupt();
     void shutdown(); // do not use NodeManager after calling it
@@ -189,6 +256,15 @@ public:
         }
         return (*iter).second;
     }
+    std::vector<std::shared_ptr<NodeWrapper>> nodes() {
+        auto lock = getLock();
+        std::vector<std::shared_ptr<NodeWrapper>> r;
+        r.reserve(nodes_index_.size());
+        for (auto &entry: nodes_index_) {
+            r.push_back(entry.second);
+        }
+        return r;
+    }
     decltype(edges_)& edges() {
         return edges_;
     }
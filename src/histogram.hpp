@@ -0,0 +1,138 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <json.hpp>
+
+// Log-bucketed (HDR-style) histogram of non-negative integer values.
+// Every power of 2 range is split into 2^SubBits linear sub-buckets,
+// so the relative error of reported values is below 2^-SubBits.
+// Recording is a relaxed atomic increment, safe to call from any thread on hot paths.
+template<unsigned SubBits = 2> class LogHistogram {
+protected:
+    static constexpr unsigned sub_count_ = 1u << SubBits;
+    static constexpr unsigned bucket_count_ = (65 - SubBits) * sub_count_;
+    std::array<std::atomic_uint64_t, bucket_count_> buckets_ {};
+    std::atomic_uint64_t total_ {0};
+    std::atomic_uint64_t max_ {0};
+
+    static unsigned bucketIndex(uint64_t value) {
+        if (value < sub_count_) return value;
+        unsigned msb = 63 - __builtin_clzll(value);
+        unsigned shift = msb - SubBits;
+        unsigned sub = (value >> shift) & (sub_count_ - 1);
+        return (shift + 1) * sub_count_ + sub;
+    }
+    static uint64_t bucketLowerBound(unsigned index) {
+        if (index < sub_count_) return index;
+        unsigned shift = index / sub_count_ - 1;
+        uint64_t sub = index % sub_count_;
+        return (sub_count_ + sub) << shift;
+    }
+    static uint64_t bucketUpperBound(unsigned index) {
+        if (index < sub_count_) return index;
+        unsigned shift = index / sub_count_ - 1;
+        return bucketLowerBound(index) + (uint64_t(1) << shift) - 1;
+    }
+public:
+    // weight is usually 1, but may be e.g. duration for time-weighted histograms
+    void record(uint64_t value, uint64_t weight = 1) {
+        buckets_[bucketIndex(value)].fetch_add(weight, std::memory_order_relaxed);
+        total_.fetch_add(weight, std::memory_order_relaxed);
+        uint64_t prev_max = max_.load(std::memory_order_relaxed);
+        while (value > prev_max && !max_.compare_exchange_weak(prev_max, value, std::memory_order_relaxed)) {
+        }
+    }
+    uint64_t total() const {
+        return total_.load(std::memory_order_relaxed);
+    }
+    uint64_t max() const {
+        return max_.load(std::memory_order_relaxed);
+    }
+    // returns upper bound of the bucket containing requested quantile (0..1)
+    uint64_t quantile(double q) const {
+        uint64_t total = this->total();
+        if (total == 0) return 0;
+        uint64_t threshold = q * total;
+        if (threshold >= total) threshold = total - 1;
+        uint64_t sum = 0;
+        for (unsigned i=0; i<bucket_count_; i++) {
+            sum += buckets_[i].load(std::memory_order_relaxed);
+            if (sum > threshold) {
+                uint64_t ub = bucketUpperBound(i);
+                return std::min(ub, max());
+            }
+        }
+        return max();
+    }
+    void reset() {
+        for (auto &b: buckets_) {
+            b.store(0, std::memory_order_relaxed);
+        }
+        total_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+    // {"count": ..., "max": ..., "p50": ..., "p90": ..., "p99": ..., "p999": ..., "buckets": [[lower_bound, count], ...]}
+    // only non-empty buckets are listed
+    nlohmann::json toJson() const {
+        nlohmann::json r;
+        r["count"] = total();
+        r["max"] = max();
+        r["p50"] = quantile(0.5);
+        r["p90"] = quantile(0.9);
+        r["p99"] = quantile(0.99);
+        r["p999"] = quantile(0.999);
+        nlohmann::json buckets = nlohmann::json::array();
+        for (unsigned i=0; i<bucket_count_; i++) {
+            uint64_t count = buckets_[i].load(std::memory_order_relaxed);
+            if (count == 0) continue;
+            buckets.push_back(nlohmann::json::array({ bucketLowerBound(i), count }));
+        }
+        r["buckets"] = buckets;
+        return r;
+    }
+    // toJson() format of values recorded between two toJson() results of the same histogram,
+    // for readers which must not reset() a shared histogram. max is the upper bound of the highest bucket.
+    static nlohmann::json jsonSince(const nlohmann::json &now, const nlohmann::json &before) {
+        std::array<uint64_t, bucket_count_> counts {};
+        for (const nlohmann::json &b: now["buckets"]) {
+            counts[bucketIndex(b[0].get<uint64_t>())] += b[1].get<uint64_t>();
+        }
+        if (before.is_object() && before.count("buckets")) {
+            for (const nlohmann::json &b: before["buckets"]) {
+                uint64_t &c = counts[bucketIndex(b[0].get<uint64_t>())];
+                c -= std::min(c, b[1].get<uint64_t>());
+            }
+        }
+        uint64_t total = 0;
+        uint64_t max = 0;
+        nlohmann::json buckets = nlohmann::json::array();
+        for (unsigned i=0; i<bucket_count_; i++) {
+            if (counts[i] == 0) continue;
+            total += counts[i];
+            max = std::min(bucketUpperBound(i), now["max"].get<uint64_t>());
+            buckets.push_back(nlohmann::json::array({ bucketLowerBound(i), counts[i] }));
+        }
+        auto quantile = [&](double q) -> uint64_t {
+            if (total == 0) return 0;
+            uint64_t threshold = q * total;
+            if (threshold >= total) threshold = total - 1;
+            uint64_t sum = 0;
+            for (unsigned i=0; i<bucket_count_; i++) {
+                sum += counts[i];
+                if (sum > threshold) return std::min(bucketUpperBound(i), max);
+            }
+            return max;
+        };
+        nlohmann::json r;
+        r["count"] = total;
+        r["max"] = max;
+        r["p50"] = quantile(0.5);
+        r["p90"] = quantile(0.9);
+        r["p99"] = quantile(0.99);
+        r["p999"] = quantile(0.999);
+        r["buckets"] = buckets;
+        return r;
+    }
+};
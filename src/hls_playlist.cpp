@@ -0,0 +1,103 @@
+#include "hls_playlist.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+HlsMediaPlaylist::HlsMediaPlaylist(const double max_segment_duration, const double part_target, const size_t list_size, const bool event, const std::string init_uri):
+    part_target_(part_target), list_size_(list_size), event_(event), init_uri_(init_uri) {
+    // EXTINF rounded to the nearest integer must not exceed EXT-X-TARGETDURATION
+    target_duration_ = std::max(1, int(std::lround(max_segment_duration)));
+}
+
+std::string HlsMediaPlaylist::formatDuration(const double seconds) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.5f", seconds);
+    return buf;
+}
+
+void HlsMediaPlaylist::addPart(const std::string &segment_uri, const Part &part) {
+    open_parts_ += "#EXT-X-PART:DURATION=" + formatDuration(part.duration) + ",URI=\"" + segment_uri
+        + "\",BYTERANGE=\"" + std::to_string(part.size) + "@" + std::to_string(part.offset) + "\"";
+    if (part.independent) {
+        open_parts_ += ",INDEPENDENT=YES";
+    }
+    open_parts_ += '\n';
+}
+
+void HlsMediaPlaylist::setPreloadHint(const std::string &segment_uri, const uint64_t offset) {
+    if (segment_uri.empty()) {
+        preload_hint_.clear();
+    } else {
+        preload_hint_ = "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"" + segment_uri + "\",BYTERANGE-START=" + std::to_string(offset) + "\n";
+    }
+}
+
+std::vector<std::string> HlsMediaPlaylist::addSegment(const uint64_t sequence, const std::string &uri, const double duration) {
+    segments_.push_back({ sequence, uri, std::move(open_parts_), "#EXTINF:" + formatDuration(duration) + ",\n" + uri + "\n" });
+    open_parts_.clear();
+    if (part_target_ > 0) {
+        segments_with_parts_++;
+        while (segments_with_parts_ > parts_kept_segments) {
+            Segment &old = segments_[segments_.size() - segments_with_parts_];
+            old.parts.clear();
+            old.parts.shrink_to_fit();
+            segments_with_parts_--;
+        }
+    }
+    std::vector<std::string> removed;
+    if (list_size_ > 0 && !event_) {
+        while (segments_.size() > list_size_) {
+            removed.push_back(std::move(segments_.front().uri));
+            segments_.pop_front();
+        }
+        segments_with_parts_ = std::min(segments_with_parts_, segments_.size());
+    }
+    return removed;
+}
+
+void HlsMediaPlaylist::end() {
+    ended_ = true;
+    preload_hint_.clear();
+}
+
+std::string HlsMediaPlaylist::render() const {
+    std::string r = "#EXTM3U\n";
+    r += part_target_ > 0 ? "#EXT-X-VERSION:9\n" : "#EXT-X-VERSION:7\n";
+    r += "#EXT-X-TARGETDURATION:" + std::to_string(target_duration_) + "\n";
+    if (event_) {
+        r += "#EXT-X-PLAYLIST-TYPE:EVENT\n";
+    }
+    if (part_target_ > 0) {
+        r += "#EXT-X-PART-INF:PART-TARGET=" + formatDuration(part_target_) + "\n";
+        r += "#EXT-X-SERVER-CONTROL:PART-HOLD-BACK=" + formatDuration(3 * part_target_) + "\n";
+    }
+    r += "#EXT-X-INDEPENDENT-SEGMENTS\n";
+    r += "#EXT-X-MEDIA-SEQUENCE:" + std::to_string(segments_.empty() ? 0 : segments_.front().sequence) + "\n";
+    r += "#EXT-X-MAP:URI=\"" + init_uri_ + "\"\n";
+    for (const Segment &s: segments_) {
+        r += s.parts;
+        r += s.lines;
+    }
+    if (!ended_) {
+        r += open_parts_;
+        r += preload_hint_;
+    } else {
+        r += "#EXT-X-ENDLIST\n";
+    }
+    return r;
+}
+
+std::string renderHlsMasterPlaylist(const std::vector<HlsVariantInfo> &variants) {
+    std::string r = "#EXTM3U\n#EXT-X-VERSION:7\n#EXT-X-INDEPENDENT-SEGMENTS\n";
+    for (const HlsVariantInfo &v: variants) {
+        r += "#EXT-X-STREAM-INF:BANDWIDTH=" + std::to_string(v.bandwidth);
+        if (v.width > 0 && v.height > 0) {
+            r += ",RESOLUTION=" + std::to_string(v.width) + "x" + std::to_string(v.height);
+        }
+        if (!v.codecs.empty()) {
+            r += ",CODECS=\"" + v.codecs + "\"";
+        }
+        r += "\n" + v.uri + "\n";
+    }
+    return r;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+// HLS media playlist kept in memory and updated incrementally: lines of every segment
+// and part are formatted once, when it is added, so rendering the playlist after each
+// part or segment only concatenates them.
+// Segments are fMP4 files with a common initialization section (EXT-X-MAP).
+// If part_target > 0, partial segments (LL-HLS) are listed as byte ranges of their segment files,
+// for the last 3 segments and the one being written.
+class HlsMediaPlaylist {
+public:
+    struct Part {
+        double duration;
+        uint64_t offset; // in segment file
+        uint64_t size;
+        bool independent; // starts with a keyframe
+    };
+protected:
+    struct Segment {
+        uint64_t sequence;
+        std::string uri;
+        std::string parts; // EXT-X-PART lines
+        std::string lines; // EXTINF & URI
+    };
+    double part_target_;
+    size_t list_size_; // 0 = unlimited
+    bool event_;
+    std::string init_uri_;
+    std::deque<Segment> segments_;
+    size_t segments_with_parts_ = 0; // at the end of segments_
+    std::string open_parts_; // of segment being written
+    std::string preload_hint_;
+    int target_duration_; // EXT-X-TARGETDURATION, must not change
+    bool ended_ = false;
+public:
+    static constexpr size_t parts_kept_segments = 3;
+    // event: EXT-X-PLAYLIST-TYPE:EVENT, nothing removed regardless of list_size
+    // max_segment_duration: no segment may be longer, determines EXT-X-TARGETDURATION
+    HlsMediaPlaylist(const double max_segment_duration, const double part_target, const size_t list_size, const bool event, const std::string init_uri);
+    void addPart(const std::string &segment_uri, const Part &part);
+    // where the next part will be (EXT-X-PRELOAD-HINT), empty uri to remove
+    void setPreloadHint(const std::string &segment_uri, const uint64_t offset);
+    // completes segment, whose parts were added with addPart,
+    // returns URIs of segments which went out of the list
+    // duration must not exceed max_segment_duration given to the constructor
+    std::vector<std::string> addSegment(const uint64_t sequence, const std::string &uri, const double duration);
+    void end();
+    bool empty() const {
+        return segments_.empty();
+    }
+    int targetDuration() const {
+        return target_duration_;
+    }
+    std::string render() const;
+    static std::string formatDuration(const double seconds);
+};
+
+struct HlsVariantInfo {
+    std::string uri;
+    uint64_t bandwidth = 0; // bits per second
+    int width = 0;
+    int height = 0;
+    std::string codecs;
+};
+
+// multivariant (master) playlist
+std::string renderHlsMasterPlaylist(const std::vector<HlsVariantInfo> &variants);
@@ -80,6 +80,10 @@ public:
         }
         return r;
     }
+    static bool exists(const InstanceData &instance, const std::string id) {
+        std::unique_lock<decltype(busy_)> lock(busy_);
+        return bool(find(instance, id));
+    }
     enum class PolicyIfExists {
         Overwrite,
         Ignore,
@@ -0,0 +1,312 @@
+#include "loudness.hpp"
+#include <algorithm>
+#include <cmath>
+extern "C" {
+#include <libavutil/channel_layout.h>
+}
+
+namespace {
+    constexpr size_t recent_blocks = 30; // 3 s of 100 ms blocks
+    constexpr size_t momentary_blocks = 4;
+    constexpr double histogram_step = 0.01;
+    constexpr size_t histogram_bins = (LoudnessMeter::max_loudness - LoudnessMeter::min_loudness) / histogram_step;
+    constexpr double integrated_gate = 10; // LU, BS.1770-4
+    constexpr double range_gate = 20; // LU, EBU Tech 3342
+
+    // 4x oversampling interpolator, ITU-R BS.1770-4 Annex 2
+    constexpr size_t tp_phases = 4;
+    constexpr size_t tp_taps = 12;
+    constexpr float tp_coefs[tp_phases][tp_taps] = {
+        { 0.0017089843750, 0.0109863281250, -0.0196533203125, 0.0332031250000, -0.0594482421875, 0.1373291015625,
+          0.9721679687500, -0.1022949218750, 0.0476074218750, -0.0266113281250, 0.0148925781250, -0.0083007812500 },
+        { -0.0291748046875, 0.0292968750000, -0.0517578125000, 0.0891113281250, -0.1665039062500, 0.4650878906250,
+          0.7797851562500, -0.2003173828125, 0.1015625000000, -0.0582275390625, 0.0330810546875, -0.0189208984375 },
+        { -0.0189208984375, 0.0330810546875, -0.0582275390625, 0.1015625000000, -0.2003173828125, 0.7797851562500,
+          0.4650878906250, -0.1665039062500, 0.0891113281250, -0.0517578125000, 0.0292968750000, -0.0291748046875 },
+        { -0.0083007812500, 0.0148925781250, -0.0266113281250, 0.0476074218750, -0.1022949218750, 0.9721679687500,
+          0.1373291015625, -0.0594482421875, 0.0332031250000, -0.0196533203125, 0.0109863281250, 0.0017089843750 },
+    };
+
+    size_t histogramBin(const double lufs) {
+        return std::min<size_t>(histogram_bins-1, (lufs - LoudnessMeter::min_loudness) / histogram_step);
+    }
+    double histogramBinLoudness(const size_t bin) {
+        return LoudnessMeter::min_loudness + (bin + 0.5) * histogram_step;
+    }
+};
+
+LoudnessMeter::Histogram::Histogram(): counts_(histogram_bins, 0), energies_(histogram_bins, 0) {
+}
+
+void LoudnessMeter::Histogram::add(const double energy) {
+    double lufs = loudness(energy);
+    if (lufs <= min_loudness) {
+        return; // absolute gate
+    }
+    size_t bin = histogramBin(lufs);
+    counts_[bin]++;
+    energies_[bin] += energy;
+    total_count_++;
+    total_energy_ += energy;
+}
+
+void LoudnessMeter::Histogram::clear() {
+    std::fill(counts_.begin(), counts_.end(), 0);
+    std::fill(energies_.begin(), energies_.end(), 0);
+    total_count_ = 0;
+    total_energy_ = 0;
+}
+
+double LoudnessMeter::Histogram::gatedEnergy(const double gate) const {
+    if (total_count_ == 0) {
+        return 0;
+    }
+    double threshold = loudness(total_energy_ / total_count_) - gate;
+    size_t first = threshold > min_loudness ? histogramBin(threshold) : 0;
+    uint64_t count = 0;
+    double energy = 0;
+    for (size_t i=first; i<histogram_bins; i++) {
+        count += counts_[i];
+        energy += energies_[i];
+    }
+    return count ? energy / count : 0;
+}
+
+void LoudnessMeter::Histogram::gatedPercentiles(const double gate, const double low, const double high, double &low_lufs, double &high_lufs) const {
+    low_lufs = high_lufs = 0;
+    if (total_count_ == 0) {
+        return;
+    }
+    double threshold = loudness(total_energy_ / total_count_) - gate;
+    size_t first = threshold > min_loudness ? histogramBin(threshold) : 0;
+    uint64_t count = 0;
+    for (size_t i=first; i<histogram_bins; i++) {
+        count += counts_[i];
+    }
+    if (count == 0) {
+        return;
+    }
+    // nearest rank
+    uint64_t low_rank = std::llround(low * (count-1));
+    uint64_t high_rank = std::llround(high * (count-1));
+    uint64_t seen = 0;
+    bool low_found = false;
+    for (size_t i=first; i<histogram_bins; i++) {
+        seen += counts_[i];
+        if (!low_found && seen > low_rank) {
+            low_lufs = histogramBinLoudness(i);
+            low_found = true;
+        }
+        if (seen > high_rank) {
+            high_lufs = histogramBinLoudness(i);
+            return;
+        }
+    }
+}
+
+double LoudnessMeter::loudness(const double energy) {
+    if (energy <= 1e-13) {
+        return -120;
+    }
+    return -0.691 + 10 * std::log10(energy);
+}
+
+void LoudnessMeter::configure(const int sample_rate, const uint64_t channel_layout, const size_t channels, const bool true_peak) {
+    sample_rate_ = sample_rate;
+    channels_ = channels;
+    block_samples_ = std::max<size_t>(1, std::lround(sample_rate / 10.0));
+    measure_peaks_ = true_peak;
+    // above 96 kHz plain sample peak is close enough to true peak
+    true_peak_ = true_peak && sample_rate < 96000;
+
+    // K-weighting: high shelf and high pass, coefficients for any sample rate
+    // (BS.1770 specifies them for 48 kHz only; these reproduce them exactly at 48 kHz)
+    {
+        const double f0 = 1681.974450955533;
+        const double gain_db = 3.999843853973347;
+        const double q = 0.7071752369554196;
+        const double k = std::tan(M_PI * f0 / sample_rate);
+        const double vh = std::pow(10.0, gain_db / 20.0);
+        const double vb = std::pow(vh, 0.4996667741545416);
+        const double a0 = 1.0 + k / q + k * k;
+        shelf_ = { (vh + vb * k / q + k * k) / a0, 2.0 * (k * k - vh) / a0, (vh - vb * k / q + k * k) / a0,
+                   2.0 * (k * k - 1.0) / a0, (1.0 - k / q + k * k) / a0 };
+    }
+    {
+        const double f0 = 38.13547087602444;
+        const double q = 0.5003270373238773;
+        const double k = std::tan(M_PI * f0 / sample_rate);
+        const double a0 = 1.0 + k / q + k * k;
+        highpass_ = { 1.0, -2.0, 1.0, 2.0 * (k * k - 1.0) / a0, (1.0 - k / q + k * k) / a0 };
+    }
+
+    // channel weights: LFE is ignored, surround channels (at the sides) are +1.5 dB
+    weights_.assign(channels, 1.0);
+    if (channel_layout != 0) {
+        const bool has_sides = channel_layout & (AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT);
+        for (size_t ch=0; ch<channels; ch++) {
+            uint64_t channel = av_channel_layout_extract_channel(channel_layout, ch);
+            if (channel & (AV_CH_LOW_FREQUENCY | AV_CH_LOW_FREQUENCY_2)) {
+                weights_[ch] = 0;
+            } else if (channel & (AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT)) {
+                weights_[ch] = 1.41;
+            } else if (!has_sides && (channel & (AV_CH_BACK_LEFT | AV_CH_BACK_RIGHT))) {
+                weights_[ch] = 1.41;
+            }
+        }
+    }
+    reset();
+}
+
+void LoudnessMeter::reset() {
+    filter_state_.assign(channels_ * 4, 0);
+    channel_energy_.assign(channels_, 0);
+    completed_.resize(channels_);
+    for (auto &c: completed_) {
+        c.clear();
+    }
+    tp_history_.assign(true_peak_ ? channels_ : 0, std::vector<float>(tp_taps - 1, 0));
+    true_peaks_.assign(measure_peaks_ ? channels_ : 0, 0);
+    block_pos_ = 0;
+    recent_.assign(recent_blocks, 0);
+    recent_count_ = 0;
+    recent_next_ = 0;
+    momentary_energy_ = 0;
+    momentary_max_energy_ = 0;
+    short_term_energy_ = 0;
+    gating_blocks_.clear();
+    short_term_blocks_.clear();
+}
+
+void LoudnessMeter::resetIntegrated() {
+    gating_blocks_.clear();
+    short_term_blocks_.clear();
+}
+
+void LoudnessMeter::addChannel(const size_t ch, const float* samples, const size_t count) {
+    double* z = &filter_state_[ch * 4];
+    double z0 = z[0], z1 = z[1], z2 = z[2], z3 = z[3];
+    const Biquad s = shelf_, h = highpass_;
+    double energy = channel_energy_[ch];
+    size_t pos = block_pos_;
+    std::vector<double> &completed = completed_[ch];
+    completed.clear();
+    for (size_t i=0; i<count;) {
+        // up to the end of the current 100 ms block
+        size_t end = std::min(count, i + (block_samples_ - pos));
+        for (size_t j=i; j<end; j++) {
+            // two biquads, transposed direct form II
+            double x = samples[j];
+            double y = s.b0 * x + z0;
+            z0 = s.b1 * x - s.a1 * y + z1;
+            z1 = s.b2 * x - s.a2 * y;
+            double w = h.b0 * y + z2;
+            z2 = h.b1 * y - h.a1 * w + z3;
+            z3 = h.b2 * y - h.a2 * w;
+            energy += w * w;
+        }
+        pos += end - i;
+        i = end;
+        if (pos == block_samples_) {
+            completed.push_back(energy);
+            energy = 0;
+            pos = 0;
+        }
+    }
+    z[0] = z0; z[1] = z1; z[2] = z2; z[3] = z3;
+    channel_energy_[ch] = energy;
+
+    if (true_peak_) {
+        truePeak(ch, samples, count);
+    } else if (measure_peaks_) {
+        float peak = true_peaks_[ch];
+        for (size_t i=0; i<count; i++) {
+            peak = std::max(peak, std::fabs(samples[i]));
+        }
+        true_peaks_[ch] = peak;
+    }
+}
+
+void LoudnessMeter::truePeak(const size_t ch, const float* samples, const size_t count) {
+    const size_t history = tp_taps - 1;
+    std::vector<float> &hist = tp_history_[ch];
+    if (tp_buffer_.size() < count + history) {
+        tp_buffer_.resize(count + history);
+    }
+    std::copy(hist.begin(), hist.end(), tp_buffer_.begin());
+    std::copy(samples, samples + count, tp_buffer_.begin() + history);
+    float peak = true_peaks_[ch];
+    for (size_t i=0; i<count; i++) {
+        // newest sample is x[0]
+        const float* x = &tp_buffer_[i + history];
+        for (size_t p=0; p<tp_phases; p++) {
+            float y = 0;
+            for (size_t k=0; k<tp_taps; k++) {
+                y += tp_coefs[p][k] * x[-ptrdiff_t(k)];
+            }
+            peak = std::max(peak, std::fabs(y));
+        }
+    }
+    true_peaks_[ch] = peak;
+    std::copy(tp_buffer_.begin() + count, tp_buffer_.begin() + count + history, hist.begin());
+}
+
+void LoudnessMeter::endFrame(const size_t count) {
+    if (channels_ == 0) {
+        return;
+    }
+    size_t blocks = completed_[0].size();
+    for (size_t b=0; b<blocks; b++) {
+        double energy = 0;
+        for (size_t ch=0; ch<channels_; ch++) {
+            energy += weights_[ch] * completed_[ch][b];
+        }
+        endBlock(energy / block_samples_);
+    }
+    block_pos_ = (block_pos_ + count) % block_samples_;
+}
+
+double LoudnessMeter::recentEnergy(const size_t blocks) const {
+    double sum = 0;
+    for (size_t i=1; i<=blocks; i++) {
+        sum += recent_[(recent_next_ + recent_blocks - i) % recent_blocks];
+    }
+    return sum / blocks;
+}
+
+void LoudnessMeter::endBlock(const double energy) {
+    recent_[recent_next_] = energy;
+    recent_next_ = (recent_next_ + 1) % recent_blocks;
+    recent_count_ = std::min(recent_count_ + 1, recent_blocks);
+    if (recent_count_ < momentary_blocks) {
+        return;
+    }
+    // 400 ms gating blocks overlap by 75%
+    momentary_energy_ = recentEnergy(momentary_blocks);
+    momentary_max_energy_ = std::max(momentary_max_energy_, momentary_energy_);
+    gating_blocks_.add(momentary_energy_);
+    // short-term loudness until the first 3 s are measured is over the available blocks
+    short_term_energy_ = recentEnergy(recent_count_);
+    if (recent_count_ == recent_blocks) {
+        short_term_blocks_.add(short_term_energy_);
+    }
+}
+
+LoudnessMeter::Result LoudnessMeter::takeResult() {
+    Result r;
+    r.valid = recent_count_ >= momentary_blocks;
+    if (r.valid) {
+        r.momentary = loudness(momentary_energy_);
+        r.momentary_max = loudness(momentary_max_energy_);
+        r.short_term = loudness(short_term_energy_);
+        r.integrated = loudness(gating_blocks_.gatedEnergy(integrated_gate));
+        short_term_blocks_.gatedPercentiles(range_gate, 0.10, 0.95, r.range_low, r.range_high);
+        r.range = r.range_high - r.range_low;
+        momentary_max_energy_ = momentary_energy_;
+    }
+    if (measure_peaks_) {
+        r.true_peaks = true_peaks_;
+        std::fill(true_peaks_.begin(), true_peaks_.end(), 0);
+    }
+    return r;
+}
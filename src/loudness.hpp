@@ -0,0 +1,88 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Streaming loudness meter according to ITU-R BS.1770-4 / EBU R128 (Tech 3341, 3342):
+// momentary (400 ms), short-term (3 s) and gated integrated loudness, loudness range
+// and optionally true peak (4x oversampling, BS.1770 Annex 2 interpolator).
+// Integrated loudness and loudness range cover everything since configure() or reset();
+// blocks are kept in 0.01 LU histograms, so memory and reporting cost don't grow with time.
+//
+// Usage, for each frame: addChannel() for every channel with the same number of samples, then endFrame().
+class LoudnessMeter {
+public:
+    struct Result {
+        bool valid = false; // false until the first 400 ms are measured
+        double momentary = 0;
+        double momentary_max = 0; // since last takeResult
+        double short_term = 0;
+        double integrated = 0;
+        double range = 0;
+        double range_low = 0;
+        double range_high = 0;
+        std::vector<double> true_peaks; // per channel, linear, since last takeResult; empty if disabled
+    };
+    static constexpr double min_loudness = -70;
+    static constexpr double max_loudness = 5;
+protected:
+    struct Biquad {
+        double b0, b1, b2, a1, a2;
+    };
+    // block loudness histogram, -70 .. +5 LUFS in 0.01 LU steps
+    class Histogram {
+    protected:
+        std::vector<uint64_t> counts_;
+        std::vector<double> energies_;
+        uint64_t total_count_ = 0;
+        double total_energy_ = 0;
+    public:
+        Histogram();
+        void add(const double energy);
+        void clear();
+        uint64_t count() const {
+            return total_count_;
+        }
+        // mean energy of blocks with loudness above the relative gate (gate LU below the mean of all blocks)
+        double gatedEnergy(const double gate) const;
+        // percentiles (0..1) of loudness of blocks above the relative gate
+        void gatedPercentiles(const double gate, const double low, const double high, double &low_lufs, double &high_lufs) const;
+    };
+    int sample_rate_ = 0;
+    size_t channels_ = 0;
+    size_t block_samples_ = 0; // 100 ms
+    bool measure_peaks_ = false;
+    bool true_peak_ = false; // oversampling, only below 96 kHz
+    Biquad shelf_, highpass_;
+    std::vector<double> weights_;
+    std::vector<double> filter_state_; // 4 per channel
+    std::vector<double> channel_energy_; // in current 100 ms block
+    std::vector<std::vector<double>> completed_; // per channel, energies of blocks completed in current frame
+    std::vector<std::vector<float>> tp_history_; // per channel, last input samples for the interpolator
+    std::vector<float> tp_buffer_;
+    std::vector<double> true_peaks_;
+    size_t block_pos_ = 0;
+    std::vector<double> recent_; // ring of last 30 block energies
+    size_t recent_count_ = 0;
+    size_t recent_next_ = 0;
+    double momentary_energy_ = 0;
+    double momentary_max_energy_ = 0;
+    double short_term_energy_ = 0;
+    Histogram gating_blocks_;
+    Histogram short_term_blocks_;
+
+    double recentEnergy(const size_t blocks) const;
+    void endBlock(const double energy);
+    void truePeak(const size_t ch, const float* samples, const size_t count);
+public:
+    // channel_layout is a mask of AV_CH_* flags, 0 if unknown (then all channels have weight 1)
+    void configure(const int sample_rate, const uint64_t channel_layout, const size_t channels, const bool true_peak);
+    void reset();
+    // starts integrated loudness and loudness range anew, keeps filters and momentary / short-term windows
+    void resetIntegrated();
+    void addChannel(const size_t ch, const float* samples, const size_t count);
+    void endFrame(const size_t count);
+    Result takeResult();
+    // LUFS of mean square energy
+    static double loudness(const double energy);
+};
@@ -12,6 +12,8 @@ std::shared_ptr<AVPlumber> avp_ptr = nullptr;
 
 void abort_handler(int) {
     logstream << "SIGABRT received";
+    // the process is killed when we return, write what's still queued
+    current_thread.logger->flush();
 }
 
 void stop_handler(int) {
@@ -66,5 +68,8 @@ int main(int argc, char **argv) {
     // and implicitly called (on exit) destructor of static field InstanceSharedObjectsDestructors::destructors_
     avp_ptr = nullptr;
 
+    // other threads may still hold the logger, so its destructor isn't guaranteed to run
+    current_thread.logger->flush();
+
     return 0;
 }
@@ -0,0 +1,149 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <utility>
+#include <vector>
+#include <json.hpp>
+#include "graph_mgmt.hpp"
+#include "stats.hpp"
+
+using nlohmann::json;
+
+namespace {
+    using Labels = std::vector<std::pair<std::string, std::string>>;
+
+    std::string sanitizeName(const std::string &name) {
+        std::string r = name;
+        for (char &c: r) {
+            if (!(std::isalnum(static_cast<unsigned char>(c)) || c=='_' || c==':')) {
+                c = '_';
+            }
+        }
+        if (r.empty() || std::isdigit(static_cast<unsigned char>(r[0]))) {
+            r = "_" + r;
+        }
+        return r;
+    }
+
+    std::string escapeLabelValue(const std::string &value) {
+        std::string r;
+        r.reserve(value.size());
+        for (char c: value) {
+            if (c=='\\' || c=='"') {
+                r += '\\';
+                r += c;
+            } else if (c=='\n') {
+                r += "\\n";
+            } else {
+                r += c;
+            }
+        }
+        return r;
+    }
+
+    // name, or name_2, name_3... if labels already have it (arrays nested in arrays)
+    std::string uniqueLabelName(const Labels &labels, const std::string &name) {
+        std::string r = name;
+        for (int n=2; std::any_of(labels.begin(), labels.end(), [&r](const std::pair<std::string, std::string> &l) { return l.first == r; }); n++) {
+            r = name + "_" + std::to_string(n);
+        }
+        return r;
+    }
+
+    std::string formatValue(const double value) {
+        if (std::isnan(value)) return "NaN";
+        if (std::isinf(value)) return value > 0 ? "+Inf" : "-Inf";
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.15g", value);
+        return buf;
+    }
+
+    // Samples grouped by metric name, as the exposition format requires.
+    class MetricsText {
+    protected:
+        std::map<std::string, std::vector<std::string>> families_;
+        std::map<std::string, std::string> types_;
+    public:
+        void add(const std::string &name, const Labels &labels, const double value, const char* type = nullptr) {
+            std::string line = name;
+            if (!labels.empty()) {
+                line += '{';
+                for (size_t i=0; i<labels.size(); i++) {
+                    if (i) line += ',';
+                    line += labels[i].first + "=\"" + escapeLabelValue(labels[i].second) + '"';
+                }
+                line += '}';
+            }
+            line += ' ';
+            line += formatValue(value);
+            families_[name].push_back(std::move(line));
+            if (type) {
+                types_[name] = type;
+            }
+        }
+        // key: name of j in its parent, used as label name for array indices
+        void addJson(const std::string &name, const std::string &key, const Labels &labels, const json &j) {
+            if (j.is_object()) {
+                for (auto it = j.begin(); it != j.end(); ++it) {
+                    if (it.key() == "buckets") continue; // raw histogram buckets
+                    std::string child_key = sanitizeName(it.key());
+                    addJson(name + "_" + child_key, child_key, labels, it.value());
+                }
+            } else if (j.is_array()) {
+                std::string label = uniqueLabelName(labels, key.empty() ? "index" : key);
+                for (size_t i=0; i<j.size(); i++) {
+                    Labels child_labels = labels;
+                    child_labels.emplace_back(label, std::to_string(i));
+                    addJson(name, key, child_labels, j[i]);
+                }
+            } else if (j.is_boolean()) {
+                add(name, labels, j.get<bool>() ? 1 : 0);
+            } else if (j.is_number()) {
+                add(name, labels, j.get<double>());
+            }
+        }
+        std::string str() const {
+            std::string r;
+            for (auto &family: families_) {
+                auto type = types_.find(family.first);
+                if (type != types_.end()) {
+                    r += "# TYPE " + family.first + " " + type->second + "\n";
+                }
+                for (const std::string &line: family.second) {
+                    r += line;
+                    r += '\n';
+                }
+            }
+            return r;
+        }
+    };
+};
+
+std::string collectMetrics(NodeManager &manager) {
+    MetricsText m;
+    for (std::shared_ptr<NodeWrapper> &nw: manager.nodes()) {
+        Labels labels { {"node", nw->name()} };
+        m.add("avplumber_node_cpu_seconds_total", labels, nw->cpuTimeNs() / 1e9, "counter");
+        m.add("avplumber_node_working", labels, nw->isWorking() ? 1 : 0, "gauge");
+        try {
+            m.addJson("avplumber_node", "", labels, nw->getObject("stats"));
+        } catch (std::exception &e) {
+            // node not created or without statistics
+        }
+    }
+
+    json jqueues = json::object();
+    manager.edges()->collectEdgesStats(jqueues);
+    for (auto it = jqueues.begin(); it != jqueues.end(); ++it) {
+        m.addJson("avplumber_queue", "", { {"queue", it.key()} }, it.value());
+    }
+
+    std::shared_ptr<StatsRegistry> registry = InstanceSharedObjects<StatsRegistry>::get(manager.instanceData(), "default");
+    for (StatsRegistry::Entry &e: registry->snapshot()) {
+        m.addJson("avplumber_stats", "", { {"subscription", e.name}, {"subscription_id", std::to_string(e.id)} }, e.stats);
+    }
+    return m.str();
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include <string>
+
+class NodeManager;
+
+// Counters of nodes (CPU time, "stats" objects), queues and stats.subscribe subscriptions
+// in Prometheus text exposition format. Numeric and boolean JSON values become samples,
+// nested keys are joined with "_" and array indices become labels.
+std::string collectMetrics(NodeManager &manager);
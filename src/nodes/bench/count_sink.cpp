@@ -0,0 +1,36 @@
+#include "../node_common.hpp"
+
+// Null sink which counts what it receives, for avplumber_bench.
+template<typename T> class BenchCountSink: public NodeSingleInput<T>, public IReturnsObjects, public IWorkerPoolSafe {
+protected:
+    std::atomic_uint64_t count_ {0};
+    std::atomic_uint64_t bytes_ {0};
+public:
+    using NodeSingleInput<T>::NodeSingleInput;
+    virtual void process() {
+        T data = this->source_->get();
+        if (!data.isComplete()) {
+            return;
+        }
+        bytes_.fetch_add(data.size(), std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+    }
+    virtual Parameters getObject(const std::string name) {
+        if (name=="stats") {
+            Parameters r;
+            r["count"] = count_.load(std::memory_order_relaxed);
+            r["bytes"] = bytes_.load(std::memory_order_relaxed);
+            return r;
+        } else {
+            throw Error("Unknown object to get");
+        }
+    }
+    static std::shared_ptr<BenchCountSink> create(NodeCreationInfo &nci) {
+        EdgeManager &edges = nci.edges;
+        const Parameters &params = nci.params;
+        std::shared_ptr<Edge<T>> edge = edges.find<T>(params["src"]);
+        return std::make_shared<BenchCountSink>(make_unique<EdgeSource<T>>(edge));
+    }
+};
+
+DECLNODE_ATD(bench_count_sink, BenchCountSink);
@@ -0,0 +1,244 @@
+#include "../node_common.hpp"
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+}
+
+// Synthetic sources for avplumber_bench.
+// Every output item is a reference to the same preallocated prototype
+// (so that we measure graph overhead, not allocation & filling),
+// only timestamps differ.
+
+namespace {
+    av::Rational rateParam(const Parameters &params, const std::string &name, const std::string &default_value) {
+        if (params.count(name)==0) {
+            return parseRatio(default_value);
+        }
+        const Parameters &param = params[name];
+        return parseRatio(param.is_string() ? param.get<std::string>() : param.dump());
+    }
+    template<typename T> void setTimestamp(T &item, const av::Timestamp ts) {
+        item.setPts(ts);
+    }
+    void setTimestamp(av::Packet &item, const av::Timestamp ts) {
+        // demuxed packets have DTS, some nodes depend on it
+        item.setPts(ts);
+        item.setDts(ts);
+    }
+    template<typename T> void setKeyframe(T&, const bool) {
+    }
+    void setKeyframe(av::Packet &item, const bool key) {
+        if (key) {
+            item.raw()->flags |= AV_PKT_FLAG_KEY;
+        } else {
+            item.raw()->flags &= ~AV_PKT_FLAG_KEY;
+        }
+    }
+};
+
+template<typename T> class BenchSource: public NodeSingleOutput<T>, public ReportsFinishByFlag, public IStoppable, public IReturnsObjects, public IWorkerPoolSafe {
+protected:
+    T prototype_;
+    av::Rational time_base_;
+    int64_t pts_step_ = 1;
+    AVTS period_ns_ = 0;
+    bool realtime_ = false;
+    uint64_t count_limit_ = 0;
+    uint64_t keyframe_interval_ = 1;
+    std::atomic_uint64_t produced_ {0};
+    AVTS start_ns_ = -1;
+    void setPeriod(const av::Rational time_base, const int64_t pts_step) {
+        time_base_ = time_base;
+        pts_step_ = pts_step;
+        period_ns_ = av_rescale(pts_step_ * time_base_.getNumerator(), 1000000000, time_base_.getDenominator());
+    }
+    void setCommonParams(const Parameters &params) {
+        if (params.count("realtime")) {
+            realtime_ = params["realtime"];
+        }
+        if (realtime_ && params.count("worker_pool")) {
+            // realtime pacing sleeps in process(), see IWorkerPoolSafe
+            throw Error("realtime bench source can't run in a worker_pool");
+        }
+        if (params.count("count")) {
+            count_limit_ = params["count"];
+        }
+        if (params.count("keyframe_interval")) {
+            keyframe_interval_ = params["keyframe_interval"];
+        }
+    }
+public:
+    BenchSource(std::unique_ptr<Sink<T>> &&sink): NodeSingleOutput<T>(std::move(sink)) {
+    }
+    virtual void process() {
+        uint64_t n = produced_.load(std::memory_order_relaxed);
+        if (count_limit_ > 0 && n >= count_limit_) {
+            this->finished_ = true;
+            return;
+        }
+        if (realtime_) {
+            if (start_ns_ < 0) {
+                start_ns_ = wallclock.ns();
+            }
+            wallclock.sleepUntilNs(start_ns_ + AVTS(n) * period_ns_);
+        }
+        T item = prototype_;
+        item.setTimeBase(time_base_);
+        setTimestamp(item, av::Timestamp(AVTS(n) * pts_step_, time_base_));
+        setKeyframe(item, keyframe_interval_ <= 1 || n % keyframe_interval_ == 0);
+        if (this->sink_->put(item)) {
+            produced_.store(n+1, std::memory_order_relaxed);
+        }
+    }
+    virtual void stop() {
+        this->finished_ = true;
+    }
+    virtual Parameters getObject(const std::string name) {
+        if (name=="stats") {
+            Parameters r;
+            r["count"] = produced_.load(std::memory_order_relaxed);
+            return r;
+        } else {
+            throw Error("Unknown object to get");
+        }
+    }
+    template<typename Child> static std::shared_ptr<Child> createCommon(NodeCreationInfo &nci) {
+        const Parameters &params = nci.params;
+        std::shared_ptr<Edge<T>> edge = nci.edges.find<T>(params["dst"]);
+        auto r = std::make_shared<Child>(make_unique<EdgeSink<T>>(edge));
+        r->setCommonParams(params);
+        return r;
+    }
+};
+
+// Also pretends to be an encoder, so that it can feed mux & output nodes.
+class BenchPacketSource: public BenchSource<av::Packet>, public IEncoder {
+protected:
+    av::Codec codec_;
+    AVCodecParameters* codecpar_ = nullptr;
+    AVCodecID codec_id_ = AV_CODEC_ID_SMPTE_KLV;
+    AVMediaType codec_type_ = AVMEDIA_TYPE_DATA;
+    int width_ = 0;
+    int height_ = 0;
+public:
+    using BenchSource<av::Packet>::BenchSource;
+    virtual av::Codec& encodingCodec() {
+        return codec_;
+    }
+    virtual AVCodecParameters* codecParameters() {
+        return codecpar_;
+    }
+    virtual void setOutput(av::Stream &stream, av::FormatContext&) {
+        codecpar_ = stream.raw()->codecpar;
+        codecpar_->codec_type = codec_type_;
+        codecpar_->codec_id = codec_id_;
+        if (codec_type_ == AVMEDIA_TYPE_VIDEO) {
+            codecpar_->width = width_;
+            codecpar_->height = height_;
+        }
+        stream.setTimeBase(time_base_);
+    }
+    static std::shared_ptr<BenchPacketSource> create(NodeCreationInfo &nci) {
+        const Parameters &params = nci.params;
+        auto r = createCommon<BenchPacketSource>(nci);
+        size_t size = 1500;
+        if (params.count("size")) {
+            size = params["size"];
+        }
+        if (params.count("codec")) {
+            std::string codec = params["codec"];
+            const AVCodecDescriptor* desc = avcodec_descriptor_get_by_name(codec.c_str());
+            if (desc == nullptr) {
+                throw Error("Unknown codec " + codec);
+            }
+            r->codec_id_ = desc->id;
+            r->codec_type_ = desc->type;
+        }
+        if (params.count("width")) {
+            r->width_ = params["width"];
+        }
+        if (params.count("height")) {
+            r->height_ = params["height"];
+        }
+        std::vector<uint8_t> payload(size, 0x47);
+        r->prototype_ = av::Packet(payload);
+        r->prototype_.setComplete(true);
+        av::Rational rate = rateParam(params, "rate", "1000");
+        r->setPeriod({rate.getDenominator(), rate.getNumerator()}, 1);
+        return r;
+    }
+};
+
+class BenchVideoSource: public BenchSource<av::VideoFrame> {
+public:
+    using BenchSource<av::VideoFrame>::BenchSource;
+    static std::shared_ptr<BenchVideoSource> create(NodeCreationInfo &nci) {
+        const Parameters &params = nci.params;
+        auto r = createCommon<BenchVideoSource>(nci);
+        int width = 1920;
+        int height = 1080;
+        std::string pix_fmt = "yuv420p";
+        if (params.count("width")) {
+            width = params["width"];
+        }
+        if (params.count("height")) {
+            height = params["height"];
+        }
+        if (params.count("pix_fmt")) {
+            pix_fmt = params["pix_fmt"];
+        }
+        av::PixelFormat fmt(pix_fmt);
+        if (fmt.get() == AV_PIX_FMT_NONE) {
+            throw Error("Invalid pix_fmt " + pix_fmt);
+        }
+        r->prototype_ = av::VideoFrame(fmt, width, height);
+        // gray picture
+        for (int plane=0; plane<AV_NUM_DATA_POINTERS && r->prototype_.data(plane); plane++) {
+            int lines = (plane==0) ? height : AV_CEIL_RSHIFT(height, fmt.descriptor()->log2_chroma_h);
+            memset(r->prototype_.data(plane), 128, size_t(r->prototype_.raw()->linesize[plane]) * lines);
+        }
+        r->prototype_.setComplete(true);
+        av::Rational fps = rateParam(params, "rate", "25");
+        r->setPeriod({fps.getDenominator(), fps.getNumerator()}, 1);
+        return r;
+    }
+};
+
+class BenchAudioSource: public BenchSource<av::AudioSamples> {
+public:
+    using BenchSource<av::AudioSamples>::BenchSource;
+    static std::shared_ptr<BenchAudioSource> create(NodeCreationInfo &nci) {
+        const Parameters &params = nci.params;
+        auto r = createCommon<BenchAudioSource>(nci);
+        int sample_rate = 48000;
+        int channels = 2;
+        int frame_size = 1024;
+        std::string sample_format = "fltp";
+        if (params.count("sample_rate")) {
+            sample_rate = params["sample_rate"];
+        }
+        if (params.count("channels")) {
+            channels = params["channels"];
+        }
+        if (params.count("frame_size")) {
+            frame_size = params["frame_size"];
+        }
+        if (params.count("sample_format")) {
+            sample_format = params["sample_format"];
+        }
+        av::SampleFormat fmt(sample_format);
+        if (fmt.get() == AV_SAMPLE_FMT_NONE) {
+            throw Error("Invalid sample_format " + sample_format);
+        }
+        r->prototype_ = av::AudioSamples(fmt, frame_size, av_get_default_channel_layout(channels), sample_rate);
+        av_samples_set_silence(r->prototype_.raw()->extended_data, 0, frame_size, channels, fmt.get());
+        r->prototype_.setComplete(true);
+        // rate is implied by frame_size / sample_rate
+        r->setPeriod({1, sample_rate}, frame_size);
+        return r;
+    }
+};
+
+DECLNODE(bench_packet_source, BenchPacketSource);
+DECLNODE(bench_video_source, BenchVideoSource);
+DECLNODE(bench_audio_source, BenchAudioSource);
@@ -3,9 +3,16 @@
 #include "../avutils.hpp"
 #include <avcpp/codeccontext.h>
 #include "../hwaccel.hpp"
+#include "../histogram.hpp"
+
+struct DecoderThreading {
+    int thread_count = -1; // -1 = libavcodec default, 0 = auto
+    int thread_type = 0; // FF_THREAD_* flags, 0 = libavcodec default
+    bool low_delay = false;
+};
 
 template<typename Child, typename DecoderContext, typename OutputFrame> class Decoder:
-    public NodeSISO<av::Packet, OutputFrame>, public ReportsFinishByFlag, public IFlushable, public IDecoder, public ITimeBaseSource {
+    public NodeSISO<av::Packet, OutputFrame>, public ReportsFinishByFlag, public IFlushable, public IDecoder, public ITimeBaseSource, public IReturnsObjects {
 protected:
     av::Codec codec_;
     DecoderContext dec_;
@@ -16,6 +23,14 @@ protected:
     av::PixelFormat pixel_format_ = AV_PIX_FMT_NONE;
     bool pixel_format_optional_ = false;
     std::shared_ptr<HWAccelDevice> hwaccel_;
+    std::vector<OutputFrame> out_batch_;
+    av::Rational pkt_time_base_;
+    int stream_index_ = -1;
+    std::atomic_uint64_t packets_ {0};
+    std::atomic_uint64_t frames_ {0};
+    std::atomic_uint64_t decode_errors_total_ {0};
+    std::atomic<AVTS> decode_ns_ {0};
+    LogHistogram<> decode_us_; // per packet, sending + receiving all frames
     //AVBufferRef *out_frames_ref_ = nullptr;
     /* input_hold_ is a workaround to prevent StreamInput from being destroyed
      * when the shared_ptr is set to null in NodeWrapper
@@ -37,7 +52,68 @@ protected:
         }
     }
 public:
-    template<typename ...Ts> Decoder(std::unique_ptr<Source<av::Packet>> &&source, std::unique_ptr<Sink<OutputFrame>> &&sink, av::Stream &stream, const std::string codec_name, av::Dictionary options, std::string pixel_format, std::shared_ptr<HWAccelDevice> hwaccel):
+    // Fills frame fields the way avcpp's decode() does.
+    void setupFrame(OutputFrame &frm) {
+        frm.setTimeBase(pkt_time_base_ != av::Rational() ? pkt_time_base_ : dec_.stream().timeBase());
+        AVFrame* raw = frm.raw();
+        if (raw->pts == AV_NOPTS_VALUE) {
+            raw->pts = raw->best_effort_timestamp;
+        }
+        frm.setTimeBase(timeBase());
+        frm.setStreamIndex(stream_index_ >= 0 ? stream_index_ : dec_.stream().index());
+        frm.setComplete(true);
+    }
+    // Receives all frames the decoder has ready. Returns 0 or libavcodec error code,
+    // AVERROR(EAGAIN) when it needs more input, AVERROR_EOF when fully drained.
+    int receiveFrames(bool output) {
+        while (true) {
+            OutputFrame frm;
+            int r = avcodec_receive_frame(dec_.raw(), frm.raw());
+            if (r < 0) {
+                return r;
+            }
+            frames_.fetch_add(1, std::memory_order_relaxed);
+            if (!output) {
+                continue;
+            }
+            setupFrame(frm);
+            if ( last_pts_.isValid() && (last_pts_ > frm.pts()) ) {
+                logstream_limited(5) << "Warning: Got out of order frame from decoder: " << last_pts_ << " -> " << frm.pts();
+            }
+            last_pts_ = frm.pts();
+            out_batch_.push_back(std::move(frm));
+        }
+    }
+    // Sends packet (nullptr = drain) and receives everything it produced.
+    // Frames are collected in out_batch_. Returns 0 or libavcodec error code.
+    int decodePacket(const AVPacket* pkt, bool output) {
+        while (true) {
+            int r = avcodec_send_packet(dec_.raw(), pkt);
+            if (r == AVERROR(EAGAIN)) {
+                // decoder's queue full (e.g. frame threading), make room and retry
+                r = receiveFrames(output);
+                if (r == AVERROR(EAGAIN)) {
+                    // nothing to receive either, shouldn't happen
+                    return AVERROR_BUG;
+                }
+                if (r < 0 && r != AVERROR_EOF) {
+                    return r;
+                }
+                continue;
+            }
+            if (r < 0 && r != AVERROR_EOF) {
+                return r;
+            }
+            break;
+        }
+        int r = receiveFrames(output);
+        if (r == AVERROR(EAGAIN) || r == AVERROR_EOF) {
+            return 0;
+        }
+        return r;
+    }
+public:
+    template<typename ...Ts> Decoder(std::unique_ptr<Source<av::Packet>> &&source, std::unique_ptr<Sink<OutputFrame>> &&sink, av::Stream &stream, const std::string codec_name, av::Dictionary options, std::string pixel_format, std::shared_ptr<HWAccelDevice> hwaccel, const DecoderThreading threading):
         NodeSISO<av::Packet, OutputFrame>(std::move(source), std::move(sink)),
         codec_(codecFromName(codec_name)),
         dec_(stream, codec_),
@@ -118,9 +194,25 @@ public:
             };
         }
 
+        if (threading.thread_count >= 0) {
+            dec_.raw()->thread_count = threading.thread_count;
+        }
+        if (threading.thread_type != 0) {
+            dec_.raw()->thread_type = threading.thread_type;
+        }
+        if (threading.low_delay) {
+            dec_.raw()->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        }
+
         dec_.open(options, codec_);
-        logstream << "Opened decoder " << dec_.codec().name() << std::endl;
+        logstream << "Opened decoder " << dec_.codec().name() << ", threads: " << dec_.raw()->thread_count << ", type: " << threadTypeString(dec_.raw()->active_thread_type) << std::endl;
     };
+    static std::string threadTypeString(int type) {
+        if (type == (FF_THREAD_FRAME | FF_THREAD_SLICE)) return "frame+slice";
+        if (type == FF_THREAD_FRAME) return "frame";
+        if (type == FF_THREAD_SLICE) return "slice";
+        return "none";
+    }
     virtual std::string codecName() const {
         if (!dec_.codec().isNull()) {
             return dec_.codec().name();
@@ -144,16 +236,13 @@ public:
     }
     virtual void flush() {
         std::lock_guard<std::recursive_mutex> lock(mutex_);
-        OutputFrame frm;
-        do {
-            try {
-                frm = dec_.decode(av::Packet());
-                //this->sink_->put(frm); // don't do anything with the frame! otherwise, blinking happens when decoder is flushed after generating "no signal" card
-            } catch (std::exception &e) {
-                logstream << "Warning: Exception " << e.what() << " when flushing decoder." << std::endl;
-                break; // flush error is not considered error
-            }
-        } while (frm);
+        // don't do anything with the frames! otherwise, blinking happens when decoder is flushed after generating "no signal" card
+        int r = decodePacket(nullptr, false);
+        if (r < 0) {
+            logstream << "Warning: Error " << av::error2string(r) << " when flushing decoder." << std::endl;
+            // flush error is not considered error
+        }
+        avcodec_flush_buffers(dec_.raw());
         //dec_.close();
         //input_hold_ = nullptr;
         this->finished_ = true;
@@ -172,22 +261,28 @@ public:
             std::lock_guard<std::recursive_mutex> lock(mutex_);
             if ( (!pkt.isNull()) && pkt.isComplete() ) {
                 // not a flush packet
-                try {
-                    OutputFrame frm = dec_.decode(pkt);
-                    if (frm) {
-                        if ( last_pts_.isValid() && (last_pts_ > frm.pts()) ) {
-                            logstream << "Warning: Got out of order frame from decoder: " << last_pts_ << " -> " << frm.pts();
-                        }
-                        last_pts_ = frm.pts();
-                        this->sink_->put(frm);
-                    }
-                    dec_errors_ = 0;
-                } catch (std::exception &e) {
+                pkt_time_base_ = pkt.timeBase();
+                stream_index_ = pkt.streamIndex();
+                AVTS begin = wallclock.ns();
+                int r = decodePacket(pkt.raw(), true);
+                AVTS elapsed = wallclock.ns() - begin;
+                packets_.fetch_add(1, std::memory_order_relaxed);
+                decode_ns_.fetch_add(elapsed, std::memory_order_relaxed);
+                decode_us_.record(elapsed / 1000);
+                if (r < 0) {
                     dec_errors_++;
+                    decode_errors_total_.fetch_add(1, std::memory_order_relaxed);
                     if (dec_errors_>200) {
-                        throw;
+                        throw Error("Too many decode errors, last: " + av::error2string(r));
                     }
-                    logstream << "Decode error: " << e.what();
+                    logstream_limited(10) << "Decode error: " << av::error2string(r);
+                } else {
+                    dec_errors_ = 0;
+                }
+                if (!out_batch_.empty()) {
+                    // frames decoded before the error are fine
+                    this->sink_->put_many(out_batch_);
+                    out_batch_.clear();
                 }
                 //if (!frm) this->finished_ = true;
 
@@ -200,6 +295,23 @@ public:
             }
         }
     }
+    virtual Parameters getObject(const std::string name) {
+        if (name=="stats") {
+            Parameters r;
+            r["codec"] = codecName();
+            r["thread_count"] = dec_.raw()->thread_count;
+            r["thread_type"] = threadTypeString(dec_.raw()->active_thread_type);
+            r["packets"] = packets_.load(std::memory_order_relaxed);
+            r["frames"] = frames_.load(std::memory_order_relaxed);
+            r["errors"] = decode_errors_total_.load(std::memory_order_relaxed);
+            r["decode_time_ns"] = decode_ns_.load(std::memory_order_relaxed);
+            r["decode_us"] = decode_us_.toJson();
+            r["decode_us"].erase("buckets");
+            return r;
+        } else {
+            throw Error("Unknown object to get");
+        }
+    }
     virtual ~Decoder() {
         try {
             dec_.close();
@@ -250,7 +362,25 @@ public:
         if (params.count("options")) {
             options = parametersToDict(params["options"]);
         }
-        std::shared_ptr<Child> r = std::make_shared<Child>(src_edge->makeSource(), dst_edge->makeSink(), md->source_stream, codec_name, options, pixel_format, hwaccel);
+        DecoderThreading threading;
+        if (params.count("thread_count")) {
+            threading.thread_count = params["thread_count"];
+        }
+        if (params.count("thread_type")) {
+            for (const std::string &type: jsonToStringList(params["thread_type"])) {
+                if (type=="frame") {
+                    threading.thread_type |= FF_THREAD_FRAME;
+                } else if (type=="slice") {
+                    threading.thread_type |= FF_THREAD_SLICE;
+                } else {
+                    throw Error("Invalid thread_type: " + type);
+                }
+            }
+        }
+        if (params.count("low_delay")) {
+            threading.low_delay = params["low_delay"];
+        }
+        std::shared_ptr<Child> r = std::make_shared<Child>(src_edge->makeSource(), dst_edge->makeSink(), md->source_stream, codec_name, options, pixel_format, hwaccel, threading);
         return r;
     }
 };
@@ -1,4 +1,5 @@
 #include "node_common.hpp"
+#include <algorithm>
 #include <libavfilter/avfilter.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
@@ -7,12 +8,149 @@
 #include "../audio_parameters.hpp"
 #include "../hwaccel.hpp"
 
+#define assign(to, from) if (params.count(from)==1) default_params_.to = params[from]
+
+// Parameters of a configured buffersink link. Copied when the graph is configured, so that
+// other threads can read them while the filter thread reconfigures or frees the graph.
+struct FilterOutputLink {
+    AVMediaType type;
+    av::Rational time_base;
+    int w;
+    int h;
+    int format;
+    AVPixelFormat sw_format = AV_PIX_FMT_NONE; // of hardware frames
+    av::Rational frame_rate;
+    int sample_rate;
+    uint64_t channel_layout;
+    explicit FilterOutputLink(const AVFilterLink* link): type(link->type), time_base(link->time_base), w(link->w), h(link->h), format(link->format),
+        frame_rate(link->frame_rate), sample_rate(link->sample_rate), channel_layout(link->channel_layout) {
+        if (link->hw_frames_ctx && link->hw_frames_ctx->data) {
+            sw_format = ((AVHWFramesContext*)link->hw_frames_ctx->data)->sw_format;
+        }
+    }
+};
+using FilterOutputLinkPtr = std::shared_ptr<const FilterOutputLink>;
+
+// Parameters of a filter output, from its buffersink link or, before the graph is configured, from node parameters.
+class VideoFilterOutputMetadata: public IVideoFormatSource, public IFrameRateSource {
+protected:
+    VideoParameters default_params_;
+    av::Rational default_frame_rate_{0, 1};
+    virtual FilterOutputLinkPtr outputLink() = 0;
+public:
+    void setDefaults(const Parameters& params) {
+        assign(width, "dst_width");
+        assign(height, "dst_height");
+        if (params.count("dst_pixel_format")==1) default_params_.pixel_format = av::PixelFormat(params["dst_pixel_format"].get<std::string>());
+        if (params.count("dst_frame_rate")==1) default_frame_rate_ = parseRatio(params["dst_frame_rate"]);
+    }
+    virtual int width() {
+        FilterOutputLinkPtr outlink = outputLink();
+        if (outlink) {
+            return outlink->w;
+        } else if (default_params_.width>0) {
+            return default_params_.width;
+        } else {
+            throw Error("unknown filter output width");
+        }
+    }
+    virtual int height() {
+        FilterOutputLinkPtr outlink = outputLink();
+        if (outlink) {
+            return outlink->h;
+        } else if (default_params_.height>0) {
+            return default_params_.height;
+        } else {
+            throw Error("unknown filter output height");
+        }
+    }
+    virtual av::PixelFormat pixelFormat() {
+        FilterOutputLinkPtr outlink = outputLink();
+        if (outlink) {
+            return av::PixelFormat(static_cast<AVPixelFormat>(outlink->format));
+        } else if (default_params_.pixel_format.get()!=AV_PIX_FMT_NONE) {
+            return default_params_.pixel_format;
+        } else {
+            throw Error("unknown filter output pixel format");
+        }
+    }
+    virtual av::PixelFormat realPixelFormat() {
+        FilterOutputLinkPtr outlink = outputLink();
+        if (outlink && outlink->sw_format != AV_PIX_FMT_NONE) {
+            logstream << "have hw frames context in filter outlink, sw_format " << av::PixelFormat(outlink->sw_format);
+            return outlink->sw_format;
+        }
+        return pixelFormat();
+    }
+    virtual av::Rational frameRate() {
+        FilterOutputLinkPtr outlink = outputLink();
+        if (outlink) {
+            return outlink->frame_rate;
+        } else if (default_frame_rate_.getNumerator()>0 && default_frame_rate_.getDenominator()>0) {
+            return default_frame_rate_;
+        } else {
+            throw Error("unknown filter output frame rate");
+        }
+    }
+};
+class AudioFilterOutputMetadata: public IAudioMetadataSource {
+protected:
+    AudioParameters default_params_;
+    virtual FilterOutputLinkPtr outputLink() = 0;
+public:
+    void setDefaults(const Parameters& params) {
+        if (params.count("dst_channel_layout")==1) {
+            std::string layout_s = params["dst_channel_layout"].get<std::string>();
+            default_params_.channel_layout = av_get_channel_layout(layout_s.c_str());
+        } else if (params.count("dst_channels")==1) {
+            int64_t cnt = params["dst_channels"].get<int>();
+            default_params_.channel_layout = av_get_channel_layout_nb_channels(cnt);
+        }
+        
+        assign(sample_rate, "dst_sample_rate");
+        if (params.count("dst_sample_format")==1) default_params_.sample_format = av::SampleFormat(params["dst_sample_format"].get<std::string>());
+    }
+    virtual int sampleRate() {
+        FilterOutputLinkPtr outlink = outputLink();
+        if (outlink) {
+            return outlink->sample_rate;
+        } else if (default_params_.sample_rate>0) {
+            return default_params_.sample_rate;
+        } else {
+            throw Error("unknown filter output sample rate");
+        }
+    }
+    virtual av::SampleFormat sampleFormat() {
+        FilterOutputLinkPtr outlink = outputLink();
+        if (outlink) {
+            return av::SampleFormat(static_cast<AVSampleFormat>(outlink->format));
+        } else if (default_params_.sample_format.get()!=AV_SAMPLE_FMT_NONE) {
+            return default_params_.sample_format;
+        } else {
+            throw Error("unknown filter output sample format");
+        }
+    }
+    virtual uint64_t channelLayout() {
+        FilterOutputLinkPtr outlink = outputLink();
+        if (outlink) {
+            return outlink->channel_layout;
+        } else if (default_params_.channel_layout>0) {
+            return default_params_.channel_layout;
+        } else {
+            throw Error("unknown filter output channel layout");
+        }
+    }
+};
+
+#undef assign
+
 template<typename T> struct FilterMediaSpecific {
 };
 
 template<> struct FilterMediaSpecific<av::VideoFrame> {
     using Parameters = VideoParameters;
     using NodeInterface = IVideoFormatSource;
+    using OutputMetadata = VideoFilterOutputMetadata;
     static constexpr const char* source_filter_name = "buffer";
     static constexpr const char* sink_filter_name = "buffersink";
     static constexpr bool default_do_shift = false;
@@ -48,6 +186,7 @@ template<> struct FilterMediaSpecific<av::VideoFrame> {
 template<> struct FilterMediaSpecific<av::AudioSamples> {
     using Parameters = AudioParameters;
     using NodeInterface = IAudioMetadataSource;
+    using OutputMetadata = AudioFilterOutputMetadata;
     static constexpr const char* source_filter_name = "abuffer";
     static constexpr const char* sink_filter_name = "abuffersink";
     static constexpr bool default_do_shift = true;
@@ -175,10 +314,50 @@ protected:
         }
     };
     
+    // With several outputs, every output edge gets its own producer: nodes below
+    // find parameters of their input (IVideoFormatSource...) by walking up the producers
+    // of edges, and each buffersink has different ones.
+    // Outputs are fed by the filter node's thread one after another with blocking enqueue,
+    // so an output whose queue is full stalls the others.
+    class OutputPort: public Node, public MediaSpecific::OutputMetadata, public ITimeBaseSource {
+    protected:
+        std::weak_ptr<FilterNode> filter_; // owns us, edges may outlive it
+        std::weak_ptr<Node> filter_node_;
+        size_t index_;
+        virtual FilterOutputLinkPtr outputLink() override {
+            std::shared_ptr<FilterNode> filter = filter_.lock();
+            return filter ? filter->publishedOutputLink(index_) : nullptr;
+        }
+    public:
+        OutputPort(std::shared_ptr<FilterNode> filter, size_t index): filter_(filter), filter_node_(filter), index_(index) {
+        }
+        virtual void process() override {
+            // never scheduled, the filter node does the work
+        }
+        virtual std::weak_ptr<Node> sourceNode() override {
+            return filter_node_;
+        }
+        virtual std::shared_ptr<EdgeBase> sourceEdge() override {
+            std::shared_ptr<Node> filter = filter_node_.lock();
+            if (filter==nullptr) return {};
+            return filter->sourceEdge();
+        }
+        virtual av::Rational timeBase() override {
+            FilterOutputLinkPtr outlink = outputLink();
+            ensureNotNull(outlink, "timeBase(): outlink none");
+            return outlink->time_base;
+        }
+    };
+    
     std::vector<Port> sinks_;
     std::vector<Port> sources_;
+    std::vector<std::string> sink_names_;
+    std::vector<std::shared_ptr<OutputPort>> output_ports_;
     AVFilterGraph *filter_graph_ = nullptr;
-    const AVFilterLink *outlink_ = nullptr;
+    // written by the filter thread, read by nodes below (through OutputPort or the metadata interfaces),
+    // replaced as a whole, null if the graph isn't configured
+    std::shared_ptr<const std::vector<FilterOutputLinkPtr>> outlinks_;
+    int threads_ = -1;
     TSEqualizer eq_;
     std::string graph_desc_;
     bool do_shift_ = true;
@@ -186,9 +365,13 @@ protected:
     
     void freeFilterGraph() {
         if (filter_graph_ == nullptr) return;
+        std::atomic_store(&outlinks_, std::shared_ptr<const std::vector<FilterOutputLinkPtr>>());
         avfilter_graph_free(&filter_graph_);
         filter_graph_ = nullptr;
-        outlink_ = nullptr;
+    }
+    FilterOutputLinkPtr publishedOutputLink(const size_t index) {
+        std::shared_ptr<const std::vector<FilterOutputLinkPtr>> links = std::atomic_load(&outlinks_);
+        return (links && index < links->size()) ? (*links)[index] : nullptr;
     }
     void initPorts() {
         sources_.resize(this->source_edges_.size());
@@ -207,6 +390,9 @@ protected:
         }
         
         filter_graph_ = avfilter_graph_alloc();
+        if (threads_ >= 0) {
+            filter_graph_->nb_threads = threads_;
+        }
         
         AVFilterInOut* inputs = nullptr;
         AVFilterInOut* outputs = nullptr;
@@ -232,14 +418,34 @@ protected:
             sources_[i].initSourceFilter(i, filter_graph_, hwaccel_, in);
             i++;
         });
-        i = 0;
-        forEachInOut(outputs, [this, &i](AVFilterInOut* out) {
-            if (i >= sinks_.size()) {
-                throw Error("Too many outputs in filtergraph");
+        // outputs labelled with name of a dst edge go to that edge, others in order
+        std::vector<bool> sink_used(sinks_.size(), false);
+        std::vector<AVFilterInOut*> unlabelled;
+        forEachInOut(outputs, [this, &sink_used, &unlabelled](AVFilterInOut* out) {
+            auto it = sink_names_.end();
+            if (out->name != nullptr) {
+                it = std::find(sink_names_.begin(), sink_names_.end(), std::string(out->name));
             }
-            sinks_[i].initSinkFilter(i, filter_graph_, out);
-            i++;
+            size_t index = it - sink_names_.begin();
+            if (it == sink_names_.end() || sink_used[index]) {
+                unlabelled.push_back(out);
+                return;
+            }
+            sink_used[index] = true;
+            sinks_[index].initSinkFilter(index, filter_graph_, out);
         });
+        size_t next = 0;
+        for (AVFilterInOut* out: unlabelled) {
+            while (next < sinks_.size() && sink_used[next]) next++;
+            if (next >= sinks_.size()) {
+                throw Error("Too many outputs in filtergraph");
+            }
+            sink_used[next] = true;
+            sinks_[next].initSinkFilter(next, filter_graph_, out);
+        }
+        if (std::find(sink_used.begin(), sink_used.end(), false) != sink_used.end()) {
+            throw Error("Filtergraph has less outputs than dst edges");
+        }
         avfilter_inout_free(&inputs);
         avfilter_inout_free(&outputs);
         
@@ -247,19 +453,16 @@ protected:
         if (ret < 0) {
             throw Error("avfilter_graph_config error");
         }
+        auto outlinks = std::make_shared<std::vector<FilterOutputLinkPtr>>();
         for (Port &port: sinks_) {
             if (!port.checkSinkFilterMediaType()) {
                 freeFilterGraph();
                 throw Error("Filter outputs invalid media type");
             }
+            outlinks->push_back(std::make_shared<const FilterOutputLink>(port.getSinkLink()));
         }
-        if (sinks_.size()==1) {
-            outlink_ = sinks_[0].getSinkLink();
-            logstream << outlink_->type;
-        } else {
-            freeFilterGraph();
-            throw Error("Exactly one destination is needed");
-        }
+        logstream << outlinks->front()->type;
+        std::atomic_store(&outlinks_, std::shared_ptr<const std::vector<FilterOutputLinkPtr>>(outlinks));
         return true;
     }
     void preliminaryInit() {
@@ -379,14 +582,27 @@ public:
         if (params.count("hwaccel")) {
             result->hwaccel_ = InstanceSharedObjects<HWAccelDevice>::get(nci.instance, params["hwaccel"]);
         }
+        if (params.count("threads")) {
+            result->threads_ = params["threads"];
+        }
         result->initDefaults(params);
         result->createSourcesFromParameters(edges, params);
-        result->createSinksFromParameters(edges, params);
-        result->initPorts();
-        if (result->sinks_.size()!=1) {
-            // TODO (would require huge change in architecture - support of in/out pads)
-            throw Error("Currently only single-output filters are supported");
+        for (const std::string &name: jsonToStringList(params["dst"])) {
+            result->sink_names_.push_back(name);
+        }
+        if (result->sink_names_.empty()) {
+            throw Error("At least one destination is needed");
+        }
+        // single output: the node itself is the producer, like other nodes
+        result->createSinksFromParameters(edges, params, result->sink_names_.size()==1);
+        if (result->sink_names_.size() > 1) {
+            for (size_t i=0; i<result->sink_edges_.size(); i++) {
+                result->output_ports_.push_back(std::make_shared<OutputPort>(result, i));
+                result->output_ports_.back()->setDefaults(params);
+                result->sink_edges_[i]->setProducer(result->output_ports_.back());
+            }
         }
+        result->initPorts();
         try {
             result->preliminaryInit();
         } catch (std::exception &e) {
@@ -395,121 +611,34 @@ public:
         return result;
     }
     virtual av::Rational timeBase() {
-        ensureNotNull(outlink_, "timeBase(): outlink none");
-        return outlink_->time_base;
+        FilterOutputLinkPtr outlink = publishedOutputLink(0);
+        ensureNotNull(outlink, "timeBase(): outlink none");
+        return outlink->time_base;
     }
 };
 
-#define assign(to, from) if (params.count(from)==1) default_params_.to = params[from]
-
-class VideoFilter: public FilterNode<VideoFilter, av::VideoFrame, AVMEDIA_TYPE_VIDEO>, public IVideoFormatSource, public IFrameRateSource {
+class VideoFilter: public FilterNode<VideoFilter, av::VideoFrame, AVMEDIA_TYPE_VIDEO>, public VideoFilterOutputMetadata {
 protected:
-    VideoParameters default_params_;
-    av::Rational default_frame_rate_{0, 1};
+    virtual FilterOutputLinkPtr outputLink() {
+        return publishedOutputLink(0);
+    }
 public:
     using FilterNode::FilterNode;
     virtual void initDefaults(const Parameters& params) {
-        assign(width, "dst_width");
-        assign(height, "dst_height");
-        if (params.count("dst_pixel_format")==1) default_params_.pixel_format = av::PixelFormat(params["dst_pixel_format"].get<std::string>());
-        if (params.count("dst_frame_rate")==1) default_frame_rate_ = parseRatio(params["dst_frame_rate"]);
-    }
-    virtual int width() {
-        if (outlink_) {
-            return outlink_->w;
-        } else if (default_params_.width>0) {
-            return default_params_.width;
-        } else {
-            throw Error("unknown filter output width");
-        }
-    }
-    virtual int height() {
-        if (outlink_) {
-            return outlink_->h;
-        } else if (default_params_.height>0) {
-            return default_params_.height;
-        } else {
-            throw Error("unknown filter output height");
-        }
-    }
-    virtual av::PixelFormat pixelFormat() {
-        if (outlink_) {
-            return av::PixelFormat(static_cast<AVPixelFormat>(outlink_->format));
-        } else if (default_params_.pixel_format.get()!=AV_PIX_FMT_NONE) {
-            return default_params_.pixel_format;
-        } else {
-            throw Error("unknown filter output pixel format");
-        }
-    }
-    virtual av::PixelFormat realPixelFormat() {
-        if (outlink_ && outlink_->hw_frames_ctx && outlink_->hw_frames_ctx->data) {
-            AVHWFramesContext *frmctx = (AVHWFramesContext *)(outlink_->hw_frames_ctx->data);
-            logstream << "have hw frames context in filter outlink, sw_format " << av::PixelFormat(frmctx->sw_format);
-            if (frmctx->sw_format != AV_PIX_FMT_NONE) {
-                return frmctx->sw_format;
-            } else {
-                logstream << "falling back to pixelFormat()";
-            }
-        }
-        return pixelFormat();
-    }
-    virtual av::Rational frameRate() {
-        if (outlink_) {
-            return outlink_->frame_rate;
-        } else if (default_frame_rate_.getNumerator()>0 && default_frame_rate_.getDenominator()>0) {
-            return default_frame_rate_;
-        } else {
-            throw Error("unknown filter output frame rate");
-        }
+        setDefaults(params);
     }
 };
-class AudioFilter: public FilterNode<AudioFilter, av::AudioSamples, AVMEDIA_TYPE_AUDIO>, public IAudioMetadataSource {
+class AudioFilter: public FilterNode<AudioFilter, av::AudioSamples, AVMEDIA_TYPE_AUDIO>, public AudioFilterOutputMetadata {
 protected:
-    AudioParameters default_params_;
+    virtual FilterOutputLinkPtr outputLink() {
+        return publishedOutputLink(0);
+    }
 public:
     using FilterNode::FilterNode;
     virtual void initDefaults(const Parameters& params) {
-        if (params.count("dst_channel_layout")==1) {
-            std::string layout_s = params["dst_channel_layout"].get<std::string>();
-            default_params_.channel_layout = av_get_channel_layout(layout_s.c_str());
-        } else if (params.count("dst_channels")==1) {
-            int64_t cnt = params["dst_channels"].get<int>();
-            default_params_.channel_layout = av_get_channel_layout_nb_channels(cnt);
-        }
-        
-        assign(sample_rate, "dst_sample_rate");
-        if (params.count("dst_sample_format")==1) default_params_.sample_format = av::SampleFormat(params["dst_sample_format"].get<std::string>());
-    }
-    virtual int sampleRate() {
-        if (outlink_) {
-            return outlink_->sample_rate;
-        } else if (default_params_.sample_rate>0) {
-            return default_params_.sample_rate>0;
-        } else {
-            throw Error("unknown filter output sample rate");
-        }
-    }
-    virtual av::SampleFormat sampleFormat() {
-        if (outlink_) {
-            return av::SampleFormat(static_cast<AVSampleFormat>(outlink_->format));
-        } else if (default_params_.sample_format.get()!=AV_SAMPLE_FMT_NONE) {
-            return default_params_.sample_format;
-        } else {
-            throw Error("unknown filter output sample format");
-        }
-    }
-    virtual uint64_t channelLayout() {
-        if (outlink_) {
-            return outlink_->channel_layout;
-        } else if (default_params_.channel_layout>0) {
-            return default_params_.channel_layout;
-        } else {
-            throw Error("unknown filter output channel layout");
-        }
+        setDefaults(params);
     }
 };
 
-#undef assign
-
 DECLNODE(filter_video, VideoFilter);
 DECLNODE(filter_audio, AudioFilter);
@@ -1,6 +1,6 @@
 #include "node_common.hpp"
 
-class ForceKeyFrame: public NodeSISO<av::VideoFrame, av::VideoFrame> {
+class ForceKeyFrame: public NodeSISO<av::VideoFrame, av::VideoFrame>, public IWorkerPoolSafe {
 protected:
     av::Rational interval_sec_;
     int64_t last_result_ = -(1L<<62);
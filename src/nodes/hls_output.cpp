@@ -0,0 +1,468 @@
+#include "node_common.hpp"
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <map>
+#include "../async_file_writer.hpp"
+#include "../hls_playlist.hpp"
+#include "../instance_shared.hpp"
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+// Collects what the mp4 muxer writes, so that it can be cut into segments & parts.
+class MemoryOutputIO: public av::CustomIO {
+protected:
+    std::string data_;
+public:
+    virtual int write(const uint8_t *data, size_t size) override {
+        data_.append(reinterpret_cast<const char*>(data), size);
+        return size;
+    }
+    virtual int64_t seek(int64_t, int) override {
+        return AVERROR(ENOSYS);
+    }
+    virtual int seekable() const override {
+        return 0;
+    }
+    virtual const char* name() const override {
+        return "avplumber_hls_memory";
+    }
+    std::string take() {
+        std::string r;
+        r.swap(data_);
+        return r;
+    }
+};
+
+// Variants (ladder rungs) in the same group start segments at the same keyframes:
+// the first variant which reaches a segment boundary decides its timestamp,
+// the others cut at their keyframe with the same timestamp, so segment sequence numbers match.
+// Also keeps the multivariant playlist.
+class HlsSegmentGroup: public InstanceShared<HlsSegmentGroup> {
+protected:
+    static constexpr size_t max_cuts_ = 64;
+    std::mutex busy_;
+    std::map<uint64_t, AVTS> cuts_; // segment sequence number -> start, microseconds
+    std::map<std::string, HlsVariantInfo> variants_; // key: media playlist path
+    std::unique_ptr<AsyncFileWriter> master_writer_;
+    void addCut(const uint64_t sequence, const AVTS ts) {
+        cuts_[sequence] = ts;
+        while (cuts_.size() > max_cuts_) {
+            cuts_.erase(cuts_.begin());
+        }
+    }
+public:
+    // sequence number of the first segment of a variant whose first keyframe is at ts,
+    // -1 if it should wait for the next keyframe
+    int64_t join(const AVTS ts, const AVTS tolerance, const AVTS min_duration) {
+        std::lock_guard<decltype(busy_)> lock(busy_);
+        if (cuts_.empty()) {
+            addCut(0, ts);
+            return 0;
+        }
+        for (auto &cut: cuts_) {
+            if (std::abs(cut.second - ts) <= tolerance) {
+                return cut.first;
+            }
+        }
+        auto last = cuts_.rbegin();
+        if (ts - last->second >= min_duration) {
+            uint64_t sequence = last->first + 1;
+            addCut(sequence, ts);
+            return sequence;
+        }
+        return -1;
+    }
+    // start of segment with given sequence number, or AV_NOPTS_VALUE if it isn't decided yet
+    // and the keyframe at ts is less than min_duration after start of the previous segment
+    AVTS cut(const uint64_t sequence, const AVTS ts, const AVTS prev_start, const AVTS min_duration) {
+        std::lock_guard<decltype(busy_)> lock(busy_);
+        auto it = cuts_.find(sequence);
+        if (it != cuts_.end()) {
+            return it->second;
+        }
+        if (ts - prev_start < min_duration) {
+            return AV_NOPTS_VALUE;
+        }
+        addCut(sequence, ts);
+        return ts;
+    }
+    void updateMaster(const std::string &master_path, const std::string &playlist_path, const HlsVariantInfo &info) {
+        std::lock_guard<decltype(busy_)> lock(busy_);
+        variants_[playlist_path] = info;
+        std::vector<HlsVariantInfo> variants;
+        for (auto &kv: variants_) {
+            variants.push_back(kv.second);
+        }
+        std::sort(variants.begin(), variants.end(), [](const HlsVariantInfo &a, const HlsVariantInfo &b) {
+            return a.bandwidth > b.bandwidth;
+        });
+        // one writer for all variants, requested under the lock, so that older versions don't overwrite newer ones
+        if (!master_writer_) {
+            master_writer_ = make_unique<AsyncFileWriter>("hls master", 1024*1024);
+        }
+        master_writer_->replace(master_path, renderHlsMasterPlaylist(variants));
+    }
+};
+
+class HlsOutput: public NodeSingleInput<av::Packet>, public IFlushable, public ReportsFinishByFlag, public IReturnsObjects {
+protected:
+    std::unique_ptr<MemoryOutputIO> io_; // must outlive octx_
+    av::FormatContext octx_;
+    std::vector<av::Rational> stream_tbs_;
+    std::unique_ptr<AsyncFileWriter> writer_;
+    std::shared_ptr<HlsSegmentGroup> group_;
+    std::unique_ptr<HlsMediaPlaylist> playlist_;
+    std::string dir_;
+    std::string playlist_name_ = "index.m3u8";
+    std::string init_name_ = "init.mp4";
+    std::string segment_prefix_ = "seg";
+    std::string master_path_;
+    HlsVariantInfo variant_;
+    bool fixed_bandwidth_ = false;
+    AVTS segment_duration_us_ = 4000000;
+    AVTS max_segment_duration_us_ = 6000000;
+    AVTS part_duration_us_ = 0;
+    AVTS tolerance_us_ = 1000;
+    size_t list_size_ = 6;
+    bool delete_segments_ = true;
+    std::deque<std::string> expired_; // out of the playlist, deleted list_size_ segments later
+    int ref_stream_ = 0; // cuts are decided on packets of this stream
+    int errors_ = 0;
+    bool closed_ = false;
+    // current segment & part:
+    bool started_ = false;
+    uint64_t sequence_ = 0;
+    AVTS segment_start_ = AV_NOPTS_VALUE;
+    AVTS part_start_ = AV_NOPTS_VALUE;
+    bool part_independent_ = false;
+    uint64_t segment_bytes_ = 0;
+    AVTS last_ts_ = AV_NOPTS_VALUE;
+    AVTS last_duration_ = 0;
+    // metrics:
+    std::atomic_uint64_t segments_ {0};
+    std::atomic_uint64_t parts_ {0};
+    std::atomic_uint64_t misaligned_cuts_ {0};
+    std::atomic_uint64_t forced_cuts_ {0};
+    std::atomic_uint64_t dropped_packets_ {0};
+    std::atomic_uint64_t last_segment_us_ {0};
+    std::atomic_uint64_t bandwidth_ {0};
+
+    std::string segmentUri(const uint64_t sequence) {
+        return segment_prefix_ + std::to_string(sequence) + ".m4s";
+    }
+    std::string path(const std::string &name) {
+        return dir_ + "/" + name;
+    }
+    static AVTS packetTs(av::Packet &pkt) {
+        av::Timestamp ts = pkt.pts();
+        if (ts.isNoPts()) ts = pkt.dts();
+        return ts.isNoPts() ? AV_NOPTS_VALUE : ts.timestamp(av::Rational(1, 1000000));
+    }
+    void writePacket(av::Packet &pkt) {
+        pkt.setTimeBase(stream_tbs_.at(pkt.streamIndex()));
+        int ret = av_write_frame(octx_.raw(), pkt.raw());
+        if (ret < 0) {
+            logstream_limited(5) << "av_write_frame failed: " << av::error2string(ret);
+            if (++errors_ > 20) {
+                throw Error("Too many consecutive write errors: " + av::error2string(ret));
+            }
+        } else {
+            errors_ = 0;
+        }
+    }
+    // moof + mdat of packets written since the previous call
+    size_t writeFragment() {
+        int ret = av_write_frame(octx_.raw(), nullptr);
+        if (ret < 0) {
+            throw Error("Flushing fragment failed: " + av::error2string(ret));
+        }
+        avio_flush(octx_.raw()->pb);
+        std::string data = io_->take();
+        size_t size = data.size();
+        if (size > 0) {
+            // a segment left in the directory by a previous run must not be continued
+            auto chunk = std::make_shared<const std::string>(std::move(data));
+            if (segment_bytes_ == 0) {
+                writer_->create(path(segmentUri(sequence_)), std::move(chunk));
+            } else {
+                writer_->append(path(segmentUri(sequence_)), std::move(chunk));
+            }
+        }
+        return size;
+    }
+    void endPart(const AVTS end) {
+        size_t size = writeFragment();
+        if (size > 0 && part_duration_us_ > 0) {
+            playlist_->addPart(segmentUri(sequence_), { (end - part_start_) / 1e6, segment_bytes_, size, part_independent_ });
+            parts_.fetch_add(1, std::memory_order_relaxed);
+        }
+        segment_bytes_ += size;
+        part_start_ = end;
+    }
+    void endSegment(const AVTS end) {
+        endPart(end);
+        double duration = (end - segment_start_) / 1e6;
+        for (std::string &uri: playlist_->addSegment(sequence_, segmentUri(sequence_), duration)) {
+            if (delete_segments_) {
+                expired_.push_back(std::move(uri));
+            }
+        }
+        // players may still be downloading segments which have just left the playlist
+        while (expired_.size() > list_size_) {
+            writer_->remove(path(expired_.front()));
+            expired_.pop_front();
+        }
+        segments_.fetch_add(1, std::memory_order_relaxed);
+        last_segment_us_.store(end - segment_start_, std::memory_order_relaxed);
+        if (duration > 0 && !fixed_bandwidth_) {
+            uint64_t bps = segment_bytes_ * 8 / duration;
+            // BANDWIDTH is the peak, don't rewrite the multivariant playlist for small changes
+            if (bps > variant_.bandwidth + variant_.bandwidth / 10) {
+                variant_.bandwidth = bps;
+                bandwidth_.store(bps, std::memory_order_relaxed);
+                updateMaster();
+            }
+        }
+        segment_bytes_ = 0;
+        sequence_++;
+        segment_start_ = end;
+    }
+    void publish() {
+        if (part_duration_us_ > 0 && !closed_) {
+            playlist_->setPreloadHint(segmentUri(sequence_), segment_bytes_);
+        }
+        writer_->replace(path(playlist_name_), playlist_->render());
+    }
+    void updateMaster() {
+        if (!master_path_.empty() && variant_.bandwidth > 0) {
+            group_->updateMaster(master_path_, path(playlist_name_), variant_);
+        }
+    }
+public:
+    using NodeSingleInput<av::Packet>::NodeSingleInput;
+    av::FormatContext& ctx() {
+        return octx_;
+    }
+    virtual void process() {
+        av::Packet pkt = this->source_->get();
+        if (!pkt) {
+            return;
+        }
+        AVTS ts = packetTs(pkt);
+        if (pkt.streamIndex() == ref_stream_ && ts != AV_NOPTS_VALUE) {
+            bool key = pkt.raw()->flags & AV_PKT_FLAG_KEY;
+            if (!started_) {
+                int64_t sequence = key ? group_->join(ts, tolerance_us_, segment_duration_us_ - tolerance_us_) : -1;
+                if (sequence < 0) {
+                    dropped_packets_.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                started_ = true;
+                sequence_ = sequence;
+                segment_start_ = part_start_ = ts;
+                part_independent_ = true;
+            } else {
+                AVTS frame_us = last_duration_ > 0 ? last_duration_ : (ts - last_ts_);
+                // EXT-X-TARGETDURATION can't grow, so a segment which would get longer is cut even without keyframe
+                bool overlong = ts > segment_start_ && ts + frame_us - segment_start_ > max_segment_duration_us_;
+                AVTS cut_at = (key || overlong) ? group_->cut(sequence_ + 1, ts, segment_start_, overlong ? 0 : segment_duration_us_ - tolerance_us_) : AV_NOPTS_VALUE;
+                if (cut_at != AV_NOPTS_VALUE && (ts + tolerance_us_ >= cut_at || overlong)) {
+                    if (!key) {
+                        forced_cuts_.fetch_add(1, std::memory_order_relaxed);
+                        logstream_limited(1) << "No keyframe within max_segment_duration, segment " << (sequence_+1) << " starts at non-keyframe " << ts << "us";
+                    }
+                    if (std::abs(ts - cut_at) > tolerance_us_) {
+                        misaligned_cuts_.fetch_add(1, std::memory_order_relaxed);
+                        logstream_limited(1) << "Segment " << (sequence_+1) << " boundary is at " << cut_at << "us, cutting at " << ts << "us";
+                    }
+                    endSegment(ts);
+                    part_independent_ = key;
+                    publish();
+                } else if (part_duration_us_ > 0 && ts + frame_us - part_start_ > part_duration_us_) {
+                    endPart(ts);
+                    part_independent_ = key;
+                    publish();
+                }
+            }
+            last_ts_ = ts;
+            last_duration_ = pkt.raw()->duration > 0 ? av_rescale_q(pkt.raw()->duration, pkt.timeBase().getValue(), {1, 1000000}) : 0;
+        } else if (!started_) {
+            dropped_packets_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        writePacket(pkt);
+    }
+    virtual void flush() {
+        if (closed_) {
+            return;
+        }
+        closed_ = true;
+        if (started_) {
+            endSegment(last_ts_ + last_duration_);
+        }
+        playlist_->end();
+        publish();
+        octx_.writeTrailer();
+        io_->take(); // mfra, not needed in segments
+        octx_.close();
+        io_ = nullptr;
+        writer_->flush();
+        this->finished_ = true;
+    }
+    virtual Parameters getObject(const std::string name) {
+        if (name=="stats") {
+            Parameters r;
+            r["segments"] = segments_.load(std::memory_order_relaxed);
+            r["parts"] = parts_.load(std::memory_order_relaxed);
+            r["misaligned_cuts"] = misaligned_cuts_.load(std::memory_order_relaxed);
+            r["forced_cuts"] = forced_cuts_.load(std::memory_order_relaxed);
+            r["dropped_packets"] = dropped_packets_.load(std::memory_order_relaxed);
+            r["last_segment_duration"] = last_segment_us_.load(std::memory_order_relaxed) / 1e6;
+            r["bandwidth"] = bandwidth_.load(std::memory_order_relaxed);
+            r["writer"] = writer_->stats();
+            return r;
+        } else {
+            throw Error("Unknown object to get");
+        }
+    }
+    static std::shared_ptr<HlsOutput> create(NodeCreationInfo &nci) {
+        EdgeManager &edges = nci.edges;
+        const Parameters &params = nci.params;
+        std::shared_ptr<Edge<av::Packet>> edge = edges.find<av::Packet>(params["src"]);
+        auto r = std::make_shared<HlsOutput>(make_unique<EdgeSource<av::Packet>>(edge));
+        av::FormatContext &octx = r->ctx();
+
+        r->dir_ = params["dir"];
+        while (r->dir_.size() > 1 && r->dir_.back() == '/') {
+            r->dir_.pop_back();
+        }
+        if (params.count("playlist")) {
+            r->playlist_name_ = params["playlist"];
+        }
+        if (params.count("segment_prefix")) {
+            r->segment_prefix_ = params["segment_prefix"];
+            r->init_name_ = r->segment_prefix_ + "init.mp4";
+        }
+        if (params.count("segment_duration")) {
+            r->segment_duration_us_ = params["segment_duration"].get<double>() * 1e6;
+        }
+        r->max_segment_duration_us_ = r->segment_duration_us_ * 3 / 2;
+        if (params.count("max_segment_duration")) {
+            r->max_segment_duration_us_ = params["max_segment_duration"].get<double>() * 1e6;
+        }
+        if (r->max_segment_duration_us_ < r->segment_duration_us_) {
+            throw Error("max_segment_duration must not be less than segment_duration");
+        }
+        if (params.count("part_duration")) {
+            r->part_duration_us_ = params["part_duration"].get<double>() * 1e6;
+        }
+        if (params.count("list_size")) {
+            r->list_size_ = params["list_size"];
+        }
+        bool event = false;
+        if (params.count("playlist_type")) {
+            std::string type = params["playlist_type"];
+            if (type == "event") {
+                event = true;
+            } else if (type != "live") {
+                throw Error("Invalid playlist_type: " + type);
+            }
+        }
+        r->delete_segments_ = !event;
+        if (params.count("delete_segments")) {
+            r->delete_segments_ = params["delete_segments"];
+        }
+        size_t buffer_bytes = 256*1024*1024;
+        if (params.count("buffer_bytes")) {
+            buffer_bytes = params["buffer_bytes"];
+        }
+        std::string group_name = "hls_output:" + r->dir_ + "/" + r->playlist_name_; // private group
+        if (params.count("group")) {
+            group_name = params["group"];
+        }
+        r->group_ = InstanceSharedObjects<HlsSegmentGroup>::get(nci.instance, group_name);
+        if (params.count("master")) {
+            r->master_path_ = params["master"];
+            std::string playlist_path = r->path(r->playlist_name_);
+            size_t slash = r->master_path_.rfind('/');
+            std::string master_dir = slash==std::string::npos ? "" : r->master_path_.substr(0, slash+1);
+            if (params.count("variant_uri")) {
+                r->variant_.uri = params["variant_uri"];
+            } else if (playlist_path.compare(0, master_dir.size(), master_dir) == 0) {
+                r->variant_.uri = playlist_path.substr(master_dir.size());
+            } else {
+                r->variant_.uri = playlist_path;
+            }
+        }
+        if (params.count("bandwidth")) {
+            r->variant_.bandwidth = params["bandwidth"];
+            r->fixed_bandwidth_ = true;
+        }
+        if (params.count("codecs")) {
+            r->variant_.codecs = params["codecs"];
+        }
+        // fragments are cut by us (av_write_frame(ctx, NULL)), initialization section is written with the header
+        std::string movflags = "+frag_custom+empty_moov+default_base_moof";
+        Parameters options = Parameters::object();
+        if (params.count("options")) {
+            options = params["options"];
+        }
+        if (options.count("movflags")) {
+            std::string user_flags = options["movflags"];
+            movflags += (user_flags.empty() || user_flags[0]=='+' || user_flags[0]=='-') ? user_flags : "+" + user_flags;
+        }
+        options["movflags"] = movflags;
+        av::Dictionary opts = parametersToDict(options);
+
+        AsyncFileWriter::makeDirectories(r->dir_);
+        r->writer_ = make_unique<AsyncFileWriter>("hls writer", buffer_bytes);
+        r->playlist_ = make_unique<HlsMediaPlaylist>(r->max_segment_duration_us_ / 1e6, r->part_duration_us_ / 1e6, r->list_size_, event, r->init_name_);
+
+        std::string init_path = r->path(r->init_name_);
+        av::OutputFormat ofmt("mp4", init_path);
+        octx.setFormat(ofmt);
+
+        std::shared_ptr<IMuxer> muxer = edge->findNodeUp<IMuxer>();
+        if (muxer==nullptr) {
+            throw Error("Muxer is mandatory before hls_output!");
+        }
+        muxer->initFromFormatContext(octx);
+
+        octx.raw()->url = av_strdup(init_path.c_str()); // workaround for avcpp not using avformat_alloc_output_context2
+        r->io_ = make_unique<MemoryOutputIO>();
+        octx.openOutput(r->io_.get(), av::throws());
+
+        muxer->initFromFormatContextPostOpenPreWriteHeader(octx);
+        octx.writeHeader(opts);
+        avio_flush(octx.raw()->pb);
+        r->writer_->replace(init_path, r->io_->take());
+        edge->setConsumer(r);
+
+        muxer->initFromFormatContextPostOpen(octx);
+
+        for (size_t i=0; i<octx.streamsCount(); i++) {
+            av::Stream stream = octx.stream(i);
+            r->stream_tbs_.push_back(stream.timeBase());
+        }
+        // segments start at keyframes of the first video stream
+        for (size_t i=0; i<octx.streamsCount(); i++) {
+            AVCodecParameters* codecpar = octx.stream(i).raw()->codecpar;
+            if (codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+                r->ref_stream_ = i;
+                r->variant_.width = codecpar->width;
+                r->variant_.height = codecpar->height;
+                break;
+            }
+        }
+        r->updateMaster();
+
+        logstream << "HLS output: " << r->path(r->playlist_name_) << ", segments " << r->segment_duration_us_/1e6 << " s"
+                  << (r->part_duration_us_ > 0 ? ", parts " + std::to_string(r->part_duration_us_/1e6) + " s" : "");
+
+        return r;
+    }
+};
+
+DECLNODE(hls_output, HlsOutput);
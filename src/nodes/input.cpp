@@ -1,15 +1,174 @@
 #include "node_common.hpp"
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <libavutil/channel_layout.h>
+#include "../histogram.hpp"
+#include "../timed_history.hpp"
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+// Custom AVIO with a buffer size of our choice: the demuxer reads from it
+// and it reads from the real AVIO (file, pipe, socket...) whatever is available.
+class BufferedInputIO: public av::CustomIO {
+protected:
+    AVIOContext* inner_ = nullptr;
+public:
+    BufferedInputIO(const std::string url, const AVIOInterruptCB* interrupt_cb, av::Dictionary &options) {
+        int r = avio_open2(&inner_, url.c_str(), AVIO_FLAG_READ, interrupt_cb, options.rawPtr());
+        if (r < 0) {
+            throw Error("Failed to open " + url + ": " + av::error2string(r));
+        }
+    }
+    virtual ~BufferedInputIO() {
+        avio_closep(&inner_);
+    }
+    virtual int read(uint8_t *data, size_t size) override {
+        return avio_read_partial(inner_, data, size);
+    }
+    virtual int64_t seek(int64_t offset, int whence) override {
+        if (whence & AVSEEK_SIZE) {
+            return avio_size(inner_);
+        }
+        return avio_seek(inner_, offset, whence);
+    }
+    virtual int seekable() const override {
+        return inner_->seekable;
+    }
+    virtual const char* name() const override {
+        return "avplumber_buffered_input";
+    }
+};
 
 class StreamInput: public NodeSingleOutput<av::Packet>, public IStreamsInput, public ReportsFinishByFlag,
                    public IStoppable, public IInterruptible, public IReturnsObjects {
 protected:
+    std::unique_ptr<BufferedInputIO> io_; // must outlive ictx_
     av::FormatContext ictx_;
     std::atomic_bool should_end_ {false};
     AVTS wait_start_;
     AVTS wait_max_ = AV_NOPTS_VALUE;
     av::Timestamp shift_ = NOTS;
     Parameters streams_object_, programs_object_;
+    // prefetch mode: reader thread fills ring_ ahead of process()
+    bool prefetch_ = false;
+    size_t prefetch_bytes_ = 16*1024*1024;
+    std::mutex mutex_;
+    std::condition_variable ring_cv_;
+    std::deque<av::Packet> ring_;
+    size_t ring_bytes_ = 0;
+    size_t max_seen_ring_bytes_ = 0;
+    bool reader_eof_ = false;
+    std::exception_ptr reader_error_;
+    std::thread reader_;
+    bool delivered_any_ = false;
+    // metrics:
+    std::atomic_uint64_t read_packets_ {0};
+    std::atomic_uint64_t read_bytes_ {0};
+    std::atomic_uint64_t stalls_ {0};
+    std::atomic_uint64_t stall_us_ {0};
+    std::atomic_uint64_t reader_blocked_us_ {0};
+    LogHistogram<> read_us_;
+    TimedHistory<uint64_t> read_history_ {5}; // total bytes read, guarded by mutex_
+
+    // returns null packet at the end of input
+    av::Packet readPacket() {
+        wait_start_ = wallclock.pts();
+        AVTS begin = wallclock.ns();
+        av::Packet pkt = ictx_.readPacket();
+        read_us_.record((wallclock.ns() - begin) / 1000);
+        if (!pkt.isNull()) {
+            read_packets_.fetch_add(1, std::memory_order_relaxed);
+            uint64_t total = read_bytes_.fetch_add(pkt.size(), std::memory_order_relaxed) + pkt.size();
+            std::lock_guard<decltype(mutex_)> lock(mutex_);
+            read_history_.pushWallclockNow(total);
+        }
+        return pkt;
+    }
+    void readerThread() {
+        try {
+            while (!should_end_) {
+                av::Packet pkt = readPacket();
+                std::unique_lock<decltype(mutex_)> lock(mutex_);
+                if (pkt.isNull()) {
+                    reader_eof_ = true;
+                    break;
+                }
+                size_t size = pkt.size();
+                // always accept into empty ring, so that a packet bigger than the budget doesn't block forever
+                auto has_space = [&]() {
+                    return should_end_ || ring_.empty() || (ring_bytes_ + size <= prefetch_bytes_);
+                };
+                if (!has_space()) {
+                    AVTS begin = wallclock.ns();
+                    ring_cv_.wait(lock, has_space);
+                    reader_blocked_us_.fetch_add((wallclock.ns() - begin) / 1000, std::memory_order_relaxed);
+                }
+                if (should_end_) break;
+                ring_.push_back(std::move(pkt));
+                ring_bytes_ += size;
+                if (ring_bytes_ > max_seen_ring_bytes_) {
+                    max_seen_ring_bytes_ = ring_bytes_;
+                }
+                lock.unlock();
+                ring_cv_.notify_all();
+            }
+        } catch (std::exception &e) {
+            logstream << "Input reader failed: " << e.what();
+            std::lock_guard<decltype(mutex_)> lock(mutex_);
+            reader_error_ = std::current_exception();
+            reader_eof_ = true;
+        }
+        ring_cv_.notify_all();
+    }
+    void stopReader() {
+        {
+            std::lock_guard<decltype(mutex_)> lock(mutex_);
+            should_end_ = true;
+        }
+        ring_cv_.notify_all();
+        if (reader_.joinable()) {
+            reader_.join();
+        }
+    }
+    // returns false if there is nothing to process because the node is stopping
+    bool takePrefetched(av::Packet &pkt) {
+        if (!reader_.joinable()) {
+            reader_ = start_thread("input reader", [this]() {
+                readerThread();
+            });
+        }
+        std::unique_lock<decltype(mutex_)> lock(mutex_);
+        auto ready = [this]() {
+            return should_end_ || reader_eof_ || !ring_.empty();
+        };
+        if (!ready()) {
+            // waiting for data with nothing buffered, downstream stalls
+            AVTS begin = wallclock.ns();
+            ring_cv_.wait(lock, ready);
+            if (delivered_any_) {
+                stalls_.fetch_add(1, std::memory_order_relaxed);
+                stall_us_.fetch_add((wallclock.ns() - begin) / 1000, std::memory_order_relaxed);
+            }
+        }
+        if (!ring_.empty()) {
+            pkt = std::move(ring_.front());
+            ring_.pop_front();
+            ring_bytes_ -= pkt.size();
+            delivered_any_ = true;
+            lock.unlock();
+            ring_cv_.notify_all();
+            return true;
+        }
+        if (reader_error_) {
+            std::exception_ptr e = reader_error_;
+            reader_error_ = nullptr;
+            std::rethrow_exception(e);
+        }
+        // EOF leaves pkt null
+        return !should_end_;
+    }
     void closeInput(bool warn = true) {
         try {
             ictx_.close();
@@ -58,8 +217,12 @@ public:
         ictx_.stream(index).raw()->discard = AVDISCARD_DEFAULT;
     }
     virtual void process() {
-        wait_start_ = wallclock.pts();
-        av::Packet pkt = ictx_.readPacket();
+        av::Packet pkt;
+        if (prefetch_) {
+            if (!takePrefetched(pkt)) return;
+        } else {
+            pkt = readPacket();
+        }
         if (pkt.isNull()) {
             this->finished_ = true;
             logstream << "Got null packet";
@@ -91,8 +254,12 @@ public:
     }
     virtual void stop() {
         logstream << "Setting should_end_ to true";
-        should_end_ = true;
+        {
+            std::lock_guard<decltype(mutex_)> lock(mutex_);
+            should_end_ = true;
+        }
         this->finished_ = true;
+        ring_cv_.notify_all();
     }
     virtual void interrupt() {
         stop();
@@ -108,6 +275,7 @@ public:
         //ictx_.setSocketTimeout(timeout);
     }
     virtual ~StreamInput() {
+        stopReader();
         #if 0 // see comment in process() "Got null packet"
         if (ictx_.isOpened()) {
             logstream << "BUG: input context still opened in destructor, closing";
@@ -142,8 +310,24 @@ public:
         if (params.count("initial_timeout") > 0) {
             initial_timeout = (int)params["initial_timeout"];
         }
+        if (params.count("probesize") > 0) {
+            opts["probesize"].set(std::to_string(params["probesize"].get<int64_t>()));
+        }
+        if (params.count("analyzeduration") > 0) {
+            opts["analyzeduration"].set(std::to_string(int64_t(params["analyzeduration"].get<double>() * 1000000)));
+        }
+        prefetch_ = params.value("prefetch", false);
+        if (params.count("prefetch_bytes") > 0) {
+            prefetch_bytes_ = params["prefetch_bytes"];
+        }
         setTimeout(initial_timeout);
-        ictx_.openInput(params["url"], opts, ifmt);
+        if (params.count("avio_buffer_size") > 0) {
+            size_t avio_buffer_size = params["avio_buffer_size"];
+            io_ = make_unique<BufferedInputIO>(params["url"], &ictx_.raw()->interrupt_callback, opts);
+            ictx_.openInput(io_.get(), opts, ifmt, av::throws(), avio_buffer_size);
+        } else {
+            ictx_.openInput(params["url"], opts, ifmt);
+        }
         ictx_.findStreamInfo();
         logstream << "Opened URL " << params["url"] << " . Streams:";
         for (unsigned i=0; i<ictx_.streamsCount(); i++) {
@@ -195,6 +379,35 @@ public:
             return streams_object_;
         } else if (name=="programs") {
             return programs_object_;
+        } else if (name=="stats") {
+            Parameters r;
+            r["prefetch"] = prefetch_;
+            r["read_packets"] = read_packets_.load(std::memory_order_relaxed);
+            r["read_bytes"] = read_bytes_.load(std::memory_order_relaxed);
+            r["read_us"] = read_us_.toJson();
+            r["read_us"].erase("buckets");
+            {
+                std::lock_guard<decltype(mutex_)> lock(mutex_);
+                read_history_.cleanupWithRefTS(wallclock.ts());
+                double bps = 0;
+                if (read_history_.size() >= 2 && read_history_.timeDiff().seconds() > 0) {
+                    bps = read_history_.valueDiff<double>() * 8 / read_history_.timeDiff().seconds();
+                }
+                r["read_bitrate"] = bps;
+                if (prefetch_) {
+                    r["ring_packets"] = ring_.size();
+                    r["ring_bytes"] = ring_bytes_;
+                    r["ring_capacity_bytes"] = prefetch_bytes_;
+                    r["ring_fill"] = double(ring_bytes_) / prefetch_bytes_;
+                    r["max_ring_bytes"] = max_seen_ring_bytes_;
+                }
+            }
+            if (prefetch_) {
+                r["stalls"] = stalls_.load(std::memory_order_relaxed);
+                r["stall_us"] = stall_us_.load(std::memory_order_relaxed);
+                r["reader_blocked_us"] = reader_blocked_us_.load(std::memory_order_relaxed);
+            }
+            return r;
         } else {
             throw Error("Unknown object to get");
         }
@@ -0,0 +1,474 @@
+#include "node_common.hpp"
+#include <cmath>
+#include <cstring>
+extern "C" {
+#include <libavutil/channel_layout.h>
+}
+
+// Input for load testing without a live source: packets of a local file
+// (or of test patterns encoded once at init) are read into memory
+// and played in a loop, with timestamps shifted by the loop duration.
+// Every output packet is a reference to the stored one, so there is no I/O
+// and no copying during playback.
+
+namespace {
+    // demuxer reads from a container kept in memory
+    class MemoryInputIO: public av::CustomIO {
+    protected:
+        std::string data_;
+        size_t pos_ = 0;
+    public:
+        MemoryInputIO(std::string data): data_(std::move(data)) {
+        }
+        virtual int read(uint8_t *data, size_t size) override {
+            if (pos_ >= data_.size()) {
+                return AVERROR_EOF;
+            }
+            size_t n = std::min(size, data_.size() - pos_);
+            memcpy(data, data_.data() + pos_, n);
+            pos_ += n;
+            return n;
+        }
+        virtual int64_t seek(int64_t offset, int whence) override {
+            if (whence & AVSEEK_SIZE) {
+                return data_.size();
+            }
+            int64_t base;
+            switch (whence & ~AVSEEK_FORCE) {
+            case SEEK_SET:
+                base = 0;
+                break;
+            case SEEK_CUR:
+                base = pos_;
+                break;
+            case SEEK_END:
+                base = data_.size();
+                break;
+            default:
+                return AVERROR(EINVAL);
+            }
+            if (base + offset < 0) {
+                return AVERROR(EINVAL);
+            }
+            pos_ = base + offset;
+            return pos_;
+        }
+        virtual int seekable() const override {
+            return AVIO_SEEKABLE_NORMAL;
+        }
+        virtual const char* name() const override {
+            return "avplumber_memory_input";
+        }
+    };
+
+    struct CodecContextDeleter {
+        void operator()(AVCodecContext* ctx) {
+            avcodec_free_context(&ctx);
+        }
+    };
+    struct FrameDeleter {
+        void operator()(AVFrame* frame) {
+            av_frame_free(&frame);
+        }
+    };
+    struct PacketDeleter {
+        void operator()(AVPacket* pkt) {
+            av_packet_free(&pkt);
+        }
+    };
+    struct MemoryMuxerDeleter {
+        void operator()(AVFormatContext* ctx) {
+            if (ctx->pb) {
+                uint8_t* buf = nullptr;
+                avio_close_dyn_buf(ctx->pb, &buf);
+                av_free(buf);
+            }
+            avformat_free_context(ctx);
+        }
+    };
+
+    void check(const int r, const std::string &what) {
+        if (r < 0) {
+            throw Error(what + " failed: " + av::error2string(r));
+        }
+    }
+
+    struct PatternEncoder {
+        std::unique_ptr<AVCodecContext, CodecContextDeleter> enc;
+        std::unique_ptr<AVFrame, FrameDeleter> frame;
+        AVStream* stream = nullptr;
+        int64_t next_pts = 0; // in enc->time_base
+        int64_t count = 0;
+        int64_t limit = 0;
+        double nextTime() const {
+            return next_pts * av_q2d(enc->time_base);
+        }
+        // frame == nullptr flushes the encoder
+        void encode(AVFrame* frame, AVFormatContext* mux, AVPacket* pkt) {
+            check(avcodec_send_frame(enc.get(), frame), "Encoding test pattern");
+            while (true) {
+                int r = avcodec_receive_packet(enc.get(), pkt);
+                if (r == AVERROR(EAGAIN) || r == AVERROR_EOF) break;
+                check(r, "Encoding test pattern");
+                av_packet_rescale_ts(pkt, enc->time_base, stream->time_base);
+                pkt->stream_index = stream->index;
+                check(av_interleaved_write_frame(mux, pkt), "Muxing test pattern");
+            }
+        }
+    };
+
+    const AVCodec* findEncoder(const std::string &name) {
+        const AVCodec* codec = avcodec_find_encoder_by_name(name.c_str());
+        if (codec == nullptr) {
+            throw Error("Encoder " + name + " not found");
+        }
+        return codec;
+    }
+
+    void openPatternEncoder(PatternEncoder &pe, const AVCodec* codec, AVFormatContext* mux, AVDictionary** opts) {
+        if (mux->oformat->flags & AVFMT_GLOBALHEADER) {
+            pe.enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        }
+        check(avcodec_open2(pe.enc.get(), codec, opts), std::string("Opening encoder ") + codec->name);
+        pe.stream = avformat_new_stream(mux, nullptr);
+        if (pe.stream == nullptr) {
+            throw Error("Adding test pattern stream failed");
+        }
+        check(avcodec_parameters_from_context(pe.stream->codecpar, pe.enc.get()), "Copying codec parameters");
+        pe.stream->time_base = pe.enc->time_base;
+        pe.frame.reset(av_frame_alloc());
+    }
+
+    // moving diagonal gradient with a white bar, so that every frame differs
+    void fillVideoPattern(AVFrame* frame, const int64_t n) {
+        check(av_frame_make_writable(frame), "Allocating test pattern frame");
+        for (int y=0; y<frame->height; y++) {
+            uint8_t* line = frame->data[0] + ptrdiff_t(y) * frame->linesize[0];
+            for (int x=0; x<frame->width; x++) {
+                line[x] = (x + y + 4*n) & 0xFF;
+            }
+        }
+        int bar_x = (n * 8) % frame->width;
+        int bar_w = std::min(16, frame->width - bar_x);
+        for (int y=0; y<frame->height; y++) {
+            memset(frame->data[0] + ptrdiff_t(y) * frame->linesize[0] + bar_x, 235, bar_w);
+        }
+        int cw = AV_CEIL_RSHIFT(frame->width, 1);
+        int ch = AV_CEIL_RSHIFT(frame->height, 1);
+        for (int y=0; y<ch; y++) {
+            uint8_t* u = frame->data[1] + ptrdiff_t(y) * frame->linesize[1];
+            uint8_t* v = frame->data[2] + ptrdiff_t(y) * frame->linesize[2];
+            for (int x=0; x<cw; x++) {
+                u[x] = x * 255 / cw;
+                v[x] = y * 255 / ch;
+            }
+        }
+    }
+
+    // 1 kHz tone at -20 dBFS
+    void fillAudioPattern(AVFrame* frame, const int64_t first_sample) {
+        check(av_frame_make_writable(frame), "Allocating test pattern frame");
+        for (int i=0; i<frame->nb_samples; i++) {
+            float s = 0.1f * sinf(2 * M_PI * 1000 * (first_sample + i) / frame->sample_rate);
+            for (int c=0; c<frame->channels; c++) {
+                reinterpret_cast<float*>(frame->extended_data[c])[i] = s;
+            }
+        }
+    }
+
+    // Encodes test patterns described by params and returns them muxed into NUT.
+    std::string encodePattern(const Parameters &params) {
+        double duration = params.value("duration", 10.0);
+        AVFormatContext* mux_raw = nullptr;
+        check(avformat_alloc_output_context2(&mux_raw, nullptr, "nut", nullptr), "Allocating muxer");
+        std::unique_ptr<AVFormatContext, MemoryMuxerDeleter> mux(mux_raw);
+        std::unique_ptr<AVPacket, PacketDeleter> pkt(av_packet_alloc());
+        std::vector<PatternEncoder> encoders;
+
+        std::string video_codec = params.value("codec", "mpeg2video");
+        if (!video_codec.empty()) {
+            const AVCodec* codec = findEncoder(video_codec);
+            std::string rate_str = "25";
+            if (params.count("rate")) {
+                rate_str = params["rate"].is_string() ? params["rate"].get<std::string>() : params["rate"].dump();
+            }
+            av::Rational rate = parseRatio(rate_str);
+            PatternEncoder pe;
+            pe.enc.reset(avcodec_alloc_context3(codec));
+            pe.enc->width = params.value("width", 1280);
+            pe.enc->height = params.value("height", 720);
+            pe.enc->pix_fmt = AV_PIX_FMT_YUV420P;
+            pe.enc->time_base = { rate.getDenominator(), rate.getNumerator() };
+            pe.enc->framerate = rate.getValue();
+            pe.enc->gop_size = params.value("gop", int(std::lround(rate.getDouble() * 2)));
+            pe.enc->bit_rate = params.value("bitrate", 4000000);
+            av::Dictionary opts;
+            if (params.count("options") > 0) {
+                opts = parametersToDict(params["options"]);
+            }
+            openPatternEncoder(pe, codec, mux.get(), opts.rawPtr());
+            pe.frame->format = pe.enc->pix_fmt;
+            pe.frame->width = pe.enc->width;
+            pe.frame->height = pe.enc->height;
+            check(av_frame_get_buffer(pe.frame.get(), 0), "Allocating test pattern frame");
+            pe.limit = std::ceil(duration * rate.getDouble());
+            encoders.push_back(std::move(pe));
+        }
+        std::string audio_codec = params.value("audio_codec", "aac");
+        if (!audio_codec.empty()) {
+            const AVCodec* codec = findEncoder(audio_codec);
+            PatternEncoder pe;
+            pe.enc.reset(avcodec_alloc_context3(codec));
+            pe.enc->sample_rate = params.value("sample_rate", 48000);
+            pe.enc->channels = params.value("channels", 2);
+            pe.enc->channel_layout = av_get_default_channel_layout(pe.enc->channels);
+            pe.enc->sample_fmt = AV_SAMPLE_FMT_FLTP;
+            pe.enc->time_base = { 1, pe.enc->sample_rate };
+            pe.enc->bit_rate = params.value("audio_bitrate", 128000);
+            openPatternEncoder(pe, codec, mux.get(), nullptr);
+            pe.frame->format = pe.enc->sample_fmt;
+            pe.frame->sample_rate = pe.enc->sample_rate;
+            pe.frame->channels = pe.enc->channels;
+            pe.frame->channel_layout = pe.enc->channel_layout;
+            pe.frame->nb_samples = pe.enc->frame_size > 0 ? pe.enc->frame_size : 1024;
+            check(av_frame_get_buffer(pe.frame.get(), 0), "Allocating test pattern frame");
+            pe.limit = std::ceil(duration * pe.enc->sample_rate / pe.frame->nb_samples);
+            encoders.push_back(std::move(pe));
+        }
+        if (encoders.empty()) {
+            throw Error("Test pattern needs codec or audio_codec");
+        }
+
+        check(avio_open_dyn_buf(&mux->pb), "Allocating muxer buffer");
+        check(avformat_write_header(mux.get(), nullptr), "Writing test pattern header");
+        while (true) {
+            // interleave streams by time
+            PatternEncoder* next = nullptr;
+            for (PatternEncoder &pe: encoders) {
+                if (pe.count < pe.limit && (next == nullptr || pe.nextTime() < next->nextTime())) {
+                    next = &pe;
+                }
+            }
+            if (next == nullptr) break;
+            AVFrame* frame = next->frame.get();
+            if (next->enc->codec_type == AVMEDIA_TYPE_VIDEO) {
+                fillVideoPattern(frame, next->count);
+                frame->pts = next->next_pts;
+                next->next_pts++;
+            } else {
+                fillAudioPattern(frame, next->next_pts);
+                frame->pts = next->next_pts;
+                next->next_pts += frame->nb_samples;
+            }
+            next->count++;
+            next->encode(frame, mux.get(), pkt.get());
+        }
+        for (PatternEncoder &pe: encoders) {
+            pe.encode(nullptr, mux.get(), pkt.get());
+        }
+        check(av_write_trailer(mux.get()), "Writing test pattern trailer");
+        uint8_t* buf = nullptr;
+        int size = avio_close_dyn_buf(mux->pb, &buf);
+        mux->pb = nullptr;
+        std::string r(reinterpret_cast<const char*>(buf), size);
+        av_free(buf);
+        return r;
+    }
+};
+
+class LoopInput: public NodeSingleOutput<av::Packet>, public IStreamsInput, public ReportsFinishByFlag,
+                 public IStoppable, public IReturnsObjects {
+protected:
+    std::unique_ptr<MemoryInputIO> io_; // must outlive ictx_
+    av::FormatContext ictx_;
+    std::vector<av::Packet> packets_;
+    size_t stored_bytes_ = 0;
+    AVTS start_us_ = 0; // earliest DTS, for pacing
+    AVTS loop_duration_us_ = 0;
+    bool realtime_ = true;
+    uint64_t loops_limit_ = 0;
+    size_t index_ = 0;
+    uint64_t loop_ = 0;
+    AVTS start_ns_ = -1;
+    Event stop_event_; // interrupts pacing
+    std::atomic_uint64_t sent_packets_ {0};
+    std::atomic_uint64_t sent_bytes_ {0};
+    std::atomic_uint64_t loops_done_ {0};
+
+    static AVTS toMicroseconds(const int64_t ts, const AVRational tb) {
+        return av_rescale_q(ts, tb, AV_TIME_BASE_Q);
+    }
+    void readAll(const size_t max_bytes) {
+        while (true) {
+            av::Packet pkt = ictx_.readPacket();
+            if (pkt.isNull()) break;
+            if (!pkt.isComplete() || (pkt.dts().isNoPts() && pkt.pts().isNoPts())) continue;
+            stored_bytes_ += pkt.size();
+            if (stored_bytes_ > max_bytes) {
+                throw Error("Input bigger than max_bytes = " + std::to_string(max_bytes));
+            }
+            packets_.push_back(std::move(pkt));
+        }
+        if (packets_.empty()) {
+            throw Error("No packets in input");
+        }
+        // loop lasts from the earliest PTS to the end of the last frame of the longest stream
+        size_t nstreams = ictx_.streamsCount();
+        std::vector<AVTS> first_ts(nstreams, AV_NOPTS_VALUE), last_ts(nstreams, AV_NOPTS_VALUE), end_us(nstreams, AV_NOPTS_VALUE);
+        std::vector<uint64_t> count(nstreams, 0);
+        AVTS min_pts_us = AV_NOPTS_VALUE;
+        start_us_ = AV_NOPTS_VALUE;
+        for (av::Packet &pkt: packets_) {
+            AVPacket* raw = pkt.raw();
+            AVRational tb = ictx_.stream(raw->stream_index).raw()->time_base;
+            int64_t pts = raw->pts != AV_NOPTS_VALUE ? raw->pts : raw->dts;
+            int64_t dts = raw->dts != AV_NOPTS_VALUE ? raw->dts : raw->pts;
+            AVTS pts_us = toMicroseconds(pts, tb);
+            AVTS dts_us = toMicroseconds(dts, tb);
+            min_pts_us = (min_pts_us == AV_NOPTS_VALUE) ? pts_us : std::min(min_pts_us, pts_us);
+            start_us_ = (start_us_ == AV_NOPTS_VALUE) ? dts_us : std::min(start_us_, dts_us);
+            size_t s = raw->stream_index;
+            first_ts[s] = (first_ts[s] == AV_NOPTS_VALUE) ? pts : std::min(first_ts[s], pts);
+            last_ts[s] = (last_ts[s] == AV_NOPTS_VALUE) ? pts : std::max(last_ts[s], pts);
+            count[s]++;
+            if (raw->duration > 0) {
+                AVTS e = toMicroseconds(pts + raw->duration, tb);
+                end_us[s] = (end_us[s] == AV_NOPTS_VALUE) ? e : std::max(end_us[s], e);
+            }
+        }
+        AVTS end = AV_NOPTS_VALUE;
+        for (size_t s=0; s<nstreams; s++) {
+            if (count[s] == 0) continue;
+            AVRational tb = ictx_.stream(s).raw()->time_base;
+            // without packet durations, assume the last frame lasts as long as an average one
+            int64_t avg = count[s] > 1 ? (last_ts[s] - first_ts[s]) / int64_t(count[s] - 1) : 0;
+            AVTS e = std::max(toMicroseconds(last_ts[s] + avg, tb), end_us[s] == AV_NOPTS_VALUE ? AVTS(0) : end_us[s]);
+            end = (end == AV_NOPTS_VALUE) ? e : std::max(end, e);
+        }
+        loop_duration_us_ = std::max<AVTS>(end - min_pts_us, 1);
+    }
+public:
+    LoopInput(std::unique_ptr<Sink<av::Packet>> &&sink): NodeSingleOutput<av::Packet>(std::move(sink)) {
+    }
+    virtual av::FormatContext& formatContext() {
+        return ictx_;
+    }
+    virtual size_t streamsCount() {
+        return ictx_.streamsCount();
+    }
+    virtual av::Stream stream(size_t id) {
+        return ictx_.stream(id);
+    }
+    virtual void discardAllStreams() {
+        for (size_t i=0; i<ictx_.streamsCount(); i++) {
+            ictx_.stream(i).raw()->discard = AVDISCARD_ALL;
+        }
+    }
+    virtual void enableStream(size_t index) {
+        ictx_.stream(index).raw()->discard = AVDISCARD_DEFAULT;
+    }
+    virtual void process() {
+        if (this->finished_) return;
+        if (index_ >= packets_.size()) {
+            index_ = 0;
+            loop_++;
+            loops_done_.store(loop_, std::memory_order_relaxed);
+            if (loops_limit_ > 0 && loop_ >= loops_limit_) {
+                logstream << "Played " << loop_ << " loops";
+                this->finished_ = true;
+                return;
+            }
+        }
+        const av::Packet &stored = packets_[index_];
+        AVStream* stream = ictx_.raw()->streams[stored.raw()->stream_index];
+        if (stream->discard == AVDISCARD_ALL) {
+            index_++;
+            return;
+        }
+        av::Packet pkt = stored;
+        AVTS offset_us = AVTS(loop_) * loop_duration_us_;
+        int64_t offset = av_rescale_q(offset_us, AV_TIME_BASE_Q, stream->time_base);
+        AVPacket* raw = pkt.raw();
+        if (raw->pts != AV_NOPTS_VALUE) raw->pts += offset;
+        if (raw->dts != AV_NOPTS_VALUE) raw->dts += offset;
+        if (realtime_) {
+            if (start_ns_ < 0) {
+                start_ns_ = wallclock.ns();
+            }
+            AVTS dts_us = toMicroseconds(raw->dts != AV_NOPTS_VALUE ? raw->dts : raw->pts, stream->time_base);
+            if (!wallclock.sleepUntilNs(start_ns_ + (dts_us - start_us_) * 1000, stop_event_.fd())) {
+                return; // stopped
+            }
+        }
+        if (this->sink_->put(pkt)) {
+            index_++;
+            sent_packets_.fetch_add(1, std::memory_order_relaxed);
+            sent_bytes_.fetch_add(pkt.size(), std::memory_order_relaxed);
+        }
+    }
+    virtual void stop() {
+        this->finished_ = true;
+        stop_event_.signal();
+    }
+    virtual Parameters getObject(const std::string name) {
+        if (name=="stats") {
+            Parameters r;
+            r["loops"] = loops_done_.load(std::memory_order_relaxed);
+            r["packets"] = sent_packets_.load(std::memory_order_relaxed);
+            r["bytes"] = sent_bytes_.load(std::memory_order_relaxed);
+            r["stored_packets"] = packets_.size();
+            r["stored_bytes"] = stored_bytes_;
+            r["loop_duration"] = loop_duration_us_ / 1000000.0;
+            return r;
+        } else {
+            throw Error("Unknown object to get");
+        }
+    }
+    virtual ~LoopInput() {
+        packets_.clear();
+        try {
+            ictx_.close();
+        } catch (std::exception &e) {
+            logstream << "WARNING: closing input failed: " << e.what();
+        }
+    }
+    static std::shared_ptr<LoopInput> create(NodeCreationInfo &nci) {
+        EdgeManager &edges = nci.edges;
+        const Parameters &params = nci.params;
+        std::shared_ptr<Edge<av::Packet>> edge = edges.find<av::Packet>(params["dst"]);
+        auto r = std::make_shared<LoopInput>(make_unique<EdgeSink<av::Packet>>(edge));
+        return r;
+    }
+    virtual void init(EdgeManager &edges, const Parameters &params) {
+        NodeSingleOutput<av::Packet>::init(edges, params);
+        realtime_ = params.value("realtime", true);
+        loops_limit_ = params.value("loops", 0);
+        size_t max_bytes = params.value("max_bytes", size_t(1024)*1024*1024);
+        if (params.count("pattern") > 0) {
+            AVTS begin = wallclock.ns();
+            io_ = make_unique<MemoryInputIO>(encodePattern(params["pattern"]));
+            logstream << "Encoded test pattern in " << (wallclock.ns() - begin) / 1000000 << " ms";
+            av::InputFormat ifmt;
+            ifmt.setFormat("nut");
+            ictx_.openInput(io_.get(), ifmt);
+        } else {
+            av::InputFormat ifmt;
+            if (params.count("format") > 0) {
+                ifmt.setFormat(params["format"]);
+            }
+            av::Dictionary opts;
+            if (params.count("options") > 0) {
+                opts = parametersToDict(params["options"]);
+            }
+            ictx_.openInput(params["url"], opts, ifmt);
+        }
+        ictx_.findStreamInfo();
+        readAll(max_bytes);
+        logstream << "Stored " << packets_.size() << " packets (" << stored_bytes_ << " bytes), loop lasts "
+                  << loop_duration_us_ / 1000000.0 << " s";
+        std::shared_ptr<Edge<av::Packet>> edge = edges.find<av::Packet>(params["dst"]);
+        edge->setProducer(this->shared_from_this());
+    }
+};
+
+DECLNODE(loop_input, LoopInput);
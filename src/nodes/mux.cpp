@@ -1,5 +1,8 @@
 #include "node_common.hpp"
 #include "../MultiEventWait.hpp"
+#include <algorithm>
+#include <queue>
+#include <set>
 
 class StreamMuxer: public NodeSingleOutput<av::Packet>, public IStoppable, public IMuxer, public NodeDoesNotBuffer {
 private:
@@ -8,15 +11,39 @@ private:
         //av::Stream stream;
         std::shared_ptr<Edge<av::Packet>> edge;
         AVTS idle_since = AV_NOPTS_VALUE; // timebase: milliseconds
-        bool idle = false; // flags that this input was idle in latest iteration of process()
         bool warned = false;
         bool known_to_be_broken = false;
         av::Timestamp prev_dts = NOTS;
         av::Rational stream_tb {0, 0};
         AVTS shift = 0;
         size_t shifted_for = 0; // unit: packets count
+        bool queued = false; // head packet is in heap_
+        AVTS head_ts = AV_NOPTS_VALUE; // DTS (or PTS) of head packet, timebase: microseconds
+        std::multiset<AVTS>::iterator idle_since_it;
+    };
+    struct HeapItem {
+        AVTS ts;
+        size_t stream;
+        bool operator>(const HeapItem &other) const {
+            // on equal timestamps, prefer stream listed first
+            return (ts > other.ts) || ((ts == other.ts) && (stream > other.stream));
+        }
     };
     std::vector<StreamInfo> streams_;
+    // Streams which have a packet waiting, ordered by its timestamp.
+    // Every stream is in the heap at most once, so there are no stale entries.
+    std::priority_queue<HeapItem, std::vector<HeapItem>, std::greater<HeapItem>> heap_;
+    // Streams without packet, not known to be broken, waiting for idle_since to be set:
+    std::vector<size_t> new_idle_;
+    // idle_since of the other idle, not broken streams:
+    std::multiset<AVTS> idle_since_;
+    size_t waiting_ = 0; // idle, not broken streams, both in new_idle_ and in idle_since_
+    size_t broken_ = 0;
+    std::vector<size_t> signalled_;
+    // while some streams are broken (or waiting without ts_sort_wait), check them every this many packets,
+    // not for every packet (a syscall each)
+    static constexpr size_t idle_poll_interval_ = 16;
+    size_t since_idle_poll_ = 0;
     Event stop_event_;
     AVTS sync_wait_max_ms_ = 2500;
     std::unique_ptr<MultiEventWait> event_wait_;
@@ -77,156 +104,184 @@ public:
         }
         events[streams_.size()] = &stop_event_;
         event_wait_ = make_unique<MultiEventWait>(events);
+        for (size_t i=0; i<streams_.size(); i++) {
+            new_idle_.push_back(i);
+        }
+        waiting_ = streams_.size();
     }
     virtual void stop() {
         stop_event_.signal();
     }
-    virtual void process() {
-        // find earliest packet (least DTS) in streams:
-        av::Timestamp least_ts = NOTS;
-        StreamInfo* least_ts_si = nullptr;
-        unsigned candidates = 0;
-        for (StreamInfo &s: streams_) {
-            s.idle = true;
-            av::Packet *pkt = s.edge->peek();
-            bool has_packet = pkt != nullptr;
-            av::Timestamp pkt_ts = NOTS;
-            if (has_packet) {
-                pkt_ts = pkt->dts();
-                if (pkt_ts.isNoPts()) pkt_ts = pkt->pts();
-                if (pkt_ts.isNoPts()) {
-                    // packet without PTS
-                    // drop as invalid
-                    s.edge->pop();
-                    has_packet = false;
-                }
+    // If stream has a packet, put it into heap_. Called only for streams which
+    // were signalled or just popped, so that we don't scan all inputs for every packet.
+    void refill(const size_t index) {
+        StreamInfo &s = streams_[index];
+        if (s.queued) return;
+        av::Packet *pkt;
+        av::Timestamp pkt_ts = NOTS;
+        while ((pkt = s.edge->peek()) != nullptr) {
+            pkt_ts = pkt->dts();
+            if (pkt_ts.isNoPts()) pkt_ts = pkt->pts();
+            if (!pkt_ts.isNoPts()) break;
+            // packet without PTS
+            // drop as invalid
+            s.edge->pop();
+        }
+        if (pkt == nullptr) return;
+        if (s.known_to_be_broken) {
+            s.known_to_be_broken = false;
+            broken_--;
+        } else if (s.idle_since == AV_NOPTS_VALUE) {
+            new_idle_.erase(std::find(new_idle_.begin(), new_idle_.end(), index));
+            waiting_--;
+        } else {
+            idle_since_.erase(s.idle_since_it);
+            waiting_--;
+        }
+        s.idle_since = AV_NOPTS_VALUE;
+        s.warned = false;
+        s.queued = true;
+        s.head_ts = pkt_ts.timestamp(av::Rational(1, 1000000));
+        heap_.push({s.head_ts, index});
+    }
+    // called after head packet of stream was popped
+    void becameIdle(const size_t index) {
+        streams_[index].queued = false;
+        refill(index);
+        if (!streams_[index].queued) {
+            new_idle_.push_back(index);
+            waiting_++;
+        }
+    }
+    // timeout_ms = 0 only collects packets which arrived in the meantime
+    bool waitForPackets(const int timeout_ms) {
+        signalled_.clear();
+        bool r = event_wait_->wait(timeout_ms, signalled_);
+        for (size_t index: signalled_) {
+            if (index < streams_.size()) {
+                refill(index);
             }
-            if (has_packet) {
-                s.idle = false;
-                s.known_to_be_broken = false;
-                s.idle_since = AV_NOPTS_VALUE;
-                s.warned = false;
-                candidates++;
-                if ( least_ts.isNoPts() || (pkt_ts < least_ts) ) {
-                    least_ts = pkt_ts;
-                    least_ts_si = &s;
-                }
-            } else {
-                if (s.known_to_be_broken) candidates++;
+        }
+        return r;
+    }
+    // pretend that waiting streams are not idle
+    void markWaitingAsBroken(const bool warn) {
+        for (size_t i=0; i<streams_.size() && waiting_ > 0; i++) {
+            StreamInfo &s = streams_[i];
+            if (s.queued || s.known_to_be_broken) continue;
+            if (warn && !s.warned) {
+                logstream << "Warning: sync wait timeout exceeded, stream " << s.stream_index;
+                s.warned = true;
             }
+            s.known_to_be_broken = true;
+            broken_++;
+            waiting_--;
         }
-        bool have_all = (candidates == streams_.size());
-        bool should_emit = false;
-        if (least_ts_si==nullptr) {
-            // no packet available in queue, wait for it
-            should_emit = false;
-            event_wait_->wait();
-        } else if (sync_wait_max_ms_>0 && !have_all) {
-            AVTS ts = least_ts.timestamp(av::Rational(1, 1000));
-            AVTS max_wait = -1;
-            for (StreamInfo &s: streams_) {
-                if (s.idle) {
-                    if (s.idle_since==AV_NOPTS_VALUE) {
-                        s.idle_since = ts;
-                        if (max_wait > sync_wait_max_ms_) {
-                            logstream << "BUG: max_wait = " << max_wait;
-                        }
-                        max_wait = sync_wait_max_ms_;
-                    } else {
-                        AVTS diff = ts-s.idle_since;
-                        if (diff < 0) {
-                            logstream << "Warning: Time went backwards in muxer: [stream_index]ms: [" << s.stream_index << "]" << s.idle_since <<
-                                " -> [" << least_ts_si->stream_index << "]" << ts;
-                            diff = 0;
-                        }
-                        AVTS to_wait = sync_wait_max_ms_ - diff;
-                        if (to_wait <= 0) {
-                            // we waited too long -> pretend that this stream is not idle
-                            candidates++;
-                            if (!s.warned) {
-                                logstream << "Warning: sync wait timeout exceeded: " << diff << "ms, stream " << s.stream_index;
-                                s.warned = true;
+        new_idle_.clear();
+        idle_since_.clear();
+    }
+    void emit(StreamInfo &s) {
+        av::Packet *pkt = s.edge->peek();
+        if (pkt!=nullptr) {
+            if (s.stream_index >= 0 && pkt->dts().isValid()) {
+                if (fix_timestamps_) {
+                    // we do it here. otherwise, in output node, avcpp will do it (FormatContext::writePacket) and sabotage our forcing of increasing DTSes
+                    pkt->setTimeBase(s.stream_tb);
+                    
+                    if (!s.prev_dts.isNoPts()) {
+                        /*if (pkt->dts().timebase() != s.prev_dts.timebase()) {
+                            logstream << "Timebase changed in muxer in stream " << s.stream_index << ": " << s.prev_dts << " -> " << pkt->dts();
+                            throw Error("Timebase changed in muxer! Nothing to do here.");
+                        }*/
+                        if (global_shift_.timestamp() != 0) {
+                            pkt->setDts(addTSSameTB(pkt->dts(), rescaleTS(global_shift_, pkt->dts().timebase())));
+                            if (pkt->pts().isValid()) {
+                                pkt->setPts(addTSSameTB(pkt->pts(), rescaleTS(global_shift_, pkt->pts().timebase())));
                             }
+                        }
+                        if (pkt->dts().timestamp() <= s.prev_dts.timestamp()) {
+                            logstream << "Non-increasing DTSes in stream " << s.stream_index << ": " << s.prev_dts << " -> " << pkt->dts() << ", fixing.";
+                            AVTS newts = s.prev_dts.timestamp()+1;
+                            s.shift = newts - pkt->dts().timestamp();
+                            s.shifted_for++;
+                            pkt->setDts({ newts, s.prev_dts.timebase() });
                         } else {
-                            // find maximum wait time and store it in max_wait
-                            if (to_wait > max_wait) {
-                                max_wait = to_wait;
-                            }
+                            s.shift = 0;
+                            s.shifted_for = 0;
                         }
                     }
+                    if (pkt->pts().isValid() && (pkt->pts() < pkt->dts())) {
+                        logstream << "PTS < DTS, " << pkt->pts() << " < " << pkt->dts() << ", fixing.";
+                        pkt->setPts(pkt->dts());
+                    }
+                    s.prev_dts = pkt->dts();
+                    calculateGlobalShift();
                 }
+                pkt->setStreamIndex(s.stream_index);
+                //logstream << "mux out: stream " << s.stream_index << ", PTS = " << pkt->pts() << std::endl;
+                sink_->put(*pkt);
+            } else {
+                logstream << "Dropping packet which would go to stream index " << s.stream_index << " dts " << pkt->dts();
             }
-            if (candidates == streams_.size()) {
+            s.edge->pop();
+        }
+    }
+    virtual void process() {
+        if (heap_.empty()) {
+            // some streams may have got packets since last time
+            waitForPackets(0);
+            since_idle_poll_ = 0;
+        } else if ((broken_ > 0 || (waiting_ > 0 && sync_wait_max_ms_ <= 0)) && ++since_idle_poll_ >= idle_poll_interval_) {
+            waitForPackets(0);
+            since_idle_poll_ = 0;
+        }
+        if (heap_.empty()) {
+            // no packet available in queue, wait for it
+            waitForPackets(-1);
+            return;
+        }
+        // earliest packet (least DTS) in streams:
+        const HeapItem least = heap_.top();
+        bool should_emit = false;
+        if (sync_wait_max_ms_<=0 || waiting_ == 0) {
+            // have packets from all streams (or from all which aren't broken)
+            should_emit = true;
+        } else {
+            AVTS ts = least.ts / 1000; // ms
+            for (size_t index: new_idle_) {
+                StreamInfo &s = streams_[index];
+                s.idle_since = ts;
+                s.idle_since_it = idle_since_.insert(ts);
+            }
+            new_idle_.clear();
+            // the stream which became idle most recently is the last one to time out
+            AVTS diff = ts - *idle_since_.rbegin();
+            if (diff < 0) {
+                logstream_limited(5) << "Warning: Time went backwards in muxer: " << *idle_since_.rbegin() << "ms -> [" << streams_[least.stream].stream_index << "]" << ts << "ms";
+                diff = 0;
+            }
+            AVTS to_wait = sync_wait_max_ms_ - diff;
+            if (to_wait <= 0) {
+                // we waited too long, unless packets arrived meanwhile
+                if (waitForPackets(0)) {
+                    return; // decide again with them
+                }
+                markWaitingAsBroken(true);
                 should_emit = true;
             } else {
-                if ( (max_wait<=0) || (max_wait > sync_wait_max_ms_) ) {
-                    logstream << "BUG: max_wait = " << max_wait << "ms";
-                    if (max_wait > sync_wait_max_ms_) {
-                        max_wait = sync_wait_max_ms_;
-                    }
-                }
-                // wait for next packet
+                // wait for next packet (returns immediately if some arrived already)
                 // if timeout occured (no more packets arrived), emit without re-checking
-                bool got_packet = event_wait_->wait(max_wait);
+                bool got_packet = waitForPackets(to_wait);
                 should_emit = !got_packet;
                 if (!got_packet) {
-                    for (StreamInfo &s: streams_) {
-                        if (s.idle) {
-                            s.known_to_be_broken = true;
-                        }
-                    }
+                    markWaitingAsBroken(false);
                 }
             }
-        } else { // have_all==true
-            should_emit = true;
         }
         if (should_emit) {
-            // set stream index & emit packet
-            StreamInfo &s = *least_ts_si;
-            av::Packet *pkt = s.edge->peek();
-            if (pkt!=nullptr) {
-                if (s.stream_index >= 0 && pkt->dts().isValid()) {
-                    if (fix_timestamps_) {
-                        // we do it here. otherwise, in output node, avcpp will do it (FormatContext::writePacket) and sabotage our forcing of increasing DTSes
-                        pkt->setTimeBase(s.stream_tb);
-                        
-                        if (!s.prev_dts.isNoPts()) {
-                            /*if (pkt->dts().timebase() != s.prev_dts.timebase()) {
-                                logstream << "Timebase changed in muxer in stream " << s.stream_index << ": " << s.prev_dts << " -> " << pkt->dts();
-                                throw Error("Timebase changed in muxer! Nothing to do here.");
-                            }*/
-                            if (global_shift_.timestamp() != 0) {
-                                pkt->setDts(addTSSameTB(pkt->dts(), rescaleTS(global_shift_, pkt->dts().timebase())));
-                                if (pkt->pts().isValid()) {
-                                    pkt->setPts(addTSSameTB(pkt->pts(), rescaleTS(global_shift_, pkt->pts().timebase())));
-                                }
-                            }
-                            if (pkt->dts().timestamp() <= s.prev_dts.timestamp()) {
-                                logstream << "Non-increasing DTSes in stream " << s.stream_index << ": " << s.prev_dts << " -> " << pkt->dts() << ", fixing.";
-                                AVTS newts = s.prev_dts.timestamp()+1;
-                                s.shift = newts - pkt->dts().timestamp();
-                                s.shifted_for++;
-                                pkt->setDts({ newts, s.prev_dts.timebase() });
-                            } else {
-                                s.shift = 0;
-                                s.shifted_for = 0;
-                            }
-                        }
-                        if (pkt->pts().isValid() && (pkt->pts() < pkt->dts())) {
-                            logstream << "PTS < DTS, " << pkt->pts() << " < " << pkt->dts() << ", fixing.";
-                            pkt->setPts(pkt->dts());
-                        }
-                        s.prev_dts = pkt->dts();
-                        calculateGlobalShift();
-                    }
-                    pkt->setStreamIndex(s.stream_index);
-                    //logstream << "mux out: stream " << s.stream_index << ", PTS = " << pkt->pts() << std::endl;
-                    sink_->put(*pkt);
-                } else {
-                    logstream << "Dropping packet which would go to stream index " << s.stream_index << " dts " << pkt->dts();
-                }
-                s.edge->pop();
-            }
+            heap_.pop();
+            emit(streams_[least.stream]);
+            becameIdle(least.stream);
         }
     }
     virtual void initFromFormatContext(av::FormatContext &octx) {
@@ -1,6 +1,6 @@
 #include "node_common.hpp"
 
-template<typename T> class NullSink: public NodeSingleInput<T> {
+template<typename T> class NullSink: public NodeSingleInput<T>, public IWorkerPoolSafe {
 public:
     using NodeSingleInput<T>::NodeSingleInput;
     virtual void process() {
@@ -1,35 +1,266 @@
 #include "node_common.hpp"
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include "../histogram.hpp"
+extern "C" {
+#include <libavformat/avio.h>
+}
 
-class StreamOutput: public NodeSingleInput<av::Packet>, public IFlushable, public ReportsFinishByFlag {
+// Custom AVIO for the async mode: the format context writes to a large buffer
+// and only full buffers are passed to the real AVIO (file, pipe, socket...),
+// so that the writer thread does few big writes.
+class BufferedOutputIO: public av::CustomIO {
 protected:
+    AVIOContext* inner_ = nullptr;
+    LogHistogram<> &io_write_us_;
+public:
+    BufferedOutputIO(const std::string url, av::Dictionary &options, LogHistogram<> &io_write_us): io_write_us_(io_write_us) {
+        int r = avio_open2(&inner_, url.c_str(), AVIO_FLAG_WRITE, nullptr, options.rawPtr());
+        if (r < 0) {
+            throw Error("Failed to open " + url + ": " + av::error2string(r));
+        }
+    }
+    virtual ~BufferedOutputIO() {
+        avio_closep(&inner_);
+    }
+    virtual int write(const uint8_t *data, size_t size) override {
+        AVTS begin = wallclock.ns();
+        // no flush here: the real AVIO writes out its own buffer when it's full and when it's closed
+        avio_write(inner_, data, size);
+        io_write_us_.record((wallclock.ns() - begin) / 1000);
+        if (inner_->error < 0) {
+            return inner_->error;
+        }
+        return size;
+    }
+    virtual int64_t seek(int64_t offset, int whence) override {
+        if (whence & AVSEEK_SIZE) {
+            return avio_size(inner_);
+        }
+        return avio_seek(inner_, offset, whence);
+    }
+    virtual int seekable() const override {
+        return inner_->seekable;
+    }
+    virtual const char* name() const override {
+        return "avplumber_buffered_output";
+    }
+};
+
+class StreamOutput: public NodeSingleInput<av::Packet>, public IFlushable, public ReportsFinishByFlag, public IReturnsObjects {
+public:
+    enum class OverflowPolicy {
+        Block,
+        DropUntilKeyframe,
+        Disconnect,
+    };
+protected:
+    struct QueuedPacket {
+        av::Packet pkt;
+        AVTS enqueued_ns;
+    };
+    // metrics:
+    std::atomic_uint64_t written_packets_ {0};
+    std::atomic_uint64_t written_bytes_ {0};
+    std::atomic_uint64_t dropped_packets_ {0};
+    LogHistogram<> write_us_; // writePacket duration
+    LogHistogram<> queue_us_; // time spent in the async queue
+    LogHistogram<> io_write_us_; // writes of the custom AVIO to the real output
+    std::unique_ptr<BufferedOutputIO> io_; // must outlive octx_
     av::FormatContext octx_;
     bool should_close_ = false;
     int errors_ = 0;
+    bool closed_ = false;
+    // async mode:
+    bool async_ = false;
+    OverflowPolicy overflow_ = OverflowPolicy::Block;
+    size_t max_backlog_bytes_ = 64*1024*1024;
+    std::mutex queue_mutex_;
+    std::condition_variable queue_cv_;
+    std::deque<QueuedPacket> queue_;
+    size_t backlog_bytes_ = 0;
+    size_t max_seen_backlog_bytes_ = 0;
+    std::set<int> waiting_for_keyframe_; // stream indices
+    bool should_work_ = true;
+    bool draining_ = false;
+    bool stop_requested_ = false;
+    bool writer_failed_ = false;
+    std::string writer_error_;
+    std::thread writer_;
+
+    void writePacket(av::Packet &pkt) {
+        size_t size = pkt.size();
+        AVTS begin = wallclock.ns();
+        try {
+            octx_.writePacket(pkt);
+            errors_ = 0;
+        } catch (std::exception &e) {
+            logstream << "writePacket failed: " << e.what();
+            errors_++;
+            if (errors_>20) {
+                throw;
+            }
+        }
+        write_us_.record((wallclock.ns() - begin) / 1000);
+        written_packets_.fetch_add(1, std::memory_order_relaxed);
+        written_bytes_.fetch_add(size, std::memory_order_relaxed);
+    }
+    void writerThread() {
+        std::unique_lock<decltype(queue_mutex_)> lock(queue_mutex_);
+        while (true) {
+            queue_cv_.wait(lock, [this]() {
+                return !queue_.empty() || !should_work_ || draining_;
+            });
+            if (queue_.empty() || !should_work_) {
+                break;
+            }
+            QueuedPacket item = std::move(queue_.front());
+            queue_.pop_front();
+            backlog_bytes_ -= item.pkt.size();
+            lock.unlock();
+            queue_cv_.notify_all();
+            queue_us_.record((wallclock.ns() - item.enqueued_ns) / 1000);
+            try {
+                writePacket(item.pkt);
+            } catch (std::exception &e) {
+                lock.lock();
+                writer_failed_ = true;
+                writer_error_ = e.what();
+                lock.unlock();
+                queue_cv_.notify_all();
+                return;
+            }
+            lock.lock();
+        }
+    }
+    void enqueue(av::Packet &pkt) {
+        size_t size = pkt.size();
+        int stream_index = pkt.streamIndex();
+        std::unique_lock<decltype(queue_mutex_)> lock(queue_mutex_);
+        if (writer_failed_) {
+            throw Error("Output writer failed: " + writer_error_);
+        }
+        if (waiting_for_keyframe_.count(stream_index) && !(pkt.raw()->flags & AV_PKT_FLAG_KEY)) {
+            dropped_packets_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        auto fits = [&]() {
+            // always accept into empty queue, so that a packet bigger than the budget doesn't block forever
+            return queue_.empty() || (backlog_bytes_ + size <= max_backlog_bytes_);
+        };
+        if (!fits()) {
+            switch (overflow_) {
+            case OverflowPolicy::Block:
+                queue_cv_.wait(lock, [&]() {
+                    return fits() || writer_failed_ || stop_requested_;
+                });
+                if (writer_failed_) {
+                    throw Error("Output writer failed: " + writer_error_);
+                }
+                if (stop_requested_) {
+                    return;
+                }
+                break;
+            case OverflowPolicy::DropUntilKeyframe:
+                dropped_packets_.fetch_add(1, std::memory_order_relaxed);
+                if (waiting_for_keyframe_.insert(stream_index).second) {
+                    logstream_limited(1) << "Output backlog full (" << backlog_bytes_ << " bytes), dropping stream " << stream_index << " until next keyframe";
+                }
+                return;
+            case OverflowPolicy::Disconnect:
+                throw Error("Output backlog exceeded " + std::to_string(max_backlog_bytes_) + " bytes, disconnecting");
+            }
+        }
+        waiting_for_keyframe_.erase(stream_index);
+        queue_.push_back({pkt, wallclock.ns()});
+        backlog_bytes_ += size;
+        if (backlog_bytes_ > max_seen_backlog_bytes_) {
+            max_seen_backlog_bytes_ = backlog_bytes_;
+        }
+        lock.unlock();
+        queue_cv_.notify_all();
+    }
+    void stopWriter(bool drain) {
+        {
+            std::lock_guard<decltype(queue_mutex_)> lock(queue_mutex_);
+            if (drain) {
+                draining_ = true;
+            } else {
+                should_work_ = false;
+            }
+        }
+        queue_cv_.notify_all();
+        if (writer_.joinable()) {
+            writer_.join();
+        }
+    }
 public:
     using NodeSingleInput<av::Packet>::NodeSingleInput;
     av::FormatContext& ctx() {
         return octx_;
     }
+    void startWriter() {
+        writer_ = start_thread("output writer", [this]() {
+            writerThread();
+        });
+    }
     virtual void process() {
         av::Packet pkt = this->source_->get();
         if (pkt) {
-            try {
-                octx_.writePacket(pkt);
-                errors_ = 0;
-            } catch (std::exception &e) {
-                logstream << "writePacket failed: " << e.what();
-                errors_++;
-                if (errors_>20) {
-                    throw;
-                }
+            if (async_) {
+                enqueue(pkt);
+            } else {
+                writePacket(pkt);
             }
         }
     }
+    virtual void stop() override {
+        NodeSingleInput<av::Packet>::stop();
+        {
+            std::lock_guard<decltype(queue_mutex_)> lock(queue_mutex_);
+            stop_requested_ = true;
+        }
+        queue_cv_.notify_all();
+    }
     virtual void flush() {
+        if (closed_) {
+            return;
+        }
+        if (async_) {
+            stopWriter(true);
+        }
+        closed_ = true;
         octx_.writeTrailer();
         octx_.close();
+        io_ = nullptr;
         this->finished_ = true;
     }
+    virtual Parameters getObject(const std::string name) {
+        if (name=="stats") {
+            Parameters r;
+            r["async"] = async_;
+            r["written_packets"] = written_packets_.load(std::memory_order_relaxed);
+            r["written_bytes"] = written_bytes_.load(std::memory_order_relaxed);
+            r["dropped_packets"] = dropped_packets_.load(std::memory_order_relaxed);
+            {
+                std::lock_guard<decltype(queue_mutex_)> lock(queue_mutex_);
+                r["backlog_packets"] = queue_.size();
+                r["backlog_bytes"] = backlog_bytes_;
+                r["max_backlog_bytes"] = max_seen_backlog_bytes_;
+            }
+            for (auto hist: { std::make_pair("write_us", &write_us_), std::make_pair("queue_us", &queue_us_), std::make_pair("io_write_us", &io_write_us_) }) {
+                r[hist.first] = hist.second->toJson();
+                r[hist.first].erase("buckets");
+            }
+            return r;
+        } else {
+            throw Error("Unknown object to get");
+        }
+    }
+    virtual ~StreamOutput() {
+        stopWriter(false);
+    }
     static std::shared_ptr<StreamOutput> create(NodeCreationInfo &nci) {
         EdgeManager &edges = nci.edges;
         const Parameters &params = nci.params;
@@ -44,10 +275,32 @@ public:
         if (params.count("options") > 0) {
             opts = parametersToDict(params["options"]);
         }
-        
+        size_t avio_buffer_size = 1024*1024;
+        if (params.count("async") > 0) {
+            r->async_ = params["async"];
+        }
+        if (params.count("buffer_bytes") > 0) {
+            r->max_backlog_bytes_ = params["buffer_bytes"];
+        }
+        if (params.count("avio_buffer_size") > 0) {
+            avio_buffer_size = params["avio_buffer_size"];
+        }
+        if (params.count("overflow") > 0) {
+            std::string overflow = params["overflow"];
+            if (overflow == "block") {
+                r->overflow_ = OverflowPolicy::Block;
+            } else if (overflow == "drop") {
+                r->overflow_ = OverflowPolicy::DropUntilKeyframe;
+            } else if (overflow == "disconnect") {
+                r->overflow_ = OverflowPolicy::Disconnect;
+            } else {
+                throw Error("Invalid overflow policy: " + overflow);
+            }
+        }
+
         std::string url = params["url"];
         
-        logstream << "output url: " << url;
+        logstream << "output url: " << url << (r->async_ ? " (async)" : "");
         
         av::OutputFormat ofmt(format, url);
         octx.setFormat(ofmt);
@@ -60,15 +313,25 @@ public:
         muxer->initFromFormatContext(octx);
         
         octx.raw()->url = av_strdup(url.c_str()); // workaround for avcpp not using avformat_alloc_output_context2
-        octx.openOutput(url, opts);
-        
+        if (r->async_ && !(ofmt.raw()->flags & AVFMT_NOFILE)) {
+            // muxers which open files by themselves (AVFMT_NOFILE) get only the writer thread
+            r->io_ = make_unique<BufferedOutputIO>(url, opts, r->io_write_us_);
+            octx.openOutput(r->io_.get(), av::throws(), avio_buffer_size);
+        } else {
+            octx.openOutput(url, opts);
+        }
+
         muxer->initFromFormatContextPostOpenPreWriteHeader(octx);
 
         octx.writeHeader(opts);
         edge->setConsumer(r);
         
         muxer->initFromFormatContextPostOpen(octx);
-        
+
+        if (r->async_) {
+            r->startWriter();
+        }
+
         return r;
     }
 };
@@ -13,9 +13,10 @@ protected:
     AVTS offset_;
     AVTS tick_period_ = 0;
     AVTS now_ts_ = AV_NOPTS_VALUE;
-    AVTS negative_time_tolerance_ = -250;
+    // defaults (-0.25 s, 1 s) are set in create() once the timebase is known
+    AVTS negative_time_tolerance_ = AV_NOPTS_VALUE;
     AVTS negative_time_discard_ = AV_NOPTS_VALUE;
-    AVTS discontinuity_threshold_ = 1000;
+    AVTS discontinuity_threshold_ = AV_NOPTS_VALUE;
     AVTS jitter_margin_ = 0;
     AVTS initial_jitter_margin_ = 0;
     AVRational timebase_;
@@ -27,6 +28,7 @@ protected:
     float max_buffered_ = 5.5;
     float min_buffered_ = 0.5;
     bool is_master_ = true; // by default everyone is master and can resync
+    bool hires_clock_ = false;
     // TODO: master election in case of failure of master specified by user
 
     std::string printDuration(AVTS duration) {
@@ -36,6 +38,14 @@ protected:
         return std::to_string(duration) +
             ((timebase_.num==1 && timebase_.den==1000) ? "ms" : ("*"+std::to_string(timebase_.num)+"/"+std::to_string(timebase_.den)));
     }
+    // current wallclock time in timebase_
+    AVTS wallclockNow() {
+        if (hires_clock_) {
+            return rescaleTS({wallclock.ns(), wallclock.fineTimeBase()}, timebase_).timestamp();
+        } else {
+            return rescaleTS({wallclock.pts(), wallclock.timeBase()}, timebase_).timestamp();
+        }
+    }
     bool anythingBuffered() {
         bool anything_buffered = input_ts_queue_->occupied() > 0;
         for (auto q: intermediate_queues_) {
@@ -56,8 +66,7 @@ protected:
 public:
     using NodeSISO<T, T>::NodeSISO;
     virtual void processNonBlocking(EventLoop& evl, bool ticks) {
-        AVTS now_ts_wclk = wallclock.pts();
-        AVTS now_ts_wclk_scaled = rescaleTS({now_ts_wclk, wallclock.timeBase()}, timebase_).timestamp();
+        AVTS now_ts_wclk_scaled = wallclockNow();
         if (now_ts_ == AV_NOPTS_VALUE) {
             now_ts_ = now_ts_wclk_scaled;
         } else if (tick_period_ && ticks) {
@@ -199,7 +208,7 @@ public:
                 T* ptr = this->source_->peek(0);
                 if (ptr==nullptr || last_wait_==0) {
                     // we'll probably wait for packet in next process() iteration
-                    last_wait_ = wallclock.pts();
+                    last_wait_ = wallclockNow();
                 }
             }
         } while (process_next);
@@ -209,6 +218,12 @@ public:
         const Parameters &params = nci.params;
         std::shared_ptr<RealTimeSpeed> r = NodeSISO<T, T>::template createCommon<RealTimeSpeed>(edges, params);
         AVRational timebase = wallclock.timeBase();
+        if (params.count("high_resolution_clock")) {
+            r->hires_clock_ = params["high_resolution_clock"];
+            if (r->hires_clock_) {
+                timebase = {1, 1000000};
+            }
+        }
         if (params.count("tick_period")) {
             int tb_den_mult = 4;
             timebase = parseRatio(params["tick_period"]);
@@ -234,6 +249,8 @@ public:
         }
         if (params.count("negative_time_tolerance")) {
             r->negative_time_tolerance_ = -secondsToTs(params["negative_time_tolerance"]);
+        } else {
+            r->negative_time_tolerance_ = -secondsToTs(0.25);
         }
         if (params.count("negative_time_discard")) {
             r->negative_time_discard_ = -secondsToTs(params["negative_time_discard"]);
@@ -243,6 +260,8 @@ public:
         }
         if (params.count("discontinuity_threshold")) {
             r->discontinuity_threshold_ = secondsToTs(params["discontinuity_threshold"]);
+        } else {
+            r->discontinuity_threshold_ = secondsToTs(1.0);
         }
         if (params.count("jitter_margin")) {
             r->jitter_margin_ = secondsToTs(params["jitter_margin"]);
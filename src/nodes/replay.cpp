@@ -0,0 +1,245 @@
+#include "node_common.hpp"
+#include "../edge_recording.hpp"
+#include <map>
+
+// Plays a recording made with queue.record. Items reference the memory-mapped file.
+
+template<typename T> class ReplaySource: public NodeSingleOutput<T>, public ReportsFinishByFlag, public IStoppable, public IReturnsObjects {
+protected:
+    std::shared_ptr<RecordingFile> file_;
+    bool realtime_ = true;
+    uint64_t loops_limit_ = 1;
+    size_t index_ = 0;
+    uint64_t loop_ = 0;
+    AVTS start_ns_ = -1;
+    AVTS loop_duration_us_ = 0;
+    std::atomic_uint64_t sent_ {0};
+    std::atomic_uint64_t sent_bytes_ {0};
+    std::atomic_uint64_t loops_done_ {0};
+
+    static AVTS toMicroseconds(const int64_t ts, const edge_recording::RecordHeader &rh) {
+        return av_rescale_q(ts, {rh.tb_num, rh.tb_den}, AV_TIME_BASE_Q);
+    }
+    // like loop_input: from the earliest PTS to the end of the last item of the longest stream
+    void computeLoopDuration() {
+        std::map<int, std::pair<AVTS, AVTS>> first_last;
+        std::map<int, uint64_t> count;
+        std::map<int, AVTS> end_us;
+        for (size_t i=0; i<file_->count(); i++) {
+            const edge_recording::RecordHeader &rh = file_->record(i);
+            if (rh.pts == AV_NOPTS_VALUE || rh.tb_num <= 0 || rh.tb_den <= 0) continue;
+            AVTS pts_us = toMicroseconds(rh.pts, rh);
+            auto it = first_last.find(rh.stream_index);
+            if (it == first_last.end()) {
+                first_last[rh.stream_index] = { pts_us, pts_us };
+            } else {
+                it->second.first = std::min(it->second.first, pts_us);
+                it->second.second = std::max(it->second.second, pts_us);
+            }
+            count[rh.stream_index]++;
+            if (rh.duration > 0) {
+                end_us[rh.stream_index] = std::max(end_us[rh.stream_index], toMicroseconds(rh.pts + rh.duration, rh));
+            }
+        }
+        AVTS begin = AV_NOPTS_VALUE, end = AV_NOPTS_VALUE;
+        for (auto &kv: first_last) {
+            uint64_t n = count[kv.first];
+            // without durations, assume the last item lasts as long as an average one
+            AVTS avg = n > 1 ? (kv.second.second - kv.second.first) / AVTS(n - 1) : 0;
+            AVTS e = std::max(kv.second.second + avg, end_us.count(kv.first) ? end_us[kv.first] : AVTS(0));
+            begin = (begin == AV_NOPTS_VALUE) ? kv.second.first : std::min(begin, kv.second.first);
+            end = (end == AV_NOPTS_VALUE) ? e : std::max(end, e);
+        }
+        loop_duration_us_ = (begin == AV_NOPTS_VALUE) ? 1 : std::max<AVTS>(end - begin, 1);
+    }
+    static void shiftTimestamps(av::Packet &pkt, const int64_t offset) {
+        AVPacket* raw = pkt.raw();
+        if (raw->pts != AV_NOPTS_VALUE) raw->pts += offset;
+        if (raw->dts != AV_NOPTS_VALUE) raw->dts += offset;
+    }
+    template<typename F> static void shiftTimestamps(F &frame, const int64_t offset) {
+        if (frame.raw()->pts != AV_NOPTS_VALUE) frame.raw()->pts += offset;
+    }
+    static size_t itemSize(const av::Packet &pkt) {
+        return pkt.size();
+    }
+    template<typename F> static size_t itemSize(const F &frame) {
+        size_t r = 0;
+        for (int i=0; i<AV_NUM_DATA_POINTERS && frame.raw()->buf[i]; i++) {
+            r += frame.raw()->buf[i]->size;
+        }
+        return r;
+    }
+public:
+    ReplaySource(std::unique_ptr<Sink<T>> &&sink, std::shared_ptr<RecordingFile> file, const Parameters &params): NodeSingleOutput<T>(std::move(sink)), file_(file) {
+        if (file_->count() == 0) {
+            throw Error("Recording is empty");
+        }
+        realtime_ = params.value("realtime", true);
+        loops_limit_ = params.value("loops", 1);
+        if (params.value("preload", true)) {
+            file_->preload();
+        }
+        computeLoopDuration();
+    }
+    virtual void process() {
+        if (this->finished_) return;
+        if (index_ >= file_->count()) {
+            index_ = 0;
+            loop_++;
+            loops_done_.store(loop_, std::memory_order_relaxed);
+            if (loops_limit_ > 0 && loop_ >= loops_limit_) {
+                logstream << "Replayed " << loop_ << " loops";
+                this->finished_ = true;
+                return;
+            }
+        }
+        const edge_recording::RecordHeader &rh = file_->record(index_);
+        if (realtime_) {
+            // original cadence of enqueueing
+            if (start_ns_ < 0) {
+                start_ns_ = wallclock.ns();
+            }
+            wallclock.sleepUntilNs(start_ns_ + AVTS(loop_) * loop_duration_us_ * 1000 + rh.time_ns);
+        }
+        T item;
+        file_->get(index_, item);
+        if (loop_ > 0) {
+            shiftTimestamps(item, av_rescale_q(AVTS(loop_) * loop_duration_us_, AV_TIME_BASE_Q, {rh.tb_num, rh.tb_den}));
+        }
+        if (this->sink_->put(item)) {
+            index_++;
+            sent_.fetch_add(1, std::memory_order_relaxed);
+            sent_bytes_.fetch_add(itemSize(item), std::memory_order_relaxed);
+        }
+    }
+    virtual void stop() {
+        this->finished_ = true;
+    }
+    virtual Parameters getObject(const std::string name) {
+        if (name=="stats") {
+            Parameters r;
+            r["loops"] = loops_done_.load(std::memory_order_relaxed);
+            r["items"] = sent_.load(std::memory_order_relaxed);
+            r["bytes"] = sent_bytes_.load(std::memory_order_relaxed);
+            r["records"] = file_->count();
+            r["file_bytes"] = file_->fileSize();
+            r["complete"] = file_->complete();
+            r["loop_duration"] = loop_duration_us_ / 1000000.0;
+            return r;
+        } else if (name=="info") {
+            return file_->info();
+        } else {
+            throw Error("Unknown object to get");
+        }
+    }
+};
+
+class PacketReplay: public ReplaySource<av::Packet>, public IStreamsInput {
+protected:
+    av::FormatContext ctx_; // only holds streams for demux & decoders
+public:
+    PacketReplay(std::unique_ptr<Sink<av::Packet>> &&sink, std::shared_ptr<RecordingFile> file, const Parameters &params): ReplaySource<av::Packet>(std::move(sink), file, params) {
+        file_->addStreams(ctx_.raw());
+    }
+    virtual av::FormatContext& formatContext() {
+        return ctx_;
+    }
+    virtual size_t streamsCount() {
+        return ctx_.raw()->nb_streams;
+    }
+    virtual av::Stream stream(size_t id) {
+        return ctx_.stream(id);
+    }
+    virtual void discardAllStreams() {
+        for (size_t i=0; i<streamsCount(); i++) {
+            ctx_.raw()->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    virtual void enableStream(size_t index) {
+        ctx_.raw()->streams[index]->discard = AVDISCARD_DEFAULT;
+    }
+};
+
+class VideoReplay: public ReplaySource<av::VideoFrame>, public IVideoFormatSource, public IFrameRateSource, public ITimeBaseSource {
+protected:
+    av::VideoFrame first_;
+public:
+    VideoReplay(std::unique_ptr<Sink<av::VideoFrame>> &&sink, std::shared_ptr<RecordingFile> file, const Parameters &params): ReplaySource<av::VideoFrame>(std::move(sink), file, params) {
+        file_->get(0, first_);
+    }
+    virtual int width() {
+        return file_->info().value("width", first_.width());
+    }
+    virtual int height() {
+        return file_->info().value("height", first_.height());
+    }
+    virtual av::PixelFormat pixelFormat() {
+        if (file_->info().count("pixel_format")) {
+            return av::PixelFormat(file_->info()["pixel_format"].get<std::string>());
+        }
+        return first_.pixelFormat();
+    }
+    virtual av::Rational frameRate() {
+        if (!file_->info().count("frame_rate")) {
+            throw Error("Recording has no frame rate");
+        }
+        return parseRatio(file_->info()["frame_rate"]);
+    }
+    virtual av::Rational timeBase() {
+        if (file_->info().count("time_base")) {
+            return parseRatio(file_->info()["time_base"]);
+        }
+        return first_.timeBase();
+    }
+};
+
+class AudioReplay: public ReplaySource<av::AudioSamples>, public IAudioMetadataSource, public ITimeBaseSource {
+protected:
+    av::AudioSamples first_;
+public:
+    AudioReplay(std::unique_ptr<Sink<av::AudioSamples>> &&sink, std::shared_ptr<RecordingFile> file, const Parameters &params): ReplaySource<av::AudioSamples>(std::move(sink), file, params) {
+        file_->get(0, first_);
+    }
+    virtual int sampleRate() {
+        return file_->info().value("sample_rate", first_.sampleRate());
+    }
+    virtual av::SampleFormat sampleFormat() {
+        if (file_->info().count("sample_format")) {
+            return av::SampleFormat(file_->info()["sample_format"].get<std::string>());
+        }
+        return first_.sampleFormat();
+    }
+    virtual uint64_t channelLayout() {
+        return file_->info().value("channel_layout", first_.channelsLayout());
+    }
+    virtual av::Rational timeBase() {
+        if (file_->info().count("time_base")) {
+            return parseRatio(file_->info()["time_base"]);
+        }
+        return first_.timeBase();
+    }
+};
+
+// node type is chosen by the media type of the recording
+class EdgeReplay {
+public:
+    static std::shared_ptr<Node> create(NodeCreationInfo &nci) {
+        const Parameters &params = nci.params;
+        auto file = std::make_shared<RecordingFile>(params["path"]);
+        logstream << "Opened recording " << params["path"] << ": " << file->count() << " records"
+                  << (file->complete() ? "" : " (incomplete)");
+        switch (file->mediaType()) {
+        case edge_recording::MediaType::Packet:
+            return std::make_shared<PacketReplay>(make_unique<EdgeSink<av::Packet>>(nci.edges.find<av::Packet>(params["dst"])), file, params);
+        case edge_recording::MediaType::Video:
+            return std::make_shared<VideoReplay>(make_unique<EdgeSink<av::VideoFrame>>(nci.edges.find<av::VideoFrame>(params["dst"])), file, params);
+        case edge_recording::MediaType::Audio:
+            return std::make_shared<AudioReplay>(make_unique<EdgeSink<av::AudioSamples>>(nci.edges.find<av::AudioSamples>(params["dst"])), file, params);
+        default:
+            throw Error("Unknown media type of recording");
+        }
+    }
+};
+
+DECLNODE(replay, EdgeReplay);
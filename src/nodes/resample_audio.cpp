@@ -4,6 +4,7 @@
 #include "../util.hpp"
 
 #include "../audio_parameters.hpp"
+#include "../buffer_pool.hpp"
 
 class DynamicAudioResampler: public NodeSISO<av::AudioSamples, av::AudioSamples>, public IFlushable, public ReportsFinishByFlag, public INeedsOutputFrameSize, public ITimeBaseSource {
 protected:
@@ -27,6 +28,9 @@ protected:
     bool prev_drift_negative_ = false;
     bool now_compensating_ = false;
     av::AudioSamples to_out_;
+    // frames produced by a single drainResampler() call, sent to sink in one batch
+    std::vector<av::AudioSamples> out_batch_;
+    AudioSamplesAllocator allocator_;
     //bool outputted_ = false;
     //av::Timestamp out_ts_shift_ = { 0, {1,1} };
     bool sourceChanged(const av::AudioSamples &samples) {
@@ -67,9 +71,14 @@ protected:
             out_samples.setPts(next_out_ts_);
             next_out_ts_ = addTSSameTB(next_out_ts_, av::Timestamp(out_samples.samplesCount(), out_samples.timeBase()) );
             //logstream << "out " << out_samples.samplesCount() << " * " << out_samples.timeBase();
-            this->sink_->put(out_samples);
+            out_batch_.push_back(out_samples);
         }
     }
+    void sendBatch() {
+        if (out_batch_.empty()) return;
+        this->sink_->put_many(out_batch_);
+        out_batch_.clear();
+    }
     void flushInternal() {
         if (!resampler_) return;
         drainResampler(true);
@@ -80,7 +89,7 @@ protected:
             // it seems that we need to drain all samples
             // otherwise libswresample will occassionally drop some without any warning in log. cute.
             size_t req_samples = enc_frame_size_ - to_out_.samplesCount();
-            av::AudioSamples out_samples(dst_params_.sample_format, req_samples, dst_params_.channel_layout, dst_params_.sample_rate);
+            av::AudioSamples out_samples = allocator_.alloc(dst_params_.sample_format, req_samples, dst_params_.channel_layout, dst_params_.sample_rate);
             bool has_frame = resampler_->pop(out_samples, true);
             if (has_frame) {
                 if (to_out_.samplesCount()>0) {
@@ -106,6 +115,7 @@ protected:
                 break;
             }
         }
+        sendBatch();
     }
 public:
     virtual void setOutputFrameSize(const size_t size) {
@@ -246,9 +256,7 @@ public:
             flush();
         }
     }
-    static av::AudioSamples audioConcat(av::AudioSamples s1, av::AudioSamples s2) {
-        auto align = av::SampleFormat::AlignDefault;
-        
+    av::AudioSamples audioConcat(av::AudioSamples s1, av::AudioSamples s2) {
         if (s1.samplesCount()==0) {
             return s2;
         }
@@ -263,7 +271,7 @@ public:
                 ", sample rate: " + std::to_string(s1.sampleRate()) + " " + std::to_string(s2.sampleRate()));
         }
         
-        av::AudioSamples r(s1.sampleFormat(), s1.samplesCount()+s2.samplesCount(), s1.channelsLayout(), s1.sampleRate(), align);
+        av::AudioSamples r = allocator_.alloc(s1.sampleFormat(), s1.samplesCount()+s2.samplesCount(), s1.channelsLayout(), s1.sampleRate());
         auto copyPlane = [&](size_t channels_per_plane, size_t i) {
             uint8_t* ptr = r.data(i);
             size_t s1size = channels_per_plane*s1.samplesCount()*r.sampleFormat().bytesPerSample();
@@ -287,7 +295,9 @@ public:
     }
     DynamicAudioResampler(std::unique_ptr<Source<av::AudioSamples>> &&source, std::unique_ptr<Sink<av::AudioSamples>> &&sink, const AudioParameters &dst_params, size_t comp_samp): NodeSISO<av::AudioSamples, av::AudioSamples>(std::move(source), std::move(sink)), dst_params_(dst_params), forward_channels_(dst_params.channel_layout==0), comp_samp_(comp_samp) {
     }
-    template<typename Child> static std::shared_ptr<Child> createCommon(EdgeManager &edges, const Parameters &params, bool have_channels) {
+    template<typename Child> static std::shared_ptr<Child> createCommon(NodeCreationInfo &nci, bool have_channels) {
+        EdgeManager &edges = nci.edges;
+        const Parameters &params = nci.params;
         AudioParameters dst_params;
         if (have_channels) {
             if (params.count("dst_channel_layout")==1) {
@@ -330,6 +340,7 @@ public:
         if (params.count("max_drift")==1) {
             r->max_drift_ = params["max_drift"];
         }
+        r->allocator_.setPools(bufferPoolsFromParams(nci.instance, params));
         return r;
     }
 
@@ -350,9 +361,7 @@ public:
         return dst_params_.channel_layout;
     }
     static std::shared_ptr<DynamicAudioResamplerProcessChannels> create(NodeCreationInfo &nci) {
-        EdgeManager &edges = nci.edges;
-        const Parameters &params = nci.params;
-        return DynamicAudioResampler::createCommon<DynamicAudioResamplerProcessChannels>(edges, params, true);
+        return DynamicAudioResampler::createCommon<DynamicAudioResamplerProcessChannels>(nci, true);
     }
     using DynamicAudioResampler::DynamicAudioResampler;
 };
@@ -360,9 +369,7 @@ public:
 class DynamicAudioResamplerForwardChannels: public DynamicAudioResampler {
 public:
     static std::shared_ptr<DynamicAudioResamplerForwardChannels> create(NodeCreationInfo &nci) {
-        EdgeManager &edges = nci.edges;
-        const Parameters &params = nci.params;
-        return DynamicAudioResampler::createCommon<DynamicAudioResamplerForwardChannels>(edges, params, false);
+        return DynamicAudioResampler::createCommon<DynamicAudioResamplerForwardChannels>(nci, false);
     }
     using DynamicAudioResampler::DynamicAudioResampler;
 };
@@ -1,20 +1,132 @@
 #include "node_common.hpp"
-#include <avcpp/videorescaler.h>
+#include <list>
+#include <tuple>
 #include "../util.hpp"
 #include "../video_parameters.hpp"
+#include "../buffer_pool.hpp"
+#include "../histogram.hpp"
+extern "C" {
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+}
 
-class DynamicVideoScaler: public NodeSISO<av::VideoFrame, av::VideoFrame>, public IVideoFormatSource {
+#if LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100)
+#define HAVE_SWS_SCALE_FRAME 1 // and slice threads
+#endif
+
+// Least recently used SwsContexts of one scaler node, so that streams which switch
+// between a few input formats (e.g. SD ads in HD stream) don't reinitialize the scaler on every switch.
+class SwsContextCache {
+public:
+    // src format, width, height, dst format, width, height
+    using Key = std::tuple<AVPixelFormat, int, int, AVPixelFormat, int, int>;
+protected:
+    std::list<std::pair<Key, SwsContext*>> entries_; // most recently used first
+    size_t capacity_ = 4;
+    int flags_ = SWS_BICUBIC;
+    int threads_ = 1;
+    std::atomic_uint64_t hits_ {0};
+    std::atomic_uint64_t misses_ {0};
+    SwsContext* create(const Key &key) {
+        SwsContext* ctx = sws_alloc_context();
+        if (ctx == nullptr) {
+            throw Error("sws_alloc_context failed");
+        }
+        av_opt_set_int(ctx, "src_format", std::get<0>(key), 0);
+        av_opt_set_int(ctx, "srcw", std::get<1>(key), 0);
+        av_opt_set_int(ctx, "srch", std::get<2>(key), 0);
+        av_opt_set_int(ctx, "dst_format", std::get<3>(key), 0);
+        av_opt_set_int(ctx, "dstw", std::get<4>(key), 0);
+        av_opt_set_int(ctx, "dsth", std::get<5>(key), 0);
+        av_opt_set_int(ctx, "sws_flags", flags_, 0);
+#ifdef HAVE_SWS_SCALE_FRAME
+        av_opt_set_int(ctx, "threads", threads_, 0);
+#endif
+        int ret = sws_init_context(ctx, nullptr, nullptr);
+        if (ret < 0) {
+            sws_freeContext(ctx);
+            throw Error("Couldn't initialize scaler: " + av::error2string(ret));
+        }
+        return ctx;
+    }
+public:
+    SwsContextCache() {
+    }
+    SwsContextCache(const SwsContextCache&) = delete;
+    ~SwsContextCache() {
+        clear();
+    }
+    void configure(const size_t capacity, const int flags, const int threads) {
+        clear();
+        capacity_ = std::max<size_t>(capacity, 1);
+        flags_ = flags;
+        threads_ = threads;
+    }
+    void clear() {
+        for (auto &entry: entries_) {
+            sws_freeContext(entry.second);
+        }
+        entries_.clear();
+    }
+    SwsContext* get(const Key &key) {
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->first == key) {
+                entries_.splice(entries_.begin(), entries_, it);
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return it->second;
+            }
+        }
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        entries_.emplace_front(key, create(key));
+        if (entries_.size() > capacity_) {
+            sws_freeContext(entries_.back().second);
+            entries_.pop_back();
+        }
+        return entries_.front().second;
+    }
+    int threads() const {
+        return threads_;
+    }
+    uint64_t hits() const {
+        return hits_.load(std::memory_order_relaxed);
+    }
+    uint64_t misses() const {
+        return misses_.load(std::memory_order_relaxed);
+    }
+};
+
+class DynamicVideoScaler: public NodeSISO<av::VideoFrame, av::VideoFrame>, public IVideoFormatSource, public IReturnsObjects, public IWorkerPoolSafe {
 protected:
     VideoParameters src_params_, dst_params_;
-    std::unique_ptr<av::VideoRescaler> rescaler_;
+    SwsContextCache scalers_;
+    SwsContext* scaler_ = nullptr; // for src_params_, owned by scalers_
     //av::Rational timebase_ = {0, 1};
     //av::Rational frame_rate_ = {0, 1};
     int32_t sws_flags_;
+    VideoFrameAllocator allocator_;
+    std::atomic_uint64_t frames_ {0};
+    LogHistogram<> scale_us_;
     bool sourceChanged(const av::VideoFrame &frame) {
         return src_params_ != VideoParameters(frame);
     }
-    void createRescaler() {
-        rescaler_ = make_unique<av::VideoRescaler>(dst_params_.width, dst_params_.height, dst_params_.pixel_format, src_params_.width, src_params_.height, src_params_.pixel_format);
+    void selectScaler() {
+        scaler_ = scalers_.get(SwsContextCache::Key(src_params_.pixel_format.get(), src_params_.width, src_params_.height, dst_params_.pixel_format.get(), dst_params_.width, dst_params_.height));
+    }
+    void scale(av::VideoFrame &out_frame, const av::VideoFrame &in_frame) {
+        AVTS begin = wallclock.ns();
+#ifdef HAVE_SWS_SCALE_FRAME
+        // splits the frame into slices processed by threads of the context
+        int ret = sws_scale_frame(scaler_, out_frame.raw(), in_frame.raw());
+#else
+        const AVFrame* in = in_frame.raw();
+        AVFrame* out = out_frame.raw();
+        int ret = sws_scale(scaler_, in->data, in->linesize, 0, in->height, out->data, out->linesize);
+#endif
+        if (ret < 0) {
+            throw Error("Scaling failed: " + av::error2string(ret));
+        }
+        scale_us_.record((wallclock.ns() - begin) / 1000);
+        frames_.fetch_add(1, std::memory_order_relaxed);
     }
 public:
     virtual void process() {
@@ -23,15 +135,16 @@ public:
             //logstream << "scale in: PTS = " << in_frame.pts() << std::endl;
             if (sourceChanged(in_frame)) {
                 src_params_ = VideoParameters(in_frame);
-                createRescaler();
-            }
-            //av::VideoFrame out_frame;
-            //rescaler_->rescale(out_frame, in_frame);
-            av::VideoFrame out_frame = rescaler_->rescale(in_frame, av::throws());
-            if (out_frame) {
-                //logstream << "scale out: PTS = " << out_frame.pts() << std::endl;
-                this->sink_->put(out_frame);
+                selectScaler();
             }
+            av::VideoFrame out_frame = allocator_.alloc(dst_params_.pixel_format, dst_params_.width, dst_params_.height);
+            scale(out_frame, in_frame);
+            av_frame_copy_props(out_frame.raw(), in_frame.raw());
+            out_frame.setTimeBase(in_frame.timeBase());
+            out_frame.setStreamIndex(in_frame.streamIndex());
+            out_frame.setComplete(true);
+            //logstream << "scale out: PTS = " << out_frame.pts() << std::endl;
+            this->sink_->put(out_frame);
         }/* else {
             flush();
         }*/
@@ -39,6 +152,20 @@ public:
     /*virtual void flush() {
         // NOOP, frame rescaler doesn't need flushing
     }*/
+    virtual Parameters getObject(const std::string name) {
+        if (name=="stats") {
+            Parameters r;
+            r["frames"] = frames_.load(std::memory_order_relaxed);
+            r["threads"] = scalers_.threads();
+            r["cache_hits"] = scalers_.hits();
+            r["cache_misses"] = scalers_.misses();
+            r["scale_us"] = scale_us_.toJson();
+            r["scale_us"].erase("buckets");
+            return r;
+        } else {
+            throw Error("Unknown object to get");
+        }
+    }
     DynamicVideoScaler(std::unique_ptr<Source<av::VideoFrame>> &&source, std::unique_ptr<Sink<av::VideoFrame>> &&sink, const VideoParameters &dst_params, int32_t flags): NodeSISO<av::VideoFrame, av::VideoFrame>(std::move(source), std::move(sink)), dst_params_(dst_params), sws_flags_(flags) {
         // DynamicVideoScaler will generally process everything thrown on it
         // but by setting preferred pix_fmt and resolution we can reduce CPU usage (and console spam from libav warnings ;) )
@@ -91,7 +218,28 @@ public:
         }
         dst_params.pixel_format = av::PixelFormat(params.at("dst_pixel_format").get<std::string>());
         // FIXME: specifying invalid pixel format causes segfault!
-        return NodeSISO<av::VideoFrame, av::VideoFrame>::template createCommon<DynamicVideoScaler>(edges, params, dst_params, flags_i);
+        if ((flags_i & (SWS_FAST_BILINEAR | SWS_BILINEAR | SWS_BICUBIC | SWS_X | SWS_POINT | SWS_AREA | SWS_BICUBLIN | SWS_GAUSS | SWS_SINC | SWS_LANCZOS | SWS_SPLINE)) == 0) {
+            // no algorithm selected
+            flags_i |= SWS_BICUBIC;
+        }
+        size_t cache_size = 4;
+        if (params.count("cache_size")==1) {
+            cache_size = params["cache_size"];
+        }
+        int threads = 1;
+        if (params.count("threads")==1) {
+            threads = params["threads"];
+        }
+#ifndef HAVE_SWS_SCALE_FRAME
+        if (threads != 1) {
+            logstream << "libswscale too old for slice threads, scaling in 1 thread";
+            threads = 1;
+        }
+#endif
+        auto r = NodeSISO<av::VideoFrame, av::VideoFrame>::template createCommon<DynamicVideoScaler>(edges, params, dst_params, flags_i);
+        r->scalers_.configure(cache_size, flags_i, threads);
+        r->allocator_.setPools(bufferPoolsFromParams(nci.instance, params));
+        return r;
     }
     virtual int width() {
         return dst_params_.width;
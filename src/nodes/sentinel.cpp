@@ -2,6 +2,7 @@
 #include "../instance_shared.hpp"
 #include "../picture_buffer.hpp"
 #include "../rest_client.hpp"
+#include "../buffer_pool.hpp"
 
 #include <avcpp/codeccontext.h>
 #include <avcpp/videorescaler.h>
@@ -140,6 +141,7 @@ protected:
     int sample_rate_ = -1;
     static constexpr av::SampleFormat::Alignment align_ = av::SampleFormat::Alignment::AlignDefault;
     av::SampleFormat sample_format_ {AV_SAMPLE_FMT_NONE};
+    AudioSamplesAllocator allocator_;
 public:
     void gotFrame(av::AudioSamples &frm) {
         if ( (frm.channelsLayout()>=0) && (frm.sampleRate()>0) && (frm.sampleFormat().get()!=AV_SAMPLE_FMT_NONE) ) {
@@ -175,7 +177,7 @@ public:
 
         if (len.timestamp() > max_len_) len = {max_len_, len.timebase()};
 
-        av::AudioSamples r(sample_format_, len.timestamp(), channel_layout_, sample_rate_, align_);
+        av::AudioSamples r = allocator_.alloc(sample_format_, len.timestamp(), channel_layout_, sample_rate_);
         if (sample_format_.isPlanar()) {
             size_t size1ch = sample_format_.requiredBufferSize(1, len.timestamp(), align_);
             for (size_t i=0; i<channel_count_; i++) {
@@ -210,7 +212,7 @@ public:
             prev_size_ = size;
         }
     }
-    CorrMediaSpecific(const Parameters&, InstanceData&) {
+    CorrMediaSpecific(const Parameters &params, InstanceData &instance): allocator_(bufferPoolsFromParams(instance, params)) {
     }
     ~CorrMediaSpecific() {
         if (zero_data_ != nullptr) {
@@ -432,7 +434,7 @@ protected:
                 // ignore minor clock fluctuations
                 return false;
             }
-            logstream << "Discontinuity: " << next_ts_ << " -> " << ts << " diff = " << diff << "s" << std::endl;
+            logstream_limited(10) << "Discontinuity: " << next_ts_ << " -> " << ts << " diff = " << diff << "s" << std::endl;
             return true;
         } else {
             return false;
@@ -447,7 +449,7 @@ protected:
         av::Timestamp delta = mspec_.getDelta(frm);
         next_ts_ = addTS(ts, delta);
         if (next_ts_.timestamp() < 0) {
-            logstream << "Warning: Setting next_ts to negative value: " << next_ts_ << ", PTS = " << ts << ", length = " << delta;
+            logstream_limited(10) << "Warning: Setting next_ts to negative value: " << next_ts_ << ", PTS = " << ts << ", length = " << delta;
         }
         //logstream << "corr out: stream " << frm.streamIndex() << " PTS = " << ts << " = " << ts.seconds() << " (" << frm.pts() << " in frame), next_ts_ = " << next_ts_ << std::endl;
         bool success = this->sink_->put(frm, drop_if_full);
@@ -1,8 +1,11 @@
 #include "node_common.hpp"
 
-template <typename T> class Split: public NodeSingleInput<T>, public NodeMultiOutput<T> {
+template <typename T> class Split: public NodeSingleInput<T>, public NodeMultiOutput<T>, public IWorkerPoolSafe {
 protected:
     bool drop_ = false;
+    size_t max_batch_ = 16;
+    static constexpr int full_output_wait_ms_ = 50;
+    std::vector<T> batch_;
 public:
     using NodeSingleInput<T>::NodeSingleInput;
     virtual void process() {
@@ -10,17 +13,54 @@ public:
         if (data==nullptr) {
             return;
         }
-        for (auto &edge: this->sink_edges_) {
-            if (!data->isComplete()) {
+        // take everything which is already queued (up to max_batch_)
+        // so that every output edge is woken up once per batch, not once per item.
+        // Without drop, take only as many as every output has room for: items we hold
+        // while waiting for a full output would be lost if we were stopped meanwhile.
+        size_t count = max_batch_;
+        if (!drop_) {
+            for (auto &edge: this->sink_edges_) {
+                count = std::min(count, size_t(std::max(edge->free(), 0)));
+            }
+            if (count == 0) {
+                // short wait, so that stop() isn't delayed by a stuck output
+                for (auto &edge: this->sink_edges_) {
+                    if (edge->free() <= 0) {
+                        edge->consumedEvent().wait(full_output_wait_ms_);
+                        break;
+                    }
+                }
+                return;
+            }
+        }
+        batch_.clear();
+        this->source_->get_many(batch_, count, 0);
+        for (T &item: batch_) {
+            if (!item.isComplete()) {
                 logstream << "WARNING: split putting incomplete frame into sink!";
             }
-            EdgeSink<T>(edge).put(*data, drop_);
+            // copies are references to the same buffer, unless it isn't refcounted:
+            // then data would be copied for every output
+            makeRefcounted(item);
+        }
+        // all outputs share the data (copy on write, see makeWritable),
+        // the last one gets our references instead of new ones.
+        // We're the only producer of the outputs, so without drop they accept the batch without waiting.
+        const size_t outputs = this->sink_edges_.size();
+        for (size_t i=0; i+1 < outputs; i++) {
+            EdgeSink<T>(this->sink_edges_[i]).put_many(batch_, drop_);
         }
-        this->source_->pop();
+        if (outputs > 0) {
+            EdgeSink<T>(this->sink_edges_[outputs-1]).put_many(std::move(batch_), drop_);
+        }
+        batch_.clear();
     }
     void setDrop(const bool drop) {
         drop_ = drop;
     }
+    void setMaxBatch(const size_t max_batch) {
+        max_batch_ = std::max<size_t>(1, max_batch);
+    }
     static std::shared_ptr<Split> create(NodeCreationInfo &nci) {
         EdgeManager &edges = nci.edges;
         const Parameters &params = nci.params;
@@ -29,6 +69,9 @@ public:
         if (params.count("drop")==1) {
             r->setDrop(params["drop"].get<bool>());
         }
+        if (params.count("max_batch")==1) {
+            r->setMaxBatch(params["max_batch"].get<size_t>());
+        }
         r->createSinksFromParameters(edges, params);
         in_edge->setConsumer(r);
         return r;
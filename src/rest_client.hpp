@@ -1,8 +1,13 @@
 #pragma once
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 #include <cpr/cpr.h>
 #include "util.hpp"
 #include "avutils.hpp"
+#include "instance_shared.hpp"
 #include <readerwriterqueue/readerwriterqueue.h>
 
 class RESTEndpoint {
@@ -12,6 +17,7 @@ protected:
     cpr::Header post_headers_ = {{"User-Agent", APP_VERSION}, {"charset", "utf-8"}, {"Content-Type", "application/json"}};
     AVTS min_interval_ = -1;
     AVTS last_send_ = -86400000;
+    std::unique_ptr<cpr::Session> session_; // reused, so that the connection is kept alive
 public:
     RESTEndpoint(const std::string url): base_url_(url) {
     }
@@ -44,13 +50,19 @@ protected:
             return -1;
         }
         try {
-            cpr::Url url(url_str);
+            if (!session_) {
+                session_ = make_unique<cpr::Session>();
+            }
             cpr::Response resp;
-            //logstream << "before REST " << url;
+            session_->SetUrl(cpr::Url(url_str));
+            //logstream << "before REST " << url_str;
             if (data.empty()) {
-                resp = cpr::Get(url, get_headers_);
+                session_->SetHeader(get_headers_);
+                resp = session_->Get();
             } else {
-                resp = cpr::Post(url, post_headers_, cpr::Body(data));
+                session_->SetHeader(post_headers_);
+                session_->SetBody(cpr::Body(data));
+                resp = session_->Post();
             }
             //logstream << "after REST, " << resp.status_line;
             return -1;
@@ -110,4 +122,73 @@ public:
             thread_.join();
         }
     }
-};
\ No newline at end of file
+};
+
+// Coalesces JSON documents sent within max_delay into a single POST of a JSON array,
+// over a kept-alive connection. Stats subscriptions with "batch": true share one per URL
+// (InstanceSharedObjects<BatchingRESTEndpoint>, keyed by URL).
+class BatchingRESTEndpoint: public RESTEndpoint, public InstanceShared<BatchingRESTEndpoint> {
+protected:
+    std::mutex busy_;
+    std::condition_variable cv_;
+    std::vector<std::string> pending_;
+    AVTS first_pending_ms_ = 0;
+    AVTS max_delay_ms_ = 100;
+    size_t max_batch_ = 1000;
+    bool should_work_ = true;
+    std::thread thread_;
+    void thread() {
+        std::unique_lock<decltype(busy_)> lock(busy_);
+        std::vector<std::string> batch;
+        std::string body;
+        while (true) {
+            cv_.wait(lock, [this]() {
+                return !pending_.empty() || !should_work_;
+            });
+            if (pending_.empty()) {
+                break;
+            }
+            // wait for more documents: subscriptions with the same interval send at the same time
+            while (should_work_ && pending_.size() < max_batch_) {
+                AVTS remaining = first_pending_ms_ + max_delay_ms_ - wallclock.pts();
+                if (remaining <= 0) break;
+                cv_.wait_for(lock, std::chrono::milliseconds(remaining));
+            }
+            batch.swap(pending_);
+            lock.unlock();
+            body = "[";
+            for (size_t i=0; i<batch.size(); i++) {
+                if (i) body += ',';
+                body += batch[i];
+            }
+            body += ']';
+            batch.clear();
+            sendInternal("", body);
+            lock.lock();
+        }
+    }
+public:
+    BatchingRESTEndpoint(const std::string url, const AVTS max_delay_ms = 100): RESTEndpoint(url), max_delay_ms_(max_delay_ms) {
+        thread_ = start_thread("REST batcher", [this]() {
+            thread();
+        });
+    }
+    void send(std::string json_document) {
+        {
+            std::lock_guard<decltype(busy_)> lock(busy_);
+            if (pending_.empty()) {
+                first_pending_ms_ = wallclock.pts();
+            }
+            pending_.push_back(std::move(json_document));
+        }
+        cv_.notify_all();
+    }
+    ~BatchingRESTEndpoint() {
+        {
+            std::lock_guard<decltype(busy_)> lock(busy_);
+            should_work_ = false;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+};
@@ -0,0 +1,255 @@
+#include "sound_levels.hpp"
+#include <algorithm>
+#include <cmath>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SOUND_LEVELS_X86 1
+#endif
+
+namespace sound_levels {
+
+std::vector<Kernel> availableKernels() {
+    std::vector<Kernel> r = { Kernel::Scalar };
+#ifdef SOUND_LEVELS_X86
+    r.push_back(Kernel::SSE2);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        r.push_back(Kernel::AVX2);
+    }
+#endif
+    return r;
+}
+
+namespace {
+    // A sample falls into bin k (1..15) if 10^((k-16)/5) < |sample| <= 10^((k-15)/5),
+    // which is the same as ceil(15 + 15*20*log10(|sample|)/60).
+    // Counting samples above each threshold gives the histogram by differences.
+    constexpr size_t thresholds_count = histogram_bins - 1;
+    struct Thresholds {
+        float values[thresholds_count];
+        Thresholds() {
+            for (size_t k=0; k<thresholds_count-1; k++) {
+                values[k] = std::pow(10.0, (double(k) - (histogram_bins-2)) * histogram_db_range / 20.0 / (histogram_bins-2));
+            }
+            values[thresholds_count-1] = clipped_level;
+        }
+    };
+    const Thresholds thresholds;
+
+    // samples per call of a kernel, keeps float sums of squares precise enough
+    // and 32-bit counters from overflowing
+    constexpr size_t chunk_size = 4096;
+
+    void addCounts(Accumulator &acc, const size_t count, const uint32_t above[thresholds_count]) {
+        acc.histogram[0] += count - above[0];
+        for (size_t k=1; k<thresholds_count; k++) {
+            acc.histogram[k] += above[k-1] - above[k];
+        }
+        acc.histogram[histogram_bins-1] += above[thresholds_count-1];
+        acc.samples_count += count;
+    }
+
+    void analyzeScalar(const float* samples, const size_t count, Accumulator &acc) {
+        uint32_t above[thresholds_count] = {0};
+        float peak = acc.peak;
+        double squares = 0;
+        for (size_t i=0; i<count; i++) {
+            float v = std::fabs(samples[i]);
+            peak = std::max(peak, v);
+            squares += double(v)*double(v);
+            for (size_t k=0; k<thresholds_count; k++) {
+                above[k] += v > thresholds.values[k];
+            }
+        }
+        acc.peak = peak;
+        acc.squares_sum += squares;
+        addCounts(acc, count, above);
+    }
+
+#ifdef SOUND_LEVELS_X86
+    void analyzeSSE2(const float* samples, const size_t count, Accumulator &acc) {
+        const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        __m128 thr[thresholds_count];
+        __m128i above_v[thresholds_count];
+        for (size_t k=0; k<thresholds_count; k++) {
+            thr[k] = _mm_set1_ps(thresholds.values[k]);
+            above_v[k] = _mm_setzero_si128();
+        }
+        __m128 peak_v = _mm_setzero_ps();
+        __m128 squares_v = _mm_setzero_ps();
+        size_t i = 0;
+        for (; i+4<=count; i+=4) {
+            __m128 v = _mm_and_ps(_mm_loadu_ps(samples+i), abs_mask);
+            peak_v = _mm_max_ps(peak_v, v);
+            squares_v = _mm_add_ps(squares_v, _mm_mul_ps(v, v));
+            for (size_t k=0; k<thresholds_count; k++) {
+                // mask is -1 where true
+                above_v[k] = _mm_sub_epi32(above_v[k], _mm_castps_si128(_mm_cmpgt_ps(v, thr[k])));
+            }
+        }
+        alignas(16) float lanes[4];
+        alignas(16) uint32_t counts[4];
+        _mm_store_ps(lanes, peak_v);
+        acc.peak = std::max({acc.peak, lanes[0], lanes[1], lanes[2], lanes[3]});
+        _mm_store_ps(lanes, squares_v);
+        acc.squares_sum += double(lanes[0]) + double(lanes[1]) + double(lanes[2]) + double(lanes[3]);
+        uint32_t above[thresholds_count];
+        for (size_t k=0; k<thresholds_count; k++) {
+            _mm_store_si128(reinterpret_cast<__m128i*>(counts), above_v[k]);
+            above[k] = counts[0] + counts[1] + counts[2] + counts[3];
+        }
+        addCounts(acc, i, above);
+        if (i < count) {
+            analyzeScalar(samples+i, count-i, acc);
+        }
+    }
+
+    __attribute__((target("avx2")))
+    void analyzeAVX2(const float* samples, const size_t count, Accumulator &acc) {
+        const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+        __m256 thr[thresholds_count];
+        __m256i above_v[thresholds_count];
+        for (size_t k=0; k<thresholds_count; k++) {
+            thr[k] = _mm256_set1_ps(thresholds.values[k]);
+            above_v[k] = _mm256_setzero_si256();
+        }
+        __m256 peak_v = _mm256_setzero_ps();
+        __m256 squares_v = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i+8<=count; i+=8) {
+            __m256 v = _mm256_and_ps(_mm256_loadu_ps(samples+i), abs_mask);
+            peak_v = _mm256_max_ps(peak_v, v);
+            squares_v = _mm256_add_ps(squares_v, _mm256_mul_ps(v, v));
+            for (size_t k=0; k<thresholds_count; k++) {
+                above_v[k] = _mm256_sub_epi32(above_v[k], _mm256_castps_si256(_mm256_cmp_ps(v, thr[k], _CMP_GT_OQ)));
+            }
+        }
+        alignas(32) float lanes[8];
+        alignas(32) uint32_t counts[8];
+        _mm256_store_ps(lanes, peak_v);
+        acc.peak = std::max(acc.peak, *std::max_element(lanes, lanes+8));
+        _mm256_store_ps(lanes, squares_v);
+        double squares = 0;
+        for (float lane: lanes) squares += lane;
+        acc.squares_sum += squares;
+        uint32_t above[thresholds_count];
+        for (size_t k=0; k<thresholds_count; k++) {
+            _mm256_store_si256(reinterpret_cast<__m256i*>(counts), above_v[k]);
+            above[k] = 0;
+            for (uint32_t lane: counts) above[k] += lane;
+        }
+        addCounts(acc, i, above);
+        if (i < count) {
+            analyzeScalar(samples+i, count-i, acc);
+        }
+    }
+#endif
+
+    using KernelFunction = void (*)(const float*, const size_t, Accumulator&);
+    KernelFunction kernelFunction(const Kernel kernel) {
+        switch (kernel) {
+#ifdef SOUND_LEVELS_X86
+        case Kernel::SSE2:
+            return analyzeSSE2;
+        case Kernel::AVX2:
+            return analyzeAVX2;
+#endif
+        default:
+            return analyzeScalar;
+        }
+    }
+    const KernelFunction default_kernel = kernelFunction(availableKernels().back());
+
+    void analyzeChunked(const KernelFunction fn, const float* samples, const size_t count, Accumulator &acc) {
+        for (size_t pos=0; pos<count; pos+=chunk_size) {
+            fn(samples+pos, std::min(chunk_size, count-pos), acc);
+        }
+    }
+
+    template<typename T> void convert(const T* src, const size_t stride, const size_t count, const float offset, const float scale, float* dst) {
+        for (size_t i=0; i<count; i++) {
+            dst[i] = (float(src[i*stride]) - offset) * scale;
+        }
+    }
+};
+
+size_t bin(const float sample) {
+    float v = std::fabs(sample);
+    size_t r = 0;
+    while (r < thresholds_count && v > thresholds.values[r]) r++;
+    return r;
+}
+
+void analyze(const float* samples, const size_t count, Accumulator &acc) {
+    analyzeChunked(default_kernel, samples, count, acc);
+}
+
+void analyze(const Kernel kernel, const float* samples, const size_t count, Accumulator &acc) {
+    analyzeChunked(kernelFunction(kernel), samples, count, acc);
+}
+
+const char* kernelName(const Kernel kernel) {
+    switch (kernel) {
+    case Kernel::SSE2:
+        return "sse2";
+    case Kernel::AVX2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+bool isSupported(const AVSampleFormat sample_fmt) {
+    switch (av_get_packed_sample_fmt(sample_fmt)) {
+    case AV_SAMPLE_FMT_U8:
+    case AV_SAMPLE_FMT_S16:
+    case AV_SAMPLE_FMT_S32:
+    case AV_SAMPLE_FMT_S64:
+    case AV_SAMPLE_FMT_FLT:
+    case AV_SAMPLE_FMT_DBL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+const float* channelAsFloat(const AVFrame* frame, const int channel, const int channels, std::vector<float> &scratch) {
+    const AVSampleFormat fmt = static_cast<AVSampleFormat>(frame->format);
+    const size_t count = frame->nb_samples;
+    const bool planar = av_sample_fmt_is_planar(fmt);
+    const uint8_t* data = planar ? frame->extended_data[channel] : frame->extended_data[0];
+    const size_t stride = planar ? 1 : channels;
+    const size_t offset = planar ? 0 : channel;
+    if (fmt == AV_SAMPLE_FMT_FLTP) {
+        return reinterpret_cast<const float*>(data);
+    }
+    if (scratch.size() < count) {
+        scratch.resize(count);
+    }
+    float* dst = scratch.data();
+    switch (av_get_packed_sample_fmt(fmt)) {
+    case AV_SAMPLE_FMT_U8:
+        convert(data + offset, stride, count, 128.0f, 1.0f/128, dst);
+        break;
+    case AV_SAMPLE_FMT_S16:
+        convert(reinterpret_cast<const int16_t*>(data) + offset, stride, count, 0, 1.0f/32768, dst);
+        break;
+    case AV_SAMPLE_FMT_S32:
+        convert(reinterpret_cast<const int32_t*>(data) + offset, stride, count, 0, 1.0f/2147483648.0f, dst);
+        break;
+    case AV_SAMPLE_FMT_S64:
+        convert(reinterpret_cast<const int64_t*>(data) + offset, stride, count, 0, 1.0f/9223372036854775808.0f, dst);
+        break;
+    case AV_SAMPLE_FMT_FLT:
+        convert(reinterpret_cast<const float*>(data) + offset, stride, count, 0, 1.0f, dst);
+        break;
+    case AV_SAMPLE_FMT_DBL:
+        convert(reinterpret_cast<const double*>(data) + offset, stride, count, 0, 1.0f, dst);
+        break;
+    default:
+        return nullptr;
+    }
+    return dst;
+}
+
+};
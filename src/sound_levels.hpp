@@ -0,0 +1,51 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+}
+
+// Level statistics of audio samples: peak, sum of squares and a histogram in 4 dB steps.
+// The kernel works on float samples (-1..1) with SSE2 or AVX2 when available
+// and bins samples by comparing them with precomputed thresholds, not by log10.
+namespace sound_levels {
+
+constexpr size_t histogram_bins = 17;
+constexpr int histogram_db_range = 60;
+constexpr float clipped_level = 0.9885309; // -0.1 dB
+constexpr float epsilon_level = 0.001; // -60 dB
+
+struct Accumulator {
+    float peak = 0;
+    double squares_sum = 0;
+    uint64_t histogram[histogram_bins] = {0};
+    uint64_t samples_count = 0;
+};
+
+// Bin of a single sample, same as the kernels. Reference for checking them.
+size_t bin(const float sample);
+
+// Adds count samples to acc, using the fastest kernel supported by the CPU.
+void analyze(const float* samples, const size_t count, Accumulator &acc);
+
+enum class Kernel { Scalar, SSE2, AVX2 };
+
+// Kernels supported by this build and CPU, fastest last.
+std::vector<Kernel> availableKernels();
+
+const char* kernelName(const Kernel kernel);
+
+// Same as analyze() with a specific kernel, which must be available.
+void analyze(const Kernel kernel, const float* samples, const size_t count, Accumulator &acc);
+
+// Converts samples of one channel of frame to floats.
+// Planar float frames don't need conversion: returns pointer to the frame's data.
+// Otherwise samples are written to scratch, which is reused between calls.
+const float* channelAsFloat(const AVFrame* frame, const int channel, const int channels, std::vector<float> &scratch);
+
+// Whether channelAsFloat supports the format.
+bool isSupported(const AVSampleFormat sample_fmt);
+
+};
@@ -1,10 +1,16 @@
 #include "stats.hpp"
 
 #include <cstdint>
+#include <list>
+#include <map>
+#include <set>
 #include <utility>
-#include <avcpp/audioresampler.h>
+#include <deque>
 #include "libavutil/dict.h"
 #include "util.hpp"
+#include "sound_levels.hpp"
+#include "loudness.hpp"
+#include "timed_history.hpp"
 #include "graph_mgmt.hpp"
 #include "rest_client.hpp"
 
@@ -14,80 +20,18 @@
 
 using nlohmann::json;
 
-template<typename Y, bool autoclean = true> class TimedHistory {
-public:
-    struct Item {
-        av::Timestamp time;
-        Y value;
-    };
-protected:
-    double max_age_sec_;
-    std::list<Item> items_;
-public:
-    void cleanupWithRefTS(const av::Timestamp now) {
-        if (now.isNoPts()) return;
-        av::Timestamp min_ts = { now.timestamp() - static_cast<int64_t>(max_age_sec_/now.timebase().getDouble()), now.timebase() };
-        items_.remove_if([min_ts](Item &item) {
-            return (item.time < min_ts);
-            // FIXME: this is inefficient. We should discard all items before the first not-too-old item.
-        });
-    }
-    TimedHistory(const double max_age_sec = 30): max_age_sec_(max_age_sec) {
-    }
-    void setMaxAge(const double seconds) {
-        max_age_sec_ = seconds;
-    }
-    void cleanup() {
-        if (items_.empty()) return;
-        // use last value as reference time
-        cleanupWithRefTS(items_.back().time);
-    }
-    void clearAll() {
-        items_.clear();
-    }
-    double itemsPerSecond() {
-        size_t nitems = items_.size();
-        if (nitems==0) {
-            return 0; // or maybe NAN?
-        }
-        av::Timestamp deltat = addTS(items_.back().time, negateTS(items_.front().time));
-        if (deltat.timestamp()==0) {
-            return 0; // or maybe NAN?
-        }
-        return ((double)(nitems-1)) / deltat.seconds();
-    }
-    void push(const av::Timestamp time, const Y value) {
-        items_.push_back({ time, value });
-        if (autoclean) cleanup();
-    }
-    void pushWallclockNow(const Y value) {
-        push(wallclock.ts(), value);
-    }
-    bool empty() {
-        return items_.empty();
-    }
-    Item& earliest() {
-        return items_.front();
-    }
-    Item& latest() {
-        return items_.back();
-    }
-    template<typename Ret = Y> Ret valueDiff() {
-        return latest().value - earliest().value;
-    }
-    av::Timestamp timeDiff() {
-        return latest().time - earliest().time;
-    }
-};
-
 /*
  * mss stats:{"AV_diff":1726560.435,"queued_packets":0,"stalled_seconds":0.0,"streams_audio":[{"codec":"aac","frame_num":16,"index":0,"kbitrate":0.0,"samplerate":0.0,"speed":0.0,"type":"A"}],"streams_video":[{"codec":"h264","field_order":"PROGRESSIVE","fps":0.0,"frame_num":0,"height":720,"index":1,"kbitrate":0.0,"speed":0.0,"type":"V","width":1280}],"card":false}
 */
 
-class AbstractStreamStats {
+class AbstractStreamStats: public std::enable_shared_from_this<AbstractStreamStats> {
 public:
+    // adds wiretaps to the stream's edges, must be called after construction (needs shared_from_this)
+    virtual void attach() = 0;
     virtual void fillStats(json &jstats) = 0;
     virtual av::Timestamp lastTS() = 0;
+    // wallclock.ts() of the last packet, NOTS if none
+    virtual av::Timestamp lastFrameRTC() = 0;
     virtual ~AbstractStreamStats() {
     }
 };
@@ -147,7 +91,12 @@ protected:
     TimedHistory<size_t> bytes_;
     std::recursive_mutex pre_dec_mutex_;
     std::recursive_mutex post_dec_mutex_;
-    StatsSender *sender_;
+    std::shared_ptr<Edge<av::Packet>> pre_dec_edge_;
+    std::shared_ptr<Edge<T>> post_dec_edge_;
+    typename Edge<av::Packet>::WiretapId pre_dec_wiretap_;
+    typename Edge<T>::WiretapId post_dec_wiretap_;
+    bool attached_ = false;
+    av::Timestamp last_frame_rtc_ = NOTS;
     double max_age_;
     bool clear_on_send_ = false;
     bool processes_decoded_frames_;
@@ -196,17 +145,32 @@ public:
             resetHistory();
         }
     }
+    void tapPacket(const av::Packet &pkt);
+    void tapFrame(const T &frm);
     virtual void processDecodedFrame(const T &frm) = 0;
     virtual void fillMediaSpecificStatsPreDec(json &jstats) {
     };
     virtual void fillMediaSpecificStatsPostDec(json &jstats) = 0;
 
-    StreamStats(std::shared_ptr<NodeManager> manager, json &jobj, StatsSender* sender, const double max_age);
+    StreamStats(std::shared_ptr<NodeManager> manager, json &jobj, const double max_age);
+    virtual ~StreamStats() {
+        if (!attached_) return;
+        pre_dec_edge_->removeWiretapCallback(pre_dec_wiretap_);
+        if (post_dec_edge_) {
+            post_dec_edge_->removeWiretapCallback(post_dec_wiretap_);
+        }
+    }
+
+    virtual void attach() override;
 
     virtual av::Timestamp lastTS() override {
         if (ts_by_rtc_.empty()) return NOTS;
         return ts_by_rtc_.latest().value;
     }
+    virtual av::Timestamp lastFrameRTC() override {
+        std::lock_guard<decltype(pre_dec_mutex_)> lock(pre_dec_mutex_);
+        return last_frame_rtc_;
+    }
 
     virtual void fillStats(json &jstats) override {
         {
@@ -320,14 +284,8 @@ static double todb(const double v) {
 
 class SoundAnalyzer {
 private:
-    using sample_t = int32_t;
-    static constexpr AVSampleFormat sample_format = AV_SAMPLE_FMT_S32P;
-    static constexpr sample_t sample_max = INT32_MAX;
     struct FrameStats {
-        static constexpr size_t histogram_bins = 17;
-        static constexpr int histogram_db_range = 60;
-        static constexpr double clipped_level = 0.9885309; // -0.1 dB
-        static constexpr double epsilon_level = 0.001; // -60 dB
+        static constexpr size_t histogram_bins = sound_levels::histogram_bins;
         double peak;
         double squares_sum;
         size_t histogram[histogram_bins];
@@ -346,40 +304,28 @@ private:
             r += other;
             return r;
         }
+        // peak can't be subtracted, it's left as is
+        FrameStats operator-=(const FrameStats &other) {
+            this->squares_sum -= other.squares_sum;
+            for (size_t i=0; i<histogram_bins; i++) {
+                this->histogram[i] -= other.histogram[i];
+            }
+            this->samples_count -= other.samples_count;
+            return *this;
+        }
         double getRMS() const {
-            return std::sqrt(squares_sum / (double)samples_count);
+            if (samples_count == 0) return 0;
+            // running sums maintained by subtraction may drop slightly below zero
+            return std::sqrt(std::max(0.0, squares_sum) / (double)samples_count);
         }
         size_t getClipped() const {
             return histogram[histogram_bins-1];
         }
-        static size_t getBin(const double sample) {
-            double value = std::abs(sample);
-            if (value<epsilon_level) return 0;
-            if (value>clipped_level) return histogram_bins-1;
-            int ret = std::ceil((histogram_bins-2) + (histogram_bins-2)*20.0*std::log10(value)/histogram_db_range);
-            if (ret >= histogram_bins) ret = histogram_bins-1;
-            if (ret < 0) ret = 0;
-            return ret;
-        }
         FrameStats(): peak(0), squares_sum(0), samples_count(0) {
             for (size_t i=0; i<histogram_bins; i++) histogram[i] = 0;
         }
-        FrameStats(const sample_t *buffer, const size_t buffsize): FrameStats() {
-            for (size_t i=0; i<buffsize; i++) {
-                double sample = (double)buffer[i]/sample_max;
-
-                // PEAK
-                double absv = std::abs(sample);
-                if (absv > this->peak) this->peak = absv;
-
-                // RMS
-                this->squares_sum += (double)sample*(double)sample;
-
-                // Histogram
-                this->histogram[getBin(sample)] += 1;
-
-            }
-            this->samples_count += buffsize;
+        FrameStats(const sound_levels::Accumulator &acc): peak(acc.peak), squares_sum(acc.squares_sum), samples_count(acc.samples_count) {
+            for (size_t i=0; i<histogram_bins; i++) histogram[i] = acc.histogram[i];
         }
         std::tuple<size_t, size_t> histogramPeak() const {
             size_t maxindex = 0;
@@ -419,35 +365,104 @@ private:
             //    "Histogram peak @ bin " << std::get<0>(histogramPeak()) << std::endl;
         }
     };
+    // Long-term history is kept in a ring of buckets (100 ms or more) with running sums,
+    // so neither adding a frame nor reporting iterates over the history.
+    struct Bucket {
+        std::vector<FrameStats> channels;
+        double peak = 0;
+        size_t samples_count = 0;
+        uint64_t seq = 0;
+    };
 
     AudioParameters audio_params_;
-    std::unique_ptr<av::AudioResampler> resampler_;
+    bool started_ = false;
+    bool supported_ = false;
     size_t channels_num = 0;
     double stats_seconds_max = 60;
     double last_sr_ = 0;
     float stats_seconds = 0;
-    std::list<std::shared_ptr<std::vector<FrameStats> > > stats;
-    std::list<std::shared_ptr<std::vector<FrameStats> > > rtstats;
-    static float samplesDuration(const av::AudioSamples &samples) {
-        return (float)samples.samplesCount()/(float)samples.sampleRate();
+    std::vector<float> scratch_;
+    std::vector<FrameStats> frame_stats_;
+    std::vector<Bucket> ring_;
+    size_t ring_first_ = 0;
+    size_t ring_count_ = 0; // the last one is being filled
+    uint64_t bucket_seq_ = 0;
+    size_t bucket_samples_ = 4800;
+    size_t evictions_since_resum_ = 0;
+    std::vector<FrameStats> long_sums_; // over ring_, peak not valid
+    std::deque<std::pair<uint64_t, double>> peaks_; // (bucket seq, peak) of full buckets, peaks decreasing
+    std::vector<FrameStats> rt_sums_; // since last getStats
+    bool have_rt_ = false;
+    bool loudness_enabled_ = false;
+    bool true_peak_ = false;
+    LoudnessMeter loudness_;
+
+    Bucket& currentBucket() {
+        return ring_[(ring_first_ + ring_count_ - 1) % ring_.size()];
     }
-    void processConvertedSamples(const av::AudioSamples &samples) {
-        std::shared_ptr<std::vector<FrameStats> > chstats = std::make_shared<std::vector<FrameStats> >(channels_num);
+    void evictOldest() {
+        Bucket &b = ring_[ring_first_];
         for (size_t ch=0; ch<channels_num; ch++) {
-            const sample_t *chbuff = reinterpret_cast<const sample_t*>(samples.data(ch));
-            (*chstats)[ch] = FrameStats(chbuff, samples.samplesCount());
-            //chstats[ch].print(logstream);
+            long_sums_[ch] -= b.channels[ch];
         }
-        stats.push_back(chstats);
-        rtstats.push_back(chstats);
-        stats_seconds += samplesDuration(samples);
-        try {
-            while (stats_seconds > stats_seconds_max) {
-                stats_seconds -= (float)(*stats.front())[0].samples_count/(float)audio_params_.sample_rate;
-                stats.pop_front();
+        stats_seconds -= (float)b.samples_count/(float)audio_params_.sample_rate;
+        if (!peaks_.empty() && peaks_.front().first == b.seq) {
+            peaks_.pop_front();
+        }
+        ring_first_ = (ring_first_ + 1) % ring_.size();
+        ring_count_--;
+        if (++evictions_since_resum_ >= ring_.size()) {
+            // running sums accumulate rounding errors of subtraction
+            evictions_since_resum_ = 0;
+            resumBuckets();
+        }
+    }
+    void resumBuckets() {
+        std::fill(long_sums_.begin(), long_sums_.end(), FrameStats());
+        size_t samples = 0;
+        for (size_t i=0; i<ring_count_; i++) {
+            Bucket &b = ring_[(ring_first_ + i) % ring_.size()];
+            for (size_t ch=0; ch<channels_num; ch++) {
+                long_sums_[ch] += b.channels[ch];
             }
-        } catch (std::exception &e) {
-            logstream << "Error cleaning sound analyzer: " << e.what() << std::endl;
+            samples += b.samples_count;
+        }
+        stats_seconds = (double)samples/(double)audio_params_.sample_rate;
+    }
+    void openBucket() {
+        if (ring_count_ > 0) {
+            Bucket &full = currentBucket();
+            while (!peaks_.empty() && peaks_.back().second <= full.peak) {
+                peaks_.pop_back();
+            }
+            peaks_.emplace_back(full.seq, full.peak);
+        }
+        if (ring_count_ == ring_.size()) {
+            evictOldest();
+        }
+        ring_count_++;
+        Bucket &b = currentBucket();
+        std::fill(b.channels.begin(), b.channels.end(), FrameStats());
+        b.peak = 0;
+        b.samples_count = 0;
+        b.seq = bucket_seq_++;
+    }
+    void processFrameStats(const size_t samples_count) {
+        if (ring_count_ == 0 || currentBucket().samples_count >= bucket_samples_) {
+            openBucket();
+        }
+        Bucket &b = currentBucket();
+        for (size_t ch=0; ch<channels_num; ch++) {
+            b.channels[ch] += frame_stats_[ch];
+            long_sums_[ch] += frame_stats_[ch];
+            rt_sums_[ch] += frame_stats_[ch];
+            b.peak = std::max(b.peak, frame_stats_[ch].peak);
+        }
+        b.samples_count += samples_count;
+        have_rt_ = true;
+        stats_seconds += (float)samples_count/(float)audio_params_.sample_rate;
+        while (ring_count_ > 1 && stats_seconds > stats_seconds_max) {
+            evictOldest();
         }
     }
 public:
@@ -456,52 +471,112 @@ public:
     void setMaxAge(const double sec) {
         stats_seconds_max = sec;
     }
+    void enableLoudness(const bool true_peak) {
+        loudness_enabled_ = true;
+        true_peak_ = true_peak;
+    }
+    bool loudnessEnabled() const {
+        return loudness_enabled_;
+    }
     void processSamples(const av::AudioSamples &in_samples) {
         if (in_samples.isComplete() && in_samples.samplesCount()>0) {
-            if ( (resampler_==nullptr) || (audio_params_ != AudioParameters(in_samples)) ) {
+            if ( (!started_) || (audio_params_ != AudioParameters(in_samples)) ) {
                 audio_params_ = AudioParameters(in_samples);
-                // preserve channel layout & sample rate
-                // convert only sample format
-                resampler_ = make_unique<av::AudioResampler>(audio_params_.channel_layout, audio_params_.sample_rate, sample_format,
-                                                             audio_params_.channel_layout, audio_params_.sample_rate, audio_params_.sample_format);
                 channels_num = in_samples.channelsCount();
+                // samples are analyzed in their own format, without conversion to a common one
+                supported_ = sound_levels::isSupported(audio_params_.sample_format.get());
+                started_ = true;
+                if (loudness_enabled_) {
+                    loudness_.configure(audio_params_.sample_rate, audio_params_.channel_layout, channels_num, true_peak_);
+                }
                 resetHistory();
-                logstream << "Sound analyzer started: " << audio_params_;
+                if (supported_) {
+                    logstream << "Sound analyzer started: " << audio_params_;
+                } else {
+                    logstream << "Sound analyzer: unsupported sample format " << audio_params_;
+                }
             }
-            resampler_->push(in_samples);
-
-            while(true) {
-                av::AudioSamples samples(sample_format, in_samples.samplesCount(), audio_params_.channel_layout, audio_params_.sample_rate);
-                bool got = resampler_->pop(samples, true);
-                if (!got) break;
-                processConvertedSamples(samples);
+            if (!supported_) return;
+            const AVFrame* frm = in_samples.raw();
+            for (size_t ch=0; ch<channels_num; ch++) {
+                sound_levels::Accumulator acc;
+                const float* samples = sound_levels::channelAsFloat(frm, ch, channels_num, scratch_);
+                sound_levels::analyze(samples, frm->nb_samples, acc);
+                frame_stats_[ch] = FrameStats(acc);
+                //frame_stats_[ch].print(logstream);
+                if (loudness_enabled_) {
+                    loudness_.addChannel(ch, samples, frm->nb_samples);
+                }
+            }
+            processFrameStats(frm->nb_samples);
+            if (loudness_enabled_) {
+                loudness_.endFrame(frm->nb_samples);
             }
         }
     }
     void resetHistory() {
-        for (auto &v: stats) {
-            v->clear();
-        }
-        for (auto &v: rtstats) {
-            v->clear();
-        }
+        clearLevels();
+        loudness_.reset();
+    }
+    // after sending with max_age <= 0: momentary and short-term loudness windows span sends,
+    // only integrated loudness and loudness range start anew
+    void clearAfterSend() {
+        clearLevels();
+        loudness_.resetIntegrated();
+    }
+    void clearLevels() {
+        // bucket length grows with max age, to keep the ring small
+        double bucket_seconds = std::max(0.1, stats_seconds_max / 600);
+        bucket_samples_ = std::max<size_t>(1, bucket_seconds * audio_params_.sample_rate);
+        Bucket empty;
+        empty.channels.resize(channels_num);
+        ring_.assign(std::ceil(stats_seconds_max / bucket_seconds) + 2, empty);
+        ring_first_ = 0;
+        ring_count_ = 0;
+        evictions_since_resum_ = 0;
+        peaks_.clear();
+        frame_stats_.assign(channels_num, FrameStats());
+        long_sums_.assign(channels_num, FrameStats());
+        rt_sums_.assign(channels_num, FrameStats());
+        have_rt_ = false;
         stats_seconds = 0;
         last_sr_ = 0;
     }
+    // same format as metadata of lavfi ebur128 filter (see AudioStreamStats::extractR128Stats)
+    void getLoudness(nlohmann::json &jobj) {
+        if (!loudness_enabled_ || !supported_) return;
+        LoudnessMeter::Result r = loudness_.takeResult();
+        if (!r.valid) return;
+        nlohmann::json jr128;
+        jr128["M"] = r.momentary;
+        jr128["M_max"] = r.momentary_max;
+        jr128["S"] = r.short_term;
+        jr128["I"] = r.integrated;
+        jr128["LRA"] = r.range;
+        jr128["LRA_low"] = r.range_low;
+        jr128["LRA_high"] = r.range_high;
+        if (!r.true_peaks.empty()) {
+            nlohmann::json jtp;
+            for (double tp: r.true_peaks) {
+                jtp.push_back(todb(tp));
+            }
+            jr128["TP"] = jtp;
+        }
+        jobj["r128"] = jr128;
+    }
     void getStats(nlohmann::json &jobj, const double sr_to_compare = 0) {
         // long-term statistics:
-        if (!stats.empty()) {
-            std::vector<FrameStats> channel_sums(channels_num);
-            for (const auto &channels: stats) {
-                for (size_t ch=0; ch<channels_num; ch++) {
-                    channel_sums[ch] += (*channels)[ch];
-                }
-            }
+        if (ring_count_ > 0) {
+            std::vector<FrameStats> &channel_sums = long_sums_;
             jobj["duration_analyzed_sound"] = stats_seconds;
             FrameStats sum;
             for (const auto &channel: channel_sums) {
                 sum += channel;
             }
+            sum.peak = currentBucket().peak;
+            if (!peaks_.empty()) {
+                sum.peak = std::max(sum.peak, peaks_.front().second);
+            }
             jobj["rms"] = todb(sum.getRMS());
             jobj["peak"] = todb(sum.peak);
             jobj["clipped_samples"] = sum.getClipped();
@@ -520,29 +595,22 @@ public:
         //sum.print(logstream);
 
         // real-time statistics:
-        if (!rtstats.empty()) {
-            std::vector<FrameStats> channel_sums(channels_num);
-            for (const auto &channels: rtstats) {
-                for (size_t ch=0; ch<channels_num; ch++) {
-                    channel_sums[ch] += (*channels)[ch];
-                }
-            }
+        if (have_rt_) {
             nlohmann::json jchannels;
-            for (const auto &channel: channel_sums) {
+            for (auto &channel: rt_sums_) {
                 nlohmann::json jch;
                 jch["rms"] = todb(channel.getRMS());
                 jch["peak"] = todb(channel.peak);
                 jch["clipped_samples"] = channel.getClipped();
                 jchannels.push_back(jch);
+                channel = FrameStats();
             }
             jobj["channels_rt"] = jchannels;
-            rtstats.clear();
+            have_rt_ = false;
         }
     }
 };
 
-constexpr AVSampleFormat SoundAnalyzer::sample_format;
-
 
 class AudioStreamStats: public StreamStats<av::AudioSamples> {
 protected:
@@ -557,10 +625,18 @@ protected:
     float true_peaks_[MAX_AUDIO_CHANNELS] = {0};
     size_t channels_count_ = 0;
 public:
-    AudioStreamStats(std::shared_ptr<NodeManager> manager, json &jobj, StatsSender* sender, const double max_age):
-        StreamStats<av::AudioSamples>(manager, jobj, sender, max_age) {
+    AudioStreamStats(std::shared_ptr<NodeManager> manager, json &jobj, const double max_age):
+        StreamStats<av::AudioSamples>(manager, jobj, max_age) {
         samples_.setMaxAge(max_age_);
         analyzer_.setMaxAge(max_age_);
+        if (jobj.count("loudness")) {
+            const json &jl = jobj["loudness"];
+            if (jl.is_object()) {
+                analyzer_.enableLoudness(jl.count("true_peak") ? jl["true_peak"].get<bool>() : true);
+            } else if (jl.get<bool>()) {
+                analyzer_.enableLoudness(true);
+            }
+        }
     }
     void extractR128Stats(const av::AudioSamples &frm) {
         #define bail { has_r128_stats_ = false; return; }
@@ -610,7 +686,9 @@ public:
         channel_layout_ = frm.channelsLayoutString();
         total_samples_ += frm.samplesCount();
         samples_.push(frm.pts(), total_samples_);
-        extractR128Stats(frm);
+        if (!analyzer_.loudnessEnabled()) {
+            extractR128Stats(frm);
+        }
         analyzer_.processSamples(frm);
     }
     virtual void fillMediaSpecificStatsPostDec(json &jstats) override {
@@ -647,9 +725,10 @@ public:
             channels_count_ = 0;
         }
         analyzer_.getStats(jstats, sr_by_ts);
+        analyzer_.getLoudness(jstats);
         if (clear_on_send_) {
             samples_.clearAll();
-            analyzer_.resetHistory();
+            analyzer_.clearAfterSend();
         }
     }
     virtual void resetHistory() override {
@@ -662,15 +741,20 @@ public:
 class StatsSender: public std::enable_shared_from_this<StatsSender> {
 protected:
     RESTEndpoint rest_;
+    std::shared_ptr<BatchingRESTEndpoint> batcher_; // if batching is enabled
+    std::shared_ptr<StatsRegistry> registry_;
+    uint64_t registry_id_;
     std::string name_;
     std::shared_ptr<NodeManager> manager_;
     AVTS interval_ms_ = 1000;
     double history_max_age_ = 30;
-    av::Timestamp last_frame_rtc_ = NOTS;
     NodeAccessor sentinel_;
+    bool send_queues_ = false;
+    std::set<std::string> queues_; // empty = all
+    std::map<std::string, json> queue_baselines_; // previous sent statistics, if max_age <= 0
     std::list<std::shared_ptr<AbstractStreamStats>> stats_video_, stats_audio_;
     #ifdef SYNCMETER
-    std::list<SyncMeter::Meter> sync_meters_;
+    std::list<std::shared_ptr<SyncMeter::Meter>> sync_meters_;
     #endif
     static void fillStatsList(json &jglobal, const std::string key, std::list<std::shared_ptr<AbstractStreamStats>> &stats) {
         json jlist;
@@ -681,10 +765,20 @@ protected:
         }
         jglobal["streams_" + key] = jlist;
     }
-    void send() {
+    // false if unsubscribed
+    bool send() {
         json jglobal;
-        if (last_frame_rtc_.isValid()) {
-            jglobal["stalled_seconds"] = (wallclock.ts() - last_frame_rtc_).seconds();
+        av::Timestamp last_frame_rtc = NOTS;
+        for (auto *stats: { &stats_video_, &stats_audio_ }) {
+            for (auto &sst: *stats) {
+                av::Timestamp rtc = sst->lastFrameRTC();
+                if (rtc.isValid() && (!last_frame_rtc.isValid() || rtc.seconds() > last_frame_rtc.seconds())) {
+                    last_frame_rtc = rtc;
+                }
+            }
+        }
+        if (last_frame_rtc.isValid()) {
+            jglobal["stalled_seconds"] = (wallclock.ts() - last_frame_rtc).seconds();
         }
         if ( (!stats_video_.empty()) && (!stats_audio_.empty()) ) {
             av::Timestamp last_ts_audio = stats_audio_.front()->lastTS();
@@ -702,9 +796,38 @@ protected:
         }
         fillStatsList(jglobal, "video", stats_video_);
         fillStatsList(jglobal, "audio", stats_audio_);
-        std::ostringstream ss;
-        ss << jglobal;
-        rest_.send("", ss.str());
+        if (send_queues_) {
+            json jqueues = json::object();
+            manager_->edges()->collectEdgesStats(jqueues);
+            if (!queues_.empty()) {
+                for (auto it = jqueues.begin(); it != jqueues.end();) {
+                    if (queues_.count(it.key())) {
+                        ++it;
+                    } else {
+                        it = jqueues.erase(it);
+                    }
+                }
+            }
+            if (history_max_age_ <= 0) {
+                // since the previous send - histograms of queues are shared with other readers, don't reset them
+                for (auto it = jqueues.begin(); it != jqueues.end(); ++it) {
+                    json &before = queue_baselines_[it.key()];
+                    json now = it.value();
+                    it.value() = EdgeBase::statsJsonSince(now, before);
+                    before = std::move(now);
+                }
+            }
+            jglobal["queues"] = jqueues;
+        }
+        if (!registry_->put(registry_id_, jglobal)) {
+            return false;
+        }
+        if (batcher_) {
+            batcher_->send(jglobal.dump());
+        } else {
+            rest_.send("", jglobal.dump());
+        }
+        return true;
     }
     void parseStream(json &jobj, const std::string subkey) {
         if (!jobj.is_object()) {
@@ -712,10 +835,12 @@ protected:
         }
         std::shared_ptr<AbstractStreamStats> sst;
         if (subkey=="video") {
-            sst = std::make_shared<VideoStreamStats>(manager_, jobj, this, history_max_age_);
+            sst = std::make_shared<VideoStreamStats>(manager_, jobj, history_max_age_);
+            sst->attach();
             stats_video_.push_back(sst);
         } else if (subkey=="audio") {
-            sst = std::make_shared<AudioStreamStats>(manager_, jobj, this, history_max_age_);
+            sst = std::make_shared<AudioStreamStats>(manager_, jobj, history_max_age_);
+            sst->attach();
             stats_audio_.push_back(sst);
         } else {
             throw Error("Unsupported media type: " + subkey);
@@ -734,8 +859,15 @@ protected:
     }
 public:
     StatsSender(json params, std::shared_ptr<NodeManager> manager): manager_(manager) {
+        std::string url;
         if (params.count("url")) {
-            rest_.setBaseURL(params["url"].get<std::string>());
+            url = params["url"].get<std::string>();
+            rest_.setBaseURL(url);
+        }
+        if (params.count("batch") && params["batch"].get<bool>() && !url.empty() && url != "-") {
+            using ISOs = InstanceSharedObjects<BatchingRESTEndpoint>;
+            ISOs::emplace(manager_->instanceData(), url, ISOs::PolicyIfExists::Ignore, url);
+            batcher_ = ISOs::get(manager_->instanceData(), url);
         }
         if (params.count("interval")) {
             interval_ms_ = static_cast<AVTS>(params["interval"].get<double>() * 1000.0);
@@ -750,6 +882,17 @@ public:
             std::string sentinel_name = params["sentinel"].get<std::string>();
             sentinel_ = NodeAccessor(manager_, sentinel_name);
         }
+        if (params.count("queues")) {
+            json jq = params["queues"];
+            if (jq.is_array()) {
+                for (std::string name: jq) {
+                    queues_.insert(name);
+                }
+                send_queues_ = true;
+            } else {
+                send_queues_ = jq.get<bool>();
+            }
+        }
         #ifdef SYNCMETER
         if (params.count("syncmeters")) {
             json jmeters = params["syncmeters"];
@@ -776,13 +919,17 @@ public:
                 if (!audio_edge || !video_edge) {
                     throw Error("Not enough edges in syncmeter specification");
                 }
-                sync_meters_.emplace_back(audio_edge, video_edge, prefix);
+                auto meter = std::make_shared<SyncMeter::Meter>(audio_edge, video_edge, prefix);
+                meter->attach();
+                sync_meters_.push_back(meter);
             }
         }
         #endif
         json jstreams = params.at("streams");
         parseStreams(jstreams, "video");
         parseStreams(jstreams, "audio");
+        registry_ = InstanceSharedObjects<StatsRegistry>::get(manager_->instanceData(), "default");
+        registry_id_ = registry_->subscribe(name_);
     }
     void mainloop() {
         auto gtod_ms = []() -> AVTS {
@@ -794,18 +941,16 @@ public:
         AVTS remainder = next_send % interval_ms_;
         next_send -= remainder;
         next_send += interval_ms_ / 10;
-        while(true) {
+        while(registry_->subscribed(registry_id_)) {
             wallclock.sleepms(next_send - gtod_ms());
             next_send += interval_ms_;
             try {
-                send();
+                if (!send()) break;
             } catch (std::exception &e) {
                 logstream << "Error in stats sender: " << e.what();
             }
         }
-    }
-    void frameNow() {
-        last_frame_rtc_ = wallclock.ts();
+        logstream << "Stats subscription " << name_ << " removed";
     }
 };
 
@@ -813,63 +958,84 @@ StatsSenderThread::StatsSenderThread(json params, std::shared_ptr<NodeManager> m
     auto sender = std::make_shared<StatsSender>(params, manager);
     thr_ = start_thread("stats sender", [sender]() {
         sender->mainloop();
+        // unsubscribed: freeing the sender frees its stream statistics,
+        // which remove their wiretaps from the queues
     });
     thr_.detach();
 }
 
-template<typename T> StreamStats<T>::StreamStats(std::shared_ptr<NodeManager> manager, json &jobj, StatsSender* sender, const double max_age):
+template<typename T> StreamStats<T>::StreamStats(std::shared_ptr<NodeManager> manager, json &jobj, const double max_age):
     manager_(manager),
-    sender_(sender),
     max_age_(max_age>0 ? max_age : 864000),
     clear_on_send_(max_age<=0) {
     ts_by_rtc_.setMaxAge(max_age_);
     bytes_.setMaxAge(max_age_);
 
-    std::shared_ptr<Edge<av::Packet>> pre_dec_edge = manager_->edges()->template find<av::Packet>(jobj.at("q_pre_dec"));
-
-    pre_dec_edge->addWiretapCallback([this](const av::Packet &pkt) {
-        try {
-            if (pkt.isComplete() && pkt.dts().isValid()) {
-                if (packet_dd_.check(pkt.dts())) {
-                    resetHistoryWrapper();
-                }
-                {
-                    std::lock_guard<decltype(pre_dec_mutex_)> lock(pre_dec_mutex_);
-                    sender_->frameNow();
-                    ts_by_rtc_.pushWallclockNow(pkt.dts());
-                    total_bytes_ += pkt.size();
-                    stream_index_ = pkt.streamIndex();
-                    bytes_.push(pkt.dts(), total_bytes_);
-                    total_frames_++;
-                }
-            }
-        } catch (std::exception &e) {
-            logstream << "Stats collecting error (pre-decoder): " << e.what();
-        }
-    });
+    pre_dec_edge_ = manager_->edges()->template find<av::Packet>(jobj.at("q_pre_dec"));
 
     if (jobj.count("q_post_dec")) {
         dec_node_name_ = jobj.at("decoder");
-
-        std::shared_ptr<Edge<T>> post_dec_edge = manager_->edges()->template find<T>(jobj.at("q_post_dec"));
-        post_dec_edge->addWiretapCallback([this](const T &frm) {
-            try {
-                if (frm.isComplete() && frm.pts().isValid()) {
-                    if (frame_dd_.check(frm.pts())) {
-                        resetHistoryWrapper();
-                    }
-                    {
-                        std::lock_guard<decltype(post_dec_mutex_)> lock(post_dec_mutex_);
-                        processDecodedFrame(frm);
-                    }
-                }
-            } catch (std::exception &e) {
-                logstream << "Stats collecting error (post-decoder): " << e.what();
-            }
-        });
+        post_dec_edge_ = manager_->edges()->template find<T>(jobj.at("q_post_dec"));
         processes_decoded_frames_ = true;
     } else {
         dec_node_name_ = jobj.at("relay");
         processes_decoded_frames_ = false;
     }
 }
+
+template<typename T> void StreamStats<T>::attach() {
+    // wiretaps may still be called after removal (see Edge::removeWiretapCallback), so they hold weak references
+    std::weak_ptr<StreamStats<T>> weak = std::static_pointer_cast<StreamStats<T>>(this->shared_from_this());
+    pre_dec_wiretap_ = pre_dec_edge_->addWiretapCallback([weak](const av::Packet &pkt) {
+        std::shared_ptr<StreamStats<T>> self = weak.lock();
+        if (self) {
+            self->tapPacket(pkt);
+        }
+    });
+    if (post_dec_edge_) {
+        post_dec_wiretap_ = post_dec_edge_->addWiretapCallback([weak](const T &frm) {
+            std::shared_ptr<StreamStats<T>> self = weak.lock();
+            if (self) {
+                self->tapFrame(frm);
+            }
+        });
+    }
+    attached_ = true;
+}
+
+template<typename T> void StreamStats<T>::tapPacket(const av::Packet &pkt) {
+    try {
+        if (pkt.isComplete() && pkt.dts().isValid()) {
+            if (packet_dd_.check(pkt.dts())) {
+                resetHistoryWrapper();
+            }
+            {
+                std::lock_guard<decltype(pre_dec_mutex_)> lock(pre_dec_mutex_);
+                last_frame_rtc_ = wallclock.ts();
+                ts_by_rtc_.pushWallclockNow(pkt.dts());
+                total_bytes_ += pkt.size();
+                stream_index_ = pkt.streamIndex();
+                bytes_.push(pkt.dts(), total_bytes_);
+                total_frames_++;
+            }
+        }
+    } catch (std::exception &e) {
+        logstream << "Stats collecting error (pre-decoder): " << e.what();
+    }
+}
+
+template<typename T> void StreamStats<T>::tapFrame(const T &frm) {
+    try {
+        if (frm.isComplete() && frm.pts().isValid()) {
+            if (frame_dd_.check(frm.pts())) {
+                resetHistoryWrapper();
+            }
+            {
+                std::lock_guard<decltype(post_dec_mutex_)> lock(post_dec_mutex_);
+                processDecodedFrame(frm);
+            }
+        }
+    } catch (std::exception &e) {
+        logstream << "Stats collecting error (post-decoder): " << e.what();
+    }
+}
@@ -1,7 +1,71 @@
 #include <json.hpp>
+#include <cstdint>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
 #include "graph_mgmt.hpp"
+#include "instance_shared.hpp"
+
+// Latest statistics of every stats.subscribe subscription. Names aren't unique,
+// so subscriptions are keyed by id. Read by the metrics endpoint (metrics.listen).
+class StatsRegistry: public InstanceShared<StatsRegistry> {
+public:
+    struct Entry {
+        uint64_t id;
+        std::string name;
+        nlohmann::json stats; // null until the first send
+    };
+protected:
+    std::mutex busy_;
+    uint64_t next_id_ = 0;
+    std::map<uint64_t, Entry> entries_;
+public:
+    // returns id of the new subscription
+    uint64_t subscribe(const std::string &name) {
+        std::lock_guard<decltype(busy_)> lock(busy_);
+        uint64_t id = next_id_++;
+        entries_[id] = { id, name.empty() ? "subscription" + std::to_string(id) : name, nullptr };
+        return id;
+    }
+    // false if the subscription has been removed
+    bool put(const uint64_t id, const nlohmann::json &stats) {
+        std::lock_guard<decltype(busy_)> lock(busy_);
+        auto it = entries_.find(id);
+        if (it == entries_.end()) return false;
+        it->second.stats = stats;
+        return true;
+    }
+    bool subscribed(const uint64_t id) {
+        std::lock_guard<decltype(busy_)> lock(busy_);
+        return entries_.count(id) > 0;
+    }
+    // removes all subscriptions with this name, returns how many
+    size_t unsubscribe(const std::string &name) {
+        std::lock_guard<decltype(busy_)> lock(busy_);
+        size_t count = 0;
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (it->second.name == name) {
+                it = entries_.erase(it);
+                count++;
+            } else {
+                ++it;
+            }
+        }
+        return count;
+    }
+    std::vector<Entry> snapshot() {
+        std::lock_guard<decltype(busy_)> lock(busy_);
+        std::vector<Entry> r;
+        for (auto &kv: entries_) {
+            if (!kv.second.stats.is_null()) {
+                r.push_back(kv.second);
+            }
+        }
+        return r;
+    }
+};
 
 class StatsSenderThread: public std::enable_shared_from_this<StatsSenderThread> {
 protected:
@@ -175,10 +175,13 @@ namespace SyncMeter {
         }
     };
     
-    class Meter {
+    class Meter: public std::enable_shared_from_this<Meter> {
     protected:
         std::shared_ptr<Edge<av::AudioSamples>> audio_edge_;
         std::shared_ptr<Edge<av::VideoFrame>> video_edge_;
+        Edge<av::AudioSamples>::WiretapId audio_wiretap_;
+        Edge<av::VideoFrame>::WiretapId video_wiretap_;
+        bool attached_ = false;
         AudioProcessor audio_proc_;
         VideoProcessor video_proc_;
         std::mutex busy_;
@@ -186,16 +189,28 @@ namespace SyncMeter {
         std::string prefix_;
     public:
         Meter(std::shared_ptr<Edge<av::AudioSamples>> audio_edge, std::shared_ptr<Edge<av::VideoFrame>> video_edge, const std::string prefix): audio_edge_(audio_edge), video_edge_(video_edge), prefix_(prefix) {
-            audio_edge_->addWiretapCallback([this](const av::AudioSamples samples) {
-                if (audio_proc_.processSamples(samples)) {
-                    triggered();
+        }
+        // must be called after construction, wiretaps hold weak references to the meter
+        void attach() {
+            std::weak_ptr<Meter> weak = shared_from_this();
+            audio_wiretap_ = audio_edge_->addWiretapCallback([weak](const av::AudioSamples samples) {
+                std::shared_ptr<Meter> self = weak.lock();
+                if (self && self->audio_proc_.processSamples(samples)) {
+                    self->triggered();
                 }
             });
-            video_edge_->addWiretapCallback([this](const av::VideoFrame frame) {
-                if (video_proc_.processFrame(frame)) {
-                    triggered();
+            video_wiretap_ = video_edge_->addWiretapCallback([weak](const av::VideoFrame frame) {
+                std::shared_ptr<Meter> self = weak.lock();
+                if (self && self->video_proc_.processFrame(frame)) {
+                    self->triggered();
                 }
             });
+            attached_ = true;
+        }
+        ~Meter() {
+            if (!attached_) return;
+            audio_edge_->removeWiretapCallback(audio_wiretap_);
+            video_edge_->removeWiretapCallback(video_wiretap_);
         }
         void triggered() {
             std::unique_lock<decltype(busy_)> lock(busy_);
@@ -0,0 +1,181 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#include <avcpp/timestamp.h>
+#include "avutils.hpp"
+#include "util.hpp"
+
+// FIFO over a power-of-2 ring buffer. Grows by doubling when full,
+// so in steady state push & pop don't allocate.
+template<typename T> class RingQueue {
+protected:
+    std::vector<T> items_;
+    size_t head_ = 0;
+    size_t size_ = 0;
+    size_t mask_ = 0;
+    void grow() {
+        std::vector<T> bigger(std::max<size_t>(items_.size()*2, 16));
+        for (size_t i=0; i<size_; i++) {
+            bigger[i] = std::move((*this)[i]);
+        }
+        items_ = std::move(bigger);
+        head_ = 0;
+        mask_ = items_.size() - 1;
+    }
+public:
+    RingQueue(const size_t initial_capacity = 0) {
+        if (initial_capacity > 0) {
+            size_t capacity = 16;
+            while (capacity < initial_capacity) capacity *= 2;
+            items_.resize(capacity);
+            mask_ = capacity - 1;
+        }
+    }
+    size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0;
+    }
+    T& operator[](const size_t i) {
+        return items_[(head_ + i) & mask_];
+    }
+    T& front() {
+        return items_[head_];
+    }
+    T& back() {
+        return (*this)[size_-1];
+    }
+    void push_back(T item) {
+        if (size_ == items_.size()) {
+            grow();
+        }
+        items_[(head_ + size_) & mask_] = std::move(item);
+        size_++;
+    }
+    void pop_front() {
+        head_ = (head_ + 1) & mask_;
+        size_--;
+    }
+    void pop_back() {
+        size_--;
+    }
+    void clear() {
+        head_ = 0;
+        size_ = 0;
+    }
+};
+
+// Values with timestamps from the last max_age seconds, oldest first.
+// Items must be pushed in time order: expiry only drops items from the head.
+// For arithmetic values, sum and max of the retained values are maintained on push/expiry
+// (max with a monotonic queue), so all queries are O(1).
+template<typename Y, bool autoclean = true> class TimedHistory {
+public:
+    struct Item {
+        av::Timestamp time;
+        Y value;
+    };
+protected:
+    static constexpr bool aggregates_ = std::is_arithmetic<Y>::value;
+    struct MaxCandidate {
+        uint64_t seq;
+        Y value;
+    };
+    double max_age_sec_;
+    RingQueue<Item> items_;
+    uint64_t front_seq_ = 0; // sequence number of items_.front()
+    Y sum_ {};
+    RingQueue<MaxCandidate> max_candidates_; // decreasing values
+
+    void popFront() {
+        if constexpr (aggregates_) {
+            sum_ -= items_.front().value;
+            if (!max_candidates_.empty() && max_candidates_.front().seq == front_seq_) {
+                max_candidates_.pop_front();
+            }
+        }
+        items_.pop_front();
+        front_seq_++;
+    }
+public:
+    void cleanupWithRefTS(const av::Timestamp now) {
+        if (now.isNoPts()) return;
+        av::Timestamp min_ts = { now.timestamp() - static_cast<int64_t>(max_age_sec_/now.timebase().getDouble()), now.timebase() };
+        while (!items_.empty() && items_.front().time < min_ts) {
+            popFront();
+        }
+    }
+    TimedHistory(const double max_age_sec = 30): max_age_sec_(max_age_sec), items_(64) {
+    }
+    void setMaxAge(const double seconds) {
+        max_age_sec_ = seconds;
+    }
+    void cleanup() {
+        if (items_.empty()) return;
+        // use last value as reference time
+        cleanupWithRefTS(items_.back().time);
+    }
+    void clearAll() {
+        items_.clear();
+        max_candidates_.clear();
+        front_seq_ = 0;
+        sum_ = Y {};
+    }
+    double itemsPerSecond() {
+        size_t nitems = items_.size();
+        if (nitems==0) {
+            return 0; // or maybe NAN?
+        }
+        av::Timestamp deltat = addTS(items_.back().time, negateTS(items_.front().time));
+        if (deltat.timestamp()==0) {
+            return 0; // or maybe NAN?
+        }
+        return ((double)(nitems-1)) / deltat.seconds();
+    }
+    void push(const av::Timestamp time, const Y value) {
+        if constexpr (aggregates_) {
+            sum_ += value;
+            while (!max_candidates_.empty() && max_candidates_.back().value <= value) {
+                max_candidates_.pop_back();
+            }
+            max_candidates_.push_back({ front_seq_ + items_.size(), value });
+        }
+        items_.push_back({ time, value });
+        if (autoclean) cleanup();
+    }
+    void pushWallclockNow(const Y value) {
+        push(wallclock.ts(), value);
+    }
+    bool empty() {
+        return items_.empty();
+    }
+    size_t size() {
+        return items_.size();
+    }
+    Item& earliest() {
+        return items_.front();
+    }
+    Item& latest() {
+        return items_.back();
+    }
+    template<typename Ret = Y> Ret valueDiff() {
+        return latest().value - earliest().value;
+    }
+    av::Timestamp timeDiff() {
+        return latest().time - earliest().time;
+    }
+    // sum of retained values (arithmetic Y only)
+    Y sum() {
+        static_assert(aggregates_, "sum() requires arithmetic values");
+        return sum_;
+    }
+    // maximum of retained values (arithmetic Y only), must not be empty
+    Y max() {
+        static_assert(aggregates_, "max() requires arithmetic values");
+        return max_candidates_.front().value;
+    }
+};
@@ -0,0 +1,175 @@
+#include "trace.hpp"
+
+#ifdef TRACING
+
+#include <list>
+#include <mutex>
+#include <unordered_set>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "avutils.hpp"
+#include "util.hpp"
+
+namespace trace {
+
+std::atomic_bool enabled_flag {false};
+
+namespace {
+
+constexpr size_t ring_size = 8192; // records per thread, must be power of 2
+constexpr size_t max_exited_threads = 256;
+
+// Record stored field by field, so that dump() may read it while the owning thread overwrites it.
+// seq tells which record the slot holds: 2*n+1 while record number n is being written, 2*n+2 when it's complete.
+struct Slot {
+    std::atomic_uint64_t seq {0};
+    std::atomic<int64_t> begin_ns {0};
+    std::atomic<int64_t> end_ns {0};
+    std::atomic<const char*> name {nullptr};
+    std::atomic<const char*> category {nullptr};
+    std::atomic<const char*> arg_key {nullptr};
+    std::atomic<const char*> arg_value {nullptr};
+};
+
+struct ThreadBuffer {
+    std::array<Slot, ring_size> ring;
+    std::atomic_uint64_t head {0}; // number of records ever written
+    std::atomic_bool exited {false};
+    long tid;
+    std::string thread_name;
+};
+
+std::mutex registry_mutex;
+std::list<std::shared_ptr<ThreadBuffer>> registry;
+
+std::mutex intern_mutex;
+std::unordered_set<std::string> interned;
+
+ThreadBuffer* registerThread() {
+    auto buf = std::make_shared<ThreadBuffer>();
+    buf->tid = syscall(SYS_gettid);
+    buf->thread_name = current_thread.name;
+    std::lock_guard<decltype(registry_mutex)> lock(registry_mutex);
+    size_t exited_count = 0;
+    for (auto &b: registry) {
+        if (b->exited) exited_count++;
+    }
+    // threads of restarted nodes come and go, forget the oldest ones
+    for (auto it = registry.begin(); it != registry.end() && exited_count > max_exited_threads;) {
+        if ((*it)->exited) {
+            it = registry.erase(it);
+            exited_count--;
+        } else {
+            ++it;
+        }
+    }
+    registry.push_back(buf);
+    return buf.get();
+}
+
+struct ThreadBufferHolder {
+    ThreadBuffer* buffer = nullptr;
+    ~ThreadBufferHolder() {
+        if (buffer) buffer->exited = true;
+    }
+};
+
+thread_local ThreadBufferHolder this_thread_buffer;
+
+};
+
+void setEnabled(bool enabled) {
+    enabled_flag = enabled;
+}
+
+const char* intern(const std::string &str) {
+    std::lock_guard<decltype(intern_mutex)> lock(intern_mutex);
+    return interned.insert(str).first->c_str();
+}
+
+int64_t now() {
+    return wallclock.ns();
+}
+
+void record(const Record &rec) {
+    ThreadBuffer* buf = this_thread_buffer.buffer;
+    if (buf == nullptr) {
+        buf = this_thread_buffer.buffer = registerThread();
+    }
+    uint64_t head = buf->head.load(std::memory_order_relaxed);
+    Slot &slot = buf->ring[head & (ring_size-1)];
+    slot.seq.store(2*head + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.begin_ns.store(rec.begin_ns, std::memory_order_relaxed);
+    slot.end_ns.store(rec.end_ns, std::memory_order_relaxed);
+    slot.name.store(rec.name, std::memory_order_relaxed);
+    slot.category.store(rec.category, std::memory_order_relaxed);
+    slot.arg_key.store(rec.arg_key, std::memory_order_relaxed);
+    slot.arg_value.store(rec.arg_value, std::memory_order_relaxed);
+    slot.seq.store(2*head + 2, std::memory_order_release);
+    buf->head.store(head+1, std::memory_order_release);
+}
+
+// false if record number n isn't (completely) in its slot, because the writer has overwritten it
+static bool readSlot(const Slot &slot, const uint64_t n, Record &rec) {
+    uint64_t seq = slot.seq.load(std::memory_order_acquire);
+    if (seq != 2*n + 2) return false;
+    rec.begin_ns = slot.begin_ns.load(std::memory_order_relaxed);
+    rec.end_ns = slot.end_ns.load(std::memory_order_relaxed);
+    rec.name = slot.name.load(std::memory_order_relaxed);
+    rec.category = slot.category.load(std::memory_order_relaxed);
+    rec.arg_key = slot.arg_key.load(std::memory_order_relaxed);
+    rec.arg_value = slot.arg_value.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.seq.load(std::memory_order_relaxed) == seq;
+}
+
+nlohmann::json dump(double seconds) {
+    int64_t min_end = now() - int64_t(seconds * 1e9);
+    std::list<std::shared_ptr<ThreadBuffer>> buffers;
+    {
+        std::lock_guard<decltype(registry_mutex)> lock(registry_mutex);
+        buffers = registry;
+    }
+    nlohmann::json events = nlohmann::json::array();
+    for (auto &buf: buffers) {
+        uint64_t head = buf->head.load(std::memory_order_acquire);
+        uint64_t first = head > ring_size ? head - ring_size : 0;
+        bool any = false;
+        for (uint64_t i=first; i<head; i++) {
+            Record rec;
+            // skip records overwritten by the writer meanwhile
+            if (!readSlot(buf->ring[i & (ring_size-1)], i, rec)) continue;
+            if (rec.end_ns < min_end) continue;
+            nlohmann::json ev;
+            ev["name"] = rec.name;
+            ev["cat"] = rec.category;
+            ev["pid"] = 1;
+            ev["tid"] = buf->tid;
+            ev["ts"] = rec.begin_ns / 1000.0;
+            if (rec.end_ns > rec.begin_ns) {
+                ev["ph"] = "X";
+                ev["dur"] = (rec.end_ns - rec.begin_ns) / 1000.0;
+            } else {
+                ev["ph"] = "i";
+                ev["s"] = "t";
+            }
+            if (rec.arg_key && rec.arg_value) {
+                ev["args"][rec.arg_key] = rec.arg_value;
+            }
+            events.push_back(ev);
+            any = true;
+        }
+        if (any) {
+            events.push_back({
+                {"name", "thread_name"}, {"ph", "M"}, {"pid", 1}, {"tid", buf->tid},
+                {"args", {{"name", buf->thread_name}}},
+            });
+        }
+    }
+    return { {"traceEvents", events}, {"displayTimeUnit", "ns"} };
+}
+
+};
+
+#endif
@@ -0,0 +1,86 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <json.hpp>
+#include "util.hpp"
+
+// Tracing of node processing and edge transfers, exported as Chrome/Perfetto trace-event JSON.
+//
+// Compiled in only with -DTRACING=1 (see Makefile), and even then records nothing
+// until enabled at runtime (trace.enable command). Every thread writes to its own ring
+// of the most recent records, without locks; dump() reads all rings.
+//
+// Names passed to Span must live forever - use trace::intern() for dynamic ones.
+
+namespace trace {
+
+struct Record {
+    int64_t begin_ns; // wallclock.ns()
+    int64_t end_ns;
+    const char* name;
+    const char* category;
+    const char* arg_key; // optional (nullptr), e.g. "src" with edge name as arg_value
+    const char* arg_value;
+};
+
+#ifdef TRACING
+
+extern std::atomic_bool enabled_flag;
+
+inline bool enabled() {
+    return enabled_flag.load(std::memory_order_relaxed);
+}
+void setEnabled(bool enabled);
+const char* intern(const std::string &str);
+void record(const Record &rec);
+int64_t now();
+// events that ended in the last `seconds` seconds, as {"traceEvents": [...]}
+nlohmann::json dump(double seconds);
+
+// RAII span: records [begin(), destruction)
+class Span {
+protected:
+    Record rec_;
+    bool active_ = false;
+public:
+    void begin(const char* name, const char* category, const char* arg_key = nullptr, const char* arg_value = nullptr) {
+        rec_ = { now(), 0, name, category, arg_key, arg_value };
+        active_ = true;
+    }
+    ~Span() {
+        if (active_) {
+            rec_.end_ns = now();
+            record(rec_);
+        }
+    }
+};
+
+#define TRACE_SPAN(var, ...) trace::Span var; if (trace::enabled()) var.begin(__VA_ARGS__)
+#define TRACE_INSTANT(...) if (trace::enabled()) { int64_t trace_now_ = trace::now(); trace::record({ trace_now_, trace_now_, __VA_ARGS__ }); }
+
+#else
+
+inline bool enabled() {
+    return false;
+}
+inline void setEnabled(bool enabled) {
+    if (enabled) {
+        throw Error("avplumber was compiled without tracing support (make TRACING=1)");
+    }
+}
+inline const char* intern(const std::string &) {
+    return "";
+}
+inline nlohmann::json dump(double) {
+    return { {"traceEvents", nlohmann::json::array()} };
+}
+
+#define TRACE_SPAN(var, ...) do {} while(0)
+#define TRACE_INSTANT(...) do {} while(0)
+
+#endif
+
+};
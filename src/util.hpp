@@ -6,6 +6,8 @@
 #include <sstream>
 #include <unordered_map>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
 #include <mutex>
 #include <list>
 #include <string>
@@ -76,6 +78,9 @@ public:
             write(line);
         }
     }
+    // wait until lines logged before this call are written
+    virtual void flush() {
+    }
     virtual ~Logger() {
     }
 };
@@ -113,3 +118,49 @@ public:
 
 #define logstream (LogLine(current_thread.logger.get()).stream())
 
+// Allows at most max_per_second messages per second from one call site, see logstream_limited.
+class LogRateLimiter {
+protected:
+    const unsigned max_per_second_;
+    std::atomic<int64_t> window_ {-1};
+    std::atomic_uint count_ {0};
+    std::atomic_uint64_t suppressed_ {0};
+public:
+    struct Suppressed {
+        uint64_t count;
+    };
+    LogRateLimiter(const unsigned max_per_second): max_per_second_(max_per_second) {
+    }
+    bool allow() {
+        int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        int64_t window = window_.load(std::memory_order_relaxed);
+        if (window != now && window_.compare_exchange_strong(window, now)) {
+            count_.store(0, std::memory_order_relaxed);
+        }
+        if (count_.fetch_add(1, std::memory_order_relaxed) < max_per_second_) {
+            return true;
+        }
+        suppressed_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    Suppressed takeSuppressed() {
+        return { suppressed_.exchange(0, std::memory_order_relaxed) };
+    }
+};
+
+inline std::ostream& operator<<(std::ostream &os, const LogRateLimiter::Suppressed s) {
+    if (s.count) {
+        os << "(" << s.count << " similar messages suppressed) ";
+    }
+    return os;
+}
+
+// logstream for messages which may repeat for every frame, e.g.:
+// logstream_limited(5) << "Queue full";
+// A single statement (loop running at most once), safe in unbraced if/else.
+// max_per_second must be a constant, every use site has its own limit.
+#define logstream_limited(max_per_second) \
+    for (LogRateLimiter* log_rate_limiter_ = []() { static LogRateLimiter limiter(max_per_second); return &limiter; }(); \
+         log_rate_limiter_ != nullptr && log_rate_limiter_->allow(); log_rate_limiter_ = nullptr) \
+        logstream << log_rate_limiter_->takeSuppressed()
+